@@ -0,0 +1,409 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _CAPTUREDB_H
+#define _CAPTUREDB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @file capturedb.h
+ *
+ * The playback database of packet_player, a manifest (.man) indexing the
+ * packet contents (.bin), as written by create_playback_db.  The same
+ * files are shared by the native capture tools.
+ *
+ * All values are big endian, as read by the JVM.  The manifest starts
+ * with the packet count, followed by an entry per packet:
+ *
+ *    int64   packet timestamp, ms since the epoch
+ *    int32   time since the previous packet in ms, 0 for the first
+ *    int32   offset of the packet in the .bin file
+ *    int16   packet size
+ *
+ * which limits a .bin file to 2 GB and a packet to 32767 bytes.
+ *
+ * Version 2 of the format adds a time index (.idx) beside the unchanged
+ * manifest, so that playback can start at any time of a long session
+ * without reading the manifest up to it:
+ *
+ *    char    "MSXEAIDX"
+ *    int32   version, 2
+ *    int32   header size, 64
+ *    int32   packet count indexed
+ *    int32   index interval in ms
+ *    int64   first packet timestamp, ms since the epoch
+ *    int64   duration in ms
+ *    int32   index entry count
+ *    int32   stream count
+ *    int32   offset of the index entries
+ *    int32   offset of the stream table
+ *    int32   offset of the packet stream ids
+ *    int32   reserved, 0
+ *
+ * Playback time is the packet's offset from the first packet, held back
+ * from running backwards.  An index entry, int64 playback time and int32
+ * packet number, is made for the first packet of each interval that has
+ * any, so a gap in the session costs nothing.  The stream table holds an
+ * int32 source address, int16 source port, int16 destination port and
+ * int32 packet count per stream, stream 0 for packets of unknown origin,
+ * and every packet has its int16 stream id.
+ */
+
+#define CAPTUREDB_HEADER_SIZE 4
+#define CAPTUREDB_ENTRY_SIZE  18
+#define CAPTUREDB_MAX_PACKET  32767
+#define CAPTUREDB_MAX_BIN     2147483647UL
+#define CAPTUREDB_PATH_MAX    4096
+
+#define CAPTUREDB_IDX_MAGIC       "MSXEAIDX"
+#define CAPTUREDB_IDX_VERSION     2
+#define CAPTUREDB_IDX_HEADER_SIZE 64
+#define CAPTUREDB_IDX_ENTRY_SIZE  12
+#define CAPTUREDB_IDX_STREAM_SIZE 12
+#define CAPTUREDB_IDX_INTERVAL_MS 1000
+#define CAPTUREDB_STREAMS_MAX     1024
+
+typedef struct
+{
+  int64_t timestamp_ms;
+  int32_t delta_ms;
+  int32_t file_pos;
+  int16_t size;
+}
+capturedb_entry_t;
+
+/* a stream, in host byte order */
+typedef struct
+{
+  uint32_t addr;
+  uint16_t port;
+  uint16_t dest_port;
+  uint32_t packets;
+}
+capturedb_stream_t;
+
+typedef struct
+{
+  capturedb_stream_t *streams;
+  uint32_t stream_count;
+  uint32_t last_stream;
+
+  /* entries and stream ids, as written */
+  unsigned char *entries;
+  uint32_t entry_count;
+  size_t entry_cap;
+  unsigned char *ids;
+  size_t id_cap;
+
+  uint32_t count;
+  int64_t first_ms;
+  int64_t offset_ms;
+  int64_t next_ms;
+}
+capturedb_index_t;
+
+typedef struct
+{
+  int man_fd;
+  int bin_fd;
+
+  /* pending entries and packet contents, written when full */
+  unsigned char *man_buf;
+  size_t man_len;
+  unsigned char *bin_buf;
+  size_t bin_len;
+  size_t buf_size;
+
+  uint32_t count;
+  uint32_t bin_pos;
+  int64_t prev_ms;
+  unsigned long long bytes_written;
+
+  /* the time index, written on close */
+  capturedb_index_t index;
+  char idx_path[CAPTUREDB_PATH_MAX];
+}
+capturedb_writer_t;
+
+typedef struct
+{
+  /* the mapped files, bin is NULL when there are no packet contents */
+  const unsigned char *man;
+  size_t man_size;
+  const unsigned char *bin;
+  size_t bin_size;
+
+  /* entries present in the manifest */
+  uint32_t count;
+  int64_t first_ms;
+
+  /* the mapped time index, NULL when there is none for the manifest */
+  const unsigned char *idx;
+  size_t idx_size;
+  uint32_t index_count;
+  uint32_t stream_count;
+  int64_t duration_ms;
+}
+capturedb_reader_t;
+
+/**
+ * Serialize a manifest entry into CAPTUREDB_ENTRY_SIZE bytes.
+ *
+ * @param e a pointer to the entry.
+ * @param buf the buffer.
+ */
+static inline void capturedb_pack_entry(const capturedb_entry_t *e,
+        unsigned char *buf)
+{
+    uint64_t t = (uint64_t) e->timestamp_ms;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        buf[i] = t >> (56 - i * 8);
+    for (i = 0; i < 4; i++)
+        buf[8 + i] = (uint32_t) e->delta_ms >> (24 - i * 8);
+    for (i = 0; i < 4; i++)
+        buf[12 + i] = (uint32_t) e->file_pos >> (24 - i * 8);
+    buf[16] = (uint16_t) e->size >> 8;
+    buf[17] = (uint16_t) e->size;
+}
+
+/**
+ * Parse a manifest entry from CAPTUREDB_ENTRY_SIZE bytes.
+ *
+ * @param e a pointer to the entry.
+ * @param buf the buffer.
+ */
+static inline void capturedb_unpack_entry(capturedb_entry_t *e,
+        const unsigned char *buf)
+{
+    uint64_t t = 0;
+    uint32_t d = 0, p = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        t = (t << 8) | buf[i];
+    for (i = 0; i < 4; i++)
+    {
+        d = (d << 8) | buf[8 + i];
+        p = (p << 8) | buf[12 + i];
+    }
+
+    e->timestamp_ms = (int64_t) t;
+    e->delta_ms = (int32_t) d;
+    e->file_pos = (int32_t) p;
+    e->size = (int16_t) ((buf[16] << 8) | buf[17]);
+}
+
+/**
+ * The manifest and contents paths of a database, replacing everything
+ * from the first dot of the file name as create_playback_db does.
+ *
+ * @param base the database name, such as default_db or default_db.man.
+ * @param man the manifest path, CAPTUREDB_PATH_MAX bytes.
+ * @param bin the contents path, CAPTUREDB_PATH_MAX bytes.
+ */
+void capturedb_paths(const char *base, char *man, char *bin);
+
+/**
+ * The time index path of a database, as capturedb_paths().
+ *
+ * @param base the database name.
+ * @param idx the index path, CAPTUREDB_PATH_MAX bytes.
+ */
+void capturedb_index_path(const char *base, char *idx);
+
+/**
+ * Start an empty time index, with the unknown stream 0.
+ *
+ * @param ix a pointer to the index structure.
+ */
+void capturedb_index_init(capturedb_index_t *ix);
+
+/**
+ * Look up the id of a stream, adding it when new.  Streams beyond
+ * CAPTUREDB_STREAMS_MAX are all given stream 0.
+ *
+ * @param ix a pointer to the index structure.
+ * @param s the stream, its packet count ignored.
+ *
+ * @return the stream id.
+ */
+uint16_t capturedb_index_stream(capturedb_index_t *ix,
+        const capturedb_stream_t *s);
+
+/**
+ * Index the next packet.
+ *
+ * @param ix a pointer to the index structure.
+ * @param timestamp_ms the packet timestamp, ms since the epoch.
+ * @param stream the packet's stream id.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int capturedb_index_add(capturedb_index_t *ix, int64_t timestamp_ms,
+        uint16_t stream);
+
+/**
+ * Write the index file.
+ *
+ * @param ix a pointer to the index structure.
+ * @param path the index path.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int capturedb_index_write(const capturedb_index_t *ix, const char *path);
+
+/**
+ * Free the index.
+ *
+ * @param ix a pointer to the index structure.
+ */
+void capturedb_index_free(capturedb_index_t *ix);
+
+/**
+ * Create a database, truncating any of the same name.
+ *
+ * @param w a pointer to the writer structure.
+ * @param base the database name.
+ * @param buf_size the size of each of the write buffers.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int capturedb_create(capturedb_writer_t *w, const char *base,
+        size_t buf_size);
+
+/**
+ * Append a packet.  The time since the previous packet is taken from the
+ * timestamps, as given.
+ *
+ * @param w a pointer to the writer structure.
+ * @param timestamp_ms the packet timestamp, ms since the epoch.
+ * @param stream the packet's stream id, from capturedb_index_stream() on
+ * the writer's index.
+ * @param data the packet contents.
+ * @param len the packet size.
+ *
+ * @return 0 on success, -1 on error with errno set, E2BIG if the packet is
+ * too large for the format and EFBIG if the .bin file is full.
+ */
+int capturedb_append(capturedb_writer_t *w, int64_t timestamp_ms,
+        uint16_t stream, const void *data, size_t len);
+
+/**
+ * Write out the buffers and the packet count, so that the database is
+ * complete up to here.
+ *
+ * @param w a pointer to the writer structure.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int capturedb_flush(capturedb_writer_t *w);
+
+/**
+ * Flush and close the database, and write its time index.
+ *
+ * @param w a pointer to the writer structure.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int capturedb_close(capturedb_writer_t *w);
+
+/**
+ * Map a database for reading, with its time index if there is one for the
+ * same packets.  A manifest whose count is beyond the entries it holds, as
+ * left by an interrupted recording, is read up to the last whole entry.
+ *
+ * @param r a pointer to the reader structure.
+ * @param base the database name.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int capturedb_open(capturedb_reader_t *r, const char *base);
+
+/**
+ * Get a manifest entry and the packet contents it refers to.
+ *
+ * @param r a pointer to the reader structure.
+ * @param i the entry number.
+ * @param e a pointer to the entry.
+ * @param data set to the packet contents, within the mapped .bin file.
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if the entry is out of
+ * range or refers past the end of the .bin file.
+ */
+int capturedb_entry(const capturedb_reader_t *r, uint32_t i,
+        capturedb_entry_t *e, const unsigned char **data);
+
+/**
+ * Find the first packet at or after a playback time, by a binary search of
+ * the time index, or a scan of the manifest without one.
+ *
+ * @param r a pointer to the reader structure.
+ * @param offset_ms the playback time, ms from the first packet.
+ * @param at_ms set to the playback time of the packet found.
+ *
+ * @return the packet number, the packet count if past the end.
+ */
+uint32_t capturedb_seek(const capturedb_reader_t *r, int64_t offset_ms,
+        int64_t *at_ms);
+
+/**
+ * The stream of a packet, 0 when unknown.
+ *
+ * @param r a pointer to the reader structure.
+ * @param i the packet number.
+ *
+ * @return the stream id.
+ */
+uint16_t capturedb_packet_stream(const capturedb_reader_t *r, uint32_t i);
+
+/**
+ * Get a stream of the time index.
+ *
+ * @param r a pointer to the reader structure.
+ * @param id the stream id.
+ * @param s a pointer to the stream.
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if there is no such
+ * stream.
+ */
+int capturedb_stream(const capturedb_reader_t *r, uint16_t id,
+        capturedb_stream_t *s);
+
+/**
+ * Unmap a database.
+ *
+ * @param r a pointer to the reader structure.
+ */
+void capturedb_unmap(capturedb_reader_t *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
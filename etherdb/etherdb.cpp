@@ -0,0 +1,1120 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "capturedb.h"
+#include "pcapfile.h"
+
+using namespace std;
+
+/* Input is split into chunks of about this size, parsed in parallel */
+#define CHUNK_BYTES        (4 * 1024 * 1024)
+
+/* chunks parsed ahead of the one being written, per thread */
+#define CHUNKS_AHEAD       2
+
+#define NSEC_PER_MSEC      1000000LL
+
+#define TIME_MARKER        "Local packet time:"
+#define TIME_MARKER_LEN    18
+#define TIME_PREFIX        "Local packet time: "
+#define TIME_PREFIX_LEN    19
+
+/* The text dump is parsed with the state machine of create_playback_db,
+ * line for line, so that the database is the same byte for byte, even
+ * for dumps it handles oddly */
+enum
+{
+    NON_HEXPACKET_DATA,
+    PROC_TIME_DATA,
+    START_HEXPACKET_DATA,
+    PROC_HEXPACKET_DATA,
+    END_HEXPACKET_DATA
+};
+
+struct Chunk
+{
+    const char *start;
+    const char *end;
+
+    /* the chunk's part of the manifest and .bin file */
+    vector<unsigned char> man;
+    vector<unsigned char> bin;
+
+    /* manifest offsets of the .bin positions, relative to the chunk, and
+     * of the first packet's delta, which depend on the chunks before */
+    vector<size_t> pos_fields;
+    size_t first_delta;
+
+    unsigned long packets;
+    unsigned long out_of_seq;
+    int64_t first_time;
+    int64_t last_time;
+
+    const char *error_at;
+    const char *error;
+    int done;
+};
+
+/* configuration */
+static const char *input_name = NULL;
+static const char *db_name = NULL;
+static const char *index_name = NULL;
+static const char *capture_name = NULL;
+static const char *export_name = NULL;
+static pcap_filter_t filter;
+static const char *dest_addr = "127.0.0.1";
+static uint16_t dest_port = 6502;
+static int threads = 0;
+static int verbose = 0;
+
+/* the mapped dump */
+static const char *text = NULL;
+static size_t text_size = 0;
+
+/* chunks, handed out to the worker threads in order */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static vector<Chunk> chunks;
+static size_t next_chunk = 0;
+static size_t written_chunks = 0;
+static size_t chunks_ahead = 0;
+
+/* hex digit values, -1 for anything else */
+static int hex_value[256];
+
+static void print_usage()
+{
+    printf("\n");
+    printf("Usage: etherdb [OPTION]...\n");
+    printf("\n");
+    printf("Create a playback database from a packet_recorder dump, as the");
+    printf("\n");
+    printf("create_playback_db script does, or from a tcpdump capture, with");
+    printf("\n");
+    printf("a time index for seeking\n");
+    printf("   -f file, packet_recorder dump, such as default_db.txt\n");
+    printf("   -o name, database written to name.man, name.bin and name.idx\n");
+    printf("      (the dump's name up to the first dot default), or the\n");
+    printf("      capture file written with -x\n");
+    printf("   -i name, write the time index of an existing database\n");
+    printf("   -c file, tcpdump capture (pcap or pcapng) to convert instead\n");
+    printf("   -u port, convert datagrams to this UDP port only, repeat for\n");
+    printf("      more ports\n");
+    printf("   -s ip_addr[:port], convert datagrams from this source only,\n");
+    printf("      repeat for more sources\n");
+    printf("   -x name, export a database to the capture file given with\n");
+    printf("      -o, pcapng when it ends in .pcapng\n");
+    printf("   -d ip_addr:port, exported destination, the port for packets\n");
+    printf("      of unknown streams (127.0.0.1:6502 default)\n");
+    printf("   -j n, parser threads (one per CPU default)\n");
+    printf("   -v, verbose debugging output\n");
+    printf("   -h, show this help message\n");
+    printf("\n");
+    printf("Examples:\n");
+    printf("\n");
+    printf("      etherdb -f audio_capture.txt");
+    printf("\n");
+    printf("      etherdb -i default_db");
+    printf("\n");
+    printf("      etherdb -c audio.pcapng -u 6502 -o audio_capture");
+    printf("\n");
+    printf("      etherdb -x audio_capture -o audio.pcap");
+    printf("\n");
+}
+
+static double now_sec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* whitespace as Python 2 strips it */
+static inline int is_space(int c)
+{
+    return (c == ' ') || ((c >= '\t') && (c <= '\r'));
+}
+
+static inline int is_time_line(const char *line, const char *next)
+{
+    return (next - line >= TIME_MARKER_LEN)
+            && (memcmp(line, TIME_MARKER, TIME_MARKER_LEN) == 0);
+}
+
+/* A hex line starts with a 4 digit byte count */
+static inline int is_hex_line(const char *line, const char *next)
+{
+    return (next - line >= 4) && (hex_value[(unsigned char) line[0]] >= 0)
+            && (hex_value[(unsigned char) line[1]] >= 0)
+            && (hex_value[(unsigned char) line[2]] >= 0)
+            && (hex_value[(unsigned char) line[3]] >= 0);
+}
+
+/* A byte as int(token, 16) reads it: surrounding whitespace, a sign and a
+ * 0x prefix are allowed */
+static int parse_hex_byte(const char *s, const char *e, unsigned char *byte)
+{
+    unsigned value = 0;
+    int neg = 0, digits = 0;
+
+    while ((s < e) && is_space(*s))
+        s++;
+
+    if ((s < e) && ((*s == '+') || (*s == '-')))
+    {
+        neg = (*s++ == '-');
+        while ((s < e) && is_space(*s))
+            s++;
+    }
+
+    if ((e - s >= 2) && (s[0] == '0') && ((s[1] | 0x20) == 'x'))
+        s += 2;
+
+    for (; (s < e) && (hex_value[(unsigned char) *s] >= 0); s++, digits++)
+    {
+        value = (value << 4) | hex_value[(unsigned char) *s];
+        if (value > 0xff)
+            value = 0x100;
+    }
+
+    while ((s < e) && is_space(*s))
+        s++;
+
+    if ((digits == 0) || (s != e) || (value > 0xff) || (neg && value))
+        return -1;
+
+    *byte = value;
+    return 0;
+}
+
+/* The bytes of a hex line, columns 5 to 51 split at each space, trailing
+ * whitespace first stripped if asked.  Returns the count, or -1 for a line
+ * that create_playback_db fails on. */
+static int decode_hex_line(const char *line, const char *next, int strip,
+        unsigned char *out)
+{
+    const char *s = line + 5;
+    const char *e = line + 52;
+    const char *tok_end;
+    int i, n, bad = 0;
+
+    if (e > next)
+        e = next;
+    if (s > e)
+        s = e;
+
+    if (strip)
+    {
+        while ((e > s) && is_space(e[-1]))
+            e--;
+    }
+
+    /* a full line of 16 bytes, checked as a whole */
+    if (e - s == 47)
+    {
+        for (i = 0; i < 16; i++)
+        {
+            int hi = hex_value[(unsigned char) s[i * 3]];
+            int lo = hex_value[(unsigned char) s[i * 3 + 1]];
+
+            bad |= hi | lo;
+            if (i < 15)
+                bad |= (s[i * 3 + 2] == ' ') ? 0 : -1;
+            out[i] = ((unsigned) hi << 4) | lo;
+        }
+
+        if (bad >= 0)
+            return 16;
+    }
+
+    for (n = 0;; n++)
+    {
+        tok_end = (const char *) memchr(s, ' ', e - s);
+        if (tok_end == NULL)
+            tok_end = e;
+
+        if (parse_hex_byte(s, tok_end, &out[n]) < 0)
+            return -1;
+
+        if (tok_end == e)
+            return n + 1;
+        s = tok_end + 1;
+    }
+}
+
+/* The next character of a time line with every TIME_PREFIX removed, or -1
+ * at the end */
+static inline int time_char(const char **p, const char *e)
+{
+    while ((e - *p >= TIME_PREFIX_LEN)
+            && (memcmp(*p, TIME_PREFIX, TIME_PREFIX_LEN) == 0))
+        *p += TIME_PREFIX_LEN;
+
+    return (*p < e) ? (unsigned char) *(*p)++ : -1;
+}
+
+/* The packet time of a time line, as int() reads it.  Returns -1 if it is
+ * not a number, and -2 if it is beyond the 64 bits it is written in. */
+static int parse_time(const char *p, const char *e, int64_t *time)
+{
+    uint64_t value = 0, limit = INT64_MAX;
+    int c, neg = 0, digits = 0, overflow = 0;
+
+    c = time_char(&p, e);
+    while (is_space(c))
+        c = time_char(&p, e);
+
+    if ((c == '+') || (c == '-'))
+    {
+        neg = (c == '-');
+        limit += neg;
+        c = time_char(&p, e);
+        while (is_space(c))
+            c = time_char(&p, e);
+    }
+
+    for (; (c >= '0') && (c <= '9'); c = time_char(&p, e), digits++)
+    {
+        if (value > (limit - (c - '0')) / 10)
+            overflow = 1;
+        value = value * 10 + (c - '0');
+    }
+
+    while (is_space(c))
+        c = time_char(&p, e);
+
+    if ((digits == 0) || (c != -1))
+        return -1;
+    if (overflow)
+        return -2;
+
+    *time = neg ? (int64_t) (0 - value) : (int64_t) value;
+    return 0;
+}
+
+static inline void put_be(vector<unsigned char> &v, uint64_t value,
+        int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+        v.push_back(value >> (i * 8));
+}
+
+static void chunk_error(Chunk *c, const char *line, const char *error)
+{
+    c->error_at = line;
+    c->error = error;
+}
+
+static void parse_chunk(Chunk *c)
+{
+    const char *line, *eol, *next;
+    unsigned char bytes[32];
+    int state = NON_HEXPACKET_DATA;
+    int64_t packet_time = 0, prev_time = 0, delta;
+    long byte_count = 0;
+    int is_time, is_hex, n, time_ok = 1;
+
+    c->bin.reserve((c->end - c->start) / 3);
+    c->man.reserve((c->end - c->start) / 40);
+
+    for (line = c->start; line < c->end; line = next)
+    {
+        eol = (const char *) memchr(line, '\n', c->end - line);
+        next = (eol != NULL) ? eol + 1 : c->end;
+
+        is_time = is_time_line(line, next);
+        is_hex = is_hex_line(line, next);
+
+        if (is_time && (state == NON_HEXPACKET_DATA))
+            state = PROC_TIME_DATA;
+        else if (is_hex && (state == PROC_TIME_DATA))
+            state = START_HEXPACKET_DATA;
+        else if (is_hex && (state == START_HEXPACKET_DATA))
+            state = PROC_HEXPACKET_DATA;
+        else if (!is_hex && (state == PROC_HEXPACKET_DATA))
+            state = END_HEXPACKET_DATA;
+        else if (!is_hex)
+            state = NON_HEXPACKET_DATA;
+
+        switch (state)
+        {
+
+        case PROC_TIME_DATA:
+            /* out of range only matters once written */
+            n = parse_time(line, next, &packet_time);
+            if (n == -1)
+                return chunk_error(c, line, "invalid packet time");
+            time_ok = (n == 0);
+            break;
+
+        case START_HEXPACKET_DATA:
+            if (!time_ok)
+                return chunk_error(c, line, "packet time out of range");
+
+            /* the first packet's delta is filled in when written */
+            if (c->packets == 0)
+            {
+                c->first_delta = c->man.size() + 8;
+                c->first_time = packet_time;
+                delta = 0;
+            }
+            else
+            {
+                if (prev_time == -1)
+                    prev_time = packet_time;
+
+                delta = packet_time - prev_time;
+                if ((delta < INT32_MIN) || (delta > INT32_MAX))
+                    return chunk_error(c, line, "packet time out of range");
+                if (delta < 0)
+                    c->out_of_seq++;
+            }
+
+            prev_time = packet_time;
+            c->last_time = packet_time;
+            c->packets++;
+
+            put_be(c->man, packet_time, 8);
+            put_be(c->man, delta, 4);
+            c->pos_fields.push_back(c->man.size());
+            put_be(c->man, c->bin.size(), 4);
+
+            byte_count = 0;
+            n = decode_hex_line(line, next, 0, bytes);
+            if (n < 0)
+                return chunk_error(c, line, "invalid hex byte");
+
+            c->bin.insert(c->bin.end(), bytes, bytes + n);
+            byte_count += n;
+            break;
+
+        case PROC_HEXPACKET_DATA:
+            n = decode_hex_line(line, next, 1, bytes);
+            if (n < 0)
+                return chunk_error(c, line, "invalid hex byte");
+
+            c->bin.insert(c->bin.end(), bytes, bytes + n);
+            byte_count += n;
+            break;
+
+        case END_HEXPACKET_DATA:
+            if (byte_count > CAPTUREDB_MAX_PACKET)
+                return chunk_error(c, line, "packet too large");
+
+            put_be(c->man, byte_count, 2);
+            break;
+        }
+    }
+}
+
+/* A line the parser is known to reach in NON_HEXPACKET_DATA state: a time
+ * line after two lines that are not hex lines, the last not a time line.
+ * Returns the start of the first at or after pos, or the end of the dump. */
+static const char *find_sync(const char *pos)
+{
+    const char *end = text + text_size;
+    const char *line, *prev, *prev2;
+
+    while (pos < end)
+    {
+        line = (const char *) memmem(pos - 1, end - pos + 1,
+                "\n" TIME_MARKER, TIME_MARKER_LEN + 1);
+        if (line == NULL)
+            break;
+        line++;
+
+        prev = (const char *) memrchr(text, '\n', line - 1 - text);
+        prev = (prev != NULL) ? prev + 1 : text;
+        if (prev > text)
+        {
+            prev2 = (const char *) memrchr(text, '\n', prev - 1 - text);
+            prev2 = (prev2 != NULL) ? prev2 + 1 : text;
+
+            if (!is_hex_line(prev2, prev) && !is_hex_line(prev, line)
+                    && !is_time_line(prev, line))
+                return line;
+        }
+
+        pos = line + 1;
+    }
+
+    return end;
+}
+
+static void *worker_function(void *ptr)
+{
+    size_t i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&mutex);
+        while ((next_chunk < chunks.size())
+                && (next_chunk >= written_chunks + chunks_ahead))
+            pthread_cond_wait(&space_cond, &mutex);
+
+        if (next_chunk == chunks.size())
+        {
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+
+        i = next_chunk++;
+        pthread_mutex_unlock(&mutex);
+
+        parse_chunk(&chunks[i]);
+
+        pthread_mutex_lock(&mutex);
+        chunks[i].done = 1;
+        pthread_cond_broadcast(&done_cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    return 0;
+}
+
+static void write_all(int fd, const unsigned char *buf, size_t len,
+        const char *path)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static unsigned long line_number(const char *pos)
+{
+    unsigned long n = 1;
+
+    for (const char *p = text; p < pos; p++)
+        n += (*p == '\n');
+
+    return n;
+}
+
+/* The time index of a database, whose packets are of unknown streams */
+static void index_database(const char *name)
+{
+    char idx[CAPTUREDB_PATH_MAX];
+    capturedb_reader_t r;
+    capturedb_index_t ix;
+    capturedb_entry_t e;
+
+    if (capturedb_open(&r, name) < 0)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+
+    capturedb_index_init(&ix);
+    for (uint32_t i = 0; i < r.count; i++)
+    {
+        capturedb_unpack_entry(&e, r.man + CAPTUREDB_HEADER_SIZE
+                + (size_t) i * CAPTUREDB_ENTRY_SIZE);
+        if (capturedb_index_add(&ix, e.timestamp_ms, 0) < 0)
+        {
+            perror(name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    capturedb_index_path(name, idx);
+    if (capturedb_index_write(&ix, idx) < 0)
+    {
+        perror(idx);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Indexed %u packets, %.1f s, into %s\n", ix.count,
+            ix.offset_ms / 1000.0, idx);
+
+    capturedb_index_free(&ix);
+    capturedb_unmap(&r);
+}
+
+static void part_name(char *name, size_t size, const char *base, int part)
+{
+    if (part == 1)
+        snprintf(name, size, "%s", base);
+    else
+        snprintf(name, size, "%s_%i", base, part);
+}
+
+/* Convert the UDP datagrams of a capture a packet at a time, so that
+ * captures of any size take the same memory.  A .bin file that fills up
+ * is continued in a database of the next part name. */
+static void import_capture(const char *base)
+{
+    char name[CAPTUREDB_PATH_MAX];
+    unsigned long packets = 0, skipped[PCAP_LINKTYPE + 1];
+    unsigned long filtered = 0, too_big = 0, ipv6 = 0;
+    uint64_t bytes = 0;
+    capturedb_writer_t w;
+    capturedb_stream_t stream;
+    pcapfile_t p;
+    pcap_packet_t pkt;
+    pcap_udp_t udp;
+    int64_t ts_ms;
+    double start;
+    int part = 1, ret;
+
+    start = now_sec();
+    if (pcapfile_open(&p, capture_name) < 0)
+    {
+        perror(capture_name);
+        exit(EXIT_FAILURE);
+    }
+
+    part_name(name, sizeof(name), base, part);
+    if (capturedb_create(&w, name, CHUNK_BYTES) < 0)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(skipped, 0, sizeof(skipped));
+    while ((ret = pcapfile_next(&p, &pkt)) > 0)
+    {
+        bytes += pkt.len;
+
+        ret = pcap_udp(&pkt, &udp);
+        if (ret != PCAP_UDP_OK)
+        {
+            skipped[ret]++;
+            continue;
+        }
+
+        if (!pcap_filter_match(&filter, &udp))
+        {
+            filtered++;
+            continue;
+        }
+
+        /* the stream table holds IPv4 sources only */
+        stream.addr = 0;
+        if (udp.ip_version == 4)
+            stream.addr = ((uint32_t) udp.src[0] << 24) | (udp.src[1] << 16)
+                    | (udp.src[2] << 8) | udp.src[3];
+        else
+            ipv6++;
+        stream.port = udp.src_port;
+        stream.dest_port = udp.dst_port;
+
+        ts_ms = pkt.ts_ns / NSEC_PER_MSEC;
+        if ((pkt.ts_ns < 0) && (ts_ms * NSEC_PER_MSEC != pkt.ts_ns))
+            ts_ms--;
+
+        if (capturedb_append(&w, ts_ms,
+                capturedb_index_stream(&w.index, &stream), udp.payload,
+                udp.len) == 0)
+        {
+            packets++;
+            continue;
+        }
+
+        if (errno == E2BIG)
+        {
+            too_big++;
+            continue;
+        }
+
+        /* Start the next part with this packet */
+        if ((errno == EFBIG) && (capturedb_close(&w) == 0))
+        {
+            part_name(name, sizeof(name), base, ++part);
+            if ((capturedb_create(&w, name, CHUNK_BYTES) == 0)
+                    && (capturedb_append(&w, ts_ms,
+                            capturedb_index_stream(&w.index, &stream),
+                            udp.payload, udp.len) == 0))
+            {
+                printf("Continuing in %s\n", name);
+                packets++;
+                continue;
+            }
+        }
+
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+
+    /* as left by a capture that was killed */
+    if ((ret < 0) && (errno == EINVAL))
+        printf("%s is cut short or malformed, converted up to there\n",
+                capture_name);
+    else if (ret < 0)
+    {
+        perror(capture_name);
+        exit(EXIT_FAILURE);
+    }
+
+    if (capturedb_close(&w) < 0)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    pcapfile_close(&p);
+
+    if (verbose)
+    {
+        printf("Skipped %lu non-UDP, %lu truncated, %lu fragmented and %lu",
+                skipped[PCAP_NOT_UDP], skipped[PCAP_TRUNCATED],
+                skipped[PCAP_FRAGMENT], skipped[PCAP_LINKTYPE]);
+        printf(" unknown link type packets\n");
+        if (ipv6 > 0)
+            printf("%lu IPv6 packets are of unknown stream\n", ipv6);
+    }
+
+    if (filtered > 0)
+        printf("%lu packets filtered out\n", filtered);
+    if (too_big > 0)
+        printf("%lu packets too large for the database skipped\n", too_big);
+
+    printf("Converted %lu packets into %s%s\n", packets, base,
+            (part > 1) ? " and its continuations" : "");
+    printf("%.1f MB in %.3f s\n", bytes / 1e6, now_sec() - start);
+}
+
+/* Write a database as raw IPv4 frames, from the sources of its streams */
+static void export_database(const char *name, const char *path)
+{
+    capturedb_reader_t r;
+    capturedb_entry_t e;
+    capturedb_stream_t s;
+    const unsigned char *data;
+    struct in_addr addr;
+    pcapwriter_t w;
+    unsigned long packets = 0, bad = 0;
+    uint32_t dest, src;
+    uint16_t src_port, port;
+    const char *ext;
+
+    if (inet_aton(dest_addr, &addr) == 0)
+    {
+        fprintf(stderr, "Invalid destination %s\n", dest_addr);
+        exit(EXIT_FAILURE);
+    }
+    dest = ntohl(addr.s_addr);
+
+    if (capturedb_open(&r, name) < 0)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+
+    ext = strrchr(path, '.');
+    if (pcapwriter_create(&w, path,
+            (ext != NULL) && (strcmp(ext, ".pcapng") == 0)) < 0)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < r.count; i++)
+    {
+        if (capturedb_entry(&r, i, &e, &data) < 0)
+        {
+            bad++;
+            continue;
+        }
+
+        /* packets of unknown origin come from the destination itself */
+        src = dest;
+        src_port = port = dest_port;
+        if ((capturedb_stream(&r, capturedb_packet_stream(&r, i), &s) == 0)
+                && (s.dest_port != 0))
+        {
+            src = s.addr;
+            src_port = s.port;
+            port = s.dest_port;
+        }
+
+        if (pcapwriter_udp(&w, e.timestamp_ms * NSEC_PER_MSEC, src, src_port,
+                dest, port, data, e.size) < 0)
+        {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        packets++;
+    }
+
+    if (pcapwriter_close(&w) < 0)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (bad > 0)
+        printf("%lu bad manifest entries skipped\n", bad);
+    printf("Exported %lu packets into %s\n", packets, path);
+
+    capturedb_unmap(&r);
+}
+
+static void map_input()
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = open(input_name, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) < 0))
+    {
+        perror(input_name);
+        exit(EXIT_FAILURE);
+    }
+
+    text_size = st.st_size;
+    if (text_size > 0)
+    {
+        p = mmap(NULL, text_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            perror(input_name);
+            exit(EXIT_FAILURE);
+        }
+
+        madvise(p, text_size, MADV_WILLNEED);
+        text = (const char *) p;
+    }
+
+    close(fd);
+}
+
+static void split_input()
+{
+    const char *start = text, *end;
+    Chunk c;
+
+    c.first_delta = 0;
+    c.packets = 0;
+    c.out_of_seq = 0;
+    c.first_time = c.last_time = 0;
+    c.error_at = NULL;
+    c.error = NULL;
+    c.done = 0;
+
+    while (start < text + text_size)
+    {
+        end = text + text_size;
+        if ((size_t) (end - start) > CHUNK_BYTES)
+            end = find_sync(start + CHUNK_BYTES);
+
+        c.start = start;
+        c.end = end;
+        chunks.push_back(c);
+        start = end;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char man[CAPTUREDB_PATH_MAX], bin[CAPTUREDB_PATH_MAX];
+    unsigned char count[CAPTUREDB_HEADER_SIZE];
+    vector<pthread_t> workers;
+    uint64_t bin_pos = 0, pos;
+    int64_t prev_time = -1, delta;
+    unsigned long packets = 0, out_of_seq = 0;
+    double start, elapsed;
+    char *port_arg;
+    int man_fd, bin_fd, i;
+
+    /* Process command line options */
+    while (argc > 1)
+    {
+        if (argv[1][0] == '-')
+        {
+            switch (argv[1][1])
+            {
+
+            case 'f':
+                input_name = &argv[1][3];
+                break;
+
+            case 'o':
+                db_name = &argv[1][3];
+                break;
+
+            case 'i':
+                index_name = &argv[1][3];
+                break;
+
+            case 'c':
+                capture_name = &argv[1][3];
+                break;
+
+            case 'x':
+                export_name = &argv[1][3];
+                break;
+
+            case 'u':
+                if (pcap_filter_port(&filter, &argv[1][3]) < 0)
+                {
+                    printf("Invalid port %s\n", &argv[1][3]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 's':
+                if (pcap_filter_source(&filter, &argv[1][3]) < 0)
+                {
+                    printf("Invalid source %s\n", &argv[1][3]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'd':
+                dest_addr = strtok(&argv[1][3], ":");
+                port_arg = strtok(NULL, "\n");
+                if (port_arg != NULL)
+                    dest_port = atoi(port_arg);
+                break;
+
+            case 'j':
+                threads = atoi(&argv[1][3]);
+                break;
+
+            case 'v':
+                verbose = 1;
+                break;
+
+            case 'h':
+            default:
+                print_usage();
+                exit(EXIT_SUCCESS);
+                break;
+            }
+        }
+
+        argv++;
+        argc--;
+    }
+
+    /* no default capture name, that could be the one imported */
+    if ((export_name != NULL) && (db_name == NULL))
+    {
+        print_usage();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (export_name != NULL)
+    {
+        export_database(export_name, db_name);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (capture_name != NULL)
+    {
+        string name = (db_name != NULL) ? db_name : capture_name;
+
+        /* as capturedb_paths() names it */
+        if (db_name == NULL)
+        {
+            size_t slash = name.rfind('/');
+            size_t dot = name.find('.', (slash == string::npos) ? 0 : slash);
+
+            if (dot != string::npos)
+                name.erase(dot);
+        }
+
+        import_capture(name.c_str());
+        exit(EXIT_SUCCESS);
+    }
+
+    if ((input_name == NULL) && (index_name != NULL))
+    {
+        index_database(index_name);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (input_name == NULL)
+    {
+        print_usage();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (threads < 1)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+
+    for (i = 0; i < 256; i++)
+        hex_value[i] = -1;
+    for (i = 0; i < 10; i++)
+        hex_value['0' + i] = i;
+    for (i = 0; i < 6; i++)
+        hex_value['a' + i] = hex_value['A' + i] = 10 + i;
+
+    capturedb_paths((db_name != NULL) ? db_name : input_name, man, bin);
+
+    start = now_sec();
+    map_input();
+
+    man_fd = open(man, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (man_fd < 0)
+    {
+        perror(man);
+        exit(EXIT_FAILURE);
+    }
+
+    bin_fd = open(bin, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (bin_fd < 0)
+    {
+        perror(bin);
+        exit(EXIT_FAILURE);
+    }
+
+    /* placeholder for the packet count */
+    memset(count, 0, sizeof(count));
+    write_all(man_fd, count, sizeof(count), man);
+
+    split_input();
+    chunks_ahead = threads * CHUNKS_AHEAD;
+    workers.resize(threads);
+    for (i = 0; i < threads; i++)
+        pthread_create(&workers[i], NULL, worker_function, NULL);
+
+    /* Write the chunks in order, once the chunks before them are known */
+    for (size_t k = 0; k < chunks.size(); k++)
+    {
+        Chunk *c = &chunks[k];
+
+        pthread_mutex_lock(&mutex);
+        while (!c->done)
+            pthread_cond_wait(&done_cond, &mutex);
+        pthread_mutex_unlock(&mutex);
+
+        if (c->error != NULL)
+        {
+            fprintf(stderr, "%s:%lu: %s\n", input_name,
+                    line_number(c->error_at), c->error);
+            exit(EXIT_FAILURE);
+        }
+
+        for (size_t j = 0; j < c->pos_fields.size(); j++)
+        {
+            unsigned char *f = &c->man[c->pos_fields[j]];
+
+            pos = bin_pos + (((uint32_t) f[0] << 24) | (f[1] << 16)
+                    | (f[2] << 8) | f[3]);
+            if (pos > CAPTUREDB_MAX_BIN)
+            {
+                fprintf(stderr, "%s: over %lu bytes of packets\n", bin,
+                        CAPTUREDB_MAX_BIN);
+                exit(EXIT_FAILURE);
+            }
+
+            for (i = 0; i < 4; i++)
+                f[i] = pos >> (24 - i * 8);
+        }
+
+        if (c->packets > 0)
+        {
+            delta = (prev_time == -1) ? 0 : c->first_time - prev_time;
+            if ((delta < INT32_MIN) || (delta > INT32_MAX))
+            {
+                fprintf(stderr, "%s: packet time out of range\n", input_name);
+                exit(EXIT_FAILURE);
+            }
+            if (delta < 0)
+                out_of_seq++;
+
+            for (i = 0; i < 4; i++)
+                c->man[c->first_delta + i] = (uint32_t) delta >> (24 - i * 8);
+
+            prev_time = c->last_time;
+        }
+
+        write_all(bin_fd, c->bin.data(), c->bin.size(), bin);
+        write_all(man_fd, c->man.data(), c->man.size(), man);
+
+        bin_pos += c->bin.size();
+        packets += c->packets;
+        out_of_seq += c->out_of_seq;
+
+        if (verbose)
+        {
+            printf("chunk %lu: %lu bytes, %lu packets\n", (unsigned long) k,
+                    (unsigned long) (c->end - c->start), c->packets);
+        }
+
+        vector<unsigned char>().swap(c->man);
+        vector<unsigned char>().swap(c->bin);
+        vector<size_t>().swap(c->pos_fields);
+
+        pthread_mutex_lock(&mutex);
+        written_chunks++;
+        pthread_cond_broadcast(&space_cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+
+    for (i = 0; i < CAPTUREDB_HEADER_SIZE; i++)
+        count[i] = packets >> (24 - i * 8);
+    if ((pwrite(man_fd, count, sizeof(count), 0) != sizeof(count))
+            || (close(man_fd) < 0) || (close(bin_fd) < 0))
+    {
+        perror(man);
+        exit(EXIT_FAILURE);
+    }
+
+    elapsed = now_sec() - start;
+
+    if (out_of_seq > 0)
+        printf("%lu out of sequence packets found\n", out_of_seq);
+
+    printf("Converted %lu packets into %s and %s\n", packets, man, bin);
+    printf("%.1f MB in %.3f s, %.1f MB/s with %i thread(s)\n",
+            text_size / 1e6, elapsed, text_size / 1e6 / elapsed, threads);
+
+    index_database((db_name != NULL) ? db_name : input_name);
+
+    return EXIT_SUCCESS;
+}
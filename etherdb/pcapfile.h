@@ -0,0 +1,271 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _PCAPFILE_H
+#define _PCAPFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** @file pcapfile.h
+ *
+ * Reading and writing tcpdump captures, in the pcap or pcapng format, a
+ * packet at a time so that captures of any size stream through a single
+ * record buffer.  The same files are shared by etherdb and etherreplay.
+ *
+ * Frames are taken apart down to the UDP datagram for Ethernet (with
+ * VLAN tags), Linux cooked (v1 and v2), raw IP and loopback captures, over
+ * IPv4 or IPv6.  Fragmented datagrams are not reassembled.
+ *
+ * Captures are written with raw IPv4 frames, the UDP header of each
+ * packet made up from its stream.
+ */
+
+/* link types */
+#define PCAP_LINKTYPE_NULL      0
+#define PCAP_LINKTYPE_ETHERNET  1
+#define PCAP_LINKTYPE_RAW_BSD   12
+#define PCAP_LINKTYPE_RAW       101
+#define PCAP_LINKTYPE_LOOP      108
+#define PCAP_LINKTYPE_SLL       113
+#define PCAP_LINKTYPE_IPV4      228
+#define PCAP_LINKTYPE_IPV6      229
+#define PCAP_LINKTYPE_SLL2      276
+
+#define PCAP_IFACES_MAX         64
+
+/* no record is larger than this, however malformed the file */
+#define PCAP_RECORD_MAX         (16 * 1024 * 1024)
+
+typedef struct
+{
+  int linktype;
+
+  /* timestamp resolution, as the pcapng if_tsresol option, and offset in
+   * seconds */
+  int tsresol;
+  int64_t ts_offset;
+}
+pcap_iface_t;
+
+typedef struct
+{
+  FILE *f;
+  int ng;
+  int big_endian;
+
+  /* classic pcap has a single interface, pcapng one per IDB of the
+   * current section */
+  pcap_iface_t iface[PCAP_IFACES_MAX];
+  int iface_count;
+  uint32_t snaplen;
+
+  /* the current record */
+  unsigned char *buf;
+  size_t buf_size;
+  int64_t last_ts_ns;
+}
+pcapfile_t;
+
+typedef struct
+{
+  int64_t ts_ns;
+  int linktype;
+  const unsigned char *data;
+  uint32_t len;
+  uint32_t orig_len;
+}
+pcap_packet_t;
+
+typedef struct
+{
+  /* 4 or 6, with IPv4 addresses in the first 4 bytes */
+  int ip_version;
+  unsigned char src[16];
+  unsigned char dst[16];
+  uint16_t src_port;
+  uint16_t dst_port;
+
+  const unsigned char *payload;
+  uint32_t len;
+}
+pcap_udp_t;
+
+/* reasons a frame holds no whole UDP datagram */
+enum
+{
+  PCAP_UDP_OK, PCAP_NOT_UDP, PCAP_TRUNCATED, PCAP_FRAGMENT, PCAP_LINKTYPE
+};
+
+/* datagrams pass when to any of the ports, none for all, and from any of
+ * the sources, none for all */
+#define PCAP_FILTER_MAX         64
+
+typedef struct
+{
+  int ip_version;
+  unsigned char addr[16];
+
+  /* 0 for any */
+  uint16_t port;
+}
+pcap_source_t;
+
+typedef struct
+{
+  uint16_t ports[PCAP_FILTER_MAX];
+  int port_count;
+  pcap_source_t sources[PCAP_FILTER_MAX];
+  int source_count;
+}
+pcap_filter_t;
+
+typedef struct
+{
+  FILE *f;
+  int ng;
+  unsigned char *buf;
+  size_t buf_size;
+  uint16_t ip_id;
+}
+pcapwriter_t;
+
+/**
+ * Open a capture, of either format.
+ *
+ * @param p a pointer to the capture structure.
+ * @param path the capture file.
+ *
+ * @return 0 on success, -1 on error with errno set, EINVAL if it is not a
+ * capture.
+ */
+int pcapfile_open(pcapfile_t *p, const char *path);
+
+/**
+ * Read the next packet.  Its data stays valid until the next call.
+ * Packets without a timestamp, in pcapng simple packet blocks, are given
+ * the time of the packet before.
+ *
+ * @param p a pointer to the capture structure.
+ * @param pkt a pointer to the packet.
+ *
+ * @return 1 for a packet, 0 at the end of the capture, -1 on error with
+ * errno set, EINVAL if the capture is malformed.
+ */
+int pcapfile_next(pcapfile_t *p, pcap_packet_t *pkt);
+
+/**
+ * Close a capture.
+ *
+ * @param p a pointer to the capture structure.
+ */
+void pcapfile_close(pcapfile_t *p);
+
+/**
+ * Find the UDP datagram in a packet.
+ *
+ * @param pkt a pointer to the packet.
+ * @param udp a pointer to the datagram, pointing into the packet data.
+ *
+ * @return PCAP_UDP_OK, or the reason there is none.
+ */
+int pcap_udp(const pcap_packet_t *pkt, pcap_udp_t *udp);
+
+/**
+ * Add a destination port to a filter, which starts zeroed.
+ *
+ * @param f a pointer to the filter.
+ * @param arg the port.
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if the port is not
+ * valid, or ENOSPC if the filter is full.
+ */
+int pcap_filter_port(pcap_filter_t *f, const char *arg);
+
+/**
+ * Add a source to a filter, which starts zeroed.
+ *
+ * @param f a pointer to the filter.
+ * @param arg the source, as addr, addr:port or [addr]:port for IPv6.
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if the source is not
+ * valid, or ENOSPC if the filter is full.
+ */
+int pcap_filter_source(pcap_filter_t *f, const char *arg);
+
+/**
+ * Check a datagram against a filter.
+ *
+ * @param f a pointer to the filter.
+ * @param udp a pointer to the datagram.
+ *
+ * @return nonzero if the datagram passes.
+ */
+int pcap_filter_match(const pcap_filter_t *f, const pcap_udp_t *udp);
+
+/**
+ * Create a capture, truncating any of the same name.
+ *
+ * @param w a pointer to the writer structure.
+ * @param path the capture file.
+ * @param ng nonzero for pcapng, zero for pcap.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int pcapwriter_create(pcapwriter_t *w, const char *path, int ng);
+
+/**
+ * Write a UDP datagram as a raw IPv4 frame.
+ *
+ * @param w a pointer to the writer structure.
+ * @param ts_ns the packet time, ns since the epoch.
+ * @param src the source address, in host byte order.
+ * @param src_port the source port.
+ * @param dst the destination address, in host byte order.
+ * @param dst_port the destination port.
+ * @param data the datagram contents.
+ * @param len the datagram size, at most 65507 bytes.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int pcapwriter_udp(pcapwriter_t *w, int64_t ts_ns, uint32_t src,
+        uint16_t src_port, uint32_t dst, uint16_t dst_port, const void *data,
+        uint32_t len);
+
+/**
+ * Close a capture.
+ *
+ * @param w a pointer to the writer structure.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int pcapwriter_close(pcapwriter_t *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
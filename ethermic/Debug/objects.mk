@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -lasound -lpthread -lrt
+LIBS := -lasound -lpthread -lrt -lm
 
@@ -6,14 +6,40 @@
 CPP_SRCS += \
 ../ethermic.cpp 
 
+C_SRCS += \
+../audiodev.c \
+../fanout.c \
+../mcast.c \
+../metrics.c \
+../rtprofile.c 
+
 OBJS += \
-./ethermic.o 
+./audiodev.o \
+./ethermic.o \
+./fanout.o \
+./mcast.o \
+./metrics.o \
+./rtprofile.o 
+
+C_DEPS += \
+./audiodev.d \
+./fanout.d \
+./mcast.d \
+./metrics.d \
+./rtprofile.d 
 
 CPP_DEPS += \
 ./ethermic.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
+%.o: ../%.c
+	@echo 'Building file: $<'
+	@echo 'Invoking: Cross GCC Compiler'
+	gcc -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
 %.o: ../%.cpp
 	@echo 'Building file: $<'
 	@echo 'Invoking: Cross G++ Compiler'
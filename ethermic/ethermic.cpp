@@ -27,6 +27,13 @@
 #include <sys/signal.h>
 #include <vector>
 
+#include "audiodev.h"
+#include "fanout.h"
+#include "mcast.h"
+#include "metrics.h"
+#include "pkthdr.h"
+#include "rtprofile.h"
+
 using namespace std;
 
 struct UDP_Destination
@@ -34,6 +41,11 @@ struct UDP_Destination
     struct sockaddr_in dest_sock_addr;
     unsigned short dest_port;
     char *dest_addr;
+
+    /* metrics, updated by the send thread */
+    metric_t *packets;
+    metric_t *bytes;
+    metric_t *errors;
 };
 
 static struct
@@ -47,6 +59,7 @@ static snd_pcm_sframes_t (*readi_func)(snd_pcm_t *handle, void *buffer,
         snd_pcm_uframes_t size);
 
 static snd_pcm_t *handle;
+static audiodev_t dev;
 
 static int open_mode = 0;
 static snd_pcm_stream_t stream = SND_PCM_STREAM_PLAYBACK;
@@ -73,10 +86,51 @@ static pthread_t udpSendThread;
 static pthread_t captureThread;
 static int pkts_second;
 
+/* optional sequence header */
+static int pkt_header = 0;
+static unsigned int format_id = 1;
+
+/* packets captured and sent together each period, as a single message to
+ * each destination point with UDP segmentation offload */
+static int gso_packets = 1;
+
+/* the longest period of packets sent together, in us, each packet of it
+ * but the last adding its length to the capture latency */
+#define GSO_PERIOD_MAX_US 100000
+
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond_var = PTHREAD_COND_INITIALIZER;
+static u_char *send_buf = NULL;
+static struct timespec signal_time;
+
+/* real-time profile */
+static rtprofile_t rt;
+
+/* multicast destinations */
+static mcast_t mc;
+
+/* metrics, the xruns updated by the capture thread */
+static metrics_t mx;
+static metric_t *xruns;
 
 static void start_threads();
+static void register_metrics();
+
+/* Handle --gso=n, the packets sent together each period */
+static int gso_option(const char *arg)
+{
+    char *end;
+
+    if (strncmp(arg, "--gso=", 6) != 0)
+        return -1;
+
+    gso_packets = strtol(arg + 6, &end, 10);
+    if ((end == arg + 6) || (*end != '\0') || (gso_packets < 1)
+            || (gso_packets > FANOUT_GSO_SEGMENTS))
+        return -1;
+
+    return 0;
+}
 
 static void print_usage()
 {
@@ -87,11 +141,29 @@ static void print_usage()
     printf("\n");
     printf("   -l, list PCM device names\n");
     printf("   -i, select PCM input device by name\n");
+    printf("   -B backend, audio capture backend (alsa default)\n");
+    printf("      tone[=hz]: sine tone, 1000 Hz default, paced like a sound card\n");
+    printf("      file=path: WAV file (.wav) or raw samples, looped\n");
     printf("   -m n, audio configuration mode\n");
     printf("      1: mu-law au fmt  (8000 hz,  8 bit, 1 channel)\n");
     printf("      2: VOIP  wav fmt (16000 hz, 16 bit, 1 channel)\n");
     printf("      3: Music wav fmt (22050 hz, 16 bit, 2 channel)\n");
     printf("   -d ip_addr:port, destination ip address and port\n");
+    printf("   -s, prefix packets with a sequence header (etherplay -s)\n");
+    printf("   --realtime[=cpu[,cpu]], SCHED_FIFO threads and locked memory,\n");
+    printf("      pinned to CPUs (capture and send threads)\n");
+    printf("   --latency, report thread wakeup latency on exit\n");
+    printf("   --gso=n, capture n packets a period and send them together,\n");
+    printf("      with UDP segmentation offload where the kernel has it,\n");
+    printf("      adding n - 1 packets of latency (1 default, 100 ms of\n");
+    printf("      packets most: 3 for -m 1 and 2, 8 for -m 3)\n");
+    printf("   --metrics=unix:path|[host:]port, serve metrics in the Prometheus\n");
+    printf("      text format (loopback unless a host is given)\n");
+    printf("   --mcast-ttl=n, hops multicast packets go (1 default)\n");
+    printf("   --mcast-if=iface, interface name or address multicast packets\n");
+    printf("      are sent from (routed default)\n");
+    printf("   --mcast-loop=0|1, multicast packets also to this host\n");
+    printf("      (1 default)\n");
     printf("   -h, show this help message\n");
     printf("\n");
     printf("Examples:\n");
@@ -100,6 +172,9 @@ static void print_usage()
     printf("\n");
     printf("      ethermic -i plughw:0,0 -m 1 -d 127.0.0.1:6502");
     printf("\n");
+    printf("\n");
+    printf("      ethermic -B tone=440 -m 2 -d 127.0.0.1:6502");
+    printf("\n");
 }
 
 static void pcm_list(void)
@@ -148,6 +223,15 @@ static void signal_handler(int sig)
 {
     shutdown_req = 1;
 
+    if (rt.report_latency)
+    {
+        rtprofile_latency_report(&rt, RT_AUDIO, "Capture");
+        rtprofile_latency_report(&rt, RT_NET, "Send");
+    }
+
+    audiodev_report(&dev);
+    metrics_close(&mx);
+
     exit(EXIT_SUCCESS);
 }
 
@@ -160,6 +244,7 @@ int main(int argc, char *argv[])
 {
     const char *pcm_name = "default";
     snd_pcm_info_t *info;
+    double packet_us;
     int err;
 
     snd_pcm_info_alloca(&info);
@@ -175,6 +260,11 @@ int main(int argc, char *argv[])
     period_frames = 256;
     sample_buffer_size = 256;
 
+    rtprofile_init(&rt);
+    audiodev_init(&dev, 1);
+    metrics_init(&mx);
+    mcast_init(&mc);
+
     /* Process command line options */
     while (argc > 1)
     {
@@ -200,6 +290,7 @@ int main(int argc, char *argv[])
                     rhwparams.rate = 8000;
                     period_frames = 256;
                     sample_buffer_size = 256;
+                    format_id = 1;
                 }
                 else if (strcasecmp(&argv[1][3], "2") == 0)
                 {
@@ -208,6 +299,7 @@ int main(int argc, char *argv[])
                     rhwparams.rate = 16000;
                     period_frames = 512;
                     sample_buffer_size = 1024;
+                    format_id = 2;
                 }
                 else if (strcasecmp(&argv[1][3], "3") == 0)
                 {
@@ -216,6 +308,7 @@ int main(int argc, char *argv[])
                     rhwparams.rate = 22050;
                     period_frames = 256;
                     sample_buffer_size = 1024;
+                    format_id = 3;
                 }
                 else
                 {
@@ -234,6 +327,30 @@ int main(int argc, char *argv[])
                 destination_points.push_back(udp_dest);
                 break;
 
+            case 's':
+                pkt_header = 1;
+                break;
+
+            case 'B':
+                if (audiodev_option(&dev, &argv[1][3]) < 0)
+                {
+                    printf("Unrecognized audio backend %s\n", &argv[1][3]);
+                    prg_exit(EXIT_FAILURE);
+                }
+                break;
+
+                /* --realtime, --latency, --metrics, --gso and --mcast-* */
+            case '-':
+                if ((metrics_option(&mx, argv[1]) < 0)
+                        && (rtprofile_option(&rt, argv[1]) < 0)
+                        && (gso_option(argv[1]) < 0)
+                        && (mcast_option(&mc, argv[1]) < 0))
+                {
+                    print_usage();
+                    prg_exit(EXIT_SUCCESS);
+                }
+                break;
+
             case 'h':
             default:
                 print_usage();
@@ -252,17 +369,34 @@ int main(int argc, char *argv[])
         prg_exit(EXIT_SUCCESS);
     }
 
-    err = snd_pcm_open(&handle, pcm_name, stream, open_mode);
-    if (err < 0)
+    /* A period of a packet, or of the packets sent together, with room in
+     * the buffer for two of them */
+    packet_us = (double) period_frames * 1000000 / rhwparams.rate;
+    if (gso_packets * packet_us > GSO_PERIOD_MAX_US)
     {
-        printf("audio open error: %s", snd_strerror(err));
-        return 1;
+        printf("--gso=%i captures %.0f ms a period, %i packets most for"
+                " this mode\n", gso_packets, gso_packets * packet_us / 1000,
+                (int) (GSO_PERIOD_MAX_US / packet_us));
+        prg_exit(EXIT_FAILURE);
     }
+    period_frames *= gso_packets;
+    if (max_buffer_time < 2 * gso_packets * packet_us)
+        max_buffer_time = 2 * gso_packets * packet_us;
 
-    if ((err = snd_pcm_info(handle, info)) < 0)
+    if (dev.type == AUDIODEV_ALSA)
     {
-        printf("info error: %s", snd_strerror(err));
-        return 1;
+        err = snd_pcm_open(&handle, pcm_name, stream, open_mode);
+        if (err < 0)
+        {
+            printf("audio open error: %s", snd_strerror(err));
+            return 1;
+        }
+
+        if ((err = snd_pcm_info(handle, info)) < 0)
+        {
+            printf("info error: %s", snd_strerror(err));
+            return 1;
+        }
     }
 
     hwparams = rhwparams;
@@ -272,6 +406,12 @@ int main(int argc, char *argv[])
     signal(SIGTERM, signal_handler);
     signal(SIGABRT, signal_handler);
 
+    /* served from a thread of its own, started before the real-time
+     * profile is applied */
+    register_metrics();
+    if (metrics_start(&mx) < 0)
+        prg_exit(EXIT_FAILURE);
+
     start_threads();
 
     while (!shutdown_req)
@@ -280,7 +420,7 @@ int main(int argc, char *argv[])
     return 0;
 }
 
-static void set_params(void)
+static void set_alsa_params(void)
 {
     snd_pcm_hw_params_t *params;
     snd_pcm_sw_params_t *swparams;
@@ -327,7 +467,12 @@ static void set_params(void)
     assert(err >= 0);
 
     err = snd_pcm_hw_params_set_period_size(handle, params, period_frames, 0);
-    //assert(err >= 0);
+    if (err < 0)
+    {
+        printf("Period size of %lu frames non available",
+                (unsigned long) period_frames);
+        prg_exit(EXIT_FAILURE);
+    }
 
     err = snd_pcm_hw_params_get_buffer_time_max(params, &buffer_time, 0);
     assert(err >= 0);
@@ -391,12 +536,40 @@ static void set_params(void)
 
     if (verbose)
         snd_pcm_dump(handle, log);
+}
+
+/* A backend standing in for the sound card gets the buffer the ALSA device
+ * would have been asked for, in whole periods */
+static void set_backend_params(void)
+{
+    snd_pcm_uframes_t buffer_frames;
+
+    period_time = (double) period_frames * 1000000 / hwparams.rate;
+    buffer_frames = (snd_pcm_uframes_t) ((double) hwparams.rate
+            * max_buffer_time / 1000000 / period_frames) * period_frames;
+    if (buffer_frames < 2 * period_frames)
+        buffer_frames = 2 * period_frames;
+
+    if (audiodev_open(&dev, hwparams.format, hwparams.rate, hwparams.channels,
+            buffer_frames, 1) < 0)
+        prg_exit(EXIT_FAILURE);
+}
+
+static void set_params(void)
+{
+    unsigned int rate = hwparams.rate;
+
+    if (dev.type == AUDIODEV_ALSA)
+        set_alsa_params();
+    else
+        set_backend_params();
 
     bits_per_sample = snd_pcm_format_physical_width(hwparams.format);
     bits_per_frame = bits_per_sample * hwparams.channels;
     period_bytes = period_frames * bits_per_frame / 8;
     audiobuf = (u_char *) malloc(period_bytes);
-    if (audiobuf == NULL)
+    send_buf = (u_char *) malloc(period_bytes);
+    if ((audiobuf == NULL) || (send_buf == NULL))
     {
         printf("not enough memory");
         prg_exit(EXIT_FAILURE);
@@ -408,7 +581,24 @@ static void set_params(void)
 
 static ssize_t pcm_read(u_char *data)
 {
-    int r = readi_func(handle, data, period_frames);
+    int r;
+
+    if (dev.type != AUDIODEV_ALSA)
+    {
+        r = audiodev_readi(&dev, data, period_frames);
+        metric_set(xruns, dev.xruns);
+        return r;
+    }
+
+    r = readi_func(handle, data, period_frames);
+
+    /* Overrun, the capture was not read in time */
+    if (r == -EPIPE)
+    {
+        metric_inc(xruns);
+        snd_pcm_recover(handle, r, 1);
+        r = readi_func(handle, data, period_frames);
+    }
 
     if (r < 0)
     {
@@ -419,6 +609,27 @@ static ssize_t pcm_read(u_char *data)
     return period_frames;
 }
 
+static void pcm_drain()
+{
+    if (dev.type != AUDIODEV_ALSA)
+    {
+        audiodev_drain(&dev);
+        return;
+    }
+
+    snd_pcm_nonblock(handle, 0);
+    snd_pcm_drain(handle);
+    snd_pcm_nonblock(handle, nonblock);
+}
+
+static void pcm_close()
+{
+    if (dev.type != AUDIODEV_ALSA)
+        audiodev_close(&dev);
+    else
+        snd_pcm_close(handle);
+}
+
 static void header()
 {
     printf("%s, ", snd_pcm_format_description(hwparams.format));
@@ -455,6 +666,13 @@ static void create_socket()
         prg_exit(EXIT_FAILURE);
     }
 
+    /* Multicast destinations, one packet for every receiver of a group */
+    if (mcast_sender(&mc, socket_desc) < 0)
+    {
+        perror("setsockopt (multicast)");
+        prg_exit(EXIT_FAILURE);
+    }
+
     /* Set socket address attributes for destination points */
     for (unsigned i = 0; i < destination_points.size(); i++)
     {
@@ -477,72 +695,124 @@ static void create_socket()
 
 static void *send_data_function(void *ptr)
 {
-    char *read_buf = (char *) malloc(period_bytes);
-    int bytes_sent;
+    char *read_buf = (char *) send_buf;
+    int bytes_sent, dest;
     int num_sample_buffers = period_bytes / sample_buffer_size;
+    vector<unsigned char> hdr_bufs(num_sample_buffers * PKTHDR_SIZE);
+    fanout_t fan;
+    pkthdr_t hdr;
+
+    rtprofile_thread(&rt, RT_NET, "send");
 
     create_socket();
 
+    /* A period of packets at a time, to every destination point */
+    if (fanout_init(&fan, socket_desc, &destination_points[0].dest_sock_addr,
+            sizeof(UDP_Destination), destination_points.size(),
+            num_sample_buffers) < 0)
+    {
+        perror("fanout_init");
+        prg_exit(EXIT_FAILURE);
+    }
+
+    /* Without offload they still leave together, a datagram each */
+    if ((gso_packets > 1) && (fanout_gso(&fan) < 0))
+        printf("UDP segmentation offload unavailable (%s), sending a"
+                " datagram at a time\n", strerror(errno));
+
+    pkthdr_init(&hdr, format_id);
+
     while (!shutdown_req)
     {
         pthread_mutex_lock(&mutex);
         pthread_cond_wait(&cond_var, &mutex);
+        rtprofile_wakeup(&rt, RT_NET, CLOCK_MONOTONIC, &signal_time);
         memcpy(read_buf, audiobuf, period_bytes);
         pthread_mutex_unlock(&mutex);
 
-        /* Send the DSP audio buffer as a stream of audio sample packets */
+        /* The DSP audio buffer as a stream of audio sample packets, the
+         * optional sequence header in front of each without copying the
+         * samples */
         for (int i = 0; i < num_sample_buffers; i++)
         {
-            /* Send sample packet to each destination point */
-            for (unsigned j = 0; j < destination_points.size(); j++)
+            unsigned char *hdr_buf = &hdr_bufs[i * PKTHDR_SIZE];
+
+            pkthdr_pack(&hdr, hdr_buf);
+            fanout_add(&fan, pkt_header ? hdr_buf : NULL, PKTHDR_SIZE,
+                    read_buf + (i * sample_buffer_size), sample_buffer_size);
+            pkthdr_next(&hdr, sample_buffer_size * 8 / bits_per_frame);
+        }
+
+        /* Sent to each destination point with a single system call */
+        fanout_flush(&fan);
+
+        for (int k = 0; k < fan.count; k++)
+        {
+            bytes_sent = fanout_result(&fan, k, &dest);
+
+            if (bytes_sent >= 0)
             {
-                bytes_sent =
-                        sendto(socket_desc,
-                                (const char *) read_buf
-                                        + (i * sample_buffer_size),
-                                sample_buffer_size, 0,
-                                (struct sockaddr *) &destination_points[j].dest_sock_addr,
-                                sizeof(destination_points[j].dest_sock_addr));
-
-                if (verbose)
-                {
-                    printf("sent %i bytes to %s:%i\n", bytes_sent,
-                            destination_points[j].dest_addr,
-                            destination_points[j].dest_port);
-                }
+                metric_inc(destination_points[dest].packets);
+                metric_add(destination_points[dest].bytes, bytes_sent);
+            }
+            else
+                metric_inc(destination_points[dest].errors);
 
-                if (bytes_sent == -1)
-                {
-                    printf("sendto() failed.  errno=%i\n", errno);
-                    perror("sendto");
-                    shutdown_req = true;
-                }
+            if (verbose)
+            {
+                printf("sent %i bytes to %s:%i\n", bytes_sent,
+                        destination_points[dest].dest_addr,
+                        destination_points[dest].dest_port);
+            }
+
+            if (bytes_sent < 0)
+            {
+                printf("sendmmsg() failed.  errno=%i\n", -bytes_sent);
+                errno = -bytes_sent;
+                perror("sendmmsg");
+                shutdown_req = true;
             }
         }
     }
 
+    fanout_close(&fan);
+
     return 0;
 }
 
+/* Sleep between periods, recording how late the thread wakes up */
+static void capture_sleep()
+{
+    struct timespec due;
+
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    due.tv_nsec += thread_sleep * 1000L;
+    due.tv_sec += due.tv_nsec / 1000000000L;
+    due.tv_nsec %= 1000000000L;
+
+    usleep(thread_sleep);
+    rtprofile_wakeup(&rt, RT_AUDIO, CLOCK_MONOTONIC, &due);
+}
+
 static void *capture_function(void *ptr)
 {
+    rtprofile_thread(&rt, RT_AUDIO, "capture");
+
     /* capture */
     while (!shutdown_req)
     {
         pcm_read(audiobuf);
 
         pthread_mutex_lock(&mutex);
+        clock_gettime(CLOCK_MONOTONIC, &signal_time);
         pthread_cond_signal(&cond_var);
         pthread_mutex_unlock(&mutex);
 
-        usleep(thread_sleep);
+        capture_sleep();
     }
 
-    snd_pcm_nonblock(handle, 0);
-    snd_pcm_drain(handle);
-    snd_pcm_nonblock(handle, nonblock);
-    
-    snd_pcm_close(handle);
+    pcm_drain();
+    pcm_close();
 
     free(audiobuf);
 
@@ -557,9 +827,46 @@ static void start_threads()
     /* display header info */
     header();
 
+    rtprofile_lock(&rt, audiobuf, period_bytes);
+    rtprofile_lock(&rt, send_buf, period_bytes);
+    rtprofile_lock_report(&rt);
+
     /* spawn send data thread */
     pthread_create(&udpSendThread, NULL, send_data_function, 0);
 
     /* capture thread */
     pthread_create(&captureThread, NULL, capture_function, 0);
 }
+
+/* Label of a destination point's metrics */
+static const char *dest_labels(unsigned i)
+{
+    static char labels[METRIC_LABELS_MAX];
+
+    snprintf(labels, sizeof(labels), "dest=\"%s:%i\"",
+            destination_points[i].dest_addr, destination_points[i].dest_port);
+    return labels;
+}
+
+/* Series of the same name are registered together */
+static void register_metrics()
+{
+    unsigned i;
+
+    for (i = 0; i < destination_points.size(); i++)
+        destination_points[i].packets = metrics_counter(&mx,
+                "ethermic_packets_sent_total", "Packets sent", dest_labels(i));
+
+    for (i = 0; i < destination_points.size(); i++)
+        destination_points[i].bytes = metrics_counter(&mx,
+                "ethermic_sent_bytes_total", "Bytes of packets sent",
+                dest_labels(i));
+
+    for (i = 0; i < destination_points.size(); i++)
+        destination_points[i].errors = metrics_counter(&mx,
+                "ethermic_send_errors_total", "Packets the socket refused",
+                dest_labels(i));
+
+    xruns = metrics_counter(&mx, "ethermic_xruns_total", "Audio device overruns",
+            NULL);
+}
@@ -0,0 +1,225 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "mcast.h"
+
+void mcast_init(mcast_t *m)
+{
+    memset(m, 0, sizeof(mcast_t));
+    m->ttl = -1;
+    m->loop = -1;
+}
+
+int mcast_option(mcast_t *m, const char *arg)
+{
+    char *end;
+    long n;
+
+    if (strncmp(arg, "--mcast-ttl=", 12) == 0)
+    {
+        n = strtol(arg + 12, &end, 10);
+        if ((end == arg + 12) || (*end != '\0') || (n < 0) || (n > 255))
+            return -1;
+        m->ttl = n;
+    }
+    else if (strncmp(arg, "--mcast-loop=", 13) == 0)
+    {
+        if ((strcmp(arg + 13, "0") != 0) && (strcmp(arg + 13, "1") != 0))
+            return -1;
+        m->loop = arg[13] - '0';
+    }
+    else if (strncmp(arg, "--mcast-if=", 11) == 0)
+    {
+        if ((arg[11] == '\0') || (strlen(arg + 11) >= sizeof(m->iface)))
+            return -1;
+        strcpy(m->iface, arg + 11);
+    }
+    else
+        return -1;
+
+    return 0;
+}
+
+int mcast_add_group(mcast_t *m, const char *arg)
+{
+    struct in_addr addr;
+
+    if ((inet_pton(AF_INET, arg, &addr) != 1) || !mcast_is_group(&addr)
+            || (m->group_count == MCAST_GROUPS_MAX))
+        return -1;
+
+    m->groups[m->group_count++] = addr;
+    return 0;
+}
+
+int mcast_add_source(mcast_t *m, const char *arg)
+{
+    struct in_addr addr;
+
+    if ((inet_pton(AF_INET, arg, &addr) != 1)
+            || (m->source_count == MCAST_SOURCES_MAX))
+        return -1;
+
+    m->sources[m->source_count++] = addr;
+    return 0;
+}
+
+/* The index of the interface, named or with the address, 0 for any */
+static int iface_index(const char *iface)
+{
+    struct ifaddrs *ifs, *ifa;
+    struct in_addr addr;
+    int index = 0;
+
+    if (iface[0] == '\0')
+        return 0;
+
+    if (inet_pton(AF_INET, iface, &addr) != 1)
+    {
+        index = if_nametoindex(iface);
+        if (index == 0)
+            errno = ENODEV;
+        return (index > 0) ? index : -1;
+    }
+
+    if (getifaddrs(&ifs) < 0)
+        return -1;
+
+    for (ifa = ifs; ifa != NULL; ifa = ifa->ifa_next)
+    {
+        if ((ifa->ifa_addr != NULL) && (ifa->ifa_addr->sa_family == AF_INET)
+                && (((struct sockaddr_in *) ifa->ifa_addr)->sin_addr.s_addr
+                        == addr.s_addr))
+        {
+            index = if_nametoindex(ifa->ifa_name);
+            break;
+        }
+    }
+
+    freeifaddrs(ifs);
+
+    if (index == 0)
+    {
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+    return index;
+}
+
+int mcast_sender(const mcast_t *m, int sock)
+{
+    struct ip_mreqn mreq;
+    unsigned char c;
+    int index;
+
+    if (m->ttl >= 0)
+    {
+        c = m->ttl;
+        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &c, sizeof(c)) < 0)
+            return -1;
+    }
+
+    if (m->loop >= 0)
+    {
+        c = m->loop;
+        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &c, sizeof(c)) < 0)
+            return -1;
+    }
+
+    if (m->iface[0] != '\0')
+    {
+        index = iface_index(m->iface);
+        if (index < 0)
+            return -1;
+
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_ifindex = index;
+        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq))
+                < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int mcast_join(const mcast_t *m, int sock)
+{
+    struct group_source_req gsr;
+    struct group_req gr;
+    struct sockaddr_in *sin;
+    int index, all = 0;
+    int g, s;
+
+    if (m->group_count == 0)
+        return 0;
+
+    index = iface_index(m->iface);
+    if (index < 0)
+        return -1;
+
+    /* Only the groups joined here, not those of other sockets */
+    if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(all)) < 0)
+        return -1;
+
+    for (g = 0; g < m->group_count; g++)
+    {
+        if (m->source_count == 0)
+        {
+            memset(&gr, 0, sizeof(gr));
+            gr.gr_interface = index;
+            sin = (struct sockaddr_in *) &gr.gr_group;
+            sin->sin_family = AF_INET;
+            sin->sin_addr = m->groups[g];
+
+            if (setsockopt(sock, IPPROTO_IP, MCAST_JOIN_GROUP, &gr,
+                    sizeof(gr)) < 0)
+                return -1;
+            continue;
+        }
+
+        /* Source-specific, the kernel drops the other sources' packets */
+        for (s = 0; s < m->source_count; s++)
+        {
+            memset(&gsr, 0, sizeof(gsr));
+            gsr.gsr_interface = index;
+            sin = (struct sockaddr_in *) &gsr.gsr_group;
+            sin->sin_family = AF_INET;
+            sin->sin_addr = m->groups[g];
+            sin = (struct sockaddr_in *) &gsr.gsr_source;
+            sin->sin_family = AF_INET;
+            sin->sin_addr = m->sources[s];
+
+            if (setsockopt(sock, IPPROTO_IP, MCAST_JOIN_SOURCE_GROUP, &gsr,
+                    sizeof(gsr)) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
@@ -4,23 +4,56 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../audiodev.c \
+../capturedb.c \
+../codec_g711.c \
+../drift.c \
+../flightrec.c \
 ../etherplay.c \
-../ringbuffer.c 
+../jitterbuf.c \
+../mcast.c \
+../metrics.c \
+../plc.c \
+../resample.c \
+../ringbuffer.c \
+../rtprofile.c 
 
 OBJS += \
+./audiodev.o \
+./capturedb.o \
+./codec_g711.o \
+./drift.o \
+./flightrec.o \
 ./etherplay.o \
-./ringbuffer.o 
+./jitterbuf.o \
+./mcast.o \
+./metrics.o \
+./plc.o \
+./resample.o \
+./ringbuffer.o \
+./rtprofile.o 
 
 C_DEPS += \
+./audiodev.d \
+./capturedb.d \
+./codec_g711.d \
+./drift.d \
+./flightrec.d \
 ./etherplay.d \
-./ringbuffer.d 
+./jitterbuf.d \
+./mcast.d \
+./metrics.d \
+./plc.d \
+./resample.d \
+./ringbuffer.d \
+./rtprofile.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
 %.o: ../%.c
 	@echo 'Building file: $<'
 	@echo 'Invoking: GCC C Compiler'
-	gcc -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	gcc -DUSE_MLOCK -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
 	@echo 'Finished building: $<'
 	@echo ' '
 
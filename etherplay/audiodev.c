@@ -0,0 +1,662 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "audiodev.h"
+
+#define WAV_FORMAT_PCM     1
+#define WAV_FORMAT_MULAW   7
+
+static const char *backend_names[] =
+{ "alsa", "null", "file", "tone", "probe" };
+
+void audiodev_init(audiodev_t *dev, int capture)
+{
+    memset(dev, 0, sizeof(audiodev_t));
+
+    dev->type = AUDIODEV_ALSA;
+    dev->capture = capture;
+    dev->tone_hz = 1000;
+    dev->fd = -1;
+    dev->onset = -1;
+}
+
+int audiodev_option(audiodev_t *dev, const char *arg)
+{
+    char *end;
+
+    if (strcmp(arg, "alsa") == 0)
+        dev->type = AUDIODEV_ALSA;
+    else if (!dev->capture && (strcmp(arg, "null") == 0))
+        dev->type = AUDIODEV_NULL;
+    else if (!dev->capture && (strcmp(arg, "probe") == 0))
+        dev->type = AUDIODEV_PROBE;
+    else if ((strncmp(arg, "file=", 5) == 0) && (arg[5] != '\0'))
+    {
+        dev->type = AUDIODEV_FILE;
+        dev->path = arg + 5;
+    }
+    else if (dev->capture && (strncmp(arg, "tone", 4) == 0))
+    {
+        dev->type = AUDIODEV_TONE;
+        arg += 4;
+
+        if (*arg == '\0')
+            return 0;
+        if (*arg++ != '=')
+            return -1;
+
+        dev->tone_hz = strtod(arg, &end);
+        if ((end == arg) || (*end != '\0') || (dev->tone_hz <= 0))
+            return -1;
+    }
+    else
+        return -1;
+
+    return 0;
+}
+
+const char *audiodev_name(const audiodev_t *dev)
+{
+    return backend_names[dev->type];
+}
+
+/* Sign and magnitude mu-law encoding, as in G.711 */
+static unsigned char ulaw_encode(int pcm)
+{
+    int sign = (pcm < 0) ? 0x80 : 0;
+    int exponent = 7, mask;
+
+    if (pcm < 0)
+        pcm = -pcm;
+    if (pcm > 32635)
+        pcm = 32635;
+    pcm += 0x84;
+
+    for (mask = 0x4000; (exponent > 0) && !(pcm & mask); mask >>= 1)
+        exponent--;
+
+    return ~(sign | (exponent << 4) | ((pcm >> (exponent + 3)) & 0x0f));
+}
+
+static int ulaw_decode(unsigned char ulaw)
+{
+    int t;
+
+    ulaw = ~ulaw;
+    t = (((ulaw & 0x0f) << 3) + 0x84) << ((ulaw & 0x70) >> 4);
+
+    return (ulaw & 0x80) ? 0x84 - t : t - 0x84;
+}
+
+static void put_le16(unsigned char *p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, unsigned long v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static unsigned int get_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long get_le32(const unsigned char *p)
+{
+    return get_le16(p) | ((unsigned long) get_le16(p + 2) << 16);
+}
+
+static int wav_format(const audiodev_t *dev)
+{
+    return (dev->format == SND_PCM_FORMAT_MU_LAW) ?
+            WAV_FORMAT_MULAW : WAV_FORMAT_PCM;
+}
+
+/* Write the header of a WAV file, with the sizes filled in on close */
+static int wav_write_header(audiodev_t *dev)
+{
+    unsigned char h[46];
+    size_t fmt_len = (wav_format(dev) == WAV_FORMAT_PCM) ? 16 : 18;
+
+    memset(h, 0, sizeof(h));
+    memcpy(h, "RIFF", 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, fmt_len);
+    put_le16(h + 20, wav_format(dev));
+    put_le16(h + 22, dev->channels);
+    put_le32(h + 24, dev->rate);
+    put_le32(h + 28, dev->rate * dev->frame_bytes);
+    put_le16(h + 32, dev->frame_bytes);
+    put_le16(h + 34, dev->frame_bytes * 8 / dev->channels);
+    memcpy(h + 20 + fmt_len, "data", 4);
+
+    dev->data_offset = 28 + fmt_len;
+
+    return (write(dev->fd, h, dev->data_offset) == dev->data_offset) ? 0 : -1;
+}
+
+static void wav_finish(audiodev_t *dev)
+{
+    unsigned char size[4];
+    unsigned long long riff = dev->data_offset - 8 + dev->data_bytes;
+
+    put_le32(size, (riff > 0xffffffffULL) ? 0xffffffffUL : riff);
+    pwrite(dev->fd, size, 4, 4);
+
+    put_le32(size, (dev->data_bytes > 0xffffffffULL) ?
+            0xffffffffUL : dev->data_bytes);
+    pwrite(dev->fd, size, 4, dev->data_offset - 4);
+}
+
+/* Find the samples of a WAV file, checking that they are in the format
+ * of the stream */
+static int wav_read_header(audiodev_t *dev)
+{
+    unsigned char h[16];
+    unsigned long len;
+    int format_ok = 0;
+
+    if ((read(dev->fd, h, 12) != 12) || (memcmp(h, "RIFF", 4) != 0)
+            || (memcmp(h + 8, "WAVE", 4) != 0))
+    {
+        printf("%s: not a WAV file\n", dev->path);
+        return -1;
+    }
+
+    while (read(dev->fd, h, 8) == 8)
+    {
+        len = get_le32(h + 4);
+
+        if (memcmp(h, "data", 4) == 0)
+        {
+            if (!format_ok)
+                break;
+
+            dev->data_offset = lseek(dev->fd, 0, SEEK_CUR);
+            return 0;
+        }
+
+        if ((memcmp(h, "fmt ", 4) == 0) && (len >= 16))
+        {
+            if (read(dev->fd, h, 16) != 16)
+                break;
+            len -= 16;
+
+            format_ok = (get_le16(h) == (unsigned int) wav_format(dev))
+                    && (get_le16(h + 2) == dev->channels)
+                    && (get_le32(h + 4) == dev->rate)
+                    && (get_le16(h + 14)
+                            == dev->frame_bytes * 8 / dev->channels);
+            if (!format_ok)
+            {
+                printf("%s: %lu Hz, %u channels, format %u, %u bits, "
+                        "does not match the audio configuration mode\n",
+                        dev->path, get_le32(h + 4), get_le16(h + 2),
+                        get_le16(h), get_le16(h + 14));
+                return -1;
+            }
+        }
+
+        lseek(dev->fd, len + (len & 1), SEEK_CUR);
+    }
+
+    printf("%s: no audio data\n", dev->path);
+    return -1;
+}
+
+static int has_suffix(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+
+    return (n >= m) && (strcasecmp(s + n - m, suffix) == 0);
+}
+
+int audiodev_open(audiodev_t *dev, snd_pcm_format_t format, unsigned int rate,
+        unsigned int channels, snd_pcm_uframes_t buffer_frames,
+        snd_pcm_uframes_t start_frames)
+{
+    if ((format != SND_PCM_FORMAT_MU_LAW) && (format != SND_PCM_FORMAT_S16_LE))
+    {
+        printf("The %s backend does not support %s\n", audiodev_name(dev),
+                snd_pcm_format_name(format));
+        return -1;
+    }
+
+    dev->format = format;
+    dev->rate = rate;
+    dev->channels = channels;
+    dev->frame_bytes = snd_pcm_format_physical_width(format) / 8 * channels;
+    dev->buffer_frames = buffer_frames;
+    dev->start_frames = start_frames;
+    if (dev->start_frames > dev->buffer_frames)
+        dev->start_frames = dev->buffer_frames;
+    if (dev->start_frames < 1)
+        dev->start_frames = 1;
+
+    dev->running = 0;
+    dev->frames = 0;
+    dev->armed = 1;
+
+    if (dev->type != AUDIODEV_FILE)
+        return 0;
+
+    dev->wav = has_suffix(dev->path, ".wav");
+    dev->data_offset = 0;
+    dev->data_bytes = 0;
+
+    if (dev->capture)
+        dev->fd = open(dev->path, O_RDONLY);
+    else
+        dev->fd = open(dev->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (dev->fd < 0)
+    {
+        perror(dev->path);
+        return -1;
+    }
+
+    if (!dev->wav)
+        return 0;
+
+    if ((dev->capture ? wav_read_header(dev) : wav_write_header(dev)) < 0)
+    {
+        close(dev->fd);
+        dev->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void audiodev_close(audiodev_t *dev)
+{
+    if (dev->fd < 0)
+        return;
+
+    if (dev->wav && !dev->capture)
+        wav_finish(dev);
+
+    close(dev->fd);
+    dev->fd = -1;
+}
+
+/* Frames of the device clock since it started */
+static unsigned long long clock_frames(const audiodev_t *dev)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((now.tv_sec - dev->start.tv_sec)
+            + (now.tv_nsec - dev->start.tv_nsec) / 1e9) * dev->rate;
+}
+
+/* When the device clock reaches the given frame */
+static void clock_deadline(const audiodev_t *dev, unsigned long long frames,
+        struct timespec *ts)
+{
+    unsigned long long ns = (double) frames * 1e9 / dev->rate;
+
+    ts->tv_sec = dev->start.tv_sec + ns / 1000000000ULL;
+    ts->tv_nsec = dev->start.tv_nsec + ns % 1000000000ULL;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void probe_print(const audiodev_t *dev, unsigned long long frame)
+{
+    struct timespec ts;
+
+    clock_deadline(dev, frame, &ts);
+    printf("Onset %ld.%09ld\n", (long) ts.tv_sec, ts.tv_nsec);
+    fflush(stdout);
+}
+
+static void clock_start(audiodev_t *dev)
+{
+    clock_gettime(CLOCK_MONOTONIC, &dev->start);
+    dev->running = 1;
+
+    /* an onset queued before the start is heard once the clock runs */
+    if (dev->onset >= 0)
+        probe_print(dev, dev->onset);
+    dev->onset = -1;
+}
+
+/* Find where sound starts after at least AUDIODEV_PROBE_REARM_MS of
+ * silence, in frames about to be queued */
+static void probe_scan(audiodev_t *dev, const char *data,
+        snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+    int v;
+
+    for (i = 0; i < frames; i++, data += dev->frame_bytes)
+    {
+        if (dev->format == SND_PCM_FORMAT_MU_LAW)
+            v = ulaw_decode(*data);
+        else
+            v = *(const int16_t *) data;
+        if (v < 0)
+            v = -v;
+
+        if (dev->armed && (v > AUDIODEV_PROBE_LOUD))
+        {
+            if (dev->running)
+                probe_print(dev, dev->frames + i);
+            else
+                dev->onset = dev->frames + i;
+            dev->armed = 0;
+            dev->quiet = 0;
+        }
+        else if (v < AUDIODEV_PROBE_QUIET)
+        {
+            if (++dev->quiet >= dev->rate * AUDIODEV_PROBE_REARM_MS / 1000)
+                dev->armed = 1;
+        }
+        else
+            dev->quiet = 0;
+    }
+}
+
+/* Stop the device clock on an xrun, as ALSA would: a playback device that
+ * has played everything queued, or a capture device whose buffer has
+ * filled up */
+static void clock_update(audiodev_t *dev)
+{
+    unsigned long long now;
+
+    if (!dev->running)
+        return;
+
+    now = clock_frames(dev);
+
+    if (dev->capture ? (now > dev->frames + dev->buffer_frames)
+            : (now >= dev->frames))
+    {
+        dev->xruns++;
+        dev->running = 0;
+        dev->frames = 0;
+    }
+}
+
+snd_pcm_sframes_t audiodev_avail(audiodev_t *dev)
+{
+    if (dev->capture)
+        return audiodev_delay(dev);
+
+    return dev->buffer_frames - audiodev_delay(dev);
+}
+
+snd_pcm_sframes_t audiodev_delay(audiodev_t *dev)
+{
+    unsigned long long now;
+
+    clock_update(dev);
+
+    if (!dev->running)
+        return dev->capture ? 0 : dev->frames;
+
+    now = clock_frames(dev);
+    if (dev->capture)
+        return (now > dev->frames) ? now - dev->frames : 0;
+
+    return (now < dev->frames) ? dev->frames - now : 0;
+}
+
+int audiodev_running(audiodev_t *dev)
+{
+    clock_update(dev);
+
+    return dev->running;
+}
+
+int audiodev_wait(audiodev_t *dev, snd_pcm_uframes_t frames, int timeout_ms)
+{
+    struct timespec due, timeout;
+    unsigned long long target;
+
+    if (frames > dev->buffer_frames)
+        frames = dev->buffer_frames;
+
+    if (audiodev_avail(dev) >= (snd_pcm_sframes_t) frames)
+        return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &timeout);
+    timeout.tv_sec += timeout_ms / 1000;
+    timeout.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (timeout.tv_nsec >= 1000000000L)
+    {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000L;
+    }
+
+    if (dev->capture && !dev->running)
+    {
+        clock_start(dev);
+        dev->frames = 0;
+    }
+
+    /* A stopped playback device frees no room, as with poll on ALSA */
+    due = timeout;
+    if (dev->running)
+    {
+        target = dev->frames + frames;
+        if (!dev->capture)
+            target -= dev->buffer_frames;
+
+        clock_deadline(dev, target, &due);
+        if ((due.tv_sec > timeout.tv_sec)
+                || ((due.tv_sec == timeout.tv_sec)
+                        && (due.tv_nsec > timeout.tv_nsec)))
+            due = timeout;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+            == EINTR)
+        ;
+
+    return audiodev_avail(dev) >= (snd_pcm_sframes_t) frames;
+}
+
+snd_pcm_sframes_t audiodev_writei(audiodev_t *dev, const void *buf,
+        snd_pcm_uframes_t frames)
+{
+    const char *data = buf;
+    snd_pcm_uframes_t done = 0, n;
+    snd_pcm_sframes_t room;
+    ssize_t len;
+
+    while (done < frames)
+    {
+        room = audiodev_avail(dev);
+        if (room <= 0)
+        {
+            audiodev_wait(dev, frames - done, 1000);
+            continue;
+        }
+
+        n = frames - done;
+        if (n > (snd_pcm_uframes_t) room)
+            n = room;
+
+        if (dev->fd >= 0)
+        {
+            len = write(dev->fd, data + done * dev->frame_bytes,
+                    n * dev->frame_bytes);
+            if (len > 0)
+                dev->data_bytes += len;
+        }
+
+        if (dev->type == AUDIODEV_PROBE)
+            probe_scan(dev, data + done * dev->frame_bytes, n);
+
+        dev->frames += n;
+        dev->total_frames += n;
+        done += n;
+
+        if (!dev->running && (dev->frames >= dev->start_frames))
+            clock_start(dev);
+    }
+
+    return done;
+}
+
+static void tone_fill(audiodev_t *dev, char *data, snd_pcm_uframes_t frames)
+{
+    double step = 2 * M_PI * dev->tone_hz / dev->rate;
+    int16_t *pcm = (int16_t *) data;
+    snd_pcm_uframes_t i;
+    unsigned int c;
+    int v;
+
+    for (i = 0; i < frames; i++)
+    {
+        /* half scale, -6 dBFS */
+        v = 16384 * sin(dev->phase);
+        dev->phase += step;
+        if (dev->phase >= 2 * M_PI)
+            dev->phase -= 2 * M_PI;
+
+        for (c = 0; c < dev->channels; c++)
+        {
+            if (dev->format == SND_PCM_FORMAT_MU_LAW)
+                *data++ = ulaw_encode(v);
+            else
+                *pcm++ = v;
+        }
+    }
+}
+
+/* Read the file from where it left off, going back to the start of the
+ * samples at the end */
+static void file_fill(audiodev_t *dev, char *data, snd_pcm_uframes_t frames)
+{
+    size_t len = frames * dev->frame_bytes;
+    int rewound = 0;
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = read(dev->fd, data, len);
+        if (n > 0)
+        {
+            data += n;
+            len -= n;
+            rewound = 0;
+            continue;
+        }
+
+        /* An empty file gives silence */
+        if (rewound || (lseek(dev->fd, dev->data_offset, SEEK_SET) < 0))
+        {
+            snd_pcm_format_set_silence(dev->format, data,
+                    len * dev->channels / dev->frame_bytes);
+            break;
+        }
+        rewound = 1;
+    }
+}
+
+snd_pcm_sframes_t audiodev_readi(audiodev_t *dev, void *buf,
+        snd_pcm_uframes_t frames)
+{
+    struct timespec due;
+
+    clock_update(dev);
+    if (!dev->running)
+    {
+        clock_start(dev);
+        dev->frames = 0;
+    }
+
+    /* Wait until the device clock has captured the frames */
+    clock_deadline(dev, dev->frames + frames, &due);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+            == EINTR)
+        ;
+
+    if (dev->type == AUDIODEV_TONE)
+        tone_fill(dev, buf, frames);
+    else
+        file_fill(dev, buf, frames);
+
+    dev->frames += frames;
+    dev->total_frames += frames;
+
+    return frames;
+}
+
+void audiodev_prepare(audiodev_t *dev)
+{
+    dev->running = 0;
+    dev->frames = 0;
+    dev->onset = -1;
+}
+
+void audiodev_drain(audiodev_t *dev)
+{
+    struct timespec due;
+
+    if (!dev->capture && (dev->frames > 0))
+    {
+        if (!dev->running)
+            clock_start(dev);
+
+        clock_deadline(dev, dev->frames, &due);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+                == EINTR)
+            ;
+    }
+
+    audiodev_prepare(dev);
+}
+
+void audiodev_report(const audiodev_t *dev)
+{
+    if (dev->type == AUDIODEV_ALSA)
+        return;
+
+    printf("Audio backend %s: %llu frames, %.1f s, %lu %s\n",
+            audiodev_name(dev), dev->total_frames,
+            (dev->rate > 0) ? (double) dev->total_frames / dev->rate : 0.0,
+            dev->xruns, dev->capture ? "overruns" : "underruns");
+}
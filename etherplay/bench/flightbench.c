@@ -0,0 +1,214 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Micro-benchmark of etherplay's flight recorder, the cost the receive
+ * thread pays per packet to keep it, and a check that dumps taken while
+ * the ring is written flat out hold only whole packets, in order.
+ *
+ * Packets carry their sequence number in every word.  They are recorded
+ * with nothing else running, to time flightrec_add() against the memcpy
+ * of the same bytes, then again while dumps are taken back to back; each
+ * dump is read back and checked.  Dumps are written to flightbench_*.
+ *
+ * Build from this directory with:
+ *
+ *    gcc -O2 -I.. -o flightbench flightbench.c ../flightrec.c \
+ *        ../capturedb.c -lpthread
+ *
+ * Usage: flightbench [packet bytes] [packets] [minutes at 1000 packets/s]
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "capturedb.h"
+#include "flightrec.h"
+
+static size_t packet_bytes = 256;
+static unsigned long packets = 5000000;
+static double minutes = 1;
+
+static double now_ns()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void fill(uint32_t *words, uint32_t seq)
+{
+    size_t i;
+
+    for (i = 0; i < packet_bytes / 4; i++)
+        words[i] = seq;
+}
+
+/* Read a dump back, checking that its packets are whole and in order */
+static int check_dump(const char *name, unsigned long *count)
+{
+    capturedb_reader_t r;
+    capturedb_entry_t e;
+    const unsigned char *data;
+    uint32_t i, seq, prev = 0, word;
+    size_t k;
+
+    if (capturedb_open(&r, name) < 0)
+    {
+        perror(name);
+        return -1;
+    }
+
+    for (i = 0; i < r.count; i++)
+    {
+        if ((capturedb_entry(&r, i, &e, &data) < 0)
+                || ((size_t) e.size != packet_bytes))
+            break;
+
+        memcpy(&seq, data, 4);
+        for (k = 4; k < packet_bytes; k += 4)
+        {
+            memcpy(&word, data + k, 4);
+            if (word != seq)
+                break;
+        }
+
+        if ((k < packet_bytes) || ((i > 0) && (seq <= prev)))
+            break;
+        prev = seq;
+    }
+
+    *count = r.count;
+    capturedb_unmap(&r);
+    return (i == *count) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    flightrec_t fr;
+    struct timespec arrival;
+    struct iovec iov;
+    uint32_t *pkt;
+    char *copy;
+    double start, add_ns, copy_ns;
+    unsigned long i, n, dumps = 0, dumped = 0, bad = 0;
+    char name[FLIGHTREC_NAME_MAX + 32];
+    FILE *p;
+
+    if (argc > 1)
+        packet_bytes = atoi(argv[1]) & ~3;
+    if (argc > 2)
+        packets = atol(argv[2]);
+    if (argc > 3)
+        minutes = atof(argv[3]);
+
+    pkt = malloc(packet_bytes);
+    copy = malloc(packet_bytes);
+    iov.iov_base = pkt;
+    iov.iov_len = packet_bytes;
+
+    flightrec_init(&fr);
+    flightrec_option(&fr, "--flight=1,flightbench");
+    fr.minutes = minutes;
+    if (flightrec_start(&fr, 1000, packet_bytes) < 0)
+    {
+        perror("flightrec_start");
+        return EXIT_FAILURE;
+    }
+
+    /* the cost per packet, against copying it anyway */
+    clock_gettime(CLOCK_REALTIME, &arrival);
+    start = now_ns();
+    for (i = 0; i < packets; i++)
+    {
+        pkt[0] = i;
+        flightrec_add(&fr, &arrival, &iov, 1, packet_bytes);
+    }
+    add_ns = (now_ns() - start) / packets;
+
+    start = now_ns();
+    for (i = 0; i < packets; i++)
+    {
+        pkt[0] = i;
+        memcpy(copy, pkt, packet_bytes);
+        __asm__ volatile("" : : "r" (copy) : "memory");
+    }
+    copy_ns = (now_ns() - start) / packets;
+
+    printf("%zu byte packets, %.1f MB ring: flightrec_add %.1f ns/packet,"
+            " memcpy %.1f ns/packet\n", packet_bytes, fr.size / 1e6, add_ns,
+            copy_ns);
+
+    /* dumps while the ring is overwritten as fast as it can be, by a ring
+     * without the packets timed */
+    flightrec_close(&fr);
+    if (flightrec_start(&fr, 1000, packet_bytes) < 0)
+    {
+        perror("flightrec_start");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < packets; i++)
+    {
+        clock_gettime(CLOCK_REALTIME, &arrival);
+        fill(pkt, packets + i);
+        flightrec_add(&fr, &arrival, &iov, 1, packet_bytes);
+
+        if (((i % 1000) == 0) && !fr.pending)
+        {
+            if (fr.dumps > dumps)
+            {
+                /* the last dump is the newest of those files */
+                p = popen("ls -t flightbench_*.man | head -1", "r");
+                if ((p != NULL) && (fgets(name, sizeof(name), p) != NULL))
+                {
+                    name[strcspn(name, ".")] = '\0';
+                    if (check_dump(name, &n) < 0)
+                        bad++;
+                    else
+                        dumped += n;
+                }
+                if (p != NULL)
+                    pclose(p);
+                dumps = fr.dumps;
+            }
+            flightrec_trigger(&fr, FLIGHTREC_SIGNAL);
+        }
+    }
+
+    while (fr.pending)
+        usleep(1000);
+
+    printf("%lu dumps taken while recording, %lu packets checked, %lu bad\n",
+            fr.dumps, dumped, bad);
+
+    flightrec_close(&fr);
+    free(pkt);
+    free(copy);
+
+    return (bad == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
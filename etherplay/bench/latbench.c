@@ -0,0 +1,426 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * End-to-end latency benchmark of etherplay, from the time a packet is
+ * sent to the time its first sample is heard.
+ *
+ * etherplay is started on the probe audio backend, which prints the time
+ * each sound that follows silence will be heard.  Packets are sent to it
+ * over loopback, paced at absolute deadlines as ethersend does, carrying
+ * silence except for a loud marker packet every MARKER_MS.  Each onset is
+ * matched to the marker sent before it, and the first marker gives the
+ * time to first sample.  This is repeated for each audio configuration
+ * mode, with and without the sequence header, and for each jitter buffer
+ * target, and a CSV summary is printed at the end.
+ *
+ * Build from this directory with:
+ *
+ *    gcc -O2 -I.. -o latbench latbench.c
+ *
+ * Usage: latbench [etherplay path] [seconds per run] [port]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "pkthdr.h"
+
+#define MARKER_MS          400
+#define STARTUP_MS         300
+#define SETTLE_MS          1000
+#define MAX_MARKERS        1024
+#define MARKER_LEVEL       16000
+
+/* the -m audio configuration modes */
+static const struct
+{
+    int mode;
+    unsigned int rate;
+    unsigned int channels;
+    int mulaw;
+    size_t packet_bytes;
+} modes[] =
+{
+{ 1, 8000, 1, 1, 256 },
+{ 2, 16000, 1, 0, 1024 },
+{ 3, 22050, 2, 0, 1024 } };
+
+#define MODES              (sizeof(modes) / sizeof(modes[0]))
+
+/* jitter buffer targets, each also the minimum */
+static const int jitter_ms[] =
+{ 20, 40, 80 };
+
+#define JITTERS            (sizeof(jitter_ms) / sizeof(jitter_ms[0]))
+
+static const char *etherplay_path = "../Debug/etherplay";
+static double run_sec = 8;
+static int port = 6510;
+
+typedef struct
+{
+    int mode;
+    int header;
+    int jitter;
+    size_t packet_bytes;
+
+    double sent[MAX_MARKERS];
+    int markers;
+    double onset[MAX_MARKERS];
+    int onsets;
+    int underruns;
+
+    /* results in ms */
+    int matched;
+    double ttfs;
+    double p50;
+    double p99;
+    double max;
+} run_t;
+
+static run_t runs[MODES * 2 * JITTERS];
+
+static double now_sec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t;
+    ts.tv_nsec = (t - ts.tv_sec) * 1e9;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* Start etherplay for the run, with its output on the returned pipe */
+static int spawn(const run_t *run, int m, pid_t *pid)
+{
+    char mode_arg[16], port_arg[16], jitter_arg[32];
+    int fds[2];
+
+    snprintf(mode_arg, sizeof(mode_arg), "-m %i", modes[m].mode);
+    snprintf(port_arg, sizeof(port_arg), "-p %i", port);
+    snprintf(jitter_arg, sizeof(jitter_arg), "-j %i:%i:1000", run->jitter,
+            run->jitter);
+
+    if (pipe(fds) < 0)
+        return -1;
+
+    *pid = fork();
+    if (*pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        if (run->header)
+            execl(etherplay_path, "etherplay", mode_arg, port_arg, jitter_arg,
+                    "-B probe", "-v", "-s", (char *) NULL);
+        else
+            execl(etherplay_path, "etherplay", mode_arg, port_arg, jitter_arg,
+                    "-B probe", "-v", (char *) NULL);
+
+        perror(etherplay_path);
+        _exit(1);
+    }
+
+    close(fds[1]);
+    if (*pid < 0)
+    {
+        close(fds[0]);
+        return -1;
+    }
+
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    return fds[0];
+}
+
+/* Collect the onsets and the underrun count from etherplay's output */
+static int read_output(int fd, run_t *run, char *line, size_t *len)
+{
+    char *nl, *p;
+    ssize_t n;
+
+    while ((n = read(fd, line + *len, 1023 - *len)) > 0)
+    {
+        *len += n;
+        line[*len] = '\0';
+
+        while ((nl = strchr(line, '\n')) != NULL)
+        {
+            *nl = '\0';
+
+            if ((strncmp(line, "Onset ", 6) == 0)
+                    && (run->onsets < MAX_MARKERS))
+                run->onset[run->onsets++] = atof(line + 6);
+            else if ((p = strstr(line, "Underruns = ")) != NULL)
+                run->underruns = atoi(p + 12);
+
+            *len -= nl + 1 - line;
+            memmove(line, nl + 1, *len + 1);
+        }
+
+        if (*len == 1023)
+            *len = 0;
+    }
+
+    return n;
+}
+
+/* Silence, or a loud square wave for a marker */
+static void fill_packet(int m, char *data, int marker)
+{
+    size_t i, samples = modes[m].packet_bytes / (modes[m].mulaw ? 1 : 2);
+    int16_t v;
+
+    for (i = 0; i < samples; i++)
+    {
+        v = marker ? (((i / modes[m].channels / 8) & 1) ?
+                -MARKER_LEVEL : MARKER_LEVEL) : 0;
+
+        if (modes[m].mulaw)
+            data[i] = v ? ((v > 0) ? 0x8f : 0x0f) : 0xff;
+        else
+            ((int16_t *) data)[i] = v;
+    }
+}
+
+static void send_stream(run_t *run, int m, int out_fd, char *line,
+        size_t *len)
+{
+    struct sockaddr_in addr;
+    char pkt[PKTHDR_SIZE + 1024], *payload;
+    size_t frames = modes[m].packet_bytes / modes[m].channels
+            / (modes[m].mulaw ? 1 : 2);
+    double packet_sec = (double) frames / modes[m].rate;
+    int marker_every = (MARKER_MS / 1000.0 + packet_sec - 1e-9) / packet_sec;
+    int packets = run_sec / packet_sec;
+    double start;
+    pkthdr_t hdr;
+    int sock, k;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    payload = pkt + (run->header ? PKTHDR_SIZE : 0);
+    pkthdr_init(&hdr, modes[m].mode);
+
+    start = now_sec();
+    for (k = 0; k < packets; k++)
+    {
+        sleep_until(start + k * packet_sec);
+
+        fill_packet(m, payload, (k % marker_every) == 0);
+        if (run->header)
+        {
+            pkthdr_pack(&hdr, (unsigned char *) pkt);
+            pkthdr_next(&hdr, frames);
+        }
+
+        if (((k % marker_every) == 0) && (run->markers < MAX_MARKERS))
+            run->sent[run->markers++] = now_sec();
+
+        sendto(sock, pkt, run->packet_bytes, 0, (struct sockaddr *) &addr,
+                sizeof(addr));
+
+        read_output(out_fd, run, line, len);
+    }
+
+    close(sock);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double d = *(const double *) a - *(const double *) b;
+
+    return (d > 0) - (d < 0);
+}
+
+/* Match each onset to the last marker sent before it */
+static void analyse(run_t *run)
+{
+    double lat[MAX_MARKERS];
+    int used[MAX_MARKERS];
+    int i, j, n = 0;
+
+    memset(used, 0, sizeof(used));
+    run->matched = 0;
+    run->ttfs = run->p50 = run->p99 = run->max = -1;
+
+    for (j = 0; j < run->onsets; j++)
+    {
+        for (i = run->markers - 1; i >= 0; i--)
+            if (run->sent[i] <= run->onset[j])
+                break;
+
+        if ((i < 0) || used[i])
+            continue;
+
+        used[i] = 1;
+        run->matched++;
+
+        if (i == 0)
+            run->ttfs = (run->onset[j] - run->sent[0]) * 1000;
+        else
+            lat[n++] = (run->onset[j] - run->sent[i]) * 1000;
+    }
+
+    if (n == 0)
+        return;
+
+    qsort(lat, n, sizeof(double), compare_double);
+    run->p50 = lat[n / 2];
+    run->p99 = lat[(n * 99) / 100];
+    run->max = lat[n - 1];
+}
+
+static int bench(run_t *run, int m)
+{
+    char line[1024];
+    size_t len = 0;
+    double until;
+    pid_t pid;
+    int fd, status;
+
+    fd = spawn(run, m, &pid);
+    if (fd < 0)
+        return -1;
+
+    /* let etherplay bind its port */
+    sleep_until(now_sec() + STARTUP_MS / 1000.0);
+
+    send_stream(run, m, fd, line, &len);
+
+    /* the last markers are still in the buffers */
+    until = now_sec() + SETTLE_MS / 1000.0;
+    while (now_sec() < until)
+    {
+        read_output(fd, run, line, &len);
+        sleep_until(now_sec() + 0.01);
+    }
+
+    /* etherplay reports its statistics on SIGINT */
+    kill(pid, SIGINT);
+    fcntl(fd, F_SETFL, 0);
+    while (read_output(fd, run, line, &len) > 0)
+        ;
+    close(fd);
+    waitpid(pid, &status, 0);
+
+    if (WIFEXITED(status) && (WEXITSTATUS(status) != 0))
+        return -1;
+
+    analyse(run);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int m, h, j, n = 0, i;
+    run_t *run;
+
+    if (argc > 1)
+        etherplay_path = argv[1];
+    if (argc > 2)
+        run_sec = atof(argv[2]);
+    if (argc > 3)
+        port = atoi(argv[3]);
+
+    if ((run_sec * 1000 < 2 * MARKER_MS) || (port <= 0)
+            || (access(etherplay_path, X_OK) < 0))
+    {
+        printf("Usage: latbench [etherplay path] [seconds per run] [port]\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Latency from packet sent to sample heard, %.0f s per run, a "
+            "marker every %i ms\n\n", run_sec, MARKER_MS);
+
+    for (m = 0; m < MODES; m++)
+    {
+        for (h = 0; h < 2; h++)
+        {
+            for (j = 0; j < JITTERS; j++)
+            {
+                run = &runs[n++];
+                memset(run, 0, sizeof(run_t));
+                run->mode = modes[m].mode;
+                run->header = h;
+                run->jitter = jitter_ms[j];
+                run->packet_bytes = modes[m].packet_bytes
+                        + (h ? PKTHDR_SIZE : 0);
+
+                printf("mode %i, %4lu byte packets, jitter %2i ms: ",
+                        run->mode, (unsigned long) run->packet_bytes,
+                        run->jitter);
+                fflush(stdout);
+
+                if (bench(run, m) < 0)
+                {
+                    printf("etherplay failed\n");
+                    continue;
+                }
+
+                printf("p50 %6.1f ms, p99 %6.1f ms, max %6.1f ms, "
+                        "first sample %6.1f ms, markers %i/%i, "
+                        "underruns %i\n", run->p50, run->p99, run->max,
+                        run->ttfs, run->matched, run->markers,
+                        run->underruns);
+            }
+        }
+    }
+
+    printf("\nmode,header,packet_bytes,jitter_ms,markers,matched,p50_ms,"
+            "p99_ms,max_ms,first_sample_ms,underruns\n");
+    for (i = 0; i < n; i++)
+    {
+        run = &runs[i];
+        printf("%i,%i,%lu,%i,%i,%i,%.2f,%.2f,%.2f,%.2f,%i\n", run->mode,
+                run->header, (unsigned long) run->packet_bytes, run->jitter,
+                run->markers, run->matched, run->p50, run->p99, run->max,
+                run->ttfs, run->underruns);
+    }
+
+    return 0;
+}
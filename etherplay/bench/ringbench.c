@@ -0,0 +1,228 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Micro-benchmark of etherplay's ringbuffer against the volatile pointer
+ * version it replaced, with one writer and one reader thread passing
+ * sequence numbered packets, as the receive and playout threads do.
+ *
+ * Build from this directory with:
+ *
+ *    gcc -O2 -I.. -o ringbench ringbench.c vringbuffer.c ../ringbuffer.c \
+ *        -lpthread
+ *
+ * Usage: ringbench [packet bytes] [packets] [ring bytes] [batch]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ringbuffer.h"
+#include "vringbuffer.h"
+
+enum
+{
+    RING_VOLATILE, RING_ATOMIC, RING_BATCH
+};
+
+static const char *ring_names[] =
+{ "volatile, byte read/write", "atomic, byte read/write",
+        "atomic, batch push/pop" };
+
+static size_t packet_bytes = 256;
+static unsigned long packets = 2000000;
+static size_t ring_bytes = 16384;
+static size_t batch = 8;
+static int ncpus;
+
+static struct
+{
+    int kind;
+    ringbuffer_t *rb;
+    vringbuffer_t *vrb;
+    unsigned long errors;
+} bench;
+
+static double now_sec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Keep the threads apart when there is more than one CPU, so the
+ * pointers really do bounce between caches */
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (ncpus < 2)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *writer_function(void *ptr)
+{
+    char *buf = malloc(packet_bytes * batch);
+    unsigned long seq = 0, next;
+    size_t i, n;
+
+    pin(0);
+
+    while (seq < packets)
+    {
+        if (bench.kind == RING_BATCH)
+        {
+            n = (packets - seq < batch) ? packets - seq : batch;
+            for (i = 0; i < n; i++)
+            {
+                next = seq + i;
+                memcpy(buf + i * packet_bytes, &next, sizeof(next));
+            }
+
+            n = ringbuffer_push(bench.rb, buf, packet_bytes, n);
+            seq += n;
+        }
+        else
+        {
+            memcpy(buf, &seq, sizeof(seq));
+
+            if (bench.kind == RING_VOLATILE)
+                n = (vringbuffer_write_space(bench.vrb) >= packet_bytes)
+                        && vringbuffer_write(bench.vrb, buf, packet_bytes);
+            else
+                n = (ringbuffer_write_space(bench.rb) >= packet_bytes)
+                        && ringbuffer_write(bench.rb, buf, packet_bytes);
+            seq += n;
+        }
+
+        if (n == 0)
+            sched_yield();
+    }
+
+    free(buf);
+    return 0;
+}
+
+static void *reader_function(void *ptr)
+{
+    char *buf = malloc(packet_bytes * batch);
+    unsigned long seq = 0, got;
+    size_t i, n;
+
+    pin(1);
+
+    while (seq < packets)
+    {
+        if (bench.kind == RING_BATCH)
+            n = ringbuffer_pop(bench.rb, buf, packet_bytes, batch);
+        else if (bench.kind == RING_VOLATILE)
+            n = (vringbuffer_read_space(bench.vrb) >= packet_bytes)
+                    && vringbuffer_read(bench.vrb, buf, packet_bytes);
+        else
+            n = (ringbuffer_read_space(bench.rb) >= packet_bytes)
+                    && ringbuffer_read(bench.rb, buf, packet_bytes);
+
+        if (n == 0)
+        {
+            sched_yield();
+            continue;
+        }
+
+        for (i = 0; i < n; i++, seq++)
+        {
+            memcpy(&got, buf + i * packet_bytes, sizeof(got));
+            if (got != seq)
+                bench.errors++;
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+static void run(int kind)
+{
+    pthread_t writer, reader;
+    double start, elapsed;
+
+    bench.kind = kind;
+    bench.errors = 0;
+    bench.rb = ringbuffer_create(ring_bytes);
+    bench.vrb = vringbuffer_create(ring_bytes);
+
+    start = now_sec();
+    pthread_create(&reader, NULL, reader_function, 0);
+    pthread_create(&writer, NULL, writer_function, 0);
+    pthread_join(writer, NULL);
+    pthread_join(reader, NULL);
+    elapsed = now_sec() - start;
+
+    printf("%-28s %8.1f ns/packet %9.1f MB/s   order errors = %lu\n",
+            ring_names[kind], elapsed * 1e9 / packets,
+            packets * packet_bytes / elapsed / 1e6, bench.errors);
+
+    ringbuffer_free(bench.rb);
+    vringbuffer_free(bench.vrb);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        packet_bytes = atoi(argv[1]);
+    if (argc > 2)
+        packets = atol(argv[2]);
+    if (argc > 3)
+        ring_bytes = atoi(argv[3]);
+    if (argc > 4)
+        batch = atoi(argv[4]);
+
+    if ((packet_bytes < sizeof(unsigned long)) || (batch < 1)
+            || (packet_bytes * batch >= ring_bytes))
+    {
+        printf("Usage: ringbench [packet bytes] [packets] [ring bytes] "
+                "[batch]\n");
+        return 1;
+    }
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("%lu packets of %lu bytes through a %lu byte ring, batches of "
+            "%lu, %i CPUs\n", packets, (unsigned long) packet_bytes,
+            (unsigned long) ring_bytes, (unsigned long) batch, ncpus);
+
+    run(RING_VOLATILE);
+    run(RING_ATOMIC);
+    run(RING_BATCH);
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+/*
+    Copyright (C) 2000 Paul Davis
+    Copyright (C) 2003 Rohan Drape
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+    
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software 
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#ifndef _VRINGBUFFER_H
+#define _VRINGBUFFER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+/** @file vringbuffer.h
+ *
+ * The ringbuffer etherplay used before its pointers became C11 atomics,
+ * with volatile read and write pointers sharing a cache line.  It is kept
+ * under its own prefix only as the baseline for ringbench.
+ */
+
+typedef struct  
+{
+  char  *buf;
+  size_t len;
+} 
+vringbuffer_data_t ;
+
+typedef struct
+{
+  char		 *buf;
+  volatile size_t write_ptr;
+  volatile size_t read_ptr;
+  size_t	  size;
+  size_t	  size_mask;
+  int		  mlocked;
+} 
+vringbuffer_t ;
+
+/**
+ * Allocates a vringbuffer data structure of a specified size. The
+ * caller must arrange for a call to vringbuffer_free() to release
+ * the memory associated with the vringbuffer.
+ *
+ * @param sz the vringbuffer size in bytes.
+ *
+ * @return a pointer to a new vringbuffer_t, if successful; NULL
+ * otherwise.
+ */
+vringbuffer_t *vringbuffer_create(size_t sz);
+
+/**
+ * Frees the vringbuffer data structure allocated by an earlier call to
+ * vringbuffer_create().
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ */
+void vringbuffer_free(vringbuffer_t *rb);
+
+/**
+ * Fill a data structure with a description of the current readable
+ * data held in the vringbuffer.  This description is returned in a two
+ * element array of vringbuffer_data_t.  Two elements are needed
+ * because the data to be read may be split across the end of the
+ * vringbuffer.
+ *
+ * The first element will always contain a valid @a len field, which
+ * may be zero or greater.  If the @a len field is non-zero, then data
+ * can be read in a contiguous fashion using the address given in the
+ * corresponding @a buf field.
+ *
+ * If the second element has a non-zero @a len field, then a second
+ * contiguous stretch of data can be read from the address given in
+ * its corresponding @a buf field.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ * @param vec a pointer to a 2 element array of vringbuffer_data_t.
+ *
+ */
+void vringbuffer_get_read_vector(const vringbuffer_t *rb,
+				     vringbuffer_data_t *vec);
+
+/**
+ * Fill a data structure with a description of the current writable
+ * space in the vringbuffer.  The description is returned in a two
+ * element array of vringbuffer_data_t.  Two elements are needed
+ * because the space available for writing may be split across the end
+ * of the vringbuffer.
+ *
+ * The first element will always contain a valid @a len field, which
+ * may be zero or greater.  If the @a len field is non-zero, then data
+ * can be written in a contiguous fashion using the address given in
+ * the corresponding @a buf field.
+ *
+ * If the second element has a non-zero @a len field, then a second
+ * contiguous stretch of data can be written to the address given in
+ * the corresponding @a buf field.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ * @param vec a pointer to a 2 element array of vringbuffer_data_t.
+ */
+void vringbuffer_get_write_vector(const vringbuffer_t *rb,
+				      vringbuffer_data_t *vec);
+
+/**
+ * Read data from the vringbuffer.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ * @param dest a pointer to a buffer where data read from the
+ * vringbuffer will go.
+ * @param cnt the number of bytes to read.
+ *
+ * @return the number of bytes read, which may range from 0 to cnt.
+ */
+size_t vringbuffer_read(vringbuffer_t *rb, char *dest, size_t cnt);
+
+/**
+ * Read data from the vringbuffer. Opposed to vringbuffer_read()
+ * this function does not move the read pointer. Thus it's
+ * a convenient way to inspect data in the vringbuffer in a
+ * continous fashion. The price is that the data is copied
+ * into a user provided buffer. For "raw" non-copy inspection
+ * of the data in the vringbuffer use vringbuffer_get_read_vector().
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ * @param dest a pointer to a buffer where data read from the
+ * vringbuffer will go.
+ * @param cnt the number of bytes to read.
+ *
+ * @return the number of bytes read, which may range from 0 to cnt.
+ */
+size_t vringbuffer_peek(vringbuffer_t *rb, char *dest, size_t cnt);
+
+/**
+ * Advance the read pointer.
+ *
+ * After data have been read from the vringbuffer using the pointers
+ * returned by vringbuffer_get_read_vector(), use this function to
+ * advance the buffer pointers, making that space available for future
+ * write operations.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ * @param cnt the number of bytes read.
+ */
+void vringbuffer_read_advance(vringbuffer_t *rb, size_t cnt);
+
+/**
+ * Return the number of bytes available for reading.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ *
+ * @return the number of bytes available to read.
+ */
+size_t vringbuffer_read_space(const vringbuffer_t *rb);
+
+/**
+ * Lock a vringbuffer data block into memory.
+ *
+ * Uses the mlock() system call.  This is not a realtime operation.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ */
+int vringbuffer_mlock(vringbuffer_t *rb);
+
+/**
+ * Reset the read and write pointers, making an empty buffer.
+ *
+ * This is not thread safe.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ */
+void vringbuffer_reset(vringbuffer_t *rb);
+
+/**
+ * Write data into the vringbuffer.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ * @param src a pointer to the data to be written to the vringbuffer.
+ * @param cnt the number of bytes to write.
+ *
+ * @return the number of bytes write, which may range from 0 to cnt
+ */
+size_t vringbuffer_write(vringbuffer_t *rb, const char *src,
+			     size_t cnt);
+
+/**
+ * Advance the write pointer.
+ *
+ * After data have been written the vringbuffer using the pointers
+ * returned by vringbuffer_get_write_vector(), use this function
+ * to advance the buffer pointer, making the data available for future
+ * read operations.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ * @param cnt the number of bytes written.
+ */
+void vringbuffer_write_advance(vringbuffer_t *rb, size_t cnt);
+
+/**
+ * Return the number of bytes available for writing.
+ *
+ * @param rb a pointer to the vringbuffer structure.
+ *
+ * @return the amount of free space (in bytes) available for writing.
+ */
+size_t vringbuffer_write_space(const vringbuffer_t *rb);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
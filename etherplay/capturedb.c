@@ -0,0 +1,664 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capturedb.h"
+
+static void make_path(const char *base, const char *ext, char *path)
+{
+    const char *name = strrchr(base, '/');
+    const char *dot;
+    int len;
+
+    name = name ? name + 1 : base;
+    dot = strchr(name, '.');
+    len = dot ? dot - base : (int) strlen(base);
+
+    snprintf(path, CAPTUREDB_PATH_MAX, "%.*s%s", len, base, ext);
+}
+
+void capturedb_paths(const char *base, char *man, char *bin)
+{
+    make_path(base, ".man", man);
+    make_path(base, ".bin", bin);
+}
+
+void capturedb_index_path(const char *base, char *idx)
+{
+    make_path(base, ".idx", idx);
+}
+
+static void put_be(unsigned char *buf, uint64_t value, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++)
+        buf[i] = value >> ((bytes - 1 - i) * 8);
+}
+
+static uint64_t get_be(const unsigned char *buf, int bytes)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < bytes; i++)
+        value = (value << 8) | buf[i];
+
+    return value;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+void capturedb_index_init(capturedb_index_t *ix)
+{
+    memset(ix, 0, sizeof(capturedb_index_t));
+}
+
+uint16_t capturedb_index_stream(capturedb_index_t *ix,
+        const capturedb_stream_t *s)
+{
+    capturedb_stream_t *p;
+    uint32_t i;
+
+    /* most packets are of the stream before */
+    if (ix->stream_count > 0)
+    {
+        p = &ix->streams[ix->last_stream];
+        if ((p->addr == s->addr) && (p->port == s->port)
+                && (p->dest_port == s->dest_port))
+            return ix->last_stream;
+    }
+
+    for (i = 0; i < ix->stream_count; i++)
+    {
+        p = &ix->streams[i];
+        if ((p->addr == s->addr) && (p->port == s->port)
+                && (p->dest_port == s->dest_port))
+            break;
+    }
+
+    if (i == ix->stream_count)
+    {
+        if (ix->streams == NULL)
+        {
+            ix->streams = calloc(CAPTUREDB_STREAMS_MAX,
+                    sizeof(capturedb_stream_t));
+            if (ix->streams == NULL)
+                return 0;
+
+            /* the unknown stream */
+            ix->stream_count = 1;
+            if ((s->addr == 0) && (s->port == 0) && (s->dest_port == 0))
+                return 0;
+            i = 1;
+        }
+
+        if (i == CAPTUREDB_STREAMS_MAX)
+            return 0;
+
+        ix->streams[i] = *s;
+        ix->streams[i].packets = 0;
+        ix->stream_count++;
+    }
+
+    ix->last_stream = i;
+    return i;
+}
+
+/* Grow a buffer to hold at least size bytes */
+static int reserve(unsigned char **buf, size_t *cap, size_t size)
+{
+    unsigned char *p;
+    size_t new_cap;
+
+    if (size <= *cap)
+        return 0;
+
+    new_cap = (*cap < 4096) ? 4096 : *cap * 2;
+    while (new_cap < size)
+        new_cap *= 2;
+
+    p = realloc(*buf, new_cap);
+    if (p == NULL)
+        return -1;
+
+    *buf = p;
+    *cap = new_cap;
+    return 0;
+}
+
+int capturedb_index_add(capturedb_index_t *ix, int64_t timestamp_ms,
+        uint16_t stream)
+{
+    unsigned char *e;
+
+    if (ix->count == 0)
+    {
+        ix->first_ms = timestamp_ms;
+        ix->offset_ms = 0;
+        ix->next_ms = 0;
+    }
+
+    /* playback time never runs backwards */
+    if (timestamp_ms - ix->first_ms > ix->offset_ms)
+        ix->offset_ms = timestamp_ms - ix->first_ms;
+
+    if (ix->offset_ms >= ix->next_ms)
+    {
+        if (reserve(&ix->entries, &ix->entry_cap, (ix->entry_count + 1)
+                * CAPTUREDB_IDX_ENTRY_SIZE) < 0)
+            return -1;
+
+        e = ix->entries + ix->entry_count * CAPTUREDB_IDX_ENTRY_SIZE;
+        put_be(e, ix->offset_ms, 8);
+        put_be(e + 8, ix->count, 4);
+        ix->entry_count++;
+
+        ix->next_ms = (ix->offset_ms / CAPTUREDB_IDX_INTERVAL_MS + 1)
+                * CAPTUREDB_IDX_INTERVAL_MS;
+    }
+
+    if (reserve(&ix->ids, &ix->id_cap, (ix->count + 1) * 2) < 0)
+        return -1;
+
+    if ((ix->streams == NULL) || (stream >= ix->stream_count))
+        stream = 0;
+    if (ix->streams != NULL)
+        ix->streams[stream].packets++;
+
+    put_be(ix->ids + ix->count * 2, stream, 2);
+    ix->count++;
+    return 0;
+}
+
+int capturedb_index_write(const capturedb_index_t *ix, const char *path)
+{
+    unsigned char header[CAPTUREDB_IDX_HEADER_SIZE];
+    unsigned char stream[CAPTUREDB_IDX_STREAM_SIZE];
+    uint32_t streams = (ix->stream_count > 0) ? ix->stream_count : 1;
+    uint32_t index_pos, stream_pos, id_pos, i;
+    int fd, err;
+
+    index_pos = CAPTUREDB_IDX_HEADER_SIZE;
+    stream_pos = index_pos + ix->entry_count * CAPTUREDB_IDX_ENTRY_SIZE;
+    id_pos = stream_pos + streams * CAPTUREDB_IDX_STREAM_SIZE;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, CAPTUREDB_IDX_MAGIC, 8);
+    put_be(header + 8, CAPTUREDB_IDX_VERSION, 4);
+    put_be(header + 12, CAPTUREDB_IDX_HEADER_SIZE, 4);
+    put_be(header + 16, ix->count, 4);
+    put_be(header + 20, CAPTUREDB_IDX_INTERVAL_MS, 4);
+    put_be(header + 24, ix->first_ms, 8);
+    put_be(header + 32, ix->offset_ms, 8);
+    put_be(header + 40, ix->entry_count, 4);
+    put_be(header + 44, streams, 4);
+    put_be(header + 48, index_pos, 4);
+    put_be(header + 52, stream_pos, 4);
+    put_be(header + 56, id_pos, 4);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    if ((write_all(fd, header, sizeof(header)) < 0)
+            || (write_all(fd, ix->entries,
+                    ix->entry_count * CAPTUREDB_IDX_ENTRY_SIZE) < 0))
+        goto fail;
+
+    for (i = 0; i < streams; i++)
+    {
+        memset(stream, 0, sizeof(stream));
+        if (i < ix->stream_count)
+        {
+            put_be(stream, ix->streams[i].addr, 4);
+            put_be(stream + 4, ix->streams[i].port, 2);
+            put_be(stream + 6, ix->streams[i].dest_port, 2);
+            put_be(stream + 8, ix->streams[i].packets, 4);
+        }
+        else
+            put_be(stream + 8, ix->count, 4);
+
+        if (write_all(fd, stream, sizeof(stream)) < 0)
+            goto fail;
+    }
+
+    if (write_all(fd, ix->ids, (size_t) ix->count * 2) < 0)
+        goto fail;
+
+    return close(fd);
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+void capturedb_index_free(capturedb_index_t *ix)
+{
+    free(ix->streams);
+    free(ix->entries);
+    free(ix->ids);
+    capturedb_index_init(ix);
+}
+
+int capturedb_create(capturedb_writer_t *w, const char *base,
+        size_t buf_size)
+{
+    char man[CAPTUREDB_PATH_MAX], bin[CAPTUREDB_PATH_MAX];
+    unsigned char count[CAPTUREDB_HEADER_SIZE];
+
+    memset(w, 0, sizeof(capturedb_writer_t));
+    w->man_fd = w->bin_fd = -1;
+
+    /* whole entries to a manifest buffer */
+    w->buf_size = (buf_size < 65536) ? 65536 : buf_size;
+    w->man_buf = malloc(w->buf_size / CAPTUREDB_ENTRY_SIZE
+            * CAPTUREDB_ENTRY_SIZE);
+    w->bin_buf = malloc(w->buf_size);
+    if ((w->man_buf == NULL) || (w->bin_buf == NULL))
+        goto fail;
+
+    capturedb_paths(base, man, bin);
+    capturedb_index_path(base, w->idx_path);
+    w->man_fd = open(man, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    w->bin_fd = open(bin, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((w->man_fd < 0) || (w->bin_fd < 0))
+        goto fail;
+
+    /* placeholder for the packet count */
+    memset(count, 0, sizeof(count));
+    if (write_all(w->man_fd, count, sizeof(count)) < 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    capturedb_close(w);
+    return -1;
+}
+
+int capturedb_append(capturedb_writer_t *w, int64_t timestamp_ms,
+        uint16_t stream, const void *data, size_t len)
+{
+    capturedb_entry_t e;
+    size_t man_cap = w->buf_size / CAPTUREDB_ENTRY_SIZE
+            * CAPTUREDB_ENTRY_SIZE;
+
+    if (len > CAPTUREDB_MAX_PACKET)
+    {
+        errno = E2BIG;
+        return -1;
+    }
+
+    if (w->bin_pos + (unsigned long) len > CAPTUREDB_MAX_BIN)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (capturedb_index_add(&w->index, timestamp_ms, stream) < 0)
+        return -1;
+
+    if (w->count == 0)
+        w->prev_ms = timestamp_ms;
+
+    e.timestamp_ms = timestamp_ms;
+    e.delta_ms = (int32_t) (timestamp_ms - w->prev_ms);
+    e.file_pos = (int32_t) w->bin_pos;
+    e.size = (int16_t) len;
+    w->prev_ms = timestamp_ms;
+
+    if ((w->man_len + CAPTUREDB_ENTRY_SIZE > man_cap)
+            || (w->bin_len + len > w->buf_size))
+    {
+        if (capturedb_flush(w) < 0)
+            return -1;
+    }
+
+    capturedb_pack_entry(&e, w->man_buf + w->man_len);
+    w->man_len += CAPTUREDB_ENTRY_SIZE;
+    memcpy(w->bin_buf + w->bin_len, data, len);
+    w->bin_len += len;
+
+    w->bin_pos += len;
+    w->count++;
+    return 0;
+}
+
+int capturedb_flush(capturedb_writer_t *w)
+{
+    unsigned char count[CAPTUREDB_HEADER_SIZE];
+    int i;
+
+    if ((write_all(w->bin_fd, w->bin_buf, w->bin_len) < 0)
+            || (write_all(w->man_fd, w->man_buf, w->man_len) < 0))
+        return -1;
+
+    w->bytes_written += w->bin_len + w->man_len;
+    w->bin_len = 0;
+    w->man_len = 0;
+
+    /* The count goes in last, so the entries it covers are all there */
+    for (i = 0; i < CAPTUREDB_HEADER_SIZE; i++)
+        count[i] = w->count >> (24 - i * 8);
+
+    if (pwrite(w->man_fd, count, sizeof(count), 0) != sizeof(count))
+        return -1;
+
+    return 0;
+}
+
+int capturedb_close(capturedb_writer_t *w)
+{
+    int err = 0;
+
+    if ((w->man_fd >= 0) && (w->bin_fd >= 0) && ((capturedb_flush(w) < 0)
+            || (capturedb_index_write(&w->index, w->idx_path) < 0)))
+        err = errno;
+
+    if (w->man_fd >= 0)
+        close(w->man_fd);
+    if (w->bin_fd >= 0)
+        close(w->bin_fd);
+    w->man_fd = w->bin_fd = -1;
+
+    free(w->man_buf);
+    free(w->bin_buf);
+    w->man_buf = w->bin_buf = NULL;
+    capturedb_index_free(&w->index);
+
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Map a whole file read only, NULL with a size of 0 for an empty one */
+static int map_file(const char *path, const unsigned char **addr,
+        size_t *size)
+{
+    struct stat st;
+    void *p;
+    int fd, err;
+
+    *addr = NULL;
+    *size = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0)
+    {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    if (st.st_size > 0)
+    {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+
+        /* packets are read in order */
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        *addr = (const unsigned char *) p;
+        *size = st.st_size;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* Take the time index if it is whole and of the same packets */
+static void check_index(capturedb_reader_t *r)
+{
+    const unsigned char *h = r->idx;
+    uint64_t index_pos, stream_pos, id_pos;
+
+    if ((r->idx_size < CAPTUREDB_IDX_HEADER_SIZE)
+            || (memcmp(h, CAPTUREDB_IDX_MAGIC, 8) != 0)
+            || (get_be(h + 8, 4) != CAPTUREDB_IDX_VERSION)
+            || (get_be(h + 16, 4) != r->count)
+            || ((r->count > 0) && ((int64_t) get_be(h + 24, 8) != r->first_ms)))
+        goto stale;
+
+    r->duration_ms = get_be(h + 32, 8);
+    r->index_count = get_be(h + 40, 4);
+    r->stream_count = get_be(h + 44, 4);
+    index_pos = get_be(h + 48, 4);
+    stream_pos = get_be(h + 52, 4);
+    id_pos = get_be(h + 56, 4);
+
+    if ((r->stream_count == 0) || (r->stream_count > CAPTUREDB_STREAMS_MAX)
+            || (index_pos + (uint64_t) r->index_count
+                    * CAPTUREDB_IDX_ENTRY_SIZE > r->idx_size)
+            || (stream_pos + (uint64_t) r->stream_count
+                    * CAPTUREDB_IDX_STREAM_SIZE > r->idx_size)
+            || (id_pos + (uint64_t) r->count * 2 > r->idx_size))
+        goto stale;
+
+    /* the tables are found from the header on each lookup */
+    return;
+
+stale:
+    munmap((void *) r->idx, r->idx_size);
+    r->idx = NULL;
+    r->idx_size = 0;
+    r->index_count = 0;
+    r->stream_count = 0;
+    r->duration_ms = 0;
+}
+
+int capturedb_open(capturedb_reader_t *r, const char *base)
+{
+    char man[CAPTUREDB_PATH_MAX], bin[CAPTUREDB_PATH_MAX];
+    char idx[CAPTUREDB_PATH_MAX];
+    size_t entries;
+    int i;
+
+    memset(r, 0, sizeof(capturedb_reader_t));
+
+    capturedb_paths(base, man, bin);
+    if ((map_file(man, &r->man, &r->man_size) < 0)
+            || (map_file(bin, &r->bin, &r->bin_size) < 0))
+        goto fail;
+
+    if (r->man_size < CAPTUREDB_HEADER_SIZE)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    for (i = 0; i < CAPTUREDB_HEADER_SIZE; i++)
+        r->count = (r->count << 8) | r->man[i];
+
+    entries = (r->man_size - CAPTUREDB_HEADER_SIZE) / CAPTUREDB_ENTRY_SIZE;
+    if (r->count > entries)
+        r->count = entries;
+
+    if (r->count > 0)
+        r->first_ms = get_be(r->man + CAPTUREDB_HEADER_SIZE, 8);
+
+    /* without an index, seeking falls back to a scan */
+    capturedb_index_path(base, idx);
+    if ((map_file(idx, &r->idx, &r->idx_size) == 0) && (r->idx != NULL))
+        check_index(r);
+
+    return 0;
+
+fail:
+    i = errno;
+    capturedb_unmap(r);
+    errno = i;
+    return -1;
+}
+
+int capturedb_entry(const capturedb_reader_t *r, uint32_t i,
+        capturedb_entry_t *e, const unsigned char **data)
+{
+    if (i >= r->count)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    capturedb_unpack_entry(e, r->man + CAPTUREDB_HEADER_SIZE
+            + (size_t) i * CAPTUREDB_ENTRY_SIZE);
+
+    if ((e->file_pos < 0) || (e->size < 0)
+            || ((size_t) e->file_pos + e->size > r->bin_size))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *data = r->bin + e->file_pos;
+    return 0;
+}
+
+static inline int64_t packet_time(const capturedb_reader_t *r, uint32_t i)
+{
+    return get_be(r->man + CAPTUREDB_HEADER_SIZE
+            + (size_t) i * CAPTUREDB_ENTRY_SIZE, 8);
+}
+
+uint32_t capturedb_seek(const capturedb_reader_t *r, int64_t offset_ms,
+        int64_t *at_ms)
+{
+    const unsigned char *index, *e;
+    uint32_t lo = 0, hi, mid, i = 0;
+    int64_t offset = 0, t;
+
+    if ((r->idx != NULL) && (r->index_count > 0))
+    {
+        /* the last entry at or before the time */
+        index = r->idx + get_be(r->idx + 48, 4);
+        hi = r->index_count;
+        while (hi - lo > 1)
+        {
+            mid = lo + (hi - lo) / 2;
+            if ((int64_t) get_be(index + mid * CAPTUREDB_IDX_ENTRY_SIZE, 8)
+                    <= offset_ms)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        e = index + lo * CAPTUREDB_IDX_ENTRY_SIZE;
+        if (((int64_t) get_be(e, 8) <= offset_ms)
+                && (get_be(e + 8, 4) < r->count))
+        {
+            offset = get_be(e, 8);
+            i = get_be(e + 8, 4);
+        }
+    }
+
+    /* then packet by packet, through at most an interval */
+    for (; i < r->count; i++)
+    {
+        t = packet_time(r, i) - r->first_ms;
+        if (t > offset)
+            offset = t;
+        if (offset >= offset_ms)
+            break;
+    }
+
+    *at_ms = offset;
+    return i;
+}
+
+uint16_t capturedb_packet_stream(const capturedb_reader_t *r, uint32_t i)
+{
+    if ((r->idx == NULL) || (i >= r->count))
+        return 0;
+
+    return get_be(r->idx + get_be(r->idx + 56, 4) + (size_t) i * 2, 2);
+}
+
+int capturedb_stream(const capturedb_reader_t *r, uint16_t id,
+        capturedb_stream_t *s)
+{
+    const unsigned char *p;
+
+    if (id >= r->stream_count)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    p = r->idx + get_be(r->idx + 52, 4) + id * CAPTUREDB_IDX_STREAM_SIZE;
+    s->addr = get_be(p, 4);
+    s->port = get_be(p + 4, 2);
+    s->dest_port = get_be(p + 6, 2);
+    s->packets = get_be(p + 8, 4);
+    return 0;
+}
+
+void capturedb_unmap(capturedb_reader_t *r)
+{
+    if (r->man != NULL)
+        munmap((void *) r->man, r->man_size);
+    if (r->bin != NULL)
+        munmap((void *) r->bin, r->bin_size);
+    if (r->idx != NULL)
+        munmap((void *) r->idx, r->idx_size);
+
+    memset(r, 0, sizeof(capturedb_reader_t));
+}
@@ -0,0 +1,170 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <string.h>
+#include "drift.h"
+
+/* Rate measurements start after this settling time */
+#define DRIFT_SETTLE_MS    2000.0
+
+/* and are trusted once they span this long */
+#define DRIFT_VALID_MS     20000.0
+
+/* A gap in arrivals longer than the media gap restarts the measurement */
+#define DRIFT_GAP_MS       500.0
+
+/* Largest correction, which is far below an audible pitch change */
+#define DRIFT_MAX_PPM      2000.0
+
+/* Fill level smoothing time constant */
+#define DRIFT_FILL_TAU_MS  1000.0
+
+/* Proportional gain in ppm per ms, and integral gain in ppm per ms.s */
+#define DRIFT_KP           40.0
+#define DRIFT_KI           0.5
+
+static double clamp(double ppm)
+{
+    if (ppm > DRIFT_MAX_PPM)
+        return DRIFT_MAX_PPM;
+    if (ppm < -DRIFT_MAX_PPM)
+        return -DRIFT_MAX_PPM;
+    return ppm;
+}
+
+void drift_init(drift_t *drift)
+{
+    memset(drift, 0, sizeof(drift_t));
+}
+
+void drift_arrival(drift_t *drift, double now_ms, double media_ms)
+{
+    double span;
+
+    /* The sender paused or restarted, start measuring again */
+    if (drift->rx_started
+            && ((now_ms - drift->rx_last_ms)
+                    - (media_ms - drift->rx_last_media_ms) > DRIFT_GAP_MS
+                    || media_ms < drift->rx_last_media_ms))
+        drift->rx_started = 0;
+
+    drift->rx_last_ms = now_ms;
+    drift->rx_last_media_ms = media_ms;
+
+    if (!drift->rx_started)
+    {
+        drift->rx_started = 1;
+        drift->rx_start_ms = now_ms + DRIFT_SETTLE_MS;
+        drift->rx_start_media_ms = -1;
+        return;
+    }
+
+    if (now_ms < drift->rx_start_ms)
+        return;
+
+    if (drift->rx_start_media_ms < 0)
+    {
+        drift->rx_start_ms = now_ms;
+        drift->rx_start_media_ms = media_ms;
+        return;
+    }
+
+    span = now_ms - drift->rx_start_ms;
+    if (span >= DRIFT_VALID_MS)
+    {
+        drift->sender_ppm = ((media_ms - drift->rx_start_media_ms) / span - 1)
+                * 1000000.0;
+        drift->sender_valid = 1;
+    }
+}
+
+void drift_output(drift_t *drift, double now_ms, double media_ms)
+{
+    double span;
+
+    if (!drift->out_started)
+    {
+        drift->out_started = 1;
+        drift->out_start_ms = now_ms + DRIFT_SETTLE_MS;
+        drift->out_start_media_ms = -1;
+        return;
+    }
+
+    if (now_ms < drift->out_start_ms)
+        return;
+
+    if (drift->out_start_media_ms < 0)
+    {
+        drift->out_start_ms = now_ms;
+        drift->out_start_media_ms = media_ms;
+        return;
+    }
+
+    span = now_ms - drift->out_start_ms;
+    if (span >= DRIFT_VALID_MS)
+    {
+        drift->device_ppm = ((media_ms - drift->out_start_media_ms) / span - 1)
+                * 1000000.0;
+        drift->device_valid = 1;
+    }
+}
+
+void drift_output_restart(drift_t *drift)
+{
+    drift->out_started = 0;
+}
+
+double drift_update(drift_t *drift, double fill_ms, double target_ms,
+        double now_ms)
+{
+    double dt, err, ff = 0;
+
+    if (!drift->have_fill)
+    {
+        drift->have_fill = 1;
+        drift->fill_avg_ms = fill_ms;
+        drift->last_update_ms = now_ms;
+    }
+
+    dt = now_ms - drift->last_update_ms;
+    drift->last_update_ms = now_ms;
+
+    if (dt > DRIFT_FILL_TAU_MS)
+        dt = DRIFT_FILL_TAU_MS;
+    drift->fill_avg_ms += (fill_ms - drift->fill_avg_ms) * dt
+            / DRIFT_FILL_TAU_MS;
+
+    /* A sender running fast against the device fills the buffer, so it
+     * has to be consumed faster, and vice versa */
+    if (drift->sender_valid && drift->device_valid)
+        ff = drift->sender_ppm - drift->device_ppm;
+
+    /* Hand over between the estimate and the integrator without a jump */
+    drift->integ_ppm -= ff - drift->ff_ppm;
+    drift->ff_ppm = ff;
+
+    err = drift->fill_avg_ms - target_ms;
+    drift->integ_ppm = clamp(drift->integ_ppm + DRIFT_KI * err * dt / 1000.0);
+    drift->ppm = clamp(ff + DRIFT_KP * err + drift->integ_ppm);
+
+    return 1.0 + drift->ppm / 1000000.0;
+}
@@ -0,0 +1,127 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _DRIFT_H
+#define _DRIFT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @file drift.h
+ *
+ * Clock drift estimation between the sender and the playback device, and
+ * the resampling ratio that compensates for it.
+ *
+ * The receive thread reports the media time of each arriving packet with
+ * drift_arrival(), giving the sender's rate against the local monotonic
+ * clock.  The playout thread reports the media time consumed by the device
+ * with drift_output(), giving the device's rate against the same clock.
+ * Once both have been measured long enough, their difference feeds
+ * forward into the ratio.
+ *
+ * drift_update() is called once per period with the buffered audio and
+ * the jitter buffer target.  A PI controller on the smoothed fill level
+ * trims the ratio, so that the buffer settles at its target whatever the
+ * estimate says.
+ *
+ * All times are in milliseconds.  Rates and corrections are in parts per
+ * million, and the ratio is input frames consumed per output frame.
+ */
+
+typedef struct
+{
+  /* receive thread state */
+  double rx_start_ms;
+  double rx_start_media_ms;
+  double rx_last_ms;
+  double rx_last_media_ms;
+  int rx_started;
+  volatile double sender_ppm;
+  volatile int sender_valid;
+
+  /* playout thread state */
+  double out_start_ms;
+  double out_start_media_ms;
+  int out_started;
+  double device_ppm;
+  int device_valid;
+  double fill_avg_ms;
+  double integ_ppm;
+  double ff_ppm;
+  double last_update_ms;
+  int have_fill;
+  double ppm;
+}
+drift_t;
+
+/**
+ * Initialize the drift estimator.
+ *
+ * @param drift a pointer to the drift structure.
+ */
+void drift_init(drift_t *drift);
+
+/**
+ * Account for the arrival of a packet.  Called from the receive thread.
+ *
+ * @param drift a pointer to the drift structure.
+ * @param now_ms the arrival time, on the monotonic clock.
+ * @param media_ms the sender's media time at the end of the packet.
+ */
+void drift_arrival(drift_t *drift, double now_ms, double media_ms);
+
+/**
+ * Account for the audio consumed by the device so far.
+ *
+ * @param drift a pointer to the drift structure.
+ * @param now_ms the current time, on the monotonic clock.
+ * @param media_ms the media time consumed by the device since playback
+ * started.
+ */
+void drift_output(drift_t *drift, double now_ms, double media_ms);
+
+/**
+ * Restart the device rate measurement, after the device has stopped.
+ *
+ * @param drift a pointer to the drift structure.
+ */
+void drift_output_restart(drift_t *drift);
+
+/**
+ * Update the resampling ratio.  Called once per period.
+ *
+ * @param drift a pointer to the drift structure.
+ * @param fill_ms the buffered audio.
+ * @param target_ms the target depth of the buffer.
+ * @param now_ms the current time.
+ *
+ * @return input frames to consume per output frame.
+ */
+double drift_update(drift_t *drift, double fill_ms, double target_ms,
+        double now_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
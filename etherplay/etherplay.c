@@ -21,12 +21,26 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <alsa/asoundlib.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/signal.h>
 #include <sys/time.h>
+#include "audiodev.h"
+#include "codec_g711.h"
+#include "drift.h"
+#include "flightrec.h"
+#include "jitterbuf.h"
+#include "mcast.h"
+#include "metrics.h"
+#include "pkthdr.h"
+#include "plc.h"
+#include "resample.h"
 #include "ringbuffer.h"
+#include "rtprofile.h"
 
 enum
 {
@@ -40,6 +54,7 @@ static snd_pcm_sframes_t (*writei_func)(snd_pcm_t *handle, const void *buffer,
         snd_pcm_uframes_t size);
 
 static snd_pcm_t *handle;
+static audiodev_t dev;
 static struct
 {
     snd_pcm_format_t format;
@@ -53,17 +68,22 @@ static int playback_delay = 0; // 0 ms
 static int open_mode = 0;
 static snd_pcm_stream_t stream = SND_PCM_STREAM_PLAYBACK;
 static int nonblock = 0;
+static int mmap_mode = 0;
 static char *audiobuf = NULL;
 static snd_pcm_uframes_t period_frames = 0;
 static unsigned period_time = 0;
 static unsigned buffer_time = 0;
 static unsigned max_buffer_time = 75000; // 75 ms
+static snd_pcm_uframes_t buffer_frames = 0;
+static snd_pcm_uframes_t start_frames = 0;
 static int start_delay = 0;
 static int stop_delay = 0;
 static int verbose = 0;
 static size_t bits_per_sample, bits_per_frame;
 static size_t period_bytes;
 static snd_output_t *log;
+static struct pollfd *pcm_pfds = NULL;
+static int pcm_pfd_count = 0;
 
 /* socket configuration */
 static int udp_receive_port = 6502;
@@ -74,21 +94,163 @@ static int sock_fd = 0;
 static int packet_cnt = 0;
 static int pkts_second;
 
+/* receive to playout wakeup, signalled only while playout is waiting */
+static int rcv_event_fd = -1;
+static volatile int rcv_waiter = 0;
+static struct timespec rcv_signal_time;
+
+/* batched receive configuration */
+#define RCV_BATCH_MAX      64
+static int rcv_batch_size = 32;
+static unsigned long rcv_batch_cnt = 0;
+static unsigned long rcv_batch_hist[RCV_BATCH_MAX + 1];
+static unsigned long rcv_placed_cnt = 0;
+static unsigned long rcv_copied_cnt = 0;
+
+/* Datagrams are received straight into the free regions of the ring, each
+ * into a slot of its own past any reordered packets held there.  Those
+ * that do not fit in the ring land in the stash, as do payloads moved out
+ * of the way before the slot they landed in is written. */
+static struct
+{
+    int count;
+    int next;
+    size_t slot[RCV_BATCH_MAX];
+    char stashed[RCV_BATCH_MAX];
+    char *stash;
+} landing;
+
+/* sequence header and reorder configuration */
+#define REORDER_MAX        64
+#define STREAM_IDLE_MS     1000.0
+static int pkt_header = 0;
+static unsigned int format_id = 1;
+static size_t pkt_size;
+
+/* state of the stream being played, relative to the ring write pointer */
+static struct
+{
+    int synced;
+    uint16_t stream;
+    uint32_t next_seq;
+    uint64_t held;
+    uint64_t seen;
+    double last_arrival_ms;
+    unsigned long streams;
+    unsigned long received;
+    unsigned long lost;
+    unsigned long reordered;
+    unsigned long duplicates;
+    unsigned long late;
+    unsigned long foreign;
+} rx;
+
 /* ring buffer configuration */
 static int ring_buffer_bytes;
+static size_t ring_max_bytes;
 static ringbuffer_t *rb;
 
+/* jitter buffer configuration, in milliseconds */
+static double jb_target_ms = 40;
+static double jb_min_ms = 20;
+static double jb_max_ms = 1000;
+static double bytes_per_ms;
+static jitterbuf_t jb;
+
+/* packet loss concealment configuration */
+static int plc_enabled = 1;
+static plc_t plc;
+static int16_t *plc_buf;
+static double plc_cost_us = 0;
+static unsigned char *slot_lost;
+
+/* clock drift compensation configuration */
+static int drift_enabled = 1;
+static drift_t drift;
+static resample_t rs;
+static double rs_ratio = 1.0;
+static int16_t *rs_out;
+static size_t rs_cap;
+static char *rs_native;
+static unsigned long long frames_played;
+
+/* real-time profile */
+static rtprofile_t rt;
+
+/* flight recorder, fed by the receive thread */
+static flightrec_t flight;
+
+/* multicast groups joined by the receive socket */
+static mcast_t mc;
+
+/* metrics, each updated by the one thread noted */
+static metrics_t mx;
+static struct
+{
+    /* receive thread */
+    metric_t *packets;
+    metric_t *bytes;
+    metric_t *wrong_size;
+    metric_t *bad_header;
+    metric_t *overflow;
+    metric_t *foreign;
+    metric_t *duplicate;
+    metric_t *late;
+    metric_t *lost;
+    metric_t *batch;
+    metric_t *ring_fill;
+    metric_t *ring_fill_time;
+
+    /* playout thread */
+    metric_t *shrink;
+    metric_t *underruns;
+    metric_t *xruns;
+} met;
+
+static const unsigned long long batch_bounds[] =
+{ 1, 2, 4, 8, 16, 32, 64 };
+
+/* ring fill in us */
+static const unsigned long long fill_bounds[] =
+{ 5000, 10000, 20000, 40000, 80000, 160000, 320000, 640000, 1280000 };
+
 /* prototypes */
 static void file_playback(char *filename);
 static void rb_playback();
+static void print_rcv_stats();
+static void register_metrics();
 
 static void signal_handler(int sig)
 {
     shutdown_req = 1;
 
+    if (verbose && playback_mode == NETWORK_PLAYBACK)
+    {
+        print_rcv_stats();
+        flightrec_report(&flight);
+    }
+
+    if (verbose || rt.report_latency)
+    {
+        rtprofile_latency_report(&rt, RT_AUDIO, "Playout");
+        rtprofile_latency_report(&rt, RT_NET, "Receive");
+    }
+
+    if (verbose)
+        audiodev_report(&dev);
+
+    /* complete the WAV header of a file backend */
+    audiodev_close(&dev);
+    metrics_close(&mx);
+
     exit(0);
 }
 
+static void flight_signal_handler(int sig)
+{
+    flightrec_trigger(&flight, FLIGHTREC_SIGNAL);
+}
+
 static void prg_exit(int code)
 {
     signal_handler(code);
@@ -110,6 +272,31 @@ static void print_usage()
     printf("      3: Music wav fmt (22050 hz, 16 bit, 2 channel)\n");
     printf(
             "   -p, UDP port to listen on for network audio packets (6502 default)\n");
+    printf("   -g group, join a multicast group on the UDP port, repeatable\n");
+    printf("   -S source, receive the groups from this source only,\n");
+    printf("      repeatable\n");
+    printf("   -b n, max packets per batched receive (1-%i, 32 default)\n",
+            RCV_BATCH_MAX);
+    printf("   -j target:min:max, jitter buffer depth in ms (40:20:1000 default)\n");
+    printf("   -s, packets carry a sequence header (sender must also use -s)\n");
+    printf("   -c, disable packet loss concealment\n");
+    printf("   -a, disable clock drift compensation\n");
+    printf("   -M, write straight into the device's mmap area when supported\n");
+    printf("   -B backend, audio output backend (alsa default)\n");
+    printf("      null: discarded, paced in real time like a sound card\n");
+    printf("      probe: as null, printing when each onset of sound is heard\n");
+    printf("      file=path: written to a WAV file (.wav) or raw samples\n");
+    printf("   -v, verbose, report receive statistics on exit\n");
+    printf("   --realtime[=cpu[,cpu]], SCHED_FIFO threads and locked memory,\n");
+    printf("      pinned to CPUs (playout and receive threads)\n");
+    printf("   --latency, report thread wakeup latency on exit\n");
+    printf("   --metrics=unix:path|[host:]port, serve metrics in the Prometheus\n");
+    printf("      text format (loopback unless a host is given)\n");
+    printf("   --mcast-if=iface, interface name or address the groups are\n");
+    printf("      joined on (routed default)\n");
+    printf("   --flight=minutes[,name], keep the last minutes of packets,\n");
+    printf("      dumped to the database name_<time> (flight default) on\n");
+    printf("      SIGUSR1 or an underrun\n");
     printf("   -h, show this help message\n");
     printf("\n");
     printf("Examples:\n");
@@ -118,6 +305,11 @@ static void print_usage()
     printf("\n");
     printf("      etherplay -i plughw:0,0 -f sample.au -m 2");
     printf("\n");
+    printf("\n");
+    printf("      etherplay -B file=out.wav -p 6502 -m 3 -v");
+    printf("\n");
+    printf("      etherplay -p 6502 -g 239.1.2.3 -S 192.168.1.20 -m 3");
+    printf("\n");
 }
 
 static void pcm_list(void)
@@ -176,6 +368,12 @@ int main(int argc, char *argv[])
     sample_buffer_size = 256;
     period_frames = 256;
 
+    rtprofile_init(&rt);
+    audiodev_init(&dev, 0);
+    metrics_init(&mx);
+    flightrec_init(&flight);
+    mcast_init(&mc);
+
     /* Process command line options */
     while (argc > 1)
     {
@@ -193,6 +391,72 @@ int main(int argc, char *argv[])
                 udp_receive_port = atoi(&argv[1][3]);
                 break;
 
+            case 'g':
+                if (mcast_add_group(&mc, &argv[1][3]) < 0)
+                {
+                    printf("Invalid multicast group %s\n", &argv[1][3]);
+                    prg_exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'S':
+                if (mcast_add_source(&mc, &argv[1][3]) < 0)
+                {
+                    printf("Invalid multicast source %s\n", &argv[1][3]);
+                    prg_exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'b':
+                rcv_batch_size = atoi(&argv[1][3]);
+                if ((rcv_batch_size < 1) || (rcv_batch_size > RCV_BATCH_MAX))
+                {
+                    printf("Receive batch size must be 1 to %i\n",
+                            RCV_BATCH_MAX);
+                    prg_exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'j':
+                if ((sscanf(&argv[1][3], "%lf:%lf:%lf", &jb_target_ms,
+                        &jb_min_ms, &jb_max_ms) != 3) || (jb_min_ms < 0)
+                        || (jb_min_ms > jb_max_ms)
+                        || (jb_target_ms < jb_min_ms)
+                        || (jb_target_ms > jb_max_ms))
+                {
+                    printf("Invalid jitter buffer bounds %s\n", &argv[1][3]);
+                    prg_exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 's':
+                pkt_header = 1;
+                break;
+
+            case 'c':
+                plc_enabled = 0;
+                break;
+
+            case 'a':
+                drift_enabled = 0;
+                break;
+
+            case 'M':
+                mmap_mode = 1;
+                break;
+
+            case 'B':
+                if (audiodev_option(&dev, &argv[1][3]) < 0)
+                {
+                    printf("Unrecognized audio backend %s\n", &argv[1][3]);
+                    prg_exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'v':
+                verbose = 1;
+                break;
+
             case 'l':
                 pcm_list();
                 prg_exit(EXIT_SUCCESS);
@@ -210,6 +474,7 @@ int main(int argc, char *argv[])
                     rhwparams.rate = 8000;
                     period_frames = 256;
                     sample_buffer_size = 256;
+                    format_id = 1;
                 }
                 else if (strcasecmp(&argv[1][3], "2") == 0)
                 {
@@ -218,6 +483,7 @@ int main(int argc, char *argv[])
                     rhwparams.rate = 16000;
                     period_frames = 512;
                     sample_buffer_size = 1024;
+                    format_id = 2;
                 }
                 else if (strcasecmp(&argv[1][3], "3") == 0)
                 {
@@ -226,6 +492,7 @@ int main(int argc, char *argv[])
                     rhwparams.rate = 22050;
                     period_frames = 256;
                     sample_buffer_size = 1024;
+                    format_id = 3;
                 }
                 else
                 {
@@ -235,6 +502,18 @@ int main(int argc, char *argv[])
                 }
                 break;
 
+                /* --realtime, --latency, --metrics, --flight and --mcast-if */
+            case '-':
+                if ((metrics_option(&mx, argv[1]) < 0)
+                        && (rtprofile_option(&rt, argv[1]) < 0)
+                        && (flightrec_option(&flight, argv[1]) < 0)
+                        && (mcast_option(&mc, argv[1]) < 0))
+                {
+                    print_usage();
+                    exit(0);
+                }
+                break;
+
                 /* show this help message */
             case 'h':
             default:
@@ -248,6 +527,12 @@ int main(int argc, char *argv[])
         argc--;
     }
 
+    if ((mc.source_count > 0) && (mc.group_count == 0))
+    {
+        printf("Sources filter multicast groups, given with -g\n");
+        prg_exit(EXIT_FAILURE);
+    }
+
     snd_pcm_info_alloca(&info);
 
     err = snd_output_stdio_attach(&log, stderr, 0);
@@ -255,25 +540,34 @@ int main(int argc, char *argv[])
 
     stream = SND_PCM_STREAM_PLAYBACK;
 
-    err = snd_pcm_open(&handle, pcm_name, stream, open_mode);
-    if (err < 0)
+    if (dev.type == AUDIODEV_ALSA)
     {
-        printf("audio open error: %s", snd_strerror(err));
-        return 1;
-    }
+        err = snd_pcm_open(&handle, pcm_name, stream, open_mode);
+        if (err < 0)
+        {
+            printf("audio open error: %s", snd_strerror(err));
+            return 1;
+        }
 
-    if ((err = snd_pcm_info(handle, info)) < 0)
-    {
-        printf("info error: %s", snd_strerror(err));
-        return 1;
+        if ((err = snd_pcm_info(handle, info)) < 0)
+        {
+            printf("info error: %s", snd_strerror(err));
+            return 1;
+        }
     }
 
     hwparams = rhwparams;
-    writei_func = snd_pcm_writei;
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGABRT, signal_handler);
+    signal(SIGUSR1, flight_signal_handler);
+
+    /* served from a thread of its own, started before the real-time
+     * profile is applied */
+    register_metrics();
+    if (metrics_start(&mx) < 0)
+        prg_exit(EXIT_FAILURE);
 
     if (playback_mode == NETWORK_PLAYBACK)
     {
@@ -286,14 +580,17 @@ int main(int argc, char *argv[])
         file_playback(filename);
     }
 
-    snd_pcm_close(handle);
+    if (dev.type == AUDIODEV_ALSA)
+        snd_pcm_close(handle);
+    else
+        audiodev_close(&dev);
 
     free(audiobuf);
 
     return 0;
 }
 
-static void set_params(void)
+static void set_alsa_params(void)
 {
     snd_pcm_hw_params_t *params;
     snd_pcm_sw_params_t *swparams;
@@ -313,13 +610,27 @@ static void set_params(void)
                 "Broken configuration for this PCM: no configurations available");
         prg_exit(EXIT_FAILURE);
     }
-    err = snd_pcm_hw_params_set_access(handle, params,
-            SND_PCM_ACCESS_RW_INTERLEAVED);
-    if (err < 0)
+    if (mmap_mode)
     {
-        printf("Access type not available");
-        prg_exit(EXIT_FAILURE);
+        err = snd_pcm_hw_params_set_access(handle, params,
+                SND_PCM_ACCESS_MMAP_INTERLEAVED);
+        if (err < 0)
+        {
+            printf("mmap access not available, using read/write access\n");
+            mmap_mode = 0;
+        }
+    }
+    if (!mmap_mode)
+    {
+        err = snd_pcm_hw_params_set_access(handle, params,
+                SND_PCM_ACCESS_RW_INTERLEAVED);
+        if (err < 0)
+        {
+            printf("Access type not available");
+            prg_exit(EXIT_FAILURE);
+        }
     }
+    writei_func = mmap_mode ? snd_pcm_mmap_writei : snd_pcm_writei;
 
     err = snd_pcm_hw_params_set_format(handle, params, hwparams.format);
     if (err < 0)
@@ -395,6 +706,9 @@ static void set_params(void)
             stop_threshold);
     assert(err >= 0);
 
+    buffer_frames = buffer_size;
+    start_frames = start_threshold;
+
     if (snd_pcm_sw_params(handle, swparams) < 0)
     {
         printf("unable to install sw params:");
@@ -405,6 +719,52 @@ static void set_params(void)
     if (verbose)
         snd_pcm_dump(handle, log);
 
+    /* poll descriptors, so playout can sleep until the device has room */
+    pcm_pfd_count = snd_pcm_poll_descriptors_count(handle);
+    if (pcm_pfd_count < 0)
+        pcm_pfd_count = 0;
+    pcm_pfds = malloc((pcm_pfd_count + 1) * sizeof(struct pollfd));
+    if (pcm_pfds == NULL)
+    {
+        printf("not enough memory");
+        prg_exit(EXIT_FAILURE);
+    }
+}
+
+/* A backend standing in for the sound card gets the buffer the ALSA device
+ * would have been asked for, in whole periods */
+static void set_backend_params(void)
+{
+    if (mmap_mode)
+    {
+        printf("mmap access needs an ALSA device, using read/write access\n");
+        mmap_mode = 0;
+    }
+
+    period_time = (double) period_frames * 1000000 / hwparams.rate;
+    buffer_frames = (snd_pcm_uframes_t) ((double) hwparams.rate
+            * max_buffer_time / 1000000 / period_frames) * period_frames;
+    if (buffer_frames < 2 * period_frames)
+        buffer_frames = 2 * period_frames;
+
+    /* Start with room for another period, as the resampled periods do not
+     * fill the buffer exactly and playout waits for a period of room */
+    start_frames = buffer_frames - period_frames;
+
+    if (audiodev_open(&dev, hwparams.format, hwparams.rate, hwparams.channels,
+            buffer_frames, start_frames) < 0)
+        prg_exit(EXIT_FAILURE);
+}
+
+static void set_params(void)
+{
+    unsigned int rate = hwparams.rate;
+
+    if (dev.type == AUDIODEV_ALSA)
+        set_alsa_params();
+    else
+        set_backend_params();
+
     bits_per_sample = snd_pcm_format_physical_width(hwparams.format);
     bits_per_frame = bits_per_sample * hwparams.channels;
     period_bytes = period_frames * bits_per_frame / 8;
@@ -417,29 +777,124 @@ static void set_params(void)
 
     /* ring buffer configuration */
     pkts_second = rate * (bits_per_frame / 8) / sample_buffer_size;
+    bytes_per_ms = rate * (bits_per_frame / 8) / 1000.0;
 
-    /* ring buffer to accommodate 2 seconds of audio packets */
-    ring_buffer_bytes = sample_buffer_size * pkts_second * 2;
+    /* ring buffer to accommodate the jitter buffer's maximum depth, in
+     * whole packets, plus the packet being received */
+    ring_max_bytes = ((size_t) (jb_max_ms * bytes_per_ms / sample_buffer_size)
+            + 1) * sample_buffer_size;
+    ring_buffer_bytes = ring_max_bytes + sample_buffer_size;
+
+    /* datagram size on the wire */
+    pkt_size = sample_buffer_size + (pkt_header ? PKTHDR_SIZE : 0);
 }
 
-static ssize_t pcm_write(char *data, size_t count)
+/* Copy frames straight into the device's mmap area, which the hardware
+ * plays from.  Samples from the resampler are 16 bit linear and are
+ * encoded on the way when the device is mu-law, and with no data the
+ * frames are filled with silence in place.  Returns the frames written. */
+static ssize_t mmap_write(const char *data, size_t count, int linear)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames;
+    snd_pcm_sframes_t avail, r;
+    size_t i, n;
+    char *dst;
+    ssize_t result = 0;
+
+    while ((count > 0) && !shutdown_req)
+    {
+        avail = snd_pcm_avail_update(handle);
+        if (avail < 0)
+        {
+            if (avail == -EPIPE)
+                metric_inc(met.xruns);
+
+            r = snd_pcm_recover(handle, avail, 1);
+            if (r < 0)
+            {
+                printf("write error: %s", snd_strerror(r));
+                prg_exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+
+        if (avail == 0)
+        {
+            snd_pcm_wait(handle, 1000);
+            continue;
+        }
+
+        /* The area may end short of the request where it wraps */
+        frames = ((size_t) avail < count) ? (size_t) avail : count;
+        r = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+        if (r < 0)
+        {
+            printf("write error: %s", snd_strerror(r));
+            prg_exit(EXIT_FAILURE);
+        }
+
+        dst = (char *) areas[0].addr
+                + (areas[0].first + offset * areas[0].step) / 8;
+        n = frames * hwparams.channels;
+
+        if (data == NULL)
+            snd_pcm_format_set_silence(hwparams.format, dst, n);
+        else if (linear && (hwparams.format == SND_PCM_FORMAT_MU_LAW))
+        {
+            for (i = 0; i < n; i++)
+                dst[i] = linear2ulaw(((const int16_t *) data)[i]);
+        }
+        else
+            memcpy(dst, data, frames * bits_per_frame / 8);
+
+        r = snd_pcm_mmap_commit(handle, offset, frames);
+        if ((r < 0) || ((snd_pcm_uframes_t) r != frames))
+        {
+            /* Overrun by the hardware while writing, recover and write
+             * the frames again */
+            metric_inc(met.xruns);
+            snd_pcm_recover(handle, (r < 0) ? r : -EPIPE, 1);
+            continue;
+        }
+
+        if (data != NULL)
+            data += linear ? n * sizeof(int16_t) : frames * bits_per_frame / 8;
+        result += frames;
+        count -= frames;
+
+        /* Unlike writei, a commit does not start the device by itself */
+        avail = snd_pcm_avail_update(handle);
+        if ((snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) && (avail >= 0)
+                && (buffer_frames - avail >= start_frames))
+            snd_pcm_start(handle);
+    }
+    return result;
+}
+
+/* Write any number of frames to the device */
+static ssize_t pcm_write_frames(char *data, size_t count)
 {
     ssize_t r;
     ssize_t result = 0;
 
-    if (count < period_frames)
+    if (mmap_mode)
+        return mmap_write(data, count, 0);
+
+    if (dev.type != AUDIODEV_ALSA)
     {
-        snd_pcm_format_set_silence(hwparams.format,
-                data + count * bits_per_frame / 8,
-                (period_frames - count) * hwparams.channels);
-        count = period_frames;
+        r = audiodev_writei(&dev, data, count);
+        metric_set(met.xruns, dev.xruns);
+        return r;
     }
+
     while ((count > 0) && !shutdown_req)
     {
         r = writei_func(handle, data, count);
 
         if (r == -EPIPE)
         {
+            metric_inc(met.xruns);
             snd_pcm_recover(handle, -EPIPE, 1);
             r = writei_func(handle, data, count);
         }
@@ -460,6 +915,74 @@ static ssize_t pcm_write(char *data, size_t count)
     return result;
 }
 
+/* Write a period to the device, padding a short one with silence */
+static ssize_t pcm_write(char *data, size_t count)
+{
+    if (mmap_mode && (count < period_frames))
+        return mmap_write(data, count, 0)
+                + mmap_write(NULL, period_frames - count, 0);
+
+    if (count < period_frames)
+    {
+        snd_pcm_format_set_silence(hwparams.format,
+                data + count * bits_per_frame / 8,
+                (period_frames - count) * hwparams.channels);
+        count = period_frames;
+    }
+
+    return pcm_write_frames(data, count);
+}
+
+/* Device state for the playout path, from ALSA or the backend standing in
+ * for it */
+static snd_pcm_sframes_t pcm_avail()
+{
+    if (dev.type != AUDIODEV_ALSA)
+        return audiodev_avail(&dev);
+
+    return snd_pcm_avail_update(handle);
+}
+
+static int pcm_running()
+{
+    if (dev.type != AUDIODEV_ALSA)
+        return audiodev_running(&dev);
+
+    return snd_pcm_state(handle) == SND_PCM_STATE_RUNNING;
+}
+
+static int pcm_delay(snd_pcm_sframes_t *delay)
+{
+    if (dev.type != AUDIODEV_ALSA)
+    {
+        *delay = audiodev_delay(&dev);
+        return 0;
+    }
+
+    return snd_pcm_delay(handle, delay);
+}
+
+static void pcm_prepare()
+{
+    if (dev.type != AUDIODEV_ALSA)
+        audiodev_prepare(&dev);
+    else
+        snd_pcm_recover(handle, -EPIPE, 1);
+}
+
+static void pcm_drain()
+{
+    if (dev.type != AUDIODEV_ALSA)
+    {
+        audiodev_drain(&dev);
+        return;
+    }
+
+    snd_pcm_nonblock(handle, 0);
+    snd_pcm_drain(handle);
+    snd_pcm_nonblock(handle, nonblock);
+}
+
 static void header()
 {
     printf("%s, ", snd_pcm_format_description(hwparams.format));
@@ -473,142 +996,1068 @@ static void header()
     printf("\n");
 
     printf("DSP chunk size = %i", (int) period_bytes);
-    printf(", UDP buffer size = %lu", sample_buffer_size);
+    printf(", UDP buffer size = %lu", pkt_size);
     printf(", Pkts/Sec = %i", pkts_second);
     printf("\n");
+
+    if (playback_mode == NETWORK_PLAYBACK)
+    {
+        printf("Jitter buffer target = %.0f ms", jitterbuf_target(&jb));
+        printf(", min = %.0f ms, max = %.0f ms", jb_min_ms, jb_max_ms);
+        printf("\n");
+    }
 }
 
-static int elapsed(struct timeval *period_start)
+static double now_ms()
 {
-    struct timeval now;
-    unsigned long elapsed_usec;
+    struct timespec now;
 
-    gettimeofday(&now, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    elapsed_usec = ((now.tv_sec - period_start->tv_sec) * 1000000) + now.tv_usec
-            - period_start->tv_usec;
-
-    return elapsed_usec;
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
 }
 
-static void start_playback(int fd)
+/* Jitter buffer target depth, rounded up to whole packets */
+static size_t target_bytes()
 {
-    int pcm_out, read_cnt, last_read, bytes_read;
-    struct timeval period_start;
+    size_t bytes = jitterbuf_target(&jb) * bytes_per_ms;
+    size_t packets = (bytes + sample_buffer_size - 1) / sample_buffer_size;
 
-    while (!shutdown_req)
-    {
-        read_cnt = 0;
-        last_read = 0;
-        bytes_read = 0;
+    if (packets < 1)
+        packets = 1;
 
-        /* Set the initial start time for this period */
-        gettimeofday(&period_start, NULL);
+    return packets * sample_buffer_size;
+}
 
-        if (playback_mode == NETWORK_PLAYBACK)
-        {
-            /* Continue to read buffers for the period, or timeout if the network
-             * throughput is not meeting the DSP timing requirements. */
-            while ((bytes_read < period_bytes)
-                    && (elapsed(&period_start) < (period_time * 4)))
-            {
-                if (ringbuffer_read_space(rb) >= sample_buffer_size)
-                {
-                    last_read = ringbuffer_read(rb, audiobuf + bytes_read,
-                            sample_buffer_size);
-                    bytes_read += last_read;
-                }
-                else
-                    usleep(10000);
-            }
-        }
-        else if (playback_mode == FILE_PLAYBACK)
-            bytes_read = read(fd, audiobuf, period_bytes);
+/* Sleep until the receive thread publishes new packets, unless the ring
+ * already holds the given number of bytes, or the timeout in ms expires
+ * (-1 for no timeout).  Returns the poll result. */
+static int wait_for_packets(size_t bytes, int timeout_ms)
+{
+    struct pollfd pfd;
+    uint64_t events;
+    int r;
 
-        if (bytes_read != period_bytes)
-            break;
+    pfd.fd = rcv_event_fd;
+    pfd.events = POLLIN;
 
-        read_cnt += bytes_read;
-        read_cnt = read_cnt * 8 / bits_per_frame;
-        pcm_out = pcm_write(audiobuf, read_cnt);
+    /* Announce the wait before the final check, so a packet published in
+     * between is either seen here or signalled by the receive thread. */
+    rcv_waiter = 1;
+    __sync_synchronize();
 
-        if (pcm_out != read_cnt)
-            break;
+    if (ringbuffer_read_space(rb) >= bytes)
+        r = 1;
+    else
+        r = poll(&pfd, 1, timeout_ms);
+
+    rcv_waiter = 0;
+
+    if ((r > 0) && (pfd.revents & POLLIN))
+    {
+        rtprofile_wakeup(&rt, RT_AUDIO, CLOCK_MONOTONIC, &rcv_signal_time);
+        read(rcv_event_fd, &events, sizeof(events));
     }
 
-    snd_pcm_nonblock(handle, 0);
-    snd_pcm_drain(handle);
-    snd_pcm_nonblock(handle, nonblock);
+    return r;
 }
 
-static void *rcv_data_function(void *ptr)
+/* Sleep until the ring holds a period of audio and the device has room
+ * for it.  Returns 0 if the audio did not arrive within timeout_ms. */
+static int wait_for_period(int timeout_ms)
 {
-    int sock_rcvd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t len;
-    char sample_buffer[sample_buffer_size];
-
-    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
-
-    bzero(&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(udp_receive_port);
-    bind(sock_fd, (struct sockaddr *) &server_addr, sizeof(server_addr));
+    double deadline = now_ms() + timeout_ms;
+    snd_pcm_sframes_t avail;
+    unsigned short revents;
+    int remaining;
 
-    while (!shutdown_req)
+    for (;;)
     {
-        sock_rcvd = 0;
+        if (ringbuffer_read_space(rb) < period_bytes)
+        {
+            remaining = deadline - now_ms();
+            if (remaining <= 0)
+                return 0;
 
-        len = sizeof(client_addr);
-        sock_rcvd = recvfrom(sock_fd, sample_buffer, sample_buffer_size, 0,
-                (struct sockaddr *) &client_addr, &len);
+            wait_for_packets(period_bytes, remaining);
+            continue;
+        }
+
+        /* Errors are left for pcm_write to recover from */
+        avail = pcm_avail();
+        if ((avail < 0) || (avail >= period_frames))
+            return 1;
 
-        if (sock_rcvd == sample_buffer_size)
+        if (dev.type != AUDIODEV_ALSA)
         {
-            packet_cnt++;
-            ringbuffer_write(rb, (const char *) sample_buffer, sock_rcvd);
+            audiodev_wait(&dev, period_frames, period_time * 4 / 1000);
+            continue;
         }
-    }
 
-    if (sock_fd > 1)
-        close(sock_fd);
+        if (pcm_pfd_count == 0)
+            return 1;
 
-    pthread_exit(0);
+        snd_pcm_poll_descriptors(handle, pcm_pfds, pcm_pfd_count);
+        if (poll(pcm_pfds, pcm_pfd_count, period_time * 4 / 1000) > 0)
+            snd_pcm_poll_descriptors_revents(handle, pcm_pfds, pcm_pfd_count,
+                    &revents);
+    }
 }
 
-static void rb_playback()
+/* How long the playout can wait for a late period before the device runs
+ * dry, keeping a quarter period in hand, after which the period has to be
+ * concealed instead. */
+static int conceal_timeout()
 {
-    int prev_packet_cnt = 0;
+    snd_pcm_sframes_t delay;
 
-    /* setup sound hardware */
-    set_params();
+    /* Until the device has started, wait as long as without concealment */
+    if (!pcm_running())
+        return period_time * 4 / 1000;
 
-    /* display header info */
-    header();
+    if ((pcm_delay(&delay) < 0) || (delay <= period_frames / 4))
+        return 0;
 
-    /* initialize ring buffer */
-    rb = ringbuffer_create(ring_buffer_bytes);
+    return (delay - period_frames / 4) * 1000 / hwparams.rate;
+}
 
-    /* spawn rcv data thread */
-    pthread_create(&udpRecThread, NULL, rcv_data_function, 0);
+/* Whether the receive thread filled the period at the read pointer in
+ * place of a lost packet */
+static int period_lost()
+{
+    ringbuffer_data_t vec[2];
 
-    /* rb playback */
+    if (!pkt_header || (period_bytes != sample_buffer_size))
+        return 0;
+
+    ringbuffer_get_read_vector(rb, vec);
+    return slot_lost[(vec[0].buf - rb->buf) / sample_buffer_size];
+}
+
+/* Period as 16 bit linear samples for the concealment stage */
+static int16_t *plc_linear(char *data)
+{
+    size_t i, n = period_frames * hwparams.channels;
+
+    if (hwparams.format != SND_PCM_FORMAT_MU_LAW)
+        return (int16_t *) data;
+
+    for (i = 0; i < n; i++)
+        plc_buf[i] = ulaw2linear(data[i]);
+
+    return plc_buf;
+}
+
+static void plc_native(char *data)
+{
+    size_t i, n = period_frames * hwparams.channels;
+
+    if (hwparams.format != SND_PCM_FORMAT_MU_LAW)
+        return;
+
+    for (i = 0; i < n; i++)
+        data[i] = linear2ulaw(plc_buf[i]);
+}
+
+static void conceal_good(char *data)
+{
+    if (plc_good(&plc, plc_linear(data), period_frames))
+        plc_native(data);
+}
+
+/* Fill the period with concealment.  Returns 0 once it has faded out. */
+static int conceal_period(char *data)
+{
+    struct timespec t0, t1;
+    int audible;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    audible = plc_conceal(&plc,
+            (hwparams.format == SND_PCM_FORMAT_MU_LAW) ?
+                    plc_buf : (int16_t *) data, period_frames);
+    plc_native(data);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    plc_cost_us += (t1.tv_sec - t0.tv_sec) * 1000000.0
+            + (t1.tv_nsec - t0.tv_nsec) / 1000.0;
+
+    return audible;
+}
+
+/* The period at the read pointer, in place in the ring, where the receive
+ * thread leaves it alone until the read pointer moves past it.  NULL when
+ * it straddles the end of the ring and has to be copied out. */
+static char *ring_period()
+{
+    ringbuffer_data_t vec[2];
+
+    ringbuffer_get_read_vector(rb, vec);
+    if (vec[0].len < period_bytes)
+        return NULL;
+
+    return vec[0].buf;
+}
+
+/* Write a period to the device, through the drift compensating resampler
+ * when playing from the network.  Returns the frames taken from data. */
+static ssize_t play_period(char *data)
+{
+    size_t i, frames;
+    snd_pcm_sframes_t delay;
+    char *out;
+
+    if (!drift_enabled || (playback_mode != NETWORK_PLAYBACK))
+        return pcm_write(data, period_frames);
+
+    /* The resampled period is a frame or so longer or shorter, and goes
+     * to the device as it is, so that nothing is held back */
+    frames = resample_process(&rs, plc_linear(data), period_frames, rs_out,
+            rs_cap, rs_ratio);
+
+    if (mmap_mode)
+    {
+        /* encoded, if need be, as it is copied into the mmap area */
+        if (mmap_write((char *) rs_out, frames, 1) != frames)
+            return 0;
+    }
+    else
+    {
+        out = (char *) rs_out;
+        if (hwparams.format == SND_PCM_FORMAT_MU_LAW)
+        {
+            for (i = 0; i < frames * hwparams.channels; i++)
+                rs_native[i] = linear2ulaw(rs_out[i]);
+            out = rs_native;
+        }
+
+        if (pcm_write_frames(out, frames) != frames)
+            return 0;
+    }
+
+    frames_played += frames;
+
+    /* Measure the device clock, and steer the buffer toward its target */
+    if (pcm_delay(&delay) == 0)
+        drift_output(&drift, now_ms(),
+                (frames_played - delay) * 1000.0 / hwparams.rate);
+
+    return period_frames;
+}
+
+static void start_playback(int fd)
+{
+    int pcm_out, read_cnt, bytes_read;
+    int drop, lost;
+    int starved = 0;
+    char *period;
+
+    /* The device clock measurement restarts with the device */
+    frames_played = 0;
+    drift_output_restart(&drift);
+
+    while (!shutdown_req)
+    {
+        read_cnt = 0;
+        bytes_read = 0;
+        period = audiobuf;
+
+        if (playback_mode == NETWORK_PLAYBACK)
+        {
+            /* Sleep until the period has arrived and the device can take it,
+             * or timeout if the network throughput is not meeting the DSP
+             * timing requirements. */
+            if (wait_for_period(
+                    plc_enabled ? conceal_timeout() : period_time * 4 / 1000))
+            {
+                lost = period_lost();
+
+                /* Played from where it lies in the ring, so that its only
+                 * copy is the one into the device */
+                period = ring_period();
+                if (period != NULL)
+                    bytes_read = period_bytes;
+                else
+                {
+                    period = audiobuf;
+                    bytes_read = ringbuffer_read(rb, audiobuf, period_bytes);
+                }
+
+                if (plc_enabled && lost)
+                    conceal_period(period);
+                else if (plc_enabled)
+                    conceal_good(period);
+
+                starved = 0;
+            }
+            else if (plc_enabled && conceal_period(audiobuf))
+            {
+                /* Late, keep the device playing on concealment for as long
+                 * as it is audible, and deepen the buffer once per loss */
+                if (!starved)
+                {
+                    jitterbuf_underrun(&jb, now_ms());
+                    metric_inc(met.underruns);
+                    flightrec_trigger(&flight, FLIGHTREC_UNDERRUN);
+                }
+                starved = 1;
+                bytes_read = period_bytes;
+            }
+        }
+        else if (playback_mode == FILE_PLAYBACK)
+            bytes_read = read(fd, audiobuf, period_bytes);
+
+        if (bytes_read != period_bytes)
+        {
+            /* Ran dry, rebuffer to a deeper target before restarting */
+            if ((playback_mode == NETWORK_PLAYBACK) && !starved)
+            {
+                jitterbuf_underrun(&jb, now_ms());
+                metric_inc(met.underruns);
+                flightrec_trigger(&flight, FLIGHTREC_UNDERRUN);
+            }
+            break;
+        }
+
+        read_cnt += bytes_read;
+        read_cnt = read_cnt * 8 / bits_per_frame;
+        pcm_out = play_period(period);
+
+        if (period != audiobuf)
+            ringbuffer_read_advance(rb, period_bytes);
+
+        if (pcm_out != read_cnt)
+            break;
+
+        /* Give latency back when the buffer has stayed deeper than needed */
+        if (playback_mode == NETWORK_PLAYBACK)
+        {
+            /* Steer the fill level as it was before this period was read,
+             * which is what the jitter buffer target describes */
+            if (drift_enabled)
+                rs_ratio = drift_update(&drift,
+                        (ringbuffer_read_space(rb) + period_bytes)
+                                / bytes_per_ms, jitterbuf_target(&jb),
+                        now_ms());
+
+            drop = jitterbuf_fill(&jb, ringbuffer_read_space(rb) / bytes_per_ms,
+                    now_ms());
+            if (drop > 0)
+            {
+                ringbuffer_read_advance(rb, drop * sample_buffer_size);
+                metric_add(met.shrink, drop);
+            }
+        }
+    }
+
+    pcm_drain();
+}
+
+/* Copy cnt bytes to the write vector of the ring buffer, starting at offset
+ * bytes into the free space.  The caller must have checked the space. */
+static void write_vector_copy(const ringbuffer_data_t *vec, size_t offset,
+        const char *src, size_t cnt)
+{
+    size_t n1 = 0;
+
+    if (offset < vec[0].len)
+    {
+        n1 = vec[0].len - offset;
+        if (n1 > cnt)
+            n1 = cnt;
+        memcpy(vec[0].buf + offset, src, n1);
+        offset = 0;
+    }
+    else
+        offset -= vec[0].len;
+
+    if (cnt > n1)
+        memcpy(vec[1].buf + offset, src + n1, cnt - n1);
+}
+
+/* Fill cnt bytes of the write vector with silence, starting at offset
+ * bytes into the free space.  The caller must have checked the space. */
+static void write_vector_silence(const ringbuffer_data_t *vec, size_t offset,
+        size_t cnt)
+{
+    size_t n1 = 0;
+
+    if (offset < vec[0].len)
+    {
+        n1 = vec[0].len - offset;
+        if (n1 > cnt)
+            n1 = cnt;
+        snd_pcm_format_set_silence(hwparams.format, vec[0].buf + offset,
+                n1 * 8 / bits_per_sample);
+        offset = 0;
+    }
+    else
+        offset -= vec[0].len;
+
+    if (cnt > n1)
+        snd_pcm_format_set_silence(hwparams.format, vec[1].buf + offset,
+                (cnt - n1) * 8 / bits_per_sample);
+}
+
+/* Copy cnt bytes from the write vector, offset bytes into the free space */
+static void read_vector_copy(const ringbuffer_data_t *vec, size_t offset,
+        char *dest, size_t cnt)
+{
+    size_t n1 = 0;
+
+    if (offset < vec[0].len)
+    {
+        n1 = vec[0].len - offset;
+        if (n1 > cnt)
+            n1 = cnt;
+        memcpy(dest, vec[0].buf + offset, n1);
+        offset = 0;
+    }
+    else
+        offset -= vec[0].len;
+
+    if (cnt > n1)
+        memcpy(dest + n1, vec[1].buf + offset, cnt - n1);
+}
+
+/* Describe a region of the ring vectors, which may span the wrap point,
+ * with one or two iovecs.  Returns the number of iovecs used. */
+static int vector_iov(const ringbuffer_data_t *vec, size_t offset, size_t cnt,
+        struct iovec *iov)
+{
+    int n = 0;
+
+    if (offset < vec[0].len)
+    {
+        iov[n].iov_base = vec[0].buf + offset;
+        iov[n].iov_len = vec[0].len - offset;
+        if (iov[n].iov_len > cnt)
+            iov[n].iov_len = cnt;
+        cnt -= iov[n++].iov_len;
+        offset = 0;
+    }
+    else
+        offset -= vec[0].len;
+
+    if (cnt > 0)
+    {
+        iov[n].iov_base = vec[1].buf + offset;
+        iov[n++].iov_len = cnt;
+    }
+
+    return n;
+}
+
+/* Point the payload of each datagram of the next batch at a free slot of
+ * the ring.  The slots start past the last packet the reorder stage holds,
+ * where the stream continues, rather than at a hole it is waiting on. */
+static void landing_prepare(const ringbuffer_data_t *vec, size_t space,
+        struct mmsghdr *msgs, struct iovec (*iovecs)[3],
+        unsigned char (*hdrs)[PKTHDR_SIZE])
+{
+    uint64_t held = pkt_header ? rx.held : 0;
+    size_t k = 0;
+    int i, n;
+
+    while ((k < 64) && (held >> k))
+        k++;
+
+    for (i = 0; i < rcv_batch_size; i++)
+    {
+        n = 0;
+        if (pkt_header)
+        {
+            iovecs[i][n].iov_base = hdrs[i];
+            iovecs[i][n++].iov_len = PKTHDR_SIZE;
+        }
+
+        landing.stashed[i] = ((k + 1) * sample_buffer_size > space);
+        if (landing.stashed[i])
+        {
+            iovecs[i][n].iov_base = landing.stash + i * sample_buffer_size;
+            iovecs[i][n++].iov_len = sample_buffer_size;
+        }
+        else
+        {
+            landing.slot[i] = k++;
+            n += vector_iov(vec, landing.slot[i] * sample_buffer_size,
+                    sample_buffer_size, &iovecs[i][n]);
+        }
+
+        msgs[i].msg_hdr.msg_iov = iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = n;
+    }
+
+    landing.count = 0;
+    landing.next = 0;
+}
+
+/* Move a payload that has not been placed yet out of a slot about to be
+ * written */
+static void landing_protect(const ringbuffer_data_t *vec, size_t slot)
+{
+    int i;
+
+    for (i = landing.next; i < landing.count; i++)
+    {
+        if (!landing.stashed[i] && (landing.slot[i] == slot))
+        {
+            read_vector_copy(vec, slot * sample_buffer_size,
+                    landing.stash + i * sample_buffer_size,
+                    sample_buffer_size);
+            landing.stashed[i] = 1;
+        }
+    }
+}
+
+/* Put the payload of the current datagram in its ring slot, which costs a
+ * copy only if it landed anywhere else */
+static void landing_place(const ringbuffer_data_t *vec, size_t slot)
+{
+    int i = landing.next;
+
+    rcv_placed_cnt++;
+    if (!landing.stashed[i] && (landing.slot[i] == slot))
+        return;
+
+    if (!landing.stashed[i])
+        landing_protect(vec, landing.slot[i]);
+    landing_protect(vec, slot);
+
+    write_vector_copy(vec, slot * sample_buffer_size,
+            landing.stash + i * sample_buffer_size, sample_buffer_size);
+    rcv_copied_cnt++;
+}
+
+/* Move the reorder window one packet forward, the slot at its head becoming
+ * ready to publish.  A slot that never received its packet is filled with
+ * silence, so that the audio stays in step with the sender. */
+static void reorder_advance(const ringbuffer_data_t *vec, size_t *ready)
+{
+    size_t pos = (vec[0].buf - rb->buf) + *ready * sample_buffer_size;
+
+    if (!(rx.held & 1))
+    {
+        landing_protect(vec, *ready);
+        write_vector_silence(vec, *ready * sample_buffer_size,
+                sample_buffer_size);
+        rx.lost++;
+        metric_inc(met.lost);
+    }
+
+    /* Let the playout thread conceal the fill */
+    slot_lost[(pos & rb->size_mask) / sample_buffer_size] = !(rx.held & 1);
+
+    rx.seen = (rx.seen << 1) | (rx.held & 1);
+    rx.held >>= 1;
+    rx.next_seq++;
+    (*ready)++;
+}
+
+/* Reorder window in packets, which is the jitter buffer target depth, as a
+ * packet arriving later than that would have been too late to play anyway */
+static int reorder_window()
+{
+    int window = target_bytes() / sample_buffer_size;
+
+    if (window < 2)
+        window = 2;
+    if (window > REORDER_MAX)
+        window = REORDER_MAX;
+
+    return window;
+}
+
+/* Place a packet into its slot in the free space beyond the ring write
+ * pointer, ready slots already being counted in *ready, and extend *ready
+ * over any slots that are now in order.  space is the usable free space. */
+static void reorder_packet(const ringbuffer_data_t *vec, size_t space,
+        size_t *ready, const pkthdr_t *hdr, double arrival_ms)
+{
+    size_t ring_slots = ring_max_bytes / sample_buffer_size;
+    int32_t d;
+    int window;
+
+    /* Lock on to the first stream heard, and only switch to another one
+     * once the current stream has gone quiet */
+    if (!rx.synced || (hdr->stream != rx.stream))
+    {
+        if (rx.synced && (arrival_ms - rx.last_arrival_ms < STREAM_IDLE_MS))
+        {
+            rx.foreign++;
+            metric_inc(met.foreign);
+            return;
+        }
+
+        rx.synced = 1;
+        rx.stream = hdr->stream;
+        rx.next_seq = hdr->seq;
+        rx.held = 0;
+        rx.seen = 0;
+        rx.streams++;
+    }
+
+    rx.last_arrival_ms = arrival_ms;
+    d = pkthdr_seq_diff(hdr->seq, rx.next_seq);
+
+    /* Behind the write pointer, either seen already or played as fill */
+    if (d < 0)
+    {
+        if ((d >= -64) && ((rx.seen >> (-d - 1)) & 1))
+        {
+            rx.duplicates++;
+            metric_inc(met.duplicate);
+        }
+        else
+        {
+            rx.late++;
+            metric_inc(met.late);
+        }
+        return;
+    }
+
+    /* A jump beyond anything the ring could hold is a sender restart */
+    if ((size_t) d >= ring_slots)
+    {
+        rx.lost += d;
+        metric_add(met.lost, d);
+        rx.next_seq = hdr->seq;
+        rx.held = 0;
+        d = 0;
+    }
+
+    if ((*ready + d + 1) * sample_buffer_size > space)
+    {
+        metric_inc(met.overflow);
+        return;
+    }
+
+    /* Give up on missing packets that have fallen out of the window */
+    window = reorder_window();
+    while (d >= window)
+    {
+        reorder_advance(vec, ready);
+        d--;
+    }
+
+    if ((rx.held >> d) & 1)
+    {
+        rx.duplicates++;
+        metric_inc(met.duplicate);
+        return;
+    }
+
+    if (rx.held >> d)
+        rx.reordered++;
+
+    landing_place(vec, *ready + d);
+    rx.held |= (uint64_t) 1 << d;
+    rx.received++;
+
+    while (rx.held & 1)
+        reorder_advance(vec, ready);
+}
+
+static void register_metrics()
+{
+    static const char *dropped = "etherplay_dropped_packets_total";
+    static const char *dropped_help = "Packets received but not played";
+    char labels[METRIC_LABELS_MAX];
+
+    snprintf(labels, sizeof(labels), "port=\"%i\"", udp_receive_port);
+    metrics_labels(&mx, labels);
+
+    met.packets = metrics_counter(&mx, "etherplay_packets_received_total",
+            "Datagrams received", NULL);
+    met.bytes = metrics_counter(&mx, "etherplay_received_bytes_total",
+            "Bytes of datagrams received", NULL);
+
+    met.wrong_size = metrics_counter(&mx, dropped, dropped_help,
+            "reason=\"wrong_size\"");
+    met.bad_header = metrics_counter(&mx, dropped, dropped_help,
+            "reason=\"bad_header\"");
+    met.overflow = metrics_counter(&mx, dropped, dropped_help,
+            "reason=\"overflow\"");
+    met.foreign = metrics_counter(&mx, dropped, dropped_help,
+            "reason=\"foreign\"");
+    met.duplicate = metrics_counter(&mx, dropped, dropped_help,
+            "reason=\"duplicate\"");
+    met.late = metrics_counter(&mx, dropped, dropped_help,
+            "reason=\"late\"");
+    met.shrink = metrics_counter(&mx, dropped, dropped_help,
+            "reason=\"shrink\"");
+
+    met.lost = metrics_counter(&mx, "etherplay_lost_packets_total",
+            "Packets missing from the sequence, played as concealment", NULL);
+    met.underruns = metrics_counter(&mx, "etherplay_underruns_total",
+            "Times the jitter buffer ran dry", NULL);
+    met.xruns = metrics_counter(&mx, "etherplay_xruns_total",
+            "Audio device underruns", NULL);
+
+    met.batch = metrics_histogram(&mx, "etherplay_receive_batch_packets",
+            "Datagrams per batched receive", NULL, batch_bounds,
+            sizeof(batch_bounds) / sizeof(batch_bounds[0]), 1);
+    met.ring_fill = metrics_gauge(&mx, "etherplay_ring_fill_bytes",
+            "Bytes waiting in the ring buffer", NULL);
+    met.ring_fill_time = metrics_histogram(&mx, "etherplay_ring_fill_seconds",
+            "Audio waiting in the ring buffer after each receive", NULL,
+            fill_bounds, sizeof(fill_bounds) / sizeof(fill_bounds[0]), 1e6);
+}
+
+static void print_rcv_stats()
+{
+    unsigned long packets = 0;
+    int i;
+
+    for (i = 1; i <= RCV_BATCH_MAX; i++)
+        packets += rcv_batch_hist[i] * i;
+
+    printf("\nReceived %lu packets in %lu batches", packets, rcv_batch_cnt);
+    if (rcv_batch_cnt > 0)
+        printf(" (%.2f packets/batch, %lu syscalls saved)",
+                (double) packets / rcv_batch_cnt, packets - rcv_batch_cnt);
+    printf("\n");
+
+    printf("Batch size histogram:");
+    for (i = 1; i <= RCV_BATCH_MAX; i++)
+    {
+        if (rcv_batch_hist[i] > 0)
+            printf(" %i:%lu", i, rcv_batch_hist[i]);
+    }
+    printf("\n");
+
+    printf("Wrong size packets = %lu, Ring overflow packets = %lu\n",
+            (unsigned long) metric_value(met.wrong_size),
+            (unsigned long) metric_value(met.overflow));
+    printf("Packets received in place = %lu, copied = %lu\n",
+            rcv_placed_cnt - rcv_copied_cnt, rcv_copied_cnt);
+
+    if (pkt_header)
+    {
+        printf("Stream %04x: Received = %lu, Lost = %lu, Reordered = %lu",
+                rx.stream, rx.received, rx.lost, rx.reordered);
+        printf(", Duplicates = %lu, Late = %lu\n", rx.duplicates, rx.late);
+        printf("Streams = %lu, Foreign packets = %lu, Bad headers = %lu\n",
+                rx.streams, rx.foreign,
+                (unsigned long) metric_value(met.bad_header));
+    }
+
+    printf("Jitter = %.2f ms, Peak = %.2f ms, Target = %.0f ms", jb.jitter_ms,
+            jb.peak_ms, jitterbuf_target(&jb));
+    printf(", Underruns = %lu, Drops = %lu\n", jb.underruns, jb.drops);
+
+    if (drift_enabled)
+    {
+        printf("Drift correction = %+.1f ppm", drift.ppm);
+        if (drift.sender_valid)
+            printf(", Sender = %+.1f ppm", drift.sender_ppm);
+        if (drift.device_valid)
+            printf(", Device = %+.1f ppm", drift.device_ppm);
+        printf("\n");
+    }
+
+    if (plc_enabled)
+    {
+        printf("Concealed periods = %lu in %lu losses", plc.periods,
+                plc.episodes);
+        if (plc.periods > 0)
+            printf(", %.2f us/period", plc_cost_us / plc.periods);
+        printf("\n");
+    }
+}
+
+/* Kernel arrival time of a received datagram, or now if it has none */
+static void msg_arrival(struct msghdr *msg, struct timespec *arrival)
+{
+    struct cmsghdr *cmsg;
+
+    clock_gettime(CLOCK_REALTIME, arrival);
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if ((cmsg->cmsg_level == SOL_SOCKET)
+                && (cmsg->cmsg_type == SCM_TIMESTAMPNS))
+            memcpy(arrival, CMSG_DATA(cmsg), sizeof(*arrival));
+    }
+}
+
+static void *rcv_data_function(void *ptr)
+{
+    int i, sock_rcvd;
+    struct sockaddr_in server_addr;
+    struct mmsghdr msgs[RCV_BATCH_MAX];
+    struct iovec iovecs[RCV_BATCH_MAX][3];
+    unsigned char hdr_buf[RCV_BATCH_MAX][PKTHDR_SIZE];
+    char cmsg_buf[RCV_BATCH_MAX][CMSG_SPACE(sizeof(struct timespec))];
+    struct timespec arrival;
+    ringbuffer_data_t vec[2];
+    size_t space, written, fill, ready;
+    double arrival_ms, batch_ms, packet_ms;
+    pkthdr_t hdr;
+    int enable = 1;
+
+    landing.stash = malloc(rcv_batch_size * sample_buffer_size);
+    if (landing.stash == NULL)
+    {
+        printf("not enough memory");
+        prg_exit(EXIT_FAILURE);
+    }
+
+    rtprofile_thread(&rt, RT_NET, "receive");
+
+    bzero(msgs, sizeof(msgs));
+    bzero(&hdr, sizeof(hdr));
+    for (i = 0; i < rcv_batch_size; i++)
+        msgs[i].msg_hdr.msg_control = cmsg_buf[i];
+
+    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    /* Receivers of a group on one host share the port, each with a copy */
+    if (mc.group_count > 0)
+        setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    bzero(&server_addr, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(udp_receive_port);
+    bind(sock_fd, (struct sockaddr *) &server_addr, sizeof(server_addr));
+
+    /* One packet from the sender reaches every receiver of a group */
+    if (mcast_join(&mc, sock_fd) < 0)
+    {
+        perror("Joining the multicast groups");
+        prg_exit(EXIT_FAILURE);
+    }
+
+    packet_ms = sample_buffer_size / bytes_per_ms;
+
+    /* Kernel arrival timestamps keep batching out of the jitter estimate */
+    setsockopt(sock_fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+
+    while (!shutdown_req)
+    {
+        for (i = 0; i < rcv_batch_size; i++)
+            msgs[i].msg_hdr.msg_controllen = sizeof(cmsg_buf[i]);
+
+        /* Receive the batch straight into the free regions of the ring
+         * buffer, and then publish it with a single write pointer advance.
+         * The space only grows while the thread is blocked. */
+        ringbuffer_get_write_vector(rb, vec);
+        space = vec[0].len + vec[1].len;
+        written = 0;
+        ready = 0;
+
+        /* Never buffer beyond the jitter buffer's maximum depth */
+        fill = ringbuffer_read_space(rb);
+        if (fill + space > ring_max_bytes)
+            space = (fill < ring_max_bytes) ? ring_max_bytes - fill : 0;
+
+        landing_prepare(vec, space, msgs, iovecs, hdr_buf);
+
+        /* Block for the first datagram, then drain whatever else is queued */
+        sock_rcvd = recvmmsg(sock_fd, msgs, rcv_batch_size, MSG_WAITFORONE,
+                NULL);
+
+        if (sock_rcvd < 1)
+            continue;
+
+        /* A copy of every datagram as received, before any is moved */
+        if (flight.enabled)
+        {
+            for (i = 0; i < sock_rcvd; i++)
+            {
+                msg_arrival(&msgs[i].msg_hdr, &arrival);
+                flightrec_add(&flight, &arrival, msgs[i].msg_hdr.msg_iov,
+                        msgs[i].msg_hdr.msg_iovlen, msgs[i].msg_len);
+            }
+        }
+
+        /* The thread was due to run when the first datagram arrived */
+        msg_arrival(&msgs[0].msg_hdr, &arrival);
+        rtprofile_wakeup(&rt, RT_NET, CLOCK_REALTIME, &arrival);
+
+        rcv_batch_cnt++;
+        rcv_batch_hist[sock_rcvd]++;
+        metric_add(met.packets, sock_rcvd);
+        metric_observe(met.batch, sock_rcvd);
+        batch_ms = now_ms();
+        landing.count = sock_rcvd;
+
+        /* Nothing is published until the write pointer advances, so a
+         * datagram that is dropped just leaves its slot to the next one */
+        for (i = 0; i < sock_rcvd; i++)
+        {
+            landing.next = i;
+            metric_add(met.bytes, msgs[i].msg_len);
+
+            if ((msgs[i].msg_len != pkt_size)
+                    || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+            {
+                metric_inc(met.wrong_size);
+                continue;
+            }
+
+            if (pkt_header)
+            {
+                if ((pkthdr_unpack(&hdr, hdr_buf[i], PKTHDR_SIZE) < 0)
+                        || (hdr.format != format_id))
+                {
+                    metric_inc(met.bad_header);
+                    continue;
+                }
+            }
+            else if (space - written < sample_buffer_size)
+            {
+                metric_inc(met.overflow);
+                continue;
+            }
+
+            msg_arrival(&msgs[i].msg_hdr, &arrival);
+            arrival_ms = arrival.tv_sec * 1000.0 + arrival.tv_nsec / 1000000.0;
+            packet_cnt++;
+
+            if (pkt_header)
+            {
+                jitterbuf_arrival(&jb, arrival_ms,
+                        hdr.timestamp * 1000.0 / hwparams.rate);
+                drift_arrival(&drift, batch_ms,
+                        hdr.timestamp * 1000.0 / hwparams.rate + packet_ms);
+                reorder_packet(vec, space, &ready, &hdr, arrival_ms);
+                continue;
+            }
+
+            jitterbuf_arrival(&jb, arrival_ms, -1);
+            drift_arrival(&drift, batch_ms, packet_cnt * packet_ms);
+
+            landing_place(vec, written / sample_buffer_size);
+            written += sample_buffer_size;
+        }
+
+        if (pkt_header)
+            written = ready * sample_buffer_size;
+
+        if (written > 0)
+        {
+            ringbuffer_write_advance(rb, written);
+
+            /* Wake the playout thread only if it is waiting for packets */
+            __sync_synchronize();
+            if (rcv_waiter)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &rcv_signal_time);
+                eventfd_write(rcv_event_fd, 1);
+            }
+        }
+
+        fill = ringbuffer_read_space(rb);
+        metric_set(met.ring_fill, fill);
+        metric_observe(met.ring_fill_time, fill * 1000 / bytes_per_ms);
+    }
+
+    if (sock_fd > 1)
+        close(sock_fd);
+
+    free(landing.stash);
+
+    pthread_exit(0);
+}
+
+static void rb_playback()
+{
+    /* setup sound hardware */
+    set_params();
+
+    /* initialize jitter buffer */
+    jitterbuf_init(&jb, sample_buffer_size / bytes_per_ms, jb_target_ms,
+            jb_min_ms, jb_max_ms);
+
+    /* display header info */
+    header();
+
+    /* initialize ring buffer */
+    rb = ringbuffer_create(ring_buffer_bytes);
+
+    /* loss concealment, speech style for the mono modes */
+    slot_lost = calloc(rb->size / sample_buffer_size + 1, 1);
+    plc_buf = malloc(period_frames * hwparams.channels * sizeof(int16_t));
+    if ((slot_lost == NULL) || (plc_buf == NULL)
+            || (plc_init(&plc, (hwparams.channels == 1) ? PLC_SPEECH : PLC_MUSIC,
+                    hwparams.rate, hwparams.channels, period_frames) < 0))
+    {
+        printf("not enough memory");
+        prg_exit(EXIT_FAILURE);
+    }
+
+    /* clock drift compensation, with room for the resampled period */
+    drift_init(&drift);
+    rs_cap = period_frames + RESAMPLE_TAPS;
+    rs_out = malloc(rs_cap * hwparams.channels * sizeof(int16_t));
+    rs_native = malloc(rs_cap * bits_per_frame / 8);
+    if ((rs_out == NULL) || (rs_native == NULL)
+            || (resample_init(&rs, hwparams.channels, period_frames) < 0))
+    {
+        printf("not enough memory");
+        prg_exit(EXIT_FAILURE);
+    }
+
+    /* sized for the nominal packet rate, and started before the
+     * real-time profile so that the dump thread keeps the default one */
+    if (flightrec_start(&flight, bytes_per_ms * 1000 / sample_buffer_size,
+            pkt_size) < 0)
+    {
+        perror("flight recorder");
+        prg_exit(EXIT_FAILURE);
+    }
+
+    rcv_event_fd = eventfd(0, EFD_NONBLOCK);
+    if (rcv_event_fd < 0)
+    {
+        perror("eventfd");
+        prg_exit(EXIT_FAILURE);
+    }
+
+    /* keep the buffers of the playout path resident */
+    if (rt.enabled)
+    {
+        rtprofile_locked(&rt, rb->size, ringbuffer_mlock(rb) ? errno : 0);
+        rtprofile_lock(&rt, audiobuf, period_bytes);
+        rtprofile_lock(&rt, slot_lost, rb->size / sample_buffer_size + 1);
+        rtprofile_lock(&rt, plc_buf,
+                period_frames * hwparams.channels * sizeof(int16_t));
+        rtprofile_lock(&rt, rs_out,
+                rs_cap * hwparams.channels * sizeof(int16_t));
+        rtprofile_lock(&rt, rs_native, rs_cap * bits_per_frame / 8);
+        if (flight.enabled)
+            rtprofile_lock(&rt, flight.buf, flight.size);
+        rtprofile_lock_report(&rt);
+    }
+    rtprofile_thread(&rt, RT_AUDIO, "playout");
+
+    /* spawn rcv data thread */
+    pthread_create(&udpRecThread, NULL, rcv_data_function, 0);
+
+    /* rb playback */
     while (!shutdown_req)
     {
-        /* wait for packets to arrive, before starting playback */
-        if (packet_cnt != prev_packet_cnt)
+        /* wait for the jitter buffer to reach its target depth, before
+         * starting playback */
+        if (ringbuffer_read_space(rb) >= target_bytes())
         {
             usleep(playback_delay);
-            snd_pcm_recover(handle, -EPIPE, 1);
+            pcm_prepare();
             start_playback(0);
         }
-
-        prev_packet_cnt = packet_cnt;
-        usleep(10000);
+        else
+            wait_for_packets(target_bytes(), -1);
     }
 
     ringbuffer_free(rb);
+    plc_free(&plc);
+    free(plc_buf);
+    free(slot_lost);
+    resample_free(&rs);
+    free(rs_out);
+    free(rs_native);
+    flightrec_close(&flight);
 }
 
 static void file_playback(char *name)
@@ -625,6 +2074,10 @@ static void file_playback(char *name)
     /* display header info */
     header();
 
+    rtprofile_lock(&rt, audiobuf, period_bytes);
+    rtprofile_lock_report(&rt);
+    rtprofile_thread(&rt, RT_AUDIO, "playout");
+
     /* file playback */
     start_playback(file_fd);
 
@@ -0,0 +1,397 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capturedb.h"
+#include "flightrec.h"
+
+/* Each record is a header and the datagram, padded to 8 bytes.  A record
+ * never wraps; the space left at the end of the ring is skipped, marked
+ * as such when a header fits in it. */
+#define RECORD_HEADER      16
+#define RECORD_SKIP        0xffffffff
+
+#define DUMP_BUFFER_BYTES  (1024 * 1024)
+
+typedef struct
+{
+  int64_t arrival_ns;
+  uint32_t len;
+  uint32_t reserved;
+}
+record_t;
+
+static inline size_t record_bytes(uint32_t len)
+{
+    return RECORD_HEADER + ((len + 7) & ~7);
+}
+
+void flightrec_init(flightrec_t *fr)
+{
+    memset(fr, 0, sizeof(flightrec_t));
+    strcpy(fr->name, "flight");
+}
+
+int flightrec_option(flightrec_t *fr, const char *arg)
+{
+    char *end;
+
+    if (strncmp(arg, "--flight=", 9) != 0)
+        return -1;
+
+    arg += 9;
+    fr->minutes = strtod(arg, &end);
+    if ((end == arg) || (fr->minutes <= 0))
+        return -1;
+
+    if (*end == ',')
+    {
+        if ((end[1] == '\0') || (strlen(end + 1) >= sizeof(fr->name)))
+            return -1;
+        strcpy(fr->name, end + 1);
+    }
+    else if (*end != '\0')
+        return -1;
+
+    fr->enabled = 1;
+    return 0;
+}
+
+/* Read the header of the record at a logical offset, or at the start of
+ * the next lap when the rest of this one is skipped.  Returns the offset
+ * of the record read. */
+static uint64_t record_at(const flightrec_t *fr, uint64_t pos,
+        record_t *rec)
+{
+    size_t off = pos % fr->size;
+
+    if (fr->size - off >= RECORD_HEADER)
+    {
+        memcpy(rec, fr->buf + off, RECORD_HEADER);
+        if (rec->len != RECORD_SKIP)
+            return pos;
+    }
+
+    memcpy(rec, fr->buf, RECORD_HEADER);
+    return pos + (fr->size - off);
+}
+
+/* Drop the oldest records until the ring has room up to end */
+static void make_room(flightrec_t *fr, uint64_t end)
+{
+    uint64_t tail = fr->tail;
+    record_t rec;
+
+    while (end - tail > fr->size)
+    {
+        tail = record_at(fr, tail, &rec);
+        if (end - tail <= fr->size)
+            break;
+        tail += record_bytes(rec.len);
+    }
+
+    /* published before the records are overwritten */
+    __atomic_store_n(&fr->tail, tail, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void flightrec_add(flightrec_t *fr, const struct timespec *arrival,
+        const struct iovec *iov, int iovcnt, size_t len)
+{
+    uint64_t head = fr->head;
+    size_t off, need, n;
+    record_t rec;
+    int i;
+
+    /* what was received of it */
+    for (i = 0, n = 0; i < iovcnt; i++)
+        n += iov[i].iov_len;
+    if (len > n)
+        len = n;
+
+    need = record_bytes(len);
+    if ((len > FLIGHTREC_RECORD_MAX) || (need > fr->size / 2))
+    {
+        fr->too_big++;
+        return;
+    }
+
+    off = head % fr->size;
+    if (fr->size - off < need)
+    {
+        make_room(fr, head + (fr->size - off) + need);
+        if (fr->size - off >= RECORD_HEADER)
+        {
+            rec.len = RECORD_SKIP;
+            memcpy(fr->buf + off, &rec, RECORD_HEADER);
+        }
+        head += fr->size - off;
+        off = 0;
+    }
+    else
+        make_room(fr, head + need);
+
+    rec.arrival_ns = arrival->tv_sec * 1000000000LL + arrival->tv_nsec;
+    rec.len = len;
+    rec.reserved = 0;
+    memcpy(fr->buf + off, &rec, RECORD_HEADER);
+
+    off += RECORD_HEADER;
+    for (i = 0; (i < iovcnt) && (len > 0); i++)
+    {
+        n = (iov[i].iov_len < len) ? iov[i].iov_len : len;
+        memcpy(fr->buf + off, iov[i].iov_base, n);
+        off += n;
+        len -= n;
+    }
+
+    fr->packets++;
+    fr->bytes += rec.len;
+    __atomic_store_n(&fr->head, head + need, __ATOMIC_RELEASE);
+}
+
+void flightrec_trigger(flightrec_t *fr, int reason)
+{
+    struct timespec now;
+
+    if (!fr->running)
+        return;
+
+    /* An outage underruns again and again; dump its start only */
+    if (reason == FLIGHTREC_UNDERRUN)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((fr->last_underrun != 0)
+                && (now.tv_sec - fr->last_underrun < FLIGHTREC_HOLDOFF_SEC))
+            return;
+        fr->last_underrun = now.tv_sec;
+    }
+
+    if (__sync_bool_compare_and_swap(&fr->pending, 0, 1))
+    {
+        fr->reason = reason;
+        sem_post(&fr->trigger);
+    }
+}
+
+/* Write the records of the last minutes, as of now, to a new database */
+static void dump(flightrec_t *fr)
+{
+    static const char *reasons[] = { "signal", "underrun" };
+    char name[FLIGHTREC_NAME_MAX + 32], stamp[32];
+    capturedb_writer_t w;
+    struct timespec now;
+    struct tm tm;
+    uint64_t pos, head, tail;
+    int64_t since_ns;
+    unsigned long packets = 0, lost = 0;
+    record_t rec;
+    size_t off;
+    int valid;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    since_ns = now.tv_sec * 1000000000LL + now.tv_nsec
+            - (int64_t) (fr->minutes * 60e9);
+
+    localtime_r(&now.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(name, sizeof(name), "%s_%s", fr->name, stamp);
+
+    if (capturedb_create(&w, name, DUMP_BUFFER_BYTES) < 0)
+    {
+        perror(name);
+        return;
+    }
+
+    head = __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE);
+    pos = __atomic_load_n(&fr->tail, __ATOMIC_ACQUIRE);
+
+    while (pos < head)
+    {
+        /* Copied out, then checked to be still in the ring */
+        pos = record_at(fr, pos, &rec);
+        if (pos >= head)
+            break;
+
+        /* the header may be torn by the writer, so it is not trusted
+         * until the tail shows that the record was not overwritten */
+        off = pos % fr->size;
+        valid = (rec.len <= FLIGHTREC_RECORD_MAX)
+                && (off + record_bytes(rec.len) <= fr->size);
+        if (valid)
+            memcpy(fr->scratch, fr->buf + off + RECORD_HEADER, rec.len);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        tail = __atomic_load_n(&fr->tail, __ATOMIC_RELAXED);
+        if (tail > pos)
+        {
+            lost++;
+            pos = tail;
+            continue;
+        }
+        if (!valid)
+            break;
+        pos += record_bytes(rec.len);
+
+        if (rec.arrival_ns < since_ns)
+            continue;
+
+        /* the database holds packets of up to 32767 bytes */
+        if (capturedb_append(&w, rec.arrival_ns / 1000000, 0, fr->scratch,
+                rec.len) == 0)
+            packets++;
+        else if (errno != E2BIG)
+            break;
+    }
+
+    if (capturedb_close(&w) < 0)
+        perror(name);
+
+    printf("Flight recorder: %lu packets dumped into %s on %s", packets, name,
+            reasons[fr->reason]);
+    if (lost > 0)
+        printf(", %lu overwritten while dumping", lost);
+    printf("\n");
+    fflush(stdout);
+}
+
+static void *dump_function(void *ptr)
+{
+    flightrec_t *fr = (flightrec_t *) ptr;
+
+    for (;;)
+    {
+        while ((sem_wait(&fr->trigger) < 0) && (errno == EINTR))
+            ;
+
+        if (fr->stop)
+            break;
+
+        dump(fr);
+        fr->dumps++;
+        __sync_lock_release(&fr->pending);
+    }
+
+    return NULL;
+}
+
+int flightrec_start(flightrec_t *fr, double packets_per_sec,
+        size_t packet_bytes)
+{
+    size_t off;
+    int err;
+
+    if (!fr->enabled)
+        return 0;
+
+    fr->head = fr->tail = 0;
+    fr->packets = fr->bytes = fr->too_big = 0;
+    fr->stop = 0;
+    fr->pending = 0;
+    fr->dumps = 0;
+
+    fr->size = (size_t) (fr->minutes * 60 * packets_per_sec
+            * FLIGHTREC_HEADROOM) * record_bytes(packet_bytes);
+    fr->size = (fr->size + 4095) & ~(size_t) 4095;
+    if (fr->size < 2 * record_bytes(FLIGHTREC_RECORD_MAX))
+        fr->size = 2 * record_bytes(FLIGHTREC_RECORD_MAX);
+
+    fr->buf = malloc(fr->size);
+    fr->scratch = malloc(FLIGHTREC_RECORD_MAX);
+    if ((fr->buf == NULL) || (fr->scratch == NULL))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* faulted in now rather than by the receive thread, a store to each
+     * page, as zeroing it could be left to the kernel */
+    for (off = 0; off < fr->size; off += 4096)
+        ((volatile unsigned char *) fr->buf)[off] = 0;
+
+    if (sem_init(&fr->trigger, 0, 0) < 0)
+        return -1;
+
+    err = pthread_create(&fr->thread, NULL, dump_function, fr);
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    fr->running = 1;
+
+    printf("Flight recorder: last %g minutes, %.1f MB ring, dumped to %s_*"
+            " on SIGUSR1 or an underrun\n", fr->minutes, fr->size / 1e6,
+            fr->name);
+
+    return 0;
+}
+
+void flightrec_report(const flightrec_t *fr)
+{
+    uint64_t head = __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE);
+    int64_t oldest_ns = 0, newest_ns = 0;
+    record_t rec;
+    uint64_t pos;
+
+    if (!fr->running)
+        return;
+
+    /* the span held, from the oldest record to the last one */
+    pos = record_at(fr, __atomic_load_n(&fr->tail, __ATOMIC_ACQUIRE), &rec);
+    if (pos < head)
+    {
+        oldest_ns = rec.arrival_ns;
+        for (; pos < head; pos += record_bytes(rec.len))
+        {
+            pos = record_at(fr, pos, &rec);
+            if (pos >= head)
+                break;
+            newest_ns = rec.arrival_ns;
+        }
+    }
+
+    printf("Flight recorder: %.1f MB ring holding %.1f s, %llu packets and",
+            fr->size / 1e6, (newest_ns - oldest_ns) / 1e9, fr->packets);
+    printf(" %llu bytes recorded, %llu too large, %lu dumps\n", fr->bytes,
+            fr->too_big, fr->dumps);
+}
+
+void flightrec_close(flightrec_t *fr)
+{
+    if (fr->running)
+    {
+        fr->stop = 1;
+        sem_post(&fr->trigger);
+        pthread_join(fr->thread, NULL);
+        sem_destroy(&fr->trigger);
+        fr->running = 0;
+    }
+
+    free(fr->buf);
+    free(fr->scratch);
+    fr->buf = NULL;
+    fr->scratch = NULL;
+}
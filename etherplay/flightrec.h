@@ -0,0 +1,170 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _FLIGHTREC_H
+#define _FLIGHTREC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/** @file flightrec.h
+ *
+ * Flight recorder of etherplay, enabled with --flight, which keeps the
+ * last minutes of received datagrams and their kernel arrival times, so
+ * that the packets leading up to a glitch can be looked at afterwards.
+ *
+ * The receive thread copies each datagram into a ring allocated and
+ * faulted in up front, overwriting the oldest, and is never held up by a
+ * dump.  A dump is asked for on SIGUSR1 or on an underrun, and written by
+ * a thread of its own to a playback database named after the time, which
+ * etherreplay, etherdb -x and packet_player take.  A record overwritten
+ * while it is being dumped is left out of the dump.
+ */
+
+/* the ring holds this many times the packets of the nominal rate */
+#define FLIGHTREC_HEADROOM      2
+
+/* underruns closer than this to the last one they dumped are not dumped */
+#define FLIGHTREC_HOLDOFF_SEC   60
+
+#define FLIGHTREC_RECORD_MAX    65536
+#define FLIGHTREC_NAME_MAX      200
+
+/* reasons for a dump */
+enum
+{
+    FLIGHTREC_SIGNAL, FLIGHTREC_UNDERRUN
+};
+
+typedef struct
+{
+  /* configuration */
+  int enabled;
+  double minutes;
+  char name[FLIGHTREC_NAME_MAX];
+
+  /* the ring of records, at logical byte offsets that only grow, from the
+   * oldest record kept (tail) to the end of the newest (head) */
+  unsigned char *buf;
+  size_t size;
+  uint64_t head;
+  uint64_t tail;
+
+  /* written by the receive thread */
+  unsigned long long packets;
+  unsigned long long bytes;
+  unsigned long long too_big;
+
+  /* the dump thread, and the dump asked of it */
+  pthread_t thread;
+  sem_t trigger;
+  int running;
+  int stop;
+  volatile sig_atomic_t pending;
+  volatile sig_atomic_t reason;
+  time_t last_underrun;
+  unsigned char *scratch;
+  unsigned long dumps;
+}
+flightrec_t;
+
+/**
+ * Initialize the flight recorder, disabled.
+ *
+ * @param fr a pointer to the flight recorder structure.
+ */
+void flightrec_init(flightrec_t *fr);
+
+/**
+ * Handle a long command line option, --flight=minutes[,name], the name
+ * dumps start with being flight by default.
+ *
+ * @param fr a pointer to the flight recorder structure.
+ * @param arg the command line argument.
+ *
+ * @return 0 on success, -1 if the option is not recognized.
+ */
+int flightrec_option(flightrec_t *fr, const char *arg);
+
+/**
+ * Allocate and fault in the ring, sized for the configured minutes of
+ * packets at the nominal rate, and start the dump thread.  Does nothing
+ * unless enabled.
+ *
+ * @param fr a pointer to the flight recorder structure.
+ * @param packets_per_sec the nominal packet rate.
+ * @param packet_bytes the nominal packet size.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int flightrec_start(flightrec_t *fr, double packets_per_sec,
+        size_t packet_bytes);
+
+/**
+ * Record a datagram, from the receive thread only.  Never blocks or
+ * allocates.
+ *
+ * @param fr a pointer to the flight recorder structure.
+ * @param arrival the arrival time, CLOCK_REALTIME.
+ * @param iov the buffers the datagram was received into.
+ * @param iovcnt the number of buffers.
+ * @param len the datagram size, of which what fits in the buffers is kept.
+ */
+void flightrec_add(flightrec_t *fr, const struct timespec *arrival,
+        const struct iovec *iov, int iovcnt, size_t len);
+
+/**
+ * Ask for a dump.  Safe to call from a signal handler, and ignored while
+ * a dump is under way.
+ *
+ * @param fr a pointer to the flight recorder structure.
+ * @param reason FLIGHTREC_SIGNAL or FLIGHTREC_UNDERRUN.
+ */
+void flightrec_trigger(flightrec_t *fr, int reason);
+
+/**
+ * Print the ring size and what it holds.
+ *
+ * @param fr a pointer to the flight recorder structure.
+ */
+void flightrec_report(const flightrec_t *fr);
+
+/**
+ * Stop the dump thread and free the ring.
+ *
+ * @param fr a pointer to the flight recorder structure.
+ */
+void flightrec_close(flightrec_t *fr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
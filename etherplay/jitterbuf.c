@@ -0,0 +1,163 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include "jitterbuf.h"
+
+/* Target depth in units of the smoothed jitter */
+#define JB_JITTER_MULT     3.0
+
+/* Time constant of the delay variation peak hold */
+#define JB_PEAK_DECAY_MS   10000.0
+
+/* Arrival gaps longer than this start a new talk spurt */
+#define JB_SPURT_GAP_MS    1000.0
+
+/* Window over which the fill level must stay above target to shrink */
+#define JB_WINDOW_MS       2000.0
+
+/* Clean playout time before one packet of underrun boost is removed */
+#define JB_BOOST_DECAY_MS  10000.0
+
+static double clamp(const jitterbuf_t *jb, double ms)
+{
+    if (ms < jb->min_ms)
+        return jb->min_ms;
+    if (ms > jb->max_ms)
+        return jb->max_ms;
+    return ms;
+}
+
+void jitterbuf_init(jitterbuf_t *jb, double packet_ms, double target_ms,
+        double min_ms, double max_ms)
+{
+    memset(jb, 0, sizeof(jitterbuf_t));
+
+    jb->packet_ms = packet_ms;
+    jb->min_ms = min_ms;
+    jb->max_ms = max_ms;
+
+    /* Seed the jitter estimate so that the initial target is the
+     * configured one, and let the measurements take over from there. */
+    jb->jitter_ms = (clamp(jb, target_ms) - packet_ms) / JB_JITTER_MULT;
+    if (jb->jitter_ms < 0)
+        jb->jitter_ms = 0;
+
+    jb->window_start_ms = -1;
+}
+
+void jitterbuf_arrival(jitterbuf_t *jb, double arrival_ms,
+        double timestamp_ms)
+{
+    double expected, delta, variation, peak;
+
+    if (jb->have_arrival)
+    {
+        delta = arrival_ms - jb->last_arrival_ms;
+
+        if ((timestamp_ms >= 0) && (jb->last_timestamp_ms >= 0))
+            expected = timestamp_ms - jb->last_timestamp_ms;
+        else
+            expected = jb->packet_ms;
+
+        /* A long silence from the sender is not network jitter */
+        if (delta - expected < JB_SPURT_GAP_MS)
+        {
+            variation = fabs(delta - expected);
+            jb->jitter_ms += (variation - jb->jitter_ms) / 16.0;
+
+            peak = jb->peak_ms * exp(-delta / JB_PEAK_DECAY_MS);
+            if (variation > peak)
+                peak = variation;
+            jb->peak_ms = peak;
+        }
+    }
+
+    jb->last_arrival_ms = arrival_ms;
+    jb->last_timestamp_ms = timestamp_ms;
+    jb->have_arrival = 1;
+}
+
+double jitterbuf_target(const jitterbuf_t *jb)
+{
+    double depth = jb->jitter_ms * JB_JITTER_MULT;
+
+    if (jb->peak_ms > depth)
+        depth = jb->peak_ms;
+
+    return clamp(jb, depth + jb->packet_ms + jb->boost_ms);
+}
+
+void jitterbuf_underrun(jitterbuf_t *jb, double now_ms)
+{
+    jb->underruns++;
+    jb->last_underrun_ms = now_ms;
+
+    jb->boost_ms += jb->packet_ms;
+    if (jb->boost_ms > jb->max_ms)
+        jb->boost_ms = jb->max_ms;
+
+    /* Start a new shrink window once playout resumes */
+    jb->window_start_ms = -1;
+}
+
+int jitterbuf_fill(jitterbuf_t *jb, double fill_ms, double now_ms)
+{
+    int drop = 0;
+
+    /* Let the underrun boost decay once playout has been clean a while */
+    if ((jb->boost_ms > 0)
+            && (now_ms - jb->last_underrun_ms > JB_BOOST_DECAY_MS))
+    {
+        jb->boost_ms -= jb->packet_ms;
+        if (jb->boost_ms < 0)
+            jb->boost_ms = 0;
+        jb->last_underrun_ms = now_ms;
+    }
+
+    if (jb->window_start_ms < 0)
+    {
+        jb->window_start_ms = now_ms;
+        jb->window_min_fill_ms = fill_ms;
+        return 0;
+    }
+
+    if (fill_ms < jb->window_min_fill_ms)
+        jb->window_min_fill_ms = fill_ms;
+
+    if (now_ms - jb->window_start_ms >= JB_WINDOW_MS)
+    {
+        /* The buffer never drained below target + one packet for the
+         * whole window, so a packet of latency can be given back. */
+        if (jb->window_min_fill_ms - jitterbuf_target(jb) >= jb->packet_ms)
+        {
+            jb->drops++;
+            drop = 1;
+        }
+
+        jb->window_start_ms = now_ms;
+        jb->window_min_fill_ms = fill_ms;
+    }
+
+    return drop;
+}
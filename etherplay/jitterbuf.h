@@ -0,0 +1,126 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _JITTERBUF_H
+#define _JITTERBUF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @file jitterbuf.h
+ *
+ * Adaptive playout depth for etherplay's ring buffer.
+ *
+ * The receive thread reports packet arrival times with
+ * jitterbuf_arrival(), which keeps an RFC 3550 style smoothed
+ * inter-arrival jitter together with a slowly decaying peak of the
+ * delay variation.  The playout thread asks for the current target depth
+ * with jitterbuf_target(), reports underruns with jitterbuf_underrun(),
+ * and reports the fill level once per period with jitterbuf_fill(),
+ * which tells it when the buffer has been deeper than needed for long
+ * enough that a packet can be dropped to bring the latency back down.
+ *
+ * All times are in milliseconds.  The target is always kept within the
+ * configured min/max bounds.
+ */
+
+typedef struct
+{
+  /* configuration */
+  double min_ms;
+  double max_ms;
+  double packet_ms;
+
+  /* receive thread state */
+  volatile double jitter_ms;
+  volatile double peak_ms;
+  double last_arrival_ms;
+  double last_timestamp_ms;
+  int have_arrival;
+
+  /* playout thread state */
+  double boost_ms;
+  double window_start_ms;
+  double window_min_fill_ms;
+  double last_underrun_ms;
+  unsigned long underruns;
+  unsigned long drops;
+}
+jitterbuf_t;
+
+/**
+ * Initialize the jitter buffer state.
+ *
+ * @param jb a pointer to the jitter buffer structure.
+ * @param packet_ms the playout duration of one audio packet.
+ * @param target_ms the initial target depth, used until the jitter
+ * estimate has settled.
+ * @param min_ms the lower bound of the target depth.
+ * @param max_ms the upper bound of the target depth.
+ */
+void jitterbuf_init(jitterbuf_t *jb, double packet_ms, double target_ms,
+        double min_ms, double max_ms);
+
+/**
+ * Account for the arrival of one packet.  Called from the receive thread.
+ *
+ * @param jb a pointer to the jitter buffer structure.
+ * @param arrival_ms the arrival time of the packet.
+ * @param timestamp_ms the sender's media time of the packet, or a
+ * negative value to assume packets are sent back to back.
+ */
+void jitterbuf_arrival(jitterbuf_t *jb, double arrival_ms,
+        double timestamp_ms);
+
+/**
+ * Return the current target depth of the buffer.
+ *
+ * @param jb a pointer to the jitter buffer structure.
+ */
+double jitterbuf_target(const jitterbuf_t *jb);
+
+/**
+ * Account for a playout underrun, raising the target depth.
+ *
+ * @param jb a pointer to the jitter buffer structure.
+ * @param now_ms the current time.
+ */
+void jitterbuf_underrun(jitterbuf_t *jb, double now_ms);
+
+/**
+ * Report the fill level after a period has been played out.
+ *
+ * @param jb a pointer to the jitter buffer structure.
+ * @param fill_ms the buffered audio, in milliseconds.
+ * @param now_ms the current time.
+ *
+ * @return the number of packets that should be dropped from the buffer
+ * to shrink it toward the target depth.
+ */
+int jitterbuf_fill(jitterbuf_t *jb, double fill_ms, double now_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
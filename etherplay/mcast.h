@@ -0,0 +1,143 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _MCAST_H
+#define _MCAST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <net/if.h>
+#include <netinet/in.h>
+
+/** @file mcast.h
+ *
+ * IPv4 multicast for the senders and etherplay, so that a single packet
+ * reaches any number of receivers.  Senders send to a group address given
+ * with -d as to any other, with the TTL, outgoing interface and loopback
+ * of their packets set by long options.  etherplay joins groups, any
+ * source or only the sources given, and receives only the groups it
+ * joined on its port.  The same files are shared by every tool.
+ */
+
+#define MCAST_GROUPS_MAX    16
+#define MCAST_SOURCES_MAX   16
+
+typedef struct
+{
+  /* sender settings, -1 for the kernel's default */
+  int ttl;
+  int loop;
+
+  /* the interface sent from and joined on, by name or address, empty for
+   * the one routed to */
+  char iface[64];
+
+  /* groups joined, from any of the sources, none for any source */
+  struct in_addr groups[MCAST_GROUPS_MAX];
+  int group_count;
+  struct in_addr sources[MCAST_SOURCES_MAX];
+  int source_count;
+}
+mcast_t;
+
+/**
+ * Initialize multicast settings, the kernel's defaults.
+ *
+ * @param m a pointer to the multicast structure.
+ */
+void mcast_init(mcast_t *m);
+
+/**
+ * Handle a long command line option, --mcast-ttl=n, --mcast-if=iface or
+ * --mcast-loop=0|1.
+ *
+ * @param m a pointer to the multicast structure.
+ * @param arg the command line argument.
+ *
+ * @return 0 on success, -1 if the option is not recognized.
+ */
+int mcast_option(mcast_t *m, const char *arg);
+
+/**
+ * Add a group to join.
+ *
+ * @param m a pointer to the multicast structure.
+ * @param arg the group address.
+ *
+ * @return 0 on success, -1 if it is not a multicast address or there are
+ * too many.
+ */
+int mcast_add_group(mcast_t *m, const char *arg);
+
+/**
+ * Add a source the groups are received from, which limits them to the
+ * sources added.
+ *
+ * @param m a pointer to the multicast structure.
+ * @param arg the source address.
+ *
+ * @return 0 on success, -1 if it is not an address or there are too many.
+ */
+int mcast_add_source(mcast_t *m, const char *arg);
+
+/**
+ * Apply the sender settings to a socket.  Does nothing for settings left
+ * at their defaults.
+ *
+ * @param m a pointer to the multicast structure.
+ * @param sock the socket.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int mcast_sender(const mcast_t *m, int sock);
+
+/**
+ * Join the groups on a bound socket, from their sources when given, and
+ * stop it receiving groups joined by other sockets on the same port.
+ * Does nothing without groups.
+ *
+ * @param m a pointer to the multicast structure.
+ * @param sock the socket.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int mcast_join(const mcast_t *m, int sock);
+
+/**
+ * Check whether an address is a multicast group.
+ *
+ * @param addr the address, in network byte order.
+ *
+ * @return nonzero if it is.
+ */
+static inline int mcast_is_group(const struct in_addr *addr)
+{
+    return IN_MULTICAST(ntohl(addr->s_addr));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
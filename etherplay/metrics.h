@@ -0,0 +1,227 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+
+/** @file metrics.h
+ *
+ * Runtime metrics, served with --metrics on etherplay, ethermic, etherptt
+ * and ethersend.  The same files are shared by all of those tools.
+ *
+ * Counters, gauges and histograms are registered at startup and updated
+ * by the audio and network threads with plain relaxed atomic stores, so
+ * an update costs no more than the increment it replaces.  Each metric
+ * must be updated by one thread only; metrics of the same name told apart
+ * by their labels may be updated by different threads.
+ *
+ * A server thread of ordinary priority answers each connection to the
+ * configured UNIX or TCP socket with all of the metrics in the Prometheus
+ * text format, behind an HTTP response header when the request is an HTTP
+ * GET, so that both a scraper and "nc -U" can read them.  The server only
+ * loads the values, and never waits on the threads that update them.
+ */
+
+/* metric kinds */
+enum
+{
+    METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM
+};
+
+#define METRICS_MAX        48
+#define METRIC_BUCKETS_MAX 12
+#define METRIC_LABELS_MAX  64
+#define METRICS_ADDR_MAX   108
+
+typedef struct
+{
+  int kind;
+  const char *name;
+  const char *help;
+  char labels[METRIC_LABELS_MAX];
+
+  /* counter or gauge value */
+  unsigned long long value;
+
+  /* histogram of integer observations, reported divided by scale */
+  const unsigned long long *bounds;
+  int buckets;
+  double scale;
+  unsigned long long bucket[METRIC_BUCKETS_MAX + 1];
+  unsigned long long sum;
+}
+metric_t;
+
+typedef struct
+{
+  /* configuration, the server is off without an address */
+  char addr[METRICS_ADDR_MAX];
+  char labels[METRIC_LABELS_MAX];
+
+  /* registered metrics, and one that takes the updates of any beyond
+   * METRICS_MAX */
+  metric_t metric[METRICS_MAX];
+  int count;
+  metric_t spare;
+
+  /* server */
+  int listen_fd;
+  int unix_socket;
+  pthread_t thread;
+}
+metrics_t;
+
+/**
+ * Initialize the metrics, with the server off.
+ *
+ * @param mx a pointer to the metrics structure.
+ */
+void metrics_init(metrics_t *mx);
+
+/**
+ * Handle a long command line option, --metrics=unix:path or
+ * --metrics=[host:]port.  A TCP server listens on the loopback interface
+ * unless a host is given.
+ *
+ * @param mx a pointer to the metrics structure.
+ * @param arg the command line argument.
+ *
+ * @return 0 on success, -1 if the option is not recognized.
+ */
+int metrics_option(metrics_t *mx, const char *arg);
+
+/**
+ * Set labels reported with every metric, such as port="6502".
+ *
+ * @param mx a pointer to the metrics structure.
+ * @param labels the labels, comma separated, without braces.
+ */
+void metrics_labels(metrics_t *mx, const char *labels);
+
+/**
+ * Register a counter.  The name and help text must outlive the metrics.
+ *
+ * @param mx a pointer to the metrics structure.
+ * @param name the metric name, ending in _total by convention.
+ * @param help the help text.
+ * @param labels labels of this metric, or NULL.
+ *
+ * @return the counter, never NULL.
+ */
+metric_t *metrics_counter(metrics_t *mx, const char *name, const char *help,
+        const char *labels);
+
+/**
+ * Register a gauge.
+ *
+ * @param mx a pointer to the metrics structure.
+ * @param name the metric name.
+ * @param help the help text.
+ * @param labels labels of this metric, or NULL.
+ *
+ * @return the gauge, never NULL.
+ */
+metric_t *metrics_gauge(metrics_t *mx, const char *name, const char *help,
+        const char *labels);
+
+/**
+ * Register a histogram.
+ *
+ * @param mx a pointer to the metrics structure.
+ * @param name the metric name.
+ * @param help the help text.
+ * @param labels labels of this metric, or NULL.
+ * @param bounds ascending bucket upper bounds, in the unit observed, which
+ * must outlive the metrics.
+ * @param buckets the number of bounds, at most METRIC_BUCKETS_MAX.
+ * @param scale the observed unit per reported unit, such as 1e6 for
+ * observations in us reported in seconds.
+ *
+ * @return the histogram, never NULL.
+ */
+metric_t *metrics_histogram(metrics_t *mx, const char *name, const char *help,
+        const char *labels, const unsigned long long *bounds, int buckets,
+        double scale);
+
+/**
+ * Start the server thread, if an address was configured.  Call it before
+ * the real-time profile is applied, so the thread is not pinned with the
+ * caller.
+ *
+ * @param mx a pointer to the metrics structure.
+ *
+ * @return 0 on success, -1 if the socket could not be opened.
+ */
+int metrics_start(metrics_t *mx);
+
+/**
+ * Remove the socket file of a UNIX socket server.
+ *
+ * @param mx a pointer to the metrics structure.
+ */
+void metrics_close(metrics_t *mx);
+
+/* Updates, each by the one thread that owns the metric */
+
+static inline void metric_add(metric_t *m, unsigned long long n)
+{
+    __atomic_store_n(&m->value, m->value + n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_inc(metric_t *m)
+{
+    metric_add(m, 1);
+}
+
+static inline void metric_set(metric_t *m, unsigned long long v)
+{
+    __atomic_store_n(&m->value, v, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long metric_value(const metric_t *m)
+{
+    return __atomic_load_n(&m->value, __ATOMIC_RELAXED);
+}
+
+static inline void metric_observe(metric_t *m, unsigned long long v)
+{
+    int i = 0;
+
+    while ((i < m->buckets) && (v > m->bounds[i]))
+        i++;
+
+    __atomic_store_n(&m->bucket[i], m->bucket[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->sum, m->sum + v, __ATOMIC_RELAXED);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
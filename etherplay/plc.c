@@ -0,0 +1,262 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "plc.h"
+
+/* Pitch search range, 66 to 200 Hz */
+#define PLC_PITCH_MIN_HZ   200
+#define PLC_PITCH_MAX_HZ   66
+
+/* Speech concealment is held at full level, then faded out */
+#define PLC_SPEECH_HOLD_MS 10
+#define PLC_SPEECH_FADE_MS 50
+
+/* Music concealment crossfades to silence */
+#define PLC_MUSIC_FADE_MS  20
+
+/* Crossfade length at the replay loop point and on recovery */
+#define PLC_OLAP_MS        4
+
+int plc_init(plc_t *plc, int mode, unsigned int rate, unsigned int channels,
+        size_t period_frames)
+{
+    memset(plc, 0, sizeof(plc_t));
+
+    plc->mode = mode;
+    plc->channels = channels;
+    plc->olap_frames = rate * PLC_OLAP_MS / 1000;
+
+    if (mode == PLC_SPEECH)
+    {
+        plc->pitch_min = rate / PLC_PITCH_MIN_HZ;
+        plc->pitch_max = rate / PLC_PITCH_MAX_HZ;
+        plc->hold_frames = rate * PLC_SPEECH_HOLD_MS / 1000;
+        plc->fade_frames = rate * PLC_SPEECH_FADE_MS / 1000;
+
+        /* correlation window plus the longest lag, and the loop crossfade */
+        plc->hist_frames = 2 * plc->pitch_max + plc->pitch_max / 4;
+    }
+    else
+    {
+        plc->pitch_min = period_frames;
+        plc->pitch_max = period_frames;
+        plc->hold_frames = 0;
+        plc->fade_frames = rate * PLC_MUSIC_FADE_MS / 1000;
+        plc->hist_frames = period_frames + plc->olap_frames;
+    }
+
+    plc->hist = calloc(plc->hist_frames * channels, sizeof(int16_t));
+    plc->seg = calloc(plc->pitch_max * channels, sizeof(int16_t));
+    plc->olap = calloc(plc->olap_frames * channels, sizeof(int16_t));
+
+    if ((plc->hist == NULL) || (plc->seg == NULL) || (plc->olap == NULL))
+    {
+        plc_free(plc);
+        return -1;
+    }
+
+    return 0;
+}
+
+void plc_free(plc_t *plc)
+{
+    free(plc->hist);
+    free(plc->seg);
+    free(plc->olap);
+
+    plc->hist = NULL;
+    plc->seg = NULL;
+    plc->olap = NULL;
+}
+
+/* Lag in frames that best matches the end of the history with the
+ * waveform one lag earlier, by normalized autocorrelation of channel 0 */
+static size_t find_pitch(const plc_t *plc)
+{
+    const int16_t *hist = plc->hist;
+    size_t ch = plc->channels;
+    size_t win = plc->pitch_max;
+    size_t x = plc->hist_frames - win;
+    size_t lag, best_lag = plc->pitch_max, i;
+    double corr, energy, score, best_score = 0;
+
+    for (lag = plc->pitch_min; lag <= plc->pitch_max; lag++)
+    {
+        corr = 0;
+        energy = 0;
+
+        for (i = 0; i < win; i++)
+        {
+            double a = hist[(x + i) * ch];
+            double b = hist[(x + i - lag) * ch];
+
+            corr += a * b;
+            energy += b * b;
+        }
+
+        if ((corr <= 0) || (energy <= 0))
+            continue;
+
+        score = corr / sqrt(energy);
+        if (score > best_score)
+        {
+            best_score = score;
+            best_lag = lag;
+        }
+    }
+
+    return best_lag;
+}
+
+/* Take the last len frames of history as the waveform to replay.  Its
+ * tail is crossfaded with the frames preceding it, so that the loop point
+ * joins up smoothly. */
+static void build_segment(plc_t *plc, size_t len)
+{
+    size_t ch = plc->channels;
+    size_t start = plc->hist_frames - len;
+    size_t q = len / 4;
+    size_t i, c;
+    double w;
+
+    if (q > plc->olap_frames)
+        q = plc->olap_frames;
+
+    memcpy(plc->seg, plc->hist + start * ch, len * ch * sizeof(int16_t));
+
+    for (i = 0; i < q; i++)
+    {
+        w = (double) (i + 1) / (q + 1);
+
+        for (c = 0; c < ch; c++)
+            plc->seg[(len - q + i) * ch + c] = plc->hist[(start + len - q + i)
+                    * ch + c] * (1 - w) + plc->hist[(start - q + i) * ch + c]
+                    * w;
+    }
+
+    plc->seg_frames = len;
+    plc->seg_pos = 0;
+}
+
+static double gain(const plc_t *plc, size_t n)
+{
+    if (n < plc->hold_frames)
+        return 1.0;
+
+    n -= plc->hold_frames;
+    if (n >= plc->fade_frames)
+        return 0.0;
+
+    return 1.0 - (double) n / plc->fade_frames;
+}
+
+/* Continue the synthetic signal for the given number of frames */
+static void synthesize(plc_t *plc, int16_t *pcm, size_t frames)
+{
+    size_t ch = plc->channels;
+    size_t i, c;
+    double g;
+
+    for (i = 0; i < frames; i++)
+    {
+        g = gain(plc, plc->concealed++);
+
+        for (c = 0; c < ch; c++)
+            pcm[i * ch + c] = plc->seg[plc->seg_pos * ch + c] * g;
+
+        if (++plc->seg_pos == plc->seg_frames)
+            plc->seg_pos = 0;
+    }
+}
+
+static void update_history(plc_t *plc, const int16_t *pcm, size_t frames)
+{
+    size_t ch = plc->channels;
+    size_t keep;
+
+    if (frames >= plc->hist_frames)
+    {
+        memcpy(plc->hist, pcm + (frames - plc->hist_frames) * ch,
+                plc->hist_frames * ch * sizeof(int16_t));
+        return;
+    }
+
+    keep = plc->hist_frames - frames;
+    memmove(plc->hist, plc->hist + frames * ch, keep * ch * sizeof(int16_t));
+    memcpy(plc->hist + keep * ch, pcm, frames * ch * sizeof(int16_t));
+}
+
+int plc_good(plc_t *plc, int16_t *pcm, size_t frames)
+{
+    size_t ch = plc->channels;
+    size_t n = plc->olap_frames;
+    size_t i, c;
+    double w;
+    int modified = 0;
+
+    if (plc->concealed > 0)
+    {
+        if (n > frames)
+            n = frames;
+
+        synthesize(plc, plc->olap, n);
+
+        for (i = 0; i < n; i++)
+        {
+            w = (double) (i + 1) / (n + 1);
+
+            for (c = 0; c < ch; c++)
+                pcm[i * ch + c] = pcm[i * ch + c] * w
+                        + plc->olap[i * ch + c] * (1 - w);
+        }
+
+        plc->concealed = 0;
+        modified = 1;
+    }
+
+    update_history(plc, pcm, frames);
+
+    return modified;
+}
+
+int plc_conceal(plc_t *plc, int16_t *pcm, size_t frames)
+{
+    int audible = plc->concealed < plc->hold_frames + plc->fade_frames;
+
+    if (plc->concealed == 0)
+    {
+        if (plc->mode == PLC_SPEECH)
+            build_segment(plc, find_pitch(plc));
+        else
+            build_segment(plc, plc->pitch_max);
+
+        plc->episodes++;
+    }
+
+    synthesize(plc, pcm, frames);
+    plc->periods++;
+
+    return audible;
+}
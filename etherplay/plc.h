@@ -0,0 +1,134 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _PLC_H
+#define _PLC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** @file plc.h
+ *
+ * Packet loss concealment for etherplay's playout path, working on
+ * interleaved 16 bit linear samples.
+ *
+ * Every period that is played is passed through plc_good(), which keeps
+ * a short history of the output.  When a period is missing, plc_conceal()
+ * synthesizes a replacement from that history.
+ *
+ * In PLC_SPEECH mode the pitch period of the history is found by
+ * normalized autocorrelation, and the last pitch period is replayed,
+ * held at full level for 10 ms and then faded out over 50 ms.  In
+ * PLC_MUSIC mode the last period is replayed while it crossfades to
+ * silence over 20 ms.  The first good period after a loss is crossfaded
+ * with the continued synthetic signal.
+ */
+
+enum
+{
+    PLC_SPEECH, PLC_MUSIC
+};
+
+typedef struct
+{
+  /* configuration */
+  int mode;
+  unsigned int channels;
+  size_t pitch_min;
+  size_t pitch_max;
+  size_t hold_frames;
+  size_t fade_frames;
+  size_t olap_frames;
+
+  /* history of the played output */
+  int16_t *hist;
+  size_t hist_frames;
+
+  /* waveform being replayed, and the frames concealed so far */
+  int16_t *seg;
+  size_t seg_frames;
+  size_t seg_pos;
+  size_t concealed;
+
+  /* continuation of the synthetic signal, for the recovery crossfade */
+  int16_t *olap;
+
+  /* statistics */
+  unsigned long episodes;
+  unsigned long periods;
+}
+plc_t;
+
+/**
+ * Initialize the loss concealment state.
+ *
+ * @param plc a pointer to the loss concealment structure.
+ * @param mode PLC_SPEECH or PLC_MUSIC.
+ * @param rate the sample rate in Hz.
+ * @param channels the number of interleaved channels.
+ * @param period_frames the number of frames per period.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int plc_init(plc_t *plc, int mode, unsigned int rate, unsigned int channels,
+        size_t period_frames);
+
+/**
+ * Free the memory allocated by plc_init().
+ *
+ * @param plc a pointer to the loss concealment structure.
+ */
+void plc_free(plc_t *plc);
+
+/**
+ * Account for a period of received audio about to be played.  If it ends
+ * a concealed stretch, the start of the period is crossfaded in place.
+ *
+ * @param plc a pointer to the loss concealment structure.
+ * @param pcm the samples of the period.
+ * @param frames the number of frames in the period.
+ *
+ * @return 1 if the samples were modified, 0 otherwise.
+ */
+int plc_good(plc_t *plc, int16_t *pcm, size_t frames);
+
+/**
+ * Synthesize a period of audio in place of a missing one.
+ *
+ * @param plc a pointer to the loss concealment structure.
+ * @param pcm the buffer to fill.
+ * @param frames the number of frames in the period.
+ *
+ * @return 1 if the period holds audible concealment, 0 once it has
+ * faded to silence.
+ */
+int plc_conceal(plc_t *plc, int16_t *pcm, size_t frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "resample.h"
+
+/* Cutoff relative to the Nyquist frequency, leaving room for the ratio */
+#define RESAMPLE_CUTOFF    0.95
+
+#define HALF               (RESAMPLE_TAPS / 2)
+
+static double sinc(double x)
+{
+    if (fabs(x) < 1e-9)
+        return 1.0;
+
+    return sin(M_PI * x) / (M_PI * x);
+}
+
+static double blackman(double x)
+{
+    if (fabs(x) >= 1.0)
+        return 0.0;
+
+    return 0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2 * M_PI * x);
+}
+
+/* Phase p holds the taps for an output frame p / RESAMPLE_PHASES of a frame
+ * past the input frame under tap HALF - 1, with one extra phase so that
+ * the interpolation never reads past the table.  Every phase is normalized
+ * to unity gain. */
+static void make_filter(float *filter)
+{
+    int p, k;
+    double d, sum, h[RESAMPLE_TAPS];
+
+    for (p = 0; p <= RESAMPLE_PHASES; p++)
+    {
+        sum = 0;
+        for (k = 0; k < RESAMPLE_TAPS; k++)
+        {
+            d = k - (HALF - 1) - (double) p / RESAMPLE_PHASES;
+            h[k] = RESAMPLE_CUTOFF * sinc(RESAMPLE_CUTOFF * d)
+                    * blackman(d / HALF);
+            sum += h[k];
+        }
+
+        for (k = 0; k < RESAMPLE_TAPS; k++)
+            filter[p * RESAMPLE_TAPS + k] = h[k] / sum;
+    }
+}
+
+int resample_init(resample_t *rs, unsigned int channels, size_t max_in_frames)
+{
+    memset(rs, 0, sizeof(resample_t));
+
+    rs->channels = channels;
+    rs->buf_cap = max_in_frames + 2 * RESAMPLE_TAPS;
+
+    rs->filter = malloc((RESAMPLE_PHASES + 1) * RESAMPLE_TAPS * sizeof(float));
+    rs->buf = calloc(rs->buf_cap * channels, sizeof(float));
+    if ((rs->filter == NULL) || (rs->buf == NULL))
+    {
+        resample_free(rs);
+        return -1;
+    }
+
+    make_filter(rs->filter);
+
+    /* Start with silence under the leading taps */
+    rs->buf_frames = HALF - 1;
+    rs->pos = HALF - 1;
+
+    return 0;
+}
+
+void resample_free(resample_t *rs)
+{
+    free(rs->filter);
+    free(rs->buf);
+
+    rs->filter = NULL;
+    rs->buf = NULL;
+}
+
+size_t resample_process(resample_t *rs, const int16_t *in, size_t in_frames,
+        int16_t *out, size_t max_out, double ratio)
+{
+    size_t ch = rs->channels;
+    size_t produced = 0;
+    size_t i, n, drop;
+    unsigned int c;
+    float h[RESAMPLE_TAPS];
+    const float *f0, *f1, *x;
+    double phase, acc;
+    float t;
+    int p, k;
+
+    if (rs->buf_frames + in_frames > rs->buf_cap)
+        in_frames = rs->buf_cap - rs->buf_frames;
+
+    for (i = 0, n = in_frames * ch; i < n; i++)
+        rs->buf[rs->buf_frames * ch + i] = in[i];
+    rs->buf_frames += in_frames;
+
+    /* Produce output while the trailing tap is inside the buffer */
+    while ((produced < max_out) && (rs->pos + HALF < rs->buf_frames))
+    {
+        i = (size_t) rs->pos;
+        phase = (rs->pos - i) * RESAMPLE_PHASES;
+        p = (int) phase;
+        t = phase - p;
+
+        f0 = rs->filter + p * RESAMPLE_TAPS;
+        f1 = f0 + RESAMPLE_TAPS;
+        for (k = 0; k < RESAMPLE_TAPS; k++)
+            h[k] = f0[k] + (f1[k] - f0[k]) * t;
+
+        x = rs->buf + (i - (HALF - 1)) * ch;
+        for (c = 0; c < ch; c++)
+        {
+            acc = 0;
+            for (k = 0; k < RESAMPLE_TAPS; k++)
+                acc += h[k] * x[k * ch + c];
+
+            if (acc > 32767)
+                acc = 32767;
+            else if (acc < -32768)
+                acc = -32768;
+            out[produced * ch + c] = lrint(acc);
+        }
+
+        produced++;
+        rs->pos += ratio;
+    }
+
+    /* Discard the input that no future output frame reaches */
+    drop = (size_t) rs->pos - (HALF - 1);
+    if (drop > rs->buf_frames)
+        drop = rs->buf_frames;
+    memmove(rs->buf, rs->buf + drop * ch,
+            (rs->buf_frames - drop) * ch * sizeof(float));
+    rs->buf_frames -= drop;
+    rs->pos -= drop;
+
+    return produced;
+}
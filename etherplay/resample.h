@@ -0,0 +1,96 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** @file resample.h
+ *
+ * Fractional resampler for small, slowly varying rate ratios, used by
+ * etherplay to absorb the clock drift between sender and playback device.
+ *
+ * Each output frame is interpolated with a 32 tap Blackman windowed sinc,
+ * whose coefficients are linearly interpolated between 128 precomputed
+ * filter phases.  The ratio may be changed on every call.
+ */
+
+#define RESAMPLE_TAPS      32
+#define RESAMPLE_PHASES    128
+
+typedef struct
+{
+  unsigned int channels;
+  float *filter;
+  float *buf;
+  size_t buf_frames;
+  size_t buf_cap;
+  double pos;
+}
+resample_t;
+
+/**
+ * Initialize the resampler.
+ *
+ * @param rs a pointer to the resampler structure.
+ * @param channels the number of interleaved channels.
+ * @param max_in_frames the largest number of frames passed to one call of
+ * resample_process().
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int resample_init(resample_t *rs, unsigned int channels, size_t max_in_frames);
+
+/**
+ * Free the memory allocated by resample_init().
+ *
+ * @param rs a pointer to the resampler structure.
+ */
+void resample_free(resample_t *rs);
+
+/**
+ * Resample a block of interleaved 16 bit samples.
+ *
+ * @param rs a pointer to the resampler structure.
+ * @param in the input samples.
+ * @param in_frames the number of input frames.
+ * @param out the buffer for the output samples.
+ * @param max_out the capacity of the output buffer in frames, which should
+ * be somewhat more than in_frames / ratio.
+ * @param ratio input frames consumed per output frame, near 1.
+ *
+ * @return the number of output frames produced.
+ */
+size_t resample_process(resample_t *rs, const int16_t *in, size_t in_frames,
+        int16_t *out, size_t max_out, double ratio);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
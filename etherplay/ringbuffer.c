@@ -20,6 +20,7 @@
   This is safe for the case of one read thread and one write thread.
 */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #ifdef USE_MLOCK
@@ -27,6 +28,10 @@
 #endif /* USE_MLOCK */
 #include "ringbuffer.h"
 
+/* The read and write pointers count bytes from the start and are never
+   wrapped, only their offsets into the buffer are, so the buffer can be
+   filled completely and a stale cached pointer can be told apart. */
+
 /* Create a new ringbuffer to hold at least `sz' bytes of data. The
    actual buffer size is rounded up to the next power of two.  */
 
@@ -35,18 +40,23 @@ ringbuffer_create (size_t sz)
 {
 	int power_of_two;
 	ringbuffer_t *rb;
+	void *mem;
 	
-	if ((rb = malloc (sizeof (ringbuffer_t))) == NULL) {
+	if (posix_memalign (&mem, RINGBUFFER_CACHE_LINE,
+			    sizeof (ringbuffer_t))) {
 		return NULL;
 	}
+	rb = mem;
 	
 	for (power_of_two = 1; 1 << power_of_two < sz; power_of_two++);
 	
 	rb->size = 1 << power_of_two;
 	rb->size_mask = rb->size;
 	rb->size_mask -= 1;
-	rb->write_ptr = 0;
-	rb->read_ptr = 0;
+	atomic_init (&rb->write_ptr, 0);
+	atomic_init (&rb->read_ptr, 0);
+	rb->read_cache = 0;
+	rb->write_cache = 0;
 	if ((rb->buf = malloc (rb->size)) == NULL) {
 		free (rb);
 		return NULL;
@@ -90,8 +100,10 @@ ringbuffer_mlock (ringbuffer_t * rb)
 void
 ringbuffer_reset (ringbuffer_t * rb)
 {
-	rb->read_ptr = 0;
-	rb->write_ptr = 0;
+	atomic_store_explicit (&rb->read_ptr, 0, memory_order_relaxed);
+	atomic_store_explicit (&rb->write_ptr, 0, memory_order_relaxed);
+	rb->read_cache = 0;
+	rb->write_cache = 0;
 }
 
 /* Return the number of bytes available for reading.  This is the
@@ -103,14 +115,10 @@ ringbuffer_read_space (const ringbuffer_t * rb)
 {
 	size_t w, r;
 	
-	w = rb->write_ptr;
-	r = rb->read_ptr;
+	w = atomic_load_explicit (&rb->write_ptr, memory_order_acquire);
+	r = atomic_load_explicit (&rb->read_ptr, memory_order_acquire);
 	
-	if (w > r) {
-		return w - r;
-	} else {
-		return (w - r + rb->size) & rb->size_mask;
-	}
+	return w - r;
 }
 
 /* Return the number of bytes available for writing.  This is the
@@ -122,15 +130,78 @@ ringbuffer_write_space (const ringbuffer_t * rb)
 {
 	size_t w, r;
 
-	w = rb->write_ptr;
-	r = rb->read_ptr;
+	w = atomic_load_explicit (&rb->write_ptr, memory_order_acquire);
+	r = atomic_load_explicit (&rb->read_ptr, memory_order_acquire);
+
+	return rb->size - (w - r);
+}
+
+/* Bytes the reader at `r' can take.  The cached write pointer is only
+   reloaded when it does not cover `want', or when the read pointer has
+   been advanced past it.  */
 
-	if (w > r) {
-		return ((r - w + rb->size) & rb->size_mask) - 1;
-	} else if (w < r) {
-		return (r - w) - 1;
+static inline size_t
+reader_space (ringbuffer_t * rb, size_t r, size_t want)
+{
+	size_t avail = rb->write_cache - r;
+
+	if ((avail < want) || (avail > rb->size)) {
+		rb->write_cache = atomic_load_explicit (&rb->write_ptr,
+							memory_order_acquire);
+		avail = rb->write_cache - r;
+	}
+
+	return avail;
+}
+
+/* Bytes the writer at `w' can fill.  The cached read pointer is only
+   reloaded when it does not leave room for `want'.  */
+
+static inline size_t
+writer_space (ringbuffer_t * rb, size_t w, size_t want)
+{
+	size_t free_cnt = rb->size - (w - rb->read_cache);
+
+	if (free_cnt < want) {
+		rb->read_cache = atomic_load_explicit (&rb->read_ptr,
+						       memory_order_acquire);
+		free_cnt = rb->size - (w - rb->read_cache);
+	}
+
+	return free_cnt;
+}
+
+/* Copy `cnt' bytes out of the buffer from position `pos', which may
+   wrap around its end.  */
+
+static inline void
+copy_out (const ringbuffer_t * rb, size_t pos, char *dest, size_t cnt)
+{
+	size_t offset = pos & rb->size_mask;
+	size_t n1 = rb->size - offset;
+
+	if (n1 >= cnt) {
+		memcpy (dest, &(rb->buf[offset]), cnt);
+	} else {
+		memcpy (dest, &(rb->buf[offset]), n1);
+		memcpy (dest + n1, rb->buf, cnt - n1);
+	}
+}
+
+/* Copy `cnt' bytes into the buffer at position `pos', which may wrap
+   around its end.  */
+
+static inline void
+copy_in (ringbuffer_t * rb, size_t pos, const char *src, size_t cnt)
+{
+	size_t offset = pos & rb->size_mask;
+	size_t n1 = rb->size - offset;
+
+	if (n1 >= cnt) {
+		memcpy (&(rb->buf[offset]), src, cnt);
 	} else {
-		return rb->size - 1;
+		memcpy (&(rb->buf[offset]), src, n1);
+		memcpy (rb->buf, src + n1, cnt - n1);
 	}
 }
 
@@ -140,34 +211,19 @@ ringbuffer_write_space (const ringbuffer_t * rb)
 size_t
 ringbuffer_read (ringbuffer_t * rb, char *dest, size_t cnt)
 {
-	size_t free_cnt;
-	size_t cnt2;
-	size_t to_read;
-	size_t n1, n2;
+	size_t r, free_cnt, to_read;
+
+	r = atomic_load_explicit (&rb->read_ptr, memory_order_relaxed);
 
-	if ((free_cnt = ringbuffer_read_space (rb)) == 0) {
+	if ((free_cnt = reader_space (rb, r, cnt)) == 0) {
 		return 0;
 	}
 
 	to_read = cnt > free_cnt ? free_cnt : cnt;
 
-	cnt2 = rb->read_ptr + to_read;
-
-	if (cnt2 > rb->size) {
-		n1 = rb->size - rb->read_ptr;
-		n2 = cnt2 & rb->size_mask;
-	} else {
-		n1 = to_read;
-		n2 = 0;
-	}
-
-	memcpy (dest, &(rb->buf[rb->read_ptr]), n1);
-	rb->read_ptr = (rb->read_ptr + n1) & rb->size_mask;
-
-	if (n2) {
-		memcpy (dest + n1, &(rb->buf[rb->read_ptr]), n2);
-		rb->read_ptr = (rb->read_ptr + n2) & rb->size_mask;
-	}
+	copy_out (rb, r, dest, to_read);
+	atomic_store_explicit (&rb->read_ptr, r + to_read,
+			       memory_order_release);
 
 	return to_read;
 }
@@ -179,36 +235,17 @@ ringbuffer_read (ringbuffer_t * rb, char *dest, size_t cnt)
 size_t
 ringbuffer_peek (ringbuffer_t * rb, char *dest, size_t cnt)
 {
-	size_t free_cnt;
-	size_t cnt2;
-	size_t to_read;
-	size_t n1, n2;
-	size_t tmp_read_ptr;
+	size_t r, free_cnt, to_read;
 
-	tmp_read_ptr = rb->read_ptr;
+	r = atomic_load_explicit (&rb->read_ptr, memory_order_relaxed);
 
-	if ((free_cnt = ringbuffer_read_space (rb)) == 0) {
+	if ((free_cnt = reader_space (rb, r, cnt)) == 0) {
 		return 0;
 	}
 
 	to_read = cnt > free_cnt ? free_cnt : cnt;
 
-	cnt2 = tmp_read_ptr + to_read;
-
-	if (cnt2 > rb->size) {
-		n1 = rb->size - tmp_read_ptr;
-		n2 = cnt2 & rb->size_mask;
-	} else {
-		n1 = to_read;
-		n2 = 0;
-	}
-
-	memcpy (dest, &(rb->buf[tmp_read_ptr]), n1);
-	tmp_read_ptr = (tmp_read_ptr + n1) & rb->size_mask;
-
-	if (n2) {
-		memcpy (dest + n1, &(rb->buf[tmp_read_ptr]), n2);
-	}
+	copy_out (rb, r, dest, to_read);
 
 	return to_read;
 }
@@ -220,36 +257,72 @@ ringbuffer_peek (ringbuffer_t * rb, char *dest, size_t cnt)
 size_t
 ringbuffer_write (ringbuffer_t * rb, const char *src, size_t cnt)
 {
-	size_t free_cnt;
-	size_t cnt2;
-	size_t to_write;
-	size_t n1, n2;
+	size_t w, free_cnt, to_write;
+
+	w = atomic_load_explicit (&rb->write_ptr, memory_order_relaxed);
 
-	if ((free_cnt = ringbuffer_write_space (rb)) == 0) {
+	if ((free_cnt = writer_space (rb, w, cnt)) == 0) {
 		return 0;
 	}
 
 	to_write = cnt > free_cnt ? free_cnt : cnt;
 
-	cnt2 = rb->write_ptr + to_write;
+	copy_in (rb, w, src, to_write);
+	atomic_store_explicit (&rb->write_ptr, w + to_write,
+			       memory_order_release);
 
-	if (cnt2 > rb->size) {
-		n1 = rb->size - rb->write_ptr;
-		n2 = cnt2 & rb->size_mask;
-	} else {
-		n1 = to_write;
-		n2 = 0;
+	return to_write;
+}
+
+/* Copy up to `n' records of `size' bytes each into `rb', publishing
+   them all at once.  Returns the number of records copied. */
+
+size_t
+ringbuffer_push (ringbuffer_t * rb, const char *src, size_t size, size_t n)
+{
+	size_t w, free_cnt;
+
+	w = atomic_load_explicit (&rb->write_ptr, memory_order_relaxed);
+
+	free_cnt = writer_space (rb, w, size * n);
+	if (n > free_cnt / size) {
+		n = free_cnt / size;
+	}
+	if (n == 0) {
+		return 0;
 	}
 
-	memcpy (&(rb->buf[rb->write_ptr]), src, n1);
-	rb->write_ptr = (rb->write_ptr + n1) & rb->size_mask;
+	copy_in (rb, w, src, size * n);
+	atomic_store_explicit (&rb->write_ptr, w + size * n,
+			       memory_order_release);
 
-	if (n2) {
-		memcpy (&(rb->buf[rb->write_ptr]), src + n1, n2);
-		rb->write_ptr = (rb->write_ptr + n2) & rb->size_mask;
+	return n;
+}
+
+/* Copy up to `n' whole records of `size' bytes each from `rb', handing
+   their space back all at once.  Returns the number of records
+   copied. */
+
+size_t
+ringbuffer_pop (ringbuffer_t * rb, char *dest, size_t size, size_t n)
+{
+	size_t r, free_cnt;
+
+	r = atomic_load_explicit (&rb->read_ptr, memory_order_relaxed);
+
+	free_cnt = reader_space (rb, r, size * n);
+	if (n > free_cnt / size) {
+		n = free_cnt / size;
+	}
+	if (n == 0) {
+		return 0;
 	}
 
-	return to_write;
+	copy_out (rb, r, dest, size * n);
+	atomic_store_explicit (&rb->read_ptr, r + size * n,
+			       memory_order_release);
+
+	return n;
 }
 
 /* Advance the read pointer `cnt' places. */
@@ -257,8 +330,9 @@ ringbuffer_write (ringbuffer_t * rb, const char *src, size_t cnt)
 void
 ringbuffer_read_advance (ringbuffer_t * rb, size_t cnt)
 {
-	size_t tmp = (rb->read_ptr + cnt) & rb->size_mask;
-	rb->read_ptr = tmp;
+	size_t r = atomic_load_explicit (&rb->read_ptr, memory_order_relaxed);
+
+	atomic_store_explicit (&rb->read_ptr, r + cnt, memory_order_release);
 }
 
 /* Advance the write pointer `cnt' places. */
@@ -266,8 +340,9 @@ ringbuffer_read_advance (ringbuffer_t * rb, size_t cnt)
 void
 ringbuffer_write_advance (ringbuffer_t * rb, size_t cnt)
 {
-	size_t tmp = (rb->write_ptr + cnt) & rb->size_mask;
-	rb->write_ptr = tmp;
+	size_t w = atomic_load_explicit (&rb->write_ptr, memory_order_relaxed);
+
+	atomic_store_explicit (&rb->write_ptr, w + cnt, memory_order_release);
 }
 
 /* The non-copying data reader.  `vec' is an array of two places.  Set
@@ -276,39 +351,31 @@ ringbuffer_write_advance (ringbuffer_t * rb, size_t cnt)
    length.  */
 
 void
-ringbuffer_get_read_vector (const ringbuffer_t * rb,
+ringbuffer_get_read_vector (ringbuffer_t * rb,
 				 ringbuffer_data_t * vec)
 {
 	size_t free_cnt;
-	size_t cnt2;
-	size_t w, r;
+	size_t r, offset;
 
-	w = rb->write_ptr;
-	r = rb->read_ptr;
+	r = atomic_load_explicit (&rb->read_ptr, memory_order_relaxed);
+	free_cnt = reader_space (rb, r, SIZE_MAX);
+	offset = r & rb->size_mask;
 
-	if (w > r) {
-		free_cnt = w - r;
-	} else {
-		free_cnt = (w - r + rb->size) & rb->size_mask;
-	}
-
-	cnt2 = r + free_cnt;
+	if (offset + free_cnt > rb->size) {
 
-	if (cnt2 > rb->size) {
-
-		/* Two part vector: the rest of the buffer after the current write
+		/* Two part vector: the rest of the buffer after the current read
 		   ptr, plus some from the start of the buffer. */
 
-		vec[0].buf = &(rb->buf[r]);
-		vec[0].len = rb->size - r;
+		vec[0].buf = &(rb->buf[offset]);
+		vec[0].len = rb->size - offset;
 		vec[1].buf = rb->buf;
-		vec[1].len = cnt2 & rb->size_mask;
+		vec[1].len = free_cnt - vec[0].len;
 
 	} else {
 
 		/* Single part vector: just the rest of the buffer */
 
-		vec[0].buf = &(rb->buf[r]);
+		vec[0].buf = &(rb->buf[offset]);
 		vec[0].len = free_cnt;
 		vec[1].len = 0;
 	}
@@ -320,37 +387,27 @@ ringbuffer_get_read_vector (const ringbuffer_t * rb,
    length.  */
 
 void
-ringbuffer_get_write_vector (const ringbuffer_t * rb,
+ringbuffer_get_write_vector (ringbuffer_t * rb,
 				  ringbuffer_data_t * vec)
 {
 	size_t free_cnt;
-	size_t cnt2;
-	size_t w, r;
-
-	w = rb->write_ptr;
-	r = rb->read_ptr;
-
-	if (w > r) {
-		free_cnt = ((r - w + rb->size) & rb->size_mask) - 1;
-	} else if (w < r) {
-		free_cnt = (r - w) - 1;
-	} else {
-		free_cnt = rb->size - 1;
-	}
+	size_t w, offset;
 
-	cnt2 = w + free_cnt;
+	w = atomic_load_explicit (&rb->write_ptr, memory_order_relaxed);
+	free_cnt = writer_space (rb, w, SIZE_MAX);
+	offset = w & rb->size_mask;
 
-	if (cnt2 > rb->size) {
+	if (offset + free_cnt > rb->size) {
 
 		/* Two part vector: the rest of the buffer after the current write
 		   ptr, plus some from the start of the buffer. */
 
-		vec[0].buf = &(rb->buf[w]);
-		vec[0].len = rb->size - w;
+		vec[0].buf = &(rb->buf[offset]);
+		vec[0].len = rb->size - offset;
 		vec[1].buf = rb->buf;
-		vec[1].len = cnt2 & rb->size_mask;
+		vec[1].len = free_cnt - vec[0].len;
 	} else {
-		vec[0].buf = &(rb->buf[w]);
+		vec[0].buf = &(rb->buf[offset]);
 		vec[0].len = free_cnt;
 		vec[1].len = 0;
 	}
@@ -25,6 +25,7 @@
 extern "C" {
 #endif
 
+#include <stdatomic.h>
 #include <sys/types.h>
 
 /** @file ringbuffer.h
@@ -39,8 +40,17 @@ extern "C" {
  * mutual exclusion primitives.  For this to work correctly, there can
  * only be a single reader and a single writer thread.  Their
  * identities cannot be interchanged.
+ *
+ * The read and write pointers are C11 atomics.  The writer publishes data
+ * with a release store of the write pointer, which the reader loads with
+ * acquire semantics before touching the data, and likewise for space
+ * handed back by the reader.  Each side keeps its own pointer, and a
+ * cached copy of the other side's, on a cache line of its own, so that
+ * the two threads only share a line when the cached copy runs out.
  */
 
+#define RINGBUFFER_CACHE_LINE 64
+
 typedef struct  
 {
   char  *buf;
@@ -51,11 +61,17 @@ ringbuffer_data_t ;
 typedef struct
 {
   char		 *buf;
-  volatile size_t write_ptr;
-  volatile size_t read_ptr;
   size_t	  size;
   size_t	  size_mask;
   int		  mlocked;
+
+  /* writer side */
+  _Alignas(RINGBUFFER_CACHE_LINE) atomic_size_t write_ptr;
+  size_t	  read_cache;
+
+  /* reader side */
+  _Alignas(RINGBUFFER_CACHE_LINE) atomic_size_t read_ptr;
+  size_t	  write_cache;
 } 
 ringbuffer_t ;
 
@@ -99,7 +115,7 @@ void ringbuffer_free(ringbuffer_t *rb);
  * @param vec a pointer to a 2 element array of ringbuffer_data_t.
  *
  */
-void ringbuffer_get_read_vector(const ringbuffer_t *rb,
+void ringbuffer_get_read_vector(ringbuffer_t *rb,
 				     ringbuffer_data_t *vec);
 
 /**
@@ -121,7 +137,7 @@ void ringbuffer_get_read_vector(const ringbuffer_t *rb,
  * @param rb a pointer to the ringbuffer structure.
  * @param vec a pointer to a 2 element array of ringbuffer_data_t.
  */
-void ringbuffer_get_write_vector(const ringbuffer_t *rb,
+void ringbuffer_get_write_vector(ringbuffer_t *rb,
 				      ringbuffer_data_t *vec);
 
 /**
@@ -227,6 +243,36 @@ void ringbuffer_write_advance(ringbuffer_t *rb, size_t cnt);
  */
 size_t ringbuffer_write_space(const ringbuffer_t *rb);
 
+/**
+ * Write whole records, such as packets, into the ringbuffer.  Only as
+ * many records as fit completely are written, and they are published
+ * to the reader with a single write pointer advance.
+ *
+ * @param rb a pointer to the ringbuffer structure.
+ * @param src a pointer to the records, one after the other.
+ * @param size the size of each record in bytes.
+ * @param n the number of records to write.
+ *
+ * @return the number of records written, which may range from 0 to n.
+ */
+size_t ringbuffer_push(ringbuffer_t *rb, const char *src, size_t size,
+			    size_t n);
+
+/**
+ * Read whole records, such as packets, from the ringbuffer.  Only
+ * complete records are read, and their space is handed back to the
+ * writer with a single read pointer advance.
+ *
+ * @param rb a pointer to the ringbuffer structure.
+ * @param dest a pointer to a buffer for the records.
+ * @param size the size of each record in bytes.
+ * @param n the maximum number of records to read.
+ *
+ * @return the number of records read, which may range from 0 to n.
+ */
+size_t ringbuffer_pop(ringbuffer_t *rb, char *dest, size_t size,
+			   size_t n);
+
 
 #ifdef __cplusplus
 }
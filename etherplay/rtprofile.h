@@ -0,0 +1,171 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _RTPROFILE_H
+#define _RTPROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <time.h>
+
+/** @file rtprofile.h
+ *
+ * Real-time profile, enabled with --realtime on etherplay, ethermic,
+ * etherptt and etherreplay.  The same files are shared by all of those
+ * tools.
+ *
+ * Each audio thread calls rtprofile_thread() when it starts, which moves
+ * it to SCHED_FIFO at the priority of its role, pins it to the configured
+ * CPU, and pre-faults and locks its stack.  Buffers the threads work on
+ * are locked with rtprofile_lock().  Whatever cannot be had, for lack of
+ * privileges or limits, is reported and the thread carries on as before.
+ *
+ * Wakeup latency is measured with or without the profile, so that the
+ * two can be compared; --latency prints it on exit.
+ */
+
+/* thread roles */
+enum
+{
+    RT_AUDIO, RT_NET, RT_ROLES
+};
+
+/* SCHED_FIFO priority of each role, the device thread above the network */
+#define RT_PRIO_AUDIO      80
+#define RT_PRIO_NET        70
+
+#define RT_STACK_PREFAULT  (64 * 1024)
+
+/* wakeup latency histogram, bucket upper bounds in us */
+#define RT_LAT_BUCKETS     7
+
+typedef struct
+{
+  unsigned long count;
+  double sum_us;
+  double max_us;
+  unsigned long hist[RT_LAT_BUCKETS];
+}
+rt_latency_t;
+
+typedef struct
+{
+  /* configuration */
+  int enabled;
+  int report_latency;
+  int cpu[RT_ROLES];
+
+  /* memory locked by rtprofile_lock(), and what could not be */
+  size_t locked_bytes;
+  size_t unlocked_bytes;
+  int lock_errno;
+
+  /* wakeup latency, each updated only by the thread of its role */
+  rt_latency_t latency[RT_ROLES];
+}
+rtprofile_t;
+
+/**
+ * Initialize the profile, disabled and with no CPUs pinned.
+ *
+ * @param rt a pointer to the real-time profile structure.
+ */
+void rtprofile_init(rtprofile_t *rt);
+
+/**
+ * Handle a long command line option, --realtime[=cpu[,cpu]] or --latency.
+ * With one CPU both threads are pinned to it, with two the first is for
+ * the audio device thread and the second for the network thread.
+ *
+ * @param rt a pointer to the real-time profile structure.
+ * @param arg the command line argument.
+ *
+ * @return 0 on success, -1 if the option is not recognized.
+ */
+int rtprofile_option(rtprofile_t *rt, const char *arg);
+
+/**
+ * Apply the profile to the calling thread and report what it got.  Does
+ * nothing unless the profile is enabled.
+ *
+ * @param rt a pointer to the real-time profile structure.
+ * @param role RT_AUDIO or RT_NET.
+ * @param name the thread name for the report.
+ */
+void rtprofile_thread(rtprofile_t *rt, int role, const char *name);
+
+/**
+ * Lock a buffer in memory, when the profile is enabled.
+ *
+ * @param rt a pointer to the real-time profile structure.
+ * @param addr the start of the buffer.
+ * @param len the length of the buffer in bytes.
+ */
+void rtprofile_lock(rtprofile_t *rt, const void *addr, size_t len);
+
+/**
+ * Account for a buffer locked by other means, such as ringbuffer_mlock().
+ *
+ * @param rt a pointer to the real-time profile structure.
+ * @param len the length of the buffer in bytes.
+ * @param err 0 if it was locked, the errno otherwise.
+ */
+void rtprofile_locked(rtprofile_t *rt, size_t len, int err);
+
+/**
+ * Report the memory locked so far.  Does nothing unless the profile is
+ * enabled.
+ *
+ * @param rt a pointer to the real-time profile structure.
+ */
+void rtprofile_lock_report(const rtprofile_t *rt);
+
+/**
+ * Record the latency of a wakeup, from the time the thread was due to run
+ * until now.
+ *
+ * @param rt a pointer to the real-time profile structure.
+ * @param role the role of the calling thread.
+ * @param clock the clock the due time was taken from.
+ * @param due the time the thread was due to run.
+ */
+void rtprofile_wakeup(rtprofile_t *rt, int role, clockid_t clock,
+        const struct timespec *due);
+
+/**
+ * Print the wakeup latency statistics of a role.
+ *
+ * @param rt a pointer to the real-time profile structure.
+ * @param role RT_AUDIO or RT_NET.
+ * @param name the thread name.
+ */
+void rtprofile_latency_report(const rtprofile_t *rt, int role,
+        const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -lasound -lpthread -lrt -lX11
+LIBS := -lasound -lpthread -lrt -lX11 -lm
 
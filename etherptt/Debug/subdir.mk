@@ -7,9 +7,25 @@ CPP_SRCS += \
 ../ethermic.cpp \
 ../pushtotalk.cpp 
 
+C_SRCS += \
+../audiodev.c \
+../mcast.c \
+../metrics.c \
+../rtprofile.c 
+
 OBJS += \
+./audiodev.o \
 ./ethermic.o \
-./pushtotalk.o 
+./mcast.o \
+./metrics.o \
+./pushtotalk.o \
+./rtprofile.o 
+
+C_DEPS += \
+./audiodev.d \
+./mcast.d \
+./metrics.d \
+./rtprofile.d 
 
 CPP_DEPS += \
 ./ethermic.d \
@@ -17,6 +33,13 @@ CPP_DEPS += \
 
 
 # Each subdirectory must supply rules for building sources it contributes
+%.o: ../%.c
+	@echo 'Building file: $<'
+	@echo 'Invoking: GCC C Compiler'
+	gcc -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
 %.o: ../%.cpp
 	@echo 'Building file: $<'
 	@echo 'Invoking: GCC C++ Compiler'
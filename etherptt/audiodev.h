@@ -0,0 +1,242 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _AUDIODEV_H
+#define _AUDIODEV_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <alsa/asoundlib.h>
+#include <time.h>
+
+/** @file audiodev.h
+ *
+ * Audio backends that stand in for a sound card, selected with -B on
+ * etherplay, ethermic and etherptt.  The same files are shared by all of
+ * those tools.
+ *
+ * A backend runs a device clock of its own, paced in real time by
+ * CLOCK_MONOTONIC, with a buffer of the size the ALSA device would have
+ * had.  Playback starts once the start threshold is queued and underruns
+ * when the buffer runs dry, capture overruns when it is not read in time,
+ * so the tools behave as they do with a sound card.  The calls mirror the
+ * ALSA calls they replace, and the ALSA backend is left to the tools.
+ *
+ *    null          playback, discards the audio
+ *    probe         playback, discards the audio and prints the time each
+ *                  sound that follows silence will be heard, as
+ *                  "Onset <sec>.<nsec>" of CLOCK_MONOTONIC, for the
+ *                  latency benchmark
+ *    file=path     playback to a WAV file if the name ends in .wav, raw
+ *                  samples otherwise; capture from such a file, looped
+ *    tone[=hz]     capture of a sine tone, 1000 Hz by default
+ *
+ * Only the mu-law and 16 bit little endian formats are supported.
+ */
+
+enum
+{
+    AUDIODEV_ALSA, AUDIODEV_NULL, AUDIODEV_FILE, AUDIODEV_TONE,
+    AUDIODEV_PROBE
+};
+
+/* probe onset detection, on the first channel */
+#define AUDIODEV_PROBE_LOUD     8000
+#define AUDIODEV_PROBE_QUIET    1000
+#define AUDIODEV_PROBE_REARM_MS 100
+
+typedef struct
+{
+  /* configuration */
+  int type;
+  int capture;
+  const char *path;
+  double tone_hz;
+
+  /* stream parameters */
+  snd_pcm_format_t format;
+  unsigned int rate;
+  unsigned int channels;
+  size_t frame_bytes;
+  snd_pcm_uframes_t buffer_frames;
+  snd_pcm_uframes_t start_frames;
+
+  /* device clock, and the frames transferred since it started */
+  int running;
+  struct timespec start;
+  unsigned long long frames;
+
+  /* WAV or raw file */
+  int fd;
+  int wav;
+  off_t data_offset;
+  unsigned long long data_bytes;
+
+  /* tone generator */
+  double phase;
+
+  /* onset probe, and the frame of an onset before the clock started */
+  int armed;
+  unsigned long quiet;
+  long long onset;
+
+  /* statistics */
+  unsigned long long total_frames;
+  unsigned long xruns;
+}
+audiodev_t;
+
+/**
+ * Initialize the device to the ALSA backend.
+ *
+ * @param dev a pointer to the audio device structure.
+ * @param capture 1 for a capture device, 0 for playback.
+ */
+void audiodev_init(audiodev_t *dev, int capture);
+
+/**
+ * Select the backend from the argument of the -B option: alsa, null, probe,
+ * file=path or tone[=hz].
+ *
+ * @param dev a pointer to the audio device structure.
+ * @param arg the option argument.
+ *
+ * @return 0 on success, -1 if the backend is not recognized or does not
+ * suit the direction of the device.
+ */
+int audiodev_option(audiodev_t *dev, const char *arg);
+
+/**
+ * Open a backend other than ALSA, reporting any error.
+ *
+ * @param dev a pointer to the audio device structure.
+ * @param format SND_PCM_FORMAT_MU_LAW or SND_PCM_FORMAT_S16_LE.
+ * @param rate the sample rate in Hz.
+ * @param channels the number of interleaved channels.
+ * @param buffer_frames the size of the device buffer.
+ * @param start_frames the playback start threshold.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int audiodev_open(audiodev_t *dev, snd_pcm_format_t format, unsigned int rate,
+        unsigned int channels, snd_pcm_uframes_t buffer_frames,
+        snd_pcm_uframes_t start_frames);
+
+/**
+ * Finish the file, if any, and close the device.
+ *
+ * @param dev a pointer to the audio device structure.
+ */
+void audiodev_close(audiodev_t *dev);
+
+/**
+ * The name of the backend, for reports.
+ *
+ * @param dev a pointer to the audio device structure.
+ */
+const char *audiodev_name(const audiodev_t *dev);
+
+/**
+ * Frames that can be written without blocking, or read for capture.
+ *
+ * @param dev a pointer to the audio device structure.
+ */
+snd_pcm_sframes_t audiodev_avail(audiodev_t *dev);
+
+/**
+ * Frames queued ahead of the sound being played.
+ *
+ * @param dev a pointer to the audio device structure.
+ */
+snd_pcm_sframes_t audiodev_delay(audiodev_t *dev);
+
+/**
+ * Whether the device clock is running.
+ *
+ * @param dev a pointer to the audio device structure.
+ */
+int audiodev_running(audiodev_t *dev);
+
+/**
+ * Sleep until the given number of frames is available, as with poll on the
+ * descriptors of an ALSA device.
+ *
+ * @param dev a pointer to the audio device structure.
+ * @param frames the number of frames to wait for.
+ * @param timeout_ms the longest to wait.
+ *
+ * @return 1 if the frames are available, 0 on timeout.
+ */
+int audiodev_wait(audiodev_t *dev, snd_pcm_uframes_t frames, int timeout_ms);
+
+/**
+ * Write frames, blocking until the device has room for all of them.
+ *
+ * @param dev a pointer to the audio device structure.
+ * @param buf the interleaved frames.
+ * @param frames the number of frames.
+ *
+ * @return the number of frames written.
+ */
+snd_pcm_sframes_t audiodev_writei(audiodev_t *dev, const void *buf,
+        snd_pcm_uframes_t frames);
+
+/**
+ * Read frames, blocking until the device has captured all of them.
+ *
+ * @param dev a pointer to the audio device structure.
+ * @param buf the buffer for the interleaved frames.
+ * @param frames the number of frames.
+ *
+ * @return the number of frames read.
+ */
+snd_pcm_sframes_t audiodev_readi(audiodev_t *dev, void *buf,
+        snd_pcm_uframes_t frames);
+
+/**
+ * Stop the device clock, dropping anything queued, ready to start again.
+ *
+ * @param dev a pointer to the audio device structure.
+ */
+void audiodev_prepare(audiodev_t *dev);
+
+/**
+ * Sleep until everything queued has been played, and stop.
+ *
+ * @param dev a pointer to the audio device structure.
+ */
+void audiodev_drain(audiodev_t *dev);
+
+/**
+ * Print the frames transferred and the xruns.
+ *
+ * @param dev a pointer to the audio device structure.
+ */
+void audiodev_report(const audiodev_t *dev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <netdb.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+#define REQUEST_TIMEOUT_MS 100
+
+static const char http_header[] = "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Connection: close\r\n\r\n";
+
+void metrics_init(metrics_t *mx)
+{
+    memset(mx, 0, sizeof(metrics_t));
+    mx->listen_fd = -1;
+}
+
+int metrics_option(metrics_t *mx, const char *arg)
+{
+    if (strncmp(arg, "--metrics=", 10) != 0)
+        return -1;
+
+    arg += 10;
+    if ((*arg == '\0') || (strlen(arg) >= sizeof(mx->addr)))
+        return -1;
+
+    strcpy(mx->addr, arg);
+    return 0;
+}
+
+void metrics_labels(metrics_t *mx, const char *labels)
+{
+    snprintf(mx->labels, sizeof(mx->labels), "%s", labels);
+}
+
+static metric_t *add(metrics_t *mx, int kind, const char *name,
+        const char *help, const char *labels,
+        const unsigned long long *bounds, int buckets, double scale)
+{
+    metric_t *m;
+
+    if (mx->count == METRICS_MAX)
+    {
+        fprintf(stderr, "Too many metrics, %s not reported\n", name);
+        m = &mx->spare;
+    }
+    else
+        m = &mx->metric[mx->count];
+
+    memset(m, 0, sizeof(metric_t));
+    m->kind = kind;
+    m->name = name;
+    m->help = help;
+    snprintf(m->labels, sizeof(m->labels), "%s", labels ? labels : "");
+    m->bounds = bounds;
+    m->buckets = (buckets > METRIC_BUCKETS_MAX) ? METRIC_BUCKETS_MAX : buckets;
+    m->scale = scale;
+
+    /* publish it whole, to a server that may already be running */
+    if (m != &mx->spare)
+        __atomic_store_n(&mx->count, mx->count + 1, __ATOMIC_RELEASE);
+
+    return m;
+}
+
+metric_t *metrics_counter(metrics_t *mx, const char *name, const char *help,
+        const char *labels)
+{
+    return add(mx, METRIC_COUNTER, name, help, labels, NULL, 0, 1);
+}
+
+metric_t *metrics_gauge(metrics_t *mx, const char *name, const char *help,
+        const char *labels)
+{
+    return add(mx, METRIC_GAUGE, name, help, labels, NULL, 0, 1);
+}
+
+metric_t *metrics_histogram(metrics_t *mx, const char *name, const char *help,
+        const char *labels, const unsigned long long *bounds, int buckets,
+        double scale)
+{
+    return add(mx, METRIC_HISTOGRAM, name, help, labels, bounds, buckets,
+            scale);
+}
+
+/* Print the labels of a series, the common ones first, with an optional
+ * extra label such as the bucket bound */
+static void print_labels(FILE *f, const metrics_t *mx, const metric_t *m,
+        const char *extra)
+{
+    const char *sep = "";
+
+    if (!mx->labels[0] && !m->labels[0] && !extra)
+        return;
+
+    fputc('{', f);
+    if (mx->labels[0])
+    {
+        fputs(mx->labels, f);
+        sep = ",";
+    }
+    if (m->labels[0])
+    {
+        fprintf(f, "%s%s", sep, m->labels);
+        sep = ",";
+    }
+    if (extra)
+        fprintf(f, "%s%s", sep, extra);
+    fputc('}', f);
+}
+
+static void print_metric(FILE *f, const metrics_t *mx, const metric_t *m)
+{
+    unsigned long long n = 0;
+    char le[48];
+    int i;
+
+    if (m->kind != METRIC_HISTOGRAM)
+    {
+        fputs(m->name, f);
+        print_labels(f, mx, m, NULL);
+        fprintf(f, " %llu\n", metric_value(m));
+        return;
+    }
+
+    /* buckets are cumulative */
+    for (i = 0; i <= m->buckets; i++)
+    {
+        n += __atomic_load_n(&m->bucket[i], __ATOMIC_RELAXED);
+
+        if (i < m->buckets)
+            snprintf(le, sizeof(le), "le=\"%g\"", m->bounds[i] / m->scale);
+        else
+            strcpy(le, "le=\"+Inf\"");
+
+        fprintf(f, "%s_bucket", m->name);
+        print_labels(f, mx, m, le);
+        fprintf(f, " %llu\n", n);
+    }
+
+    fprintf(f, "%s_sum", m->name);
+    print_labels(f, mx, m, NULL);
+    fprintf(f, " %.9g\n",
+            __atomic_load_n(&m->sum, __ATOMIC_RELAXED) / m->scale);
+
+    fprintf(f, "%s_count", m->name);
+    print_labels(f, mx, m, NULL);
+    fprintf(f, " %llu\n", n);
+}
+
+/* All metrics in the text format, in a buffer the caller frees */
+static char *format_page(const metrics_t *mx, size_t *len)
+{
+    static const char *types[] =
+    { "counter", "gauge", "histogram" };
+    const metric_t *m;
+    char *page = NULL;
+    int count, i;
+    FILE *f;
+
+    f = open_memstream(&page, len);
+    if (f == NULL)
+        return NULL;
+
+    count = __atomic_load_n(&mx->count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < count; i++)
+    {
+        m = &mx->metric[i];
+
+        /* series of the same name are registered together */
+        if ((i == 0) || (strcmp(m->name, mx->metric[i - 1].name) != 0))
+        {
+            fprintf(f, "# HELP %s %s\n", m->name, m->help);
+            fprintf(f, "# TYPE %s %s\n", m->name, types[m->kind]);
+        }
+
+        print_metric(f, mx, m);
+    }
+
+    fclose(f);
+    return page;
+}
+
+static void send_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void *server_function(void *ptr)
+{
+    metrics_t *mx = (metrics_t *) ptr;
+    struct timeval timeout;
+    char request[512];
+    char *page;
+    size_t len;
+    ssize_t n;
+    int fd;
+
+    timeout.tv_sec = 0;
+    timeout.tv_usec = REQUEST_TIMEOUT_MS * 1000;
+
+    for (;;)
+    {
+        fd = accept(mx->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        /* A client that sends nothing just gets the metrics */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        n = recv(fd, request, sizeof(request) - 1, 0);
+        request[(n > 0) ? n : 0] = '\0';
+
+        page = format_page(mx, &len);
+        if (page != NULL)
+        {
+            if (strncmp(request, "GET ", 4) == 0)
+                send_all(fd, http_header, sizeof(http_header) - 1);
+            send_all(fd, page, len);
+            free(page);
+        }
+
+        close(fd);
+    }
+
+    return 0;
+}
+
+static int open_socket(metrics_t *mx)
+{
+    struct addrinfo hints, *res;
+    struct sockaddr_un sun;
+    char host[METRICS_ADDR_MAX];
+    const char *port;
+    int fd, err, enable = 1;
+
+    if (strncmp(mx->addr, "unix:", 5) == 0)
+    {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", mx->addr + 5);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+
+        /* left behind by a previous run */
+        unlink(sun.sun_path);
+        if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+
+        mx->unix_socket = 1;
+        return fd;
+    }
+
+    /* [host:]port, the loopback interface by default */
+    port = strrchr(mx->addr, ':');
+    if (port != NULL)
+    {
+        snprintf(host, sizeof(host), "%.*s", (int) (port - mx->addr),
+                mx->addr);
+        port++;
+    }
+    else
+    {
+        strcpy(host, "127.0.0.1");
+        port = mx->addr;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (err != 0)
+    {
+        fprintf(stderr, "metrics address %s: %s\n", mx->addr,
+                gai_strerror(err));
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        if (bind(fd, res->ai_addr, res->ai_addrlen) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+int metrics_start(metrics_t *mx)
+{
+    struct sched_param param;
+    pthread_attr_t attr;
+    int err;
+
+    if (!mx->addr[0])
+        return 0;
+
+    mx->listen_fd = open_socket(mx);
+    if ((mx->listen_fd < 0) || (listen(mx->listen_fd, 4) < 0))
+    {
+        fprintf(stderr, "metrics %s: %s\n", mx->addr, strerror(errno));
+        return -1;
+    }
+
+    /* Never inherit the SCHED_FIFO priority of an audio thread */
+    memset(&param, 0, sizeof(param));
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    err = pthread_create(&mx->thread, &attr, server_function, mx);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+    {
+        fprintf(stderr, "metrics thread: %s\n", strerror(err));
+        return -1;
+    }
+
+    printf("Serving metrics on %s\n", mx->addr);
+    return 0;
+}
+
+void metrics_close(metrics_t *mx)
+{
+    if (mx->unix_socket)
+        unlink(mx->addr + 5);
+}
@@ -0,0 +1,632 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "capturedb.h"
+
+using namespace std;
+
+/* batched receive configuration */
+#define RCV_BATCH_MAX      64
+#define MAX_DATAGRAM       65536
+#define MAX_SOURCES        64
+#define POLL_TIMEOUT_MS    200
+
+/* Received datagrams are packed into chunks, each a run of records
+ * followed by their contents, which the writer thread turns into the
+ * database while the next chunk fills */
+#define CHUNK_BYTES        (4 * 1024 * 1024)
+
+struct Record
+{
+    int64_t timestamp_ms;
+    uint32_t len;
+
+    /* the stream, in host byte order */
+    uint32_t addr;
+    uint16_t port;
+    uint16_t dest_port;
+    uint32_t pad;
+};
+
+struct Chunk
+{
+    char *buf;
+    size_t len;
+};
+
+struct Listener
+{
+    unsigned short port;
+    int fd;
+    uint32_t kernel_drops;
+};
+
+struct Source
+{
+    struct sockaddr_in addr;
+    unsigned long packets;
+    unsigned long long bytes;
+};
+
+/* socket configuration */
+static vector<Listener> listeners;
+static const char *multicast_group = NULL;
+static int rcv_batch_size = 32;
+static int rcv_buffer_kb = 4096;
+
+/* database configuration */
+static const char *db_name = "default_db";
+static int queue_mb = 64;
+static int verbose = 0;
+
+static volatile sig_atomic_t shutdown_req = 0;
+
+/* chunks waiting to be written, and chunks free to fill */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t full_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t free_cond = PTHREAD_COND_INITIALIZER;
+static vector<Chunk *> full_chunks;
+static vector<Chunk *> free_chunks;
+static int receive_done = 0;
+
+/* statistics */
+static unsigned long packet_cnt = 0;
+static unsigned long long byte_cnt = 0;
+static unsigned long oversize_cnt = 0;
+static unsigned long writer_stall_cnt = 0;
+static unsigned long too_big_cnt = 0;
+static int write_error = 0;
+static int db_parts = 1;
+static Source sources[MAX_SOURCES];
+static int source_cnt = 0;
+static unsigned long other_source_cnt = 0;
+
+static void signal_handler(int sig)
+{
+    shutdown_req = 1;
+}
+
+static void print_usage()
+{
+    printf("\n");
+    printf("Usage: etherrecord [OPTION]...\n");
+    printf("\n");
+    printf("Record audio packets from across a LAN into a playback database");
+    printf("\n");
+    printf("   -p port, UDP port to record (6502 default), repeat for more\n");
+    printf("   -g group, join a multicast group on each port\n");
+    printf("   -o name, database written to name.man and name.bin ");
+    printf("(default_db default)\n");
+    printf("   -b n, max packets per batched receive (1-%i, 32 default)\n",
+            RCV_BATCH_MAX);
+    printf("   -q MB, write queue size (64 default)\n");
+    printf("   -r KB, socket receive buffer size (4096 default)\n");
+    printf("   -v, verbose, report progress every second\n");
+    printf("   -h, show this help message\n");
+    printf("\n");
+    printf("Examples:\n");
+    printf("\n");
+    printf("      etherrecord -p 6502 -o session");
+    printf("\n");
+    printf("      etherrecord -p 6502 -p 6503 -g 239.0.0.1 -o session");
+    printf("\n");
+}
+
+static double now_sec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void open_listener(Listener *l)
+{
+    struct sockaddr_in addr;
+    struct ip_mreq mreq;
+    int enable = 1;
+    int size = rcv_buffer_kb * 1024;
+
+    l->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (l->fd < 0)
+    {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    /* The buffer rides out writer stalls; past the limit a privileged
+     * process can still have it */
+    if (setsockopt(l->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size))
+            < 0)
+        setsockopt(l->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    /* Kernel arrival times, and the count of datagrams the kernel dropped
+     * for want of buffer space */
+    setsockopt(l->fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+    setsockopt(l->fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(l->port);
+    if (bind(l->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (multicast_group != NULL)
+    {
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if ((inet_pton(AF_INET, multicast_group, &mreq.imr_multiaddr) != 1)
+                || (setsockopt(l->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                        sizeof(mreq)) < 0))
+        {
+            printf("Unable to join multicast group %s\n", multicast_group);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    l->kernel_drops = 0;
+}
+
+/* Hand a filled chunk to the writer, and take a free one.  Blocking here
+ * leaves the datagrams to queue in the socket buffers. */
+static Chunk *next_chunk(Chunk *chunk)
+{
+    pthread_mutex_lock(&mutex);
+
+    if (chunk != NULL)
+    {
+        full_chunks.push_back(chunk);
+        pthread_cond_signal(&full_cond);
+    }
+
+    if (free_chunks.empty())
+        writer_stall_cnt++;
+    while (free_chunks.empty())
+        pthread_cond_wait(&free_cond, &mutex);
+
+    chunk = free_chunks.back();
+    free_chunks.pop_back();
+    pthread_mutex_unlock(&mutex);
+
+    chunk->len = 0;
+    return chunk;
+}
+
+static void count_source(const struct sockaddr_in *addr, size_t len)
+{
+    int i;
+
+    for (i = 0; i < source_cnt; i++)
+    {
+        if ((sources[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr)
+                && (sources[i].addr.sin_port == addr->sin_port))
+            break;
+    }
+
+    if (i == source_cnt)
+    {
+        if (source_cnt == MAX_SOURCES)
+        {
+            other_source_cnt++;
+            return;
+        }
+
+        sources[i].addr = *addr;
+        source_cnt++;
+    }
+
+    sources[i].packets++;
+    sources[i].bytes += len;
+}
+
+/* Kernel arrival time in ms since the epoch, and the socket's drop count */
+static int64_t msg_info(struct msghdr *msg, Listener *l)
+{
+    struct cmsghdr *cmsg;
+    struct timespec arrival;
+
+    clock_gettime(CLOCK_REALTIME, &arrival);
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            memcpy(&arrival, CMSG_DATA(cmsg), sizeof(arrival));
+        else if (cmsg->cmsg_type == SO_RXQ_OVFL)
+            memcpy(&l->kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+    }
+
+    return arrival.tv_sec * 1000LL + arrival.tv_nsec / 1000000;
+}
+
+static unsigned long kernel_drops()
+{
+    unsigned long drops = 0;
+
+    for (unsigned i = 0; i < listeners.size(); i++)
+        drops += listeners[i].kernel_drops;
+
+    return drops;
+}
+
+static void receive()
+{
+    static char stage[RCV_BATCH_MAX][MAX_DATAGRAM];
+    struct mmsghdr msgs[RCV_BATCH_MAX];
+    struct iovec iovecs[RCV_BATCH_MAX];
+    struct sockaddr_in addrs[RCV_BATCH_MAX];
+    char cmsg_buf[RCV_BATCH_MAX][CMSG_SPACE(sizeof(struct timespec))
+            + CMSG_SPACE(sizeof(uint32_t))];
+    vector<struct pollfd> pfds(listeners.size());
+    Chunk *chunk = next_chunk(NULL);
+    Record rec;
+    int64_t last_ms = 0;
+    double report_time = now_sec() + 1;
+    int i, sock_rcvd;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < RCV_BATCH_MAX; i++)
+    {
+        iovecs[i].iov_base = stage[i];
+        iovecs[i].iov_len = MAX_DATAGRAM;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_control = cmsg_buf[i];
+    }
+
+    for (unsigned j = 0; j < listeners.size(); j++)
+    {
+        pfds[j].fd = listeners[j].fd;
+        pfds[j].events = POLLIN;
+    }
+
+    while (!shutdown_req && !write_error)
+    {
+        if (poll(&pfds[0], pfds.size(), POLL_TIMEOUT_MS) < 0)
+            continue;
+
+        for (unsigned j = 0; j < listeners.size(); j++)
+        {
+            if (!(pfds[j].revents & POLLIN))
+                continue;
+
+            for (i = 0; i < rcv_batch_size; i++)
+            {
+                msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+                msgs[i].msg_hdr.msg_controllen = sizeof(cmsg_buf[i]);
+            }
+
+            sock_rcvd = recvmmsg(listeners[j].fd, msgs, rcv_batch_size,
+                    MSG_DONTWAIT, NULL);
+
+            for (i = 0; i < sock_rcvd; i++)
+            {
+                if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                {
+                    oversize_cnt++;
+                    continue;
+                }
+
+                /* Sockets are drained in turn, so keep time from running
+                 * backwards between them */
+                rec.timestamp_ms = msg_info(&msgs[i].msg_hdr, &listeners[j]);
+                if (rec.timestamp_ms < last_ms)
+                    rec.timestamp_ms = last_ms;
+                last_ms = rec.timestamp_ms;
+
+                rec.len = msgs[i].msg_len;
+                rec.addr = ntohl(addrs[i].sin_addr.s_addr);
+                rec.port = ntohs(addrs[i].sin_port);
+                rec.dest_port = listeners[j].port;
+                rec.pad = 0;
+
+                if (chunk->len + sizeof(rec) + rec.len > CHUNK_BYTES)
+                    chunk = next_chunk(chunk);
+
+                memcpy(chunk->buf + chunk->len, &rec, sizeof(rec));
+                memcpy(chunk->buf + chunk->len + sizeof(rec), stage[i],
+                        rec.len);
+                chunk->len += sizeof(rec) + ((rec.len + 7) & ~7);
+
+                packet_cnt++;
+                byte_cnt += rec.len;
+                count_source(&addrs[i], rec.len);
+            }
+        }
+
+        if (verbose && (now_sec() >= report_time))
+        {
+            report_time += 1;
+            printf("%lu packets, %.1f MB, kernel drops = %lu\n", packet_cnt,
+                    byte_cnt / 1e6, kernel_drops());
+            fflush(stdout);
+        }
+    }
+
+    /* pass on the last, partly filled chunk */
+    pthread_mutex_lock(&mutex);
+    full_chunks.push_back(chunk);
+    receive_done = 1;
+    pthread_cond_signal(&full_cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+/* The database name of each part after the first, once the .bin file of
+ * the previous one is full */
+static void part_name(char *name, size_t size, int part)
+{
+    if (part == 1)
+        snprintf(name, size, "%s", db_name);
+    else
+        snprintf(name, size, "%s_%i", db_name, part);
+}
+
+static void *writer_function(void *ptr)
+{
+    capturedb_writer_t *w = (capturedb_writer_t *) ptr;
+    char name[CAPTUREDB_PATH_MAX];
+    capturedb_stream_t stream;
+    Chunk *chunk;
+    Record rec;
+    size_t pos;
+
+    /* the part written to, named in any error */
+    part_name(name, sizeof(name), db_parts);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&mutex);
+        while (full_chunks.empty() && !receive_done)
+            pthread_cond_wait(&full_cond, &mutex);
+
+        if (full_chunks.empty())
+        {
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+
+        chunk = full_chunks.front();
+        full_chunks.erase(full_chunks.begin());
+        pthread_mutex_unlock(&mutex);
+
+        for (pos = 0; (pos < chunk->len) && !write_error;
+                pos += sizeof(rec) + ((rec.len + 7) & ~7))
+        {
+            memcpy(&rec, chunk->buf + pos, sizeof(rec));
+            stream.addr = rec.addr;
+            stream.port = rec.port;
+            stream.dest_port = rec.dest_port;
+
+            if (capturedb_append(w, rec.timestamp_ms,
+                    capturedb_index_stream(&w->index, &stream),
+                    chunk->buf + pos + sizeof(rec), rec.len) == 0)
+                continue;
+
+            if (errno == E2BIG)
+            {
+                too_big_cnt++;
+                continue;
+            }
+
+            /* Start the next part with this packet */
+            if ((errno == EFBIG) && (capturedb_close(w) == 0))
+            {
+                part_name(name, sizeof(name), ++db_parts);
+                if ((capturedb_create(w, name, CHUNK_BYTES) == 0)
+                        && (capturedb_append(w, rec.timestamp_ms,
+                                capturedb_index_stream(&w->index, &stream),
+                                chunk->buf + pos + sizeof(rec), rec.len) == 0))
+                {
+                    printf("Continuing in %s\n", name);
+                    continue;
+                }
+            }
+
+            perror(name);
+            write_error = 1;
+        }
+
+        /* complete on disk up to the end of the chunk */
+        if (!write_error && (capturedb_flush(w) < 0))
+        {
+            perror(name);
+            write_error = 1;
+        }
+
+        pthread_mutex_lock(&mutex);
+        free_chunks.push_back(chunk);
+        pthread_cond_signal(&free_cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    return 0;
+}
+
+static void print_stats(double elapsed)
+{
+    char addr[INET_ADDRSTRLEN];
+    int i;
+
+    printf("\nReceived %lu packets, %llu bytes in %.1f s", packet_cnt,
+            byte_cnt, elapsed);
+    if (db_parts > 1)
+        printf(", in %i parts", db_parts);
+    printf("\n");
+
+    printf("Kernel drops = %lu, Oversize packets = %lu", kernel_drops(),
+            oversize_cnt + too_big_cnt);
+    printf(", Writer stalls = %lu\n", writer_stall_cnt);
+
+    for (i = 0; i < source_cnt; i++)
+    {
+        inet_ntop(AF_INET, &sources[i].addr.sin_addr, addr, sizeof(addr));
+        printf("   %s:%i: %lu packets, %llu bytes\n", addr,
+                ntohs(sources[i].addr.sin_port), sources[i].packets,
+                sources[i].bytes);
+    }
+
+    if (other_source_cnt > 0)
+        printf("   other sources: %lu packets\n", other_source_cnt);
+}
+
+int main(int argc, char *argv[])
+{
+    capturedb_writer_t w;
+    char name[CAPTUREDB_PATH_MAX];
+    pthread_t writer_thread;
+    Listener listener;
+    double start;
+    int chunks;
+
+    /* Process command line options */
+    while (argc > 1)
+    {
+        if (argv[1][0] == '-')
+        {
+            switch (argv[1][1])
+            {
+
+            case 'p':
+                listener.port = atoi(&argv[1][3]);
+                listeners.push_back(listener);
+                break;
+
+            case 'g':
+                multicast_group = &argv[1][3];
+                break;
+
+            case 'o':
+                db_name = &argv[1][3];
+                break;
+
+            case 'b':
+                rcv_batch_size = atoi(&argv[1][3]);
+                if ((rcv_batch_size < 1) || (rcv_batch_size > RCV_BATCH_MAX))
+                {
+                    printf("Receive batch size must be 1 to %i\n",
+                            RCV_BATCH_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'q':
+                queue_mb = atoi(&argv[1][3]);
+                break;
+
+            case 'r':
+                rcv_buffer_kb = atoi(&argv[1][3]);
+                break;
+
+            case 'v':
+                verbose = 1;
+                break;
+
+            case 'h':
+            default:
+                print_usage();
+                exit(EXIT_SUCCESS);
+                break;
+            }
+        }
+
+        argv++;
+        argc--;
+    }
+
+    if (listeners.empty())
+    {
+        listener.port = 6502;
+        listeners.push_back(listener);
+    }
+
+    for (unsigned i = 0; i < listeners.size(); i++)
+        open_listener(&listeners[i]);
+
+    /* at least one chunk filling while another is written */
+    chunks = queue_mb * 1024 * 1024 / CHUNK_BYTES;
+    if (chunks < 2)
+        chunks = 2;
+    for (int i = 0; i < chunks; i++)
+    {
+        Chunk *chunk = new Chunk;
+        chunk->buf = (char *) malloc(CHUNK_BYTES);
+        if (chunk->buf == NULL)
+        {
+            printf("not enough memory");
+            exit(EXIT_FAILURE);
+        }
+        free_chunks.push_back(chunk);
+    }
+
+    if (capturedb_create(&w, db_name, CHUNK_BYTES) < 0)
+    {
+        perror(db_name);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    for (unsigned i = 0; i < listeners.size(); i++)
+        printf("Recording packets on port: %i\n", listeners[i].port);
+    if (multicast_group != NULL)
+        printf("Multicast group: %s\n", multicast_group);
+
+    start = now_sec();
+    pthread_create(&writer_thread, NULL, writer_function, &w);
+
+    receive();
+
+    pthread_join(writer_thread, NULL);
+    part_name(name, sizeof(name), db_parts);
+    if ((capturedb_close(&w) < 0) && !write_error)
+    {
+        perror(name);
+        write_error = 1;
+    }
+
+    print_stats(now_sec() - start);
+
+    return write_error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+################################################################################
+# Automatically-generated file. Do not edit!
+################################################################################
+
+# Add inputs and outputs from these tool invocations to the build variables 
+CPP_SRCS += \
+../etherreplay.cpp 
+
+C_SRCS += \
+../capturedb.c \
+../mcast.c \
+../pcapfile.c \
+../rtprofile.c 
+
+OBJS += \
+./capturedb.o \
+./etherreplay.o \
+./mcast.o \
+./pcapfile.o \
+./rtprofile.o 
+
+C_DEPS += \
+./capturedb.d \
+./mcast.d \
+./pcapfile.d \
+./rtprofile.d 
+
+CPP_DEPS += \
+./etherreplay.d 
+
+
+# Each subdirectory must supply rules for building sources it contributes
+%.o: ../%.c
+	@echo 'Building file: $<'
+	@echo 'Invoking: GCC C Compiler'
+	gcc -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
+%.o: ../%.cpp
+	@echo 'Building file: $<'
+	@echo 'Invoking: GCC C++ Compiler'
+	g++ -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
+
@@ -0,0 +1,879 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "capturedb.h"
+#include "mcast.h"
+#include "pcapfile.h"
+#include "rtprofile.h"
+
+using namespace std;
+
+#define NSEC_PER_SEC       1000000000LL
+#define NSEC_PER_MSEC      1000000LL
+
+/* a packet is late when sent this long after its deadline */
+#define LATE_NS            (1 * NSEC_PER_MSEC)
+
+/* send errors are counted per us up to ERROR_FINE_US, then per ms, with
+ * anything beyond the last bucket in it */
+#define ERROR_FINE_US      100000
+#define ERROR_BUCKETS      (ERROR_FINE_US + 100000)
+
+struct UDP_Destination
+{
+    struct sockaddr_in dest_sock_addr;
+    unsigned short dest_port;
+    char *dest_addr;
+};
+
+/* A database replayed, merged with the others by playback time */
+struct Session
+{
+    const char *name;
+    capturedb_reader_t r;
+
+    /* the next packet to send and its playback time, held back from
+     * running backwards, from first_offset_ms */
+    uint32_t next;
+    int ready;
+    int64_t offset_ms;
+    int64_t first_offset_ms;
+
+    /* a socket per fan-out copy */
+    vector<int> sockets;
+};
+
+/* socket configuration, each socket with a source port of its own */
+static vector<UDP_Destination> destination_points;
+static int fanout = 1;
+static int source_port = 0;
+static int socket_cnt = 0;
+
+/* replay configuration, at speed times the recorded pace, 0 for as fast
+ * as possible */
+static vector<const char *> db_names;
+static vector<Session> sessions;
+static double speed = 1;
+static const char *capture_name = NULL;
+static pcap_filter_t filter;
+static int64_t start_offset_ms = 0;
+static int stream_filter = -1;
+static int verbose_debug = 0;
+static rtprofile_t rt;
+static mcast_t mc;
+
+static volatile sig_atomic_t shutdown_req = 0;
+
+/* statistics, a histogram of send errors in us after each packet's
+ * deadline, so that memory is the same for sessions of any length */
+static vector<unsigned long> error_hist(ERROR_BUCKETS);
+static long long error_sum_us = 0;
+static long long error_max_us = 0;
+static unsigned long packet_cnt = 0;
+static unsigned long long byte_cnt = 0;
+static unsigned long long datagram_cnt = 0;
+static unsigned long long datagram_bytes = 0;
+static struct timespec first_send, last_send;
+static int64_t played_ns = 0;
+static unsigned long send_fail_cnt = 0;
+static unsigned long late_cnt = 0;
+static unsigned long bad_entry_cnt = 0;
+static unsigned long skipped_cnt[PCAP_LINKTYPE + 1];
+static unsigned long filtered_cnt = 0;
+
+static void signal_handler(int sig)
+{
+    shutdown_req = 1;
+}
+
+static void print_usage()
+{
+    printf("\n");
+    printf("Usage: etherreplay [OPTION]...\n");
+    printf("\n");
+    printf("Replay a recorded audio session across a LAN, with the timing");
+    printf("\n");
+    printf("it was recorded with\n");
+    printf("   -f name, playback database name.man and name.bin ");
+    printf("(default_db default),\n");
+    printf("      repeat to replay several at once\n");
+    printf("   -d ip_addr:port, destination ip address and port\n");
+    printf("      (127.0.0.1:6502 default), repeat for more destinations\n");
+    printf("   -t time, start this far into the session, in seconds or\n");
+    printf("      [hh:]mm:ss\n");
+    printf("   -S id, replay one stream only, as listed with -v\n");
+    printf("   -r speed, times the recorded pace, 0 for as fast as possible\n");
+    printf("      (1 default)\n");
+    printf("   -n count, send each packet from this many sockets (1 default)\n");
+    printf("   -p port, first source port, one per session and copy\n");
+    printf("      (any free port default)\n");
+    printf("   -P file, replay the UDP datagrams of a tcpdump capture (pcap\n");
+    printf("      or pcapng) instead\n");
+    printf("   -u port, replay capture datagrams to this UDP port only,\n");
+    printf("      repeat for more ports\n");
+    printf("   -s ip_addr[:port], replay capture datagrams from this source\n");
+    printf("      only, repeat for more sources\n");
+    printf("   -v, verbose debugging output\n");
+    printf("   --realtime[=cpu], SCHED_FIFO send thread pinned to a CPU\n");
+    printf("   --latency, report thread wakeup latency on exit\n");
+    printf("   --mcast-ttl=n, hops multicast packets go (1 default)\n");
+    printf("   --mcast-if=iface, interface name or address multicast packets\n");
+    printf("      are sent from (routed default)\n");
+    printf("   --mcast-loop=0|1, multicast packets also to this host\n");
+    printf("      (1 default)\n");
+    printf("   -h, show this help message\n");
+    printf("\n");
+    printf("Examples:\n");
+    printf("\n");
+    printf("      etherreplay -f audio_capture -d 127.0.0.1:6502");
+    printf("\n");
+    printf("      etherreplay -f audio_capture -t 1:30:00 -S 1");
+    printf("\n");
+    printf("      etherreplay -P audio.pcapng -u 6502 -s 192.168.1.20");
+    printf("\n");
+    printf("      etherreplay -f session_a -f session_b -r 10 -n 8");
+    printf("\n");
+}
+
+/* A time of seconds, mm:ss or hh:mm:ss in ms, or -1 */
+static int64_t parse_offset(const char *arg)
+{
+    double value = 0, field;
+    char *end;
+
+    for (;;)
+    {
+        field = strtod(arg, &end);
+        if ((end == arg) || (field < 0))
+            return -1;
+
+        value = value * 60 + field;
+        if (*end != ':')
+            break;
+        arg = end + 1;
+    }
+
+    return (*end == '\0') ? (int64_t) (value * 1000 + 0.5) : -1;
+}
+
+static void print_streams(const capturedb_reader_t *r)
+{
+    capturedb_stream_t s;
+    struct in_addr addr;
+
+    for (uint16_t id = 0; capturedb_stream(r, id, &s) == 0; id++)
+    {
+        if (s.packets == 0)
+            continue;
+
+        addr.s_addr = htonl(s.addr);
+        if (id == 0)
+            printf("  stream 0: unknown source, %u packets\n", s.packets);
+        else
+            printf("  stream %u: %s:%u to port %u, %u packets\n", id,
+                    inet_ntoa(addr), s.port, s.dest_port, s.packets);
+    }
+}
+
+static void resolve_destinations()
+{
+    /* Resolved once, rather than for every packet */
+    for (unsigned i = 0; i < destination_points.size(); i++)
+    {
+        struct hostent *dest_host_info = gethostbyname(
+                destination_points[i].dest_addr);
+
+        if (dest_host_info == NULL)
+        {
+            fprintf(stderr, "Unknown host %s\n",
+                    destination_points[i].dest_addr);
+            exit(EXIT_FAILURE);
+        }
+
+        destination_points[i].dest_sock_addr.sin_family = AF_INET;
+        destination_points[i].dest_sock_addr.sin_port = htons(
+                destination_points[i].dest_port);
+        memcpy((char *) &destination_points[i].dest_sock_addr.sin_addr,
+                (char *) dest_host_info->h_addr, dest_host_info->h_length);
+
+        if (verbose_debug)
+        {
+            printf("  dest address: %s:%i\n", destination_points[i].dest_addr,
+                    destination_points[i].dest_port);
+        }
+    }
+}
+
+/* The sockets of a session, one per fan-out copy */
+static void create_sockets(vector<int> &sockets)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    int sock;
+
+    for (int i = 0; i < fanout; i++)
+    {
+        /* Create socket descriptor */
+        if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+        {
+            fprintf(stderr, "Couldn't create socket descriptor\n");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Allow broadcast packets to be sent */
+        int broadcast = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (char *) &broadcast,
+                sizeof broadcast) == -1)
+        {
+            perror("setsockopt (SO_BROADCAST)");
+            exit(EXIT_FAILURE);
+        }
+
+        if (mcast_sender(&mc, sock) < 0)
+        {
+            perror("setsockopt (multicast)");
+            exit(EXIT_FAILURE);
+        }
+
+        /* A source port of its own, so that receivers tell them apart */
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (source_port > 0)
+            addr.sin_port = htons(source_port + socket_cnt);
+        if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        {
+            fprintf(stderr, "Couldn't bind source port %i: %s\n",
+                    source_port + socket_cnt, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        addr_len = sizeof(addr);
+        getsockname(sock, (struct sockaddr *) &addr, &addr_len);
+        if (verbose_debug)
+            printf("  source port: %u\n", ntohs(addr.sin_port));
+
+        sockets.push_back(sock);
+        socket_cnt++;
+    }
+}
+
+static void close_sockets(vector<int> &sockets)
+{
+    for (unsigned i = 0; i < sockets.size(); i++)
+        close(sockets[i]);
+    sockets.clear();
+}
+
+static void timespec_add_ns(struct timespec *t, long long ns)
+{
+    ns += t->tv_nsec;
+    t->tv_sec += ns / NSEC_PER_SEC;
+    t->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+static long long timespec_diff_ns(const struct timespec *a,
+        const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * NSEC_PER_SEC + (a->tv_nsec - b->tv_nsec);
+}
+
+static void send_packet(const vector<int> &sockets,
+        const unsigned char *data, size_t len)
+{
+    ssize_t bytes_sent;
+
+    for (unsigned s = 0; s < sockets.size(); s++)
+    {
+        for (unsigned i = 0; i < destination_points.size(); i++)
+        {
+            bytes_sent = sendto(sockets[s], data, len, 0,
+                    (struct sockaddr *) &destination_points[i].dest_sock_addr,
+                    sizeof(destination_points[i].dest_sock_addr));
+
+            if (bytes_sent < 0)
+            {
+                /* A full queue or an absent listener loses this packet
+                 * only */
+                send_fail_cnt++;
+                if ((errno != ENOBUFS) && (errno != EAGAIN)
+                        && (errno != ECONNREFUSED))
+                {
+                    perror("sendto");
+                    shutdown_req = 1;
+                }
+            }
+            else
+            {
+                datagram_cnt++;
+                datagram_bytes += bytes_sent;
+            }
+        }
+    }
+}
+
+/* The deadline of a packet at a playback time from the start, at the
+ * replay speed, left unset when replaying as fast as possible */
+static void scaled_deadline(struct timespec *deadline,
+        const struct timespec *start, int64_t offset_ns)
+{
+    if (offset_ns > played_ns)
+        played_ns = offset_ns;
+
+    /* as fast as possible, nothing is due */
+    if (speed == 0)
+        return;
+
+    *deadline = *start;
+    timespec_add_ns(deadline, (speed == 1) ? offset_ns : offset_ns / speed);
+}
+
+/* Sleep until a packet's deadline and send it, or send it at once when
+ * replaying as fast as possible.  Returns the send time error in ns, or
+ * -1 on shutdown. */
+static long long send_at(const struct timespec *deadline,
+        const vector<int> &sockets, const unsigned char *data, size_t len)
+{
+    struct timespec now;
+    long long error_ns, error_us;
+
+    if (speed == 0)
+    {
+        send_packet(sockets, data, len);
+        clock_gettime(CLOCK_MONOTONIC, &last_send);
+        if (packet_cnt++ == 0)
+            first_send = last_send;
+        byte_cnt += len;
+        return 0;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL)
+            == EINTR)
+    {
+        if (shutdown_req)
+            return -1;
+    }
+
+    rtprofile_wakeup(&rt, RT_NET, CLOCK_MONOTONIC, deadline);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    send_packet(sockets, data, len);
+    if (packet_cnt == 0)
+        first_send = now;
+    last_send = now;
+
+    error_ns = max(timespec_diff_ns(&now, deadline), 0LL);
+    if (error_ns > LATE_NS)
+        late_cnt++;
+
+    error_us = error_ns / 1000;
+    if (error_us < ERROR_FINE_US)
+        error_hist[error_us]++;
+    else
+        error_hist[min(ERROR_FINE_US + (error_us - ERROR_FINE_US) / 1000,
+                (long long) ERROR_BUCKETS - 1)]++;
+    error_sum_us += error_us;
+    error_max_us = max(error_max_us, error_us);
+
+    packet_cnt++;
+    byte_cnt += len;
+
+    return error_ns;
+}
+
+/* The next packet of a session to send, or 0 when it has none left */
+static int session_next(Session *s)
+{
+    capturedb_entry_t e;
+    const unsigned char *data;
+
+    for (; s->next < s->r.count; s->next++)
+    {
+        if (capturedb_entry(&s->r, s->next, &e, &data) < 0)
+        {
+            bad_entry_cnt++;
+            continue;
+        }
+
+        /* The recorder's clock may have stepped back; send at once */
+        if (e.timestamp_ms - s->r.first_ms > s->offset_ms)
+            s->offset_ms = e.timestamp_ms - s->r.first_ms;
+
+        if ((stream_filter >= 0)
+                && (capturedb_packet_stream(&s->r, s->next) != stream_filter))
+            continue;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Send every packet at the recording's offset of its timestamp from the
+ * first one, as absolute deadlines so that sleep and send times do not
+ * accumulate.  Each session starts at its packet next, at playback time
+ * first_offset_ms, and all of them start together, their packets sent in
+ * order of playback time. */
+static void replay()
+{
+    capturedb_entry_t e;
+    const unsigned char *data;
+    struct timespec start, deadline;
+    long long error_ns;
+    Session *s;
+
+    for (unsigned k = 0; k < sessions.size(); k++)
+        sessions[k].ready = session_next(&sessions[k]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (!shutdown_req)
+    {
+        s = NULL;
+        for (unsigned k = 0; k < sessions.size(); k++)
+        {
+            Session *c = &sessions[k];
+
+            if (c->ready && ((s == NULL) || (c->offset_ms - c->first_offset_ms
+                    < s->offset_ms - s->first_offset_ms)))
+                s = c;
+        }
+
+        if (s == NULL)
+            break;
+
+        capturedb_entry(&s->r, s->next, &e, &data);
+        scaled_deadline(&deadline, &start,
+                (s->offset_ms - s->first_offset_ms) * NSEC_PER_MSEC);
+
+        error_ns = send_at(&deadline, s->sockets, data, e.size);
+        if (error_ns < 0)
+            return;
+
+        if (verbose_debug)
+        {
+            printf("%s packet %u: %i bytes, delta %i ms, sent %lli us late\n",
+                    s->name, s->next, e.size, e.delta_ms, error_ns / 1000);
+        }
+
+        s->next++;
+        s->ready = session_next(s);
+    }
+}
+
+/* Send the datagrams of a capture as it is read, at their offsets from
+ * the first packet of the capture, to the ns.  Packets before the start
+ * time are read past, as a capture has no index. */
+static void replay_capture(pcapfile_t *p, const vector<int> &sockets)
+{
+    pcap_packet_t pkt;
+    pcap_udp_t udp;
+    struct timespec start, deadline;
+    int64_t first_ns = 0, offset_ns = 0, start_ns = -1;
+    long long error_ns;
+    unsigned long i;
+    int ret;
+
+    for (i = 0; !shutdown_req; i++)
+    {
+        ret = pcapfile_next(p, &pkt);
+        if (ret <= 0)
+        {
+            if (ret < 0)
+                perror(capture_name);
+            return;
+        }
+
+        if (i == 0)
+            first_ns = pkt.ts_ns;
+
+        /* The capture's clock may have stepped back; send at once */
+        if (pkt.ts_ns - first_ns > offset_ns)
+            offset_ns = pkt.ts_ns - first_ns;
+
+        ret = pcap_udp(&pkt, &udp);
+        if (ret != PCAP_UDP_OK)
+        {
+            skipped_cnt[ret]++;
+            continue;
+        }
+
+        if (!pcap_filter_match(&filter, &udp))
+        {
+            filtered_cnt++;
+            continue;
+        }
+
+        if (offset_ns < start_offset_ms * NSEC_PER_MSEC)
+            continue;
+
+        if (start_ns < 0)
+        {
+            start_ns = offset_ns;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            if (start_offset_ms > 0)
+                printf("Starting at %.3f s, packet %lu\n", start_ns / 1e9, i);
+        }
+
+        scaled_deadline(&deadline, &start, offset_ns - start_ns);
+
+        error_ns = send_at(&deadline, sockets, udp.payload, udp.len);
+        if (error_ns < 0)
+            return;
+
+        if (verbose_debug)
+        {
+            printf("packet %lu: %u bytes from port %u to %u, sent %lli us"
+                    " late\n", i, udp.len, udp.src_port, udp.dst_port,
+                    error_ns / 1000);
+        }
+    }
+}
+
+/* The send error below which a fraction of the packets were sent */
+static long long error_percentile(double fraction)
+{
+    unsigned long rank = packet_cnt * fraction, n = 0;
+
+    for (long long b = 0; b < ERROR_BUCKETS - 1; b++)
+    {
+        n += error_hist[b];
+        if (n > rank)
+            return (b < ERROR_FINE_US) ? b : min(error_max_us,
+                    ERROR_FINE_US + (b - ERROR_FINE_US) * 1000);
+    }
+
+    return error_max_us;
+}
+
+static void print_pace()
+{
+    if (speed == 0)
+        printf("As fast as possible");
+    else
+        printf("At %g times the recorded pace", speed);
+    printf(", each packet from %i socket(s)\n", fanout);
+}
+
+static void print_stats()
+{
+    double elapsed;
+
+    printf("\nSent %lu packets, %llu bytes to %u destination(s)\n",
+            packet_cnt, byte_cnt, (unsigned) destination_points.size());
+    if (capture_name != NULL)
+    {
+        printf("Send errors = %lu, Filtered packets = %lu\n", send_fail_cnt,
+                filtered_cnt);
+        printf("Skipped %lu non-UDP, %lu truncated, %lu fragmented and %lu",
+                skipped_cnt[PCAP_NOT_UDP], skipped_cnt[PCAP_TRUNCATED],
+                skipped_cnt[PCAP_FRAGMENT], skipped_cnt[PCAP_LINKTYPE]);
+        printf(" unknown link type packets\n");
+    }
+    else
+        printf("Send errors = %lu, Bad manifest entries = %lu\n",
+                send_fail_cnt, bad_entry_cnt);
+
+    if (packet_cnt == 0)
+        return;
+
+    /* the sends actually made, every copy to every destination */
+    elapsed = timespec_diff_ns(&last_send, &first_send) / 1e9;
+    printf("Sent %llu datagrams from %i socket(s) to %u destination(s)",
+            datagram_cnt, socket_cnt, (unsigned) destination_points.size());
+    if (elapsed > 0)
+    {
+        printf(" in %.3f s, %.0f datagrams/s, %.1f Mbit/s", elapsed,
+                datagram_cnt / elapsed,
+                datagram_bytes * 8 / elapsed / 1e6);
+        printf("\nPlayed %.3f s of recording at %.2f times its pace",
+                played_ns / 1e9, played_ns / 1e9 / elapsed);
+    }
+    printf("\n");
+
+    /* as fast as possible has no deadlines to miss */
+    if (speed == 0)
+        return;
+
+    printf("Send time error (us): mean %.0f, p50 %lli, p90 %lli, p99 %lli",
+            (double) error_sum_us / packet_cnt, error_percentile(0.5),
+            error_percentile(0.9), error_percentile(0.99));
+    printf(", p99.9 %lli, max %lli\n", error_percentile(0.999),
+            error_max_us);
+    printf("Late by more than %lli ms = %lu\n", LATE_NS / NSEC_PER_MSEC,
+            late_cnt);
+}
+
+int main(int argc, char *argv[])
+{
+    struct timespec open_time, seek_time;
+    int64_t at_ms;
+    char *end;
+
+    rtprofile_init(&rt);
+    mcast_init(&mc);
+
+    /* Process command line options */
+    while (argc > 1)
+    {
+        if (argv[1][0] == '-')
+        {
+            switch (argv[1][1])
+            {
+
+            case 'f':
+                db_names.push_back(&argv[1][3]);
+                break;
+
+            case 'r':
+                speed = strtod(&argv[1][3], &end);
+                if ((end == &argv[1][3]) || (*end != '\0') || (speed < 0))
+                {
+                    printf("Invalid speed %s\n", &argv[1][3]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'n':
+                fanout = atoi(&argv[1][3]);
+                if (fanout < 1)
+                {
+                    printf("Invalid count %s\n", &argv[1][3]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'p':
+                source_port = atoi(&argv[1][3]);
+                if ((source_port < 1) || (source_port > 65535))
+                {
+                    printf("Invalid port %s\n", &argv[1][3]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 't':
+                start_offset_ms = parse_offset(&argv[1][3]);
+                if (start_offset_ms < 0)
+                {
+                    printf("Invalid start time %s\n", &argv[1][3]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'S':
+                stream_filter = strtol(&argv[1][3], &end, 10);
+                if ((end == &argv[1][3]) || (*end != '\0')
+                        || (stream_filter < 0))
+                {
+                    printf("Invalid stream %s\n", &argv[1][3]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'P':
+                capture_name = &argv[1][3];
+                break;
+
+            case 'u':
+                if (pcap_filter_port(&filter, &argv[1][3]) < 0)
+                {
+                    printf("Invalid port %s\n", &argv[1][3]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 's':
+                if (pcap_filter_source(&filter, &argv[1][3]) < 0)
+                {
+                    printf("Invalid source %s\n", &argv[1][3]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'd':
+                struct UDP_Destination udp_dest;
+
+                udp_dest.dest_addr = strtok(&argv[1][3], ":");
+                udp_dest.dest_port = atoi(strtok(NULL, "\n"));
+
+                destination_points.push_back(udp_dest);
+                break;
+
+            case 'v':
+                verbose_debug = 1;
+                break;
+
+                /* --realtime, --latency and --mcast-* */
+            case '-':
+                if ((rtprofile_option(&rt, argv[1]) < 0)
+                        && (mcast_option(&mc, argv[1]) < 0))
+                {
+                    print_usage();
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+
+            case 'h':
+            default:
+                print_usage();
+                exit(EXIT_SUCCESS);
+                break;
+            }
+        }
+
+        argv++;
+        argc--;
+    }
+
+    if (destination_points.empty())
+    {
+        struct UDP_Destination udp_dest;
+
+        udp_dest.dest_addr = (char *) "127.0.0.1";
+        udp_dest.dest_port = 6502;
+        destination_points.push_back(udp_dest);
+    }
+
+    if (db_names.empty())
+        db_names.push_back("default_db");
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    resolve_destinations();
+
+    if (capture_name != NULL)
+    {
+        pcapfile_t p;
+        vector<int> sockets;
+
+        if (pcapfile_open(&p, capture_name) < 0)
+        {
+            perror(capture_name);
+            exit(EXIT_FAILURE);
+        }
+
+        create_sockets(sockets);
+        printf("Replaying %s\n", capture_name);
+        print_pace();
+
+        rtprofile_thread(&rt, RT_NET, "send");
+        replay_capture(&p, sockets);
+
+        print_stats();
+        if (rt.report_latency)
+            rtprofile_latency_report(&rt, RT_NET, "Send");
+
+        pcapfile_close(&p);
+        close_sockets(sockets);
+
+        return EXIT_SUCCESS;
+    }
+
+    /* Sized up front, the sessions are not moved once open */
+    sessions.resize(db_names.size());
+
+    for (unsigned k = 0; k < sessions.size(); k++)
+    {
+        Session *s = &sessions[k];
+
+        s->name = db_names[k];
+
+        clock_gettime(CLOCK_MONOTONIC, &open_time);
+        if (capturedb_open(&s->r, s->name) < 0)
+        {
+            perror(s->name);
+            exit(EXIT_FAILURE);
+        }
+
+        /* streams are only known from a time index which is up to date */
+        if ((stream_filter >= 0) && (s->r.idx == NULL))
+        {
+            printf("%s: no time index for -S, write it with etherdb -i\n",
+                    s->name);
+            exit(EXIT_FAILURE);
+        }
+        if ((stream_filter >= 0)
+                && ((unsigned) stream_filter >= s->r.stream_count))
+        {
+            printf("%s: no stream %i, %u streams\n", s->name, stream_filter,
+                    s->r.stream_count);
+            exit(EXIT_FAILURE);
+        }
+
+        s->next = capturedb_seek(&s->r, start_offset_ms, &at_ms);
+        s->offset_ms = s->first_offset_ms = at_ms;
+        clock_gettime(CLOCK_MONOTONIC, &seek_time);
+
+        create_sockets(s->sockets);
+
+        printf("Replaying %u packets from %s", s->r.count, s->name);
+        if (s->r.idx != NULL)
+            printf(", %.1f s, %u streams", s->r.duration_ms / 1000.0,
+                    s->r.stream_count);
+        printf("\n");
+
+        if (verbose_debug)
+            print_streams(&s->r);
+
+        if (start_offset_ms > 0)
+        {
+            printf("Starting at %.3f s, packet %u, found in %lli us%s\n",
+                    at_ms / 1000.0, s->next,
+                    timespec_diff_ns(&seek_time, &open_time) / 1000,
+                    (s->r.idx != NULL) ? "" : " without a time index");
+        }
+    }
+
+    print_pace();
+
+    rtprofile_thread(&rt, RT_NET, "send");
+    replay();
+
+    print_stats();
+    if (rt.report_latency)
+        rtprofile_latency_report(&rt, RT_NET, "Send");
+
+    for (unsigned k = 0; k < sessions.size(); k++)
+    {
+        capturedb_unmap(&sessions[k].r);
+        close_sockets(sessions[k].sockets);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,809 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pcapfile.h"
+
+#define PCAP_MAGIC_US      0xa1b2c3d4
+#define PCAP_MAGIC_NS      0xa1b23c4d
+#define PCAPNG_BYTE_ORDER  0x1a2b3c4d
+
+/* pcapng block types */
+#define BLOCK_SHB          0x0a0d0d0a
+#define BLOCK_IDB          1
+#define BLOCK_PB           2
+#define BLOCK_SPB          3
+#define BLOCK_EPB          6
+
+/* pcapng options */
+#define OPT_ENDOFOPT       0
+#define OPT_IF_TSRESOL     9
+#define OPT_IF_TSOFFSET    14
+
+#define IO_BUFFER_SIZE     (1024 * 1024)
+#define SNAPLEN            65535
+
+static inline uint32_t get_be16(const unsigned char *b)
+{
+    return (b[0] << 8) | b[1];
+}
+
+static inline uint32_t get_le32(const unsigned char *b)
+{
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static inline uint32_t get16(const pcapfile_t *p, const unsigned char *b)
+{
+    return p->big_endian ? get_be16(b) : (uint32_t) (b[0] | (b[1] << 8));
+}
+
+static inline uint32_t get32(const pcapfile_t *p, const unsigned char *b)
+{
+    if (p->big_endian)
+        return ((uint32_t) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+
+    return get_le32(b);
+}
+
+static inline uint64_t get64(const pcapfile_t *p, const unsigned char *b)
+{
+    if (p->big_endian)
+        return ((uint64_t) get32(p, b) << 32) | get32(p, b + 4);
+
+    return ((uint64_t) get32(p, b + 4) << 32) | get32(p, b);
+}
+
+static int read_fully(pcapfile_t *p, void *buf, size_t len)
+{
+    if (fread(buf, 1, len, p->f) == len)
+        return 0;
+
+    errno = ferror(p->f) ? EIO : EINVAL;
+    return -1;
+}
+
+static int reserve(pcapfile_t *p, size_t size)
+{
+    unsigned char *buf;
+
+    if (size <= p->buf_size)
+        return 0;
+
+    if (size > PCAP_RECORD_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    buf = realloc(p->buf, size);
+    if (buf == NULL)
+        return -1;
+
+    p->buf = buf;
+    p->buf_size = size;
+    return 0;
+}
+
+/* A timestamp in ns, from units of the interface's resolution */
+static int64_t to_ns(const pcap_iface_t *iface, uint64_t ts)
+{
+    int exp = iface->tsresol & 0x7f;
+    uint64_t scale = 1;
+    int64_t ns;
+
+    if (iface->tsresol & 0x80)
+    {
+        /* 2^-exp seconds */
+        if (exp > 30)
+        {
+            ts >>= exp - 30;
+            exp = 30;
+        }
+        ns = (ts >> exp) * 1000000000LL
+                + (((ts & ((1ULL << exp) - 1)) * 1000000000ULL) >> exp);
+    }
+    else if (exp <= 9)
+    {
+        while (exp++ < 9)
+            scale *= 10;
+        ns = ts * scale;
+    }
+    else
+    {
+        while (exp-- > 9)
+            scale *= 10;
+        ns = ts / scale;
+    }
+
+    return ns + iface->ts_offset * 1000000000LL;
+}
+
+int pcapfile_open(pcapfile_t *p, const char *path)
+{
+    unsigned char header[24];
+    uint32_t magic;
+    int err;
+
+    memset(p, 0, sizeof(pcapfile_t));
+
+    p->f = fopen(path, "rb");
+    if (p->f == NULL)
+        return -1;
+    setvbuf(p->f, NULL, _IOFBF, IO_BUFFER_SIZE);
+
+    if (read_fully(p, header, 4) < 0)
+        goto fail;
+
+    /* a pcapng section header reads the same in either byte order */
+    if (get_le32(header) == BLOCK_SHB)
+    {
+        p->ng = 1;
+        rewind(p->f);
+        return 0;
+    }
+
+    magic = get_le32(header);
+    if ((magic == PCAP_MAGIC_US) || (magic == PCAP_MAGIC_NS))
+        p->big_endian = 0;
+    else
+    {
+        p->big_endian = 1;
+        magic = get32(p, header);
+        if ((magic != PCAP_MAGIC_US) && (magic != PCAP_MAGIC_NS))
+        {
+            errno = EINVAL;
+            goto fail;
+        }
+    }
+
+    if (read_fully(p, header + 4, sizeof(header) - 4) < 0)
+        goto fail;
+
+    p->snaplen = get32(p, header + 16);
+    p->iface[0].linktype = get32(p, header + 20) & 0xffff;
+    p->iface[0].tsresol = (magic == PCAP_MAGIC_NS) ? 9 : 6;
+    p->iface_count = 1;
+    return 0;
+
+fail:
+    err = errno;
+    fclose(p->f);
+    p->f = NULL;
+    errno = err;
+    return -1;
+}
+
+static int next_classic(pcapfile_t *p, pcap_packet_t *pkt)
+{
+    unsigned char header[16];
+    uint32_t len;
+    size_t n;
+
+    n = fread(header, 1, sizeof(header), p->f);
+    if (n == 0)
+    {
+        if (ferror(p->f))
+        {
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (n != sizeof(header))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    len = get32(p, header + 8);
+    if ((reserve(p, len) < 0) || (read_fully(p, p->buf, len) < 0))
+        return -1;
+
+    pkt->ts_ns = (int64_t) get32(p, header) * 1000000000LL
+            + to_ns(&p->iface[0], get32(p, header + 4));
+    pkt->linktype = p->iface[0].linktype;
+    pkt->data = p->buf;
+    pkt->len = len;
+    pkt->orig_len = get32(p, header + 12);
+    return 1;
+}
+
+static void add_iface(pcapfile_t *p, const unsigned char *body, uint32_t len)
+{
+    pcap_iface_t *iface;
+    uint32_t pos, code, opt_len;
+
+    if ((len < 8) || (p->iface_count == PCAP_IFACES_MAX))
+        return;
+
+    iface = &p->iface[p->iface_count++];
+    iface->linktype = get16(p, body);
+    iface->tsresol = 6;
+    iface->ts_offset = 0;
+    if (p->iface_count == 1)
+        p->snaplen = get32(p, body + 4);
+
+    for (pos = 8; pos + 4 <= len; pos += 4 + ((opt_len + 3) & ~3))
+    {
+        code = get16(p, body + pos);
+        opt_len = get16(p, body + pos + 2);
+        if ((code == OPT_ENDOFOPT) || (pos + 4 + opt_len > len))
+            break;
+
+        if ((code == OPT_IF_TSRESOL) && (opt_len >= 1))
+            iface->tsresol = body[pos + 4];
+        else if ((code == OPT_IF_TSOFFSET) && (opt_len >= 8))
+            iface->ts_offset = get64(p, body + pos + 4);
+    }
+}
+
+static int next_ng(pcapfile_t *p, pcap_packet_t *pkt)
+{
+    unsigned char header[12];
+    const unsigned char *body;
+    uint32_t type, len, body_len, iface, caplen;
+    size_t n;
+
+    for (;;)
+    {
+        n = fread(header, 1, 8, p->f);
+        if (n == 0)
+        {
+            if (ferror(p->f))
+            {
+                errno = EIO;
+                return -1;
+            }
+            return 0;
+        }
+
+        if (n != 8)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* each section sets its own byte order */
+        type = get32(p, header);
+        if (type == BLOCK_SHB)
+        {
+            if (read_fully(p, header + 8, 4) < 0)
+                return -1;
+
+            if (get_le32(header + 8) == PCAPNG_BYTE_ORDER)
+                p->big_endian = 0;
+            else if (get_le32(header + 8) == 0x4d3c2b1a)
+                p->big_endian = 1;
+            else
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            p->iface_count = 0;
+        }
+
+        len = get32(p, header + 4);
+        if ((len < 12) || (len & 3) || (len > PCAP_RECORD_MAX))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* the rest of the block, with the trailing length */
+        body_len = len - ((type == BLOCK_SHB) ? 12 : 8);
+        if ((reserve(p, body_len) < 0)
+                || (read_fully(p, p->buf, body_len) < 0))
+            return -1;
+
+        body = p->buf;
+        body_len -= 4;
+
+        switch (type)
+        {
+
+        case BLOCK_IDB:
+            add_iface(p, body, body_len);
+            break;
+
+        case BLOCK_EPB:
+        case BLOCK_PB:
+            if (body_len < 20)
+                break;
+
+            if (type == BLOCK_EPB)
+                iface = get32(p, body);
+            else
+                iface = get16(p, body);
+
+            caplen = get32(p, body + 12);
+            if ((iface >= (uint32_t) p->iface_count)
+                    || (caplen > body_len - 20))
+                break;
+
+            pkt->ts_ns = to_ns(&p->iface[iface],
+                    ((uint64_t) get32(p, body + 4) << 32)
+                            | get32(p, body + 8));
+            pkt->linktype = p->iface[iface].linktype;
+            pkt->data = body + 20;
+            pkt->len = caplen;
+            pkt->orig_len = get32(p, body + 16);
+            p->last_ts_ns = pkt->ts_ns;
+            return 1;
+
+        case BLOCK_SPB:
+            if ((body_len < 4) || (p->iface_count == 0))
+                break;
+
+            pkt->orig_len = get32(p, body);
+            caplen = pkt->orig_len;
+            if (caplen > body_len - 4)
+                caplen = body_len - 4;
+            if ((p->snaplen > 0) && (caplen > p->snaplen))
+                caplen = p->snaplen;
+
+            pkt->ts_ns = p->last_ts_ns;
+            pkt->linktype = p->iface[0].linktype;
+            pkt->data = body + 4;
+            pkt->len = caplen;
+            return 1;
+        }
+    }
+}
+
+int pcapfile_next(pcapfile_t *p, pcap_packet_t *pkt)
+{
+    return p->ng ? next_ng(p, pkt) : next_classic(p, pkt);
+}
+
+void pcapfile_close(pcapfile_t *p)
+{
+    if (p->f != NULL)
+        fclose(p->f);
+    free(p->buf);
+    memset(p, 0, sizeof(pcapfile_t));
+}
+
+int pcap_udp(const pcap_packet_t *pkt, pcap_udp_t *udp)
+{
+    const unsigned char *d = pkt->data;
+    const unsigned char *u;
+    uint32_t len = pkt->len, off = 0, type = 0, ihl, ip_len, udp_len;
+    int version;
+
+    switch (pkt->linktype)
+    {
+
+    case PCAP_LINKTYPE_ETHERNET:
+        if (len < 14)
+            return PCAP_TRUNCATED;
+        type = get_be16(d + 12);
+        off = 14;
+
+        /* 802.1Q and 802.1ad tags */
+        while ((type == 0x8100) || (type == 0x88a8) || (type == 0x9100))
+        {
+            if (len < off + 4)
+                return PCAP_TRUNCATED;
+            type = get_be16(d + off + 2);
+            off += 4;
+        }
+        break;
+
+    case PCAP_LINKTYPE_SLL:
+        if (len < 16)
+            return PCAP_TRUNCATED;
+        type = get_be16(d + 14);
+        off = 16;
+        break;
+
+    case PCAP_LINKTYPE_SLL2:
+        if (len < 20)
+            return PCAP_TRUNCATED;
+        type = get_be16(d);
+        off = 20;
+        break;
+
+    case PCAP_LINKTYPE_NULL:
+    case PCAP_LINKTYPE_LOOP:
+        off = 4;
+        break;
+
+    case PCAP_LINKTYPE_RAW:
+    case PCAP_LINKTYPE_RAW_BSD:
+    case PCAP_LINKTYPE_IPV4:
+    case PCAP_LINKTYPE_IPV6:
+        break;
+
+    default:
+        return PCAP_LINKTYPE;
+    }
+
+    if ((type != 0) && (type != 0x0800) && (type != 0x86dd))
+        return PCAP_NOT_UDP;
+
+    if (len <= off)
+        return PCAP_TRUNCATED;
+    d += off;
+    len -= off;
+
+    memset(udp, 0, sizeof(pcap_udp_t));
+    version = d[0] >> 4;
+
+    if (version == 4)
+    {
+        if (len < 20)
+            return PCAP_TRUNCATED;
+
+        ihl = (d[0] & 0x0f) * 4;
+        ip_len = get_be16(d + 2);
+        if ((d[9] != 17) || (ihl < 20))
+            return PCAP_NOT_UDP;
+        if (get_be16(d + 6) & 0x3fff)
+            return PCAP_FRAGMENT;
+        if ((ip_len < ihl + 8) || (len < ihl + 8))
+            return PCAP_TRUNCATED;
+
+        /* Ethernet pads short frames */
+        if (len > ip_len)
+            len = ip_len;
+
+        memcpy(udp->src, d + 12, 4);
+        memcpy(udp->dst, d + 16, 4);
+        u = d + ihl;
+        len -= ihl;
+    }
+    else if (version == 6)
+    {
+        if (len < 40)
+            return PCAP_TRUNCATED;
+        if (d[6] != 17)
+            return PCAP_NOT_UDP;
+
+        ip_len = get_be16(d + 4);
+        if ((ip_len < 8) || (len < 48))
+            return PCAP_TRUNCATED;
+        if (len > 40 + ip_len)
+            len = 40 + ip_len;
+
+        memcpy(udp->src, d + 8, 16);
+        memcpy(udp->dst, d + 24, 16);
+        u = d + 40;
+        len -= 40;
+    }
+    else
+        return PCAP_NOT_UDP;
+
+    udp_len = get_be16(u + 4);
+    if ((udp_len < 8) || (udp_len > len))
+        return PCAP_TRUNCATED;
+
+    udp->ip_version = version;
+    udp->src_port = get_be16(u);
+    udp->dst_port = get_be16(u + 2);
+    udp->payload = u + 8;
+    udp->len = udp_len - 8;
+    return PCAP_UDP_OK;
+}
+
+static int parse_port(const char *arg, uint16_t *port)
+{
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(arg, &end, 10);
+    if ((errno != 0) || (end == arg) || (*end != '\0') || (value < 1)
+            || (value > 65535))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *port = value;
+    return 0;
+}
+
+int pcap_filter_port(pcap_filter_t *f, const char *arg)
+{
+    if (f->port_count == PCAP_FILTER_MAX)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (parse_port(arg, &f->ports[f->port_count]) < 0)
+        return -1;
+
+    f->port_count++;
+    return 0;
+}
+
+int pcap_filter_source(pcap_filter_t *f, const char *arg)
+{
+    char host[INET6_ADDRSTRLEN + 8];
+    char *addr = host, *port = NULL, *end;
+    pcap_source_t *s;
+
+    if (f->source_count == PCAP_FILTER_MAX)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (strlen(arg) >= sizeof(host))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(host, arg);
+
+    /* [addr]:port for IPv6, addr:port when there is a single colon */
+    if (host[0] == '[')
+    {
+        addr = host + 1;
+        end = strchr(addr, ']');
+        if ((end == NULL) || ((end[1] != '\0') && (end[1] != ':')))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        if (end[1] == ':')
+            port = end + 2;
+        *end = '\0';
+    }
+    else if (((end = strchr(host, ':')) != NULL)
+            && (strchr(end + 1, ':') == NULL))
+    {
+        port = end + 1;
+        *end = '\0';
+    }
+
+    s = &f->sources[f->source_count];
+    memset(s, 0, sizeof(pcap_source_t));
+    if (inet_pton(AF_INET, addr, s->addr) == 1)
+        s->ip_version = 4;
+    else if (inet_pton(AF_INET6, addr, s->addr) == 1)
+        s->ip_version = 6;
+    else
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((port != NULL) && (parse_port(port, &s->port) < 0))
+        return -1;
+
+    f->source_count++;
+    return 0;
+}
+
+int pcap_filter_match(const pcap_filter_t *f, const pcap_udp_t *udp)
+{
+    const pcap_source_t *s;
+    int i;
+
+    if (f->port_count > 0)
+    {
+        for (i = 0; i < f->port_count; i++)
+            if (f->ports[i] == udp->dst_port)
+                break;
+        if (i == f->port_count)
+            return 0;
+    }
+
+    if (f->source_count == 0)
+        return 1;
+
+    for (i = 0; i < f->source_count; i++)
+    {
+        s = &f->sources[i];
+        if ((s->ip_version == udp->ip_version)
+                && (memcmp(s->addr, udp->src, (s->ip_version == 4) ? 4 : 16)
+                        == 0) && ((s->port == 0) || (s->port == udp->src_port)))
+            return 1;
+    }
+
+    return 0;
+}
+
+static inline void put_le(unsigned char *b, uint64_t value, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++)
+        b[i] = value >> (i * 8);
+}
+
+static inline void put_be(unsigned char *b, uint32_t value, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++)
+        b[i] = value >> ((bytes - 1 - i) * 8);
+}
+
+int pcapwriter_create(pcapwriter_t *w, const char *path, int ng)
+{
+    unsigned char header[48];
+    size_t len;
+    int err;
+
+    memset(w, 0, sizeof(pcapwriter_t));
+    w->ng = ng;
+
+    w->buf_size = 64 + 28 + SNAPLEN;
+    w->buf = malloc(w->buf_size);
+    if (w->buf == NULL)
+        return -1;
+
+    w->f = fopen(path, "wb");
+    if (w->f == NULL)
+    {
+        err = errno;
+        free(w->buf);
+        errno = err;
+        return -1;
+    }
+    setvbuf(w->f, NULL, _IOFBF, IO_BUFFER_SIZE);
+
+    memset(header, 0, sizeof(header));
+    if (ng)
+    {
+        /* a section header and one raw IP interface, in us */
+        put_le(header, BLOCK_SHB, 4);
+        put_le(header + 4, 28, 4);
+        put_le(header + 8, PCAPNG_BYTE_ORDER, 4);
+        put_le(header + 12, 1, 2);
+        put_le(header + 16, (uint64_t) -1, 8);
+        put_le(header + 24, 28, 4);
+
+        put_le(header + 28, BLOCK_IDB, 4);
+        put_le(header + 32, 20, 4);
+        put_le(header + 36, PCAP_LINKTYPE_RAW, 2);
+        put_le(header + 40, SNAPLEN, 4);
+        put_le(header + 44, 20, 4);
+        len = 48;
+    }
+    else
+    {
+        put_le(header, PCAP_MAGIC_US, 4);
+        put_le(header + 4, 2, 2);
+        put_le(header + 6, 4, 2);
+        put_le(header + 16, SNAPLEN, 4);
+        put_le(header + 20, PCAP_LINKTYPE_RAW, 4);
+        len = 24;
+    }
+
+    if (fwrite(header, 1, len, w->f) != len)
+    {
+        err = errno;
+        pcapwriter_close(w);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint16_t ip_checksum(const unsigned char *b, int len)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < len; i += 2)
+        sum += get_be16(b + i);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+int pcapwriter_udp(pcapwriter_t *w, int64_t ts_ns, uint32_t src,
+        uint16_t src_port, uint32_t dst, uint16_t dst_port, const void *data,
+        uint32_t len)
+{
+    unsigned char *b = w->buf, *ip;
+    uint64_t ts_us = ts_ns / 1000;
+    uint32_t frame_len = 28 + len, block_len, header_len;
+
+    if (frame_len > SNAPLEN)
+    {
+        errno = E2BIG;
+        return -1;
+    }
+
+    if (w->ng)
+    {
+        header_len = 28;
+        block_len = header_len + ((frame_len + 3) & ~3) + 4;
+        put_le(b, BLOCK_EPB, 4);
+        put_le(b + 4, block_len, 4);
+        put_le(b + 8, 0, 4);
+        put_le(b + 12, ts_us >> 32, 4);
+        put_le(b + 16, ts_us, 4);
+        put_le(b + 20, frame_len, 4);
+        put_le(b + 24, frame_len, 4);
+    }
+    else
+    {
+        header_len = 16;
+        block_len = header_len + frame_len;
+        put_le(b, ts_us / 1000000, 4);
+        put_le(b + 4, ts_us % 1000000, 4);
+        put_le(b + 8, frame_len, 4);
+        put_le(b + 12, frame_len, 4);
+    }
+
+    ip = b + header_len;
+    memset(ip, 0, 28);
+    ip[0] = 0x45;
+    put_be(ip + 2, frame_len, 2);
+    put_be(ip + 4, w->ip_id++, 2);
+    put_be(ip + 6, 0x4000, 2);
+    ip[8] = 64;
+    ip[9] = 17;
+    put_be(ip + 12, src, 4);
+    put_be(ip + 16, dst, 4);
+    put_be(ip + 10, ip_checksum(ip, 20), 2);
+
+    /* no UDP checksum, as IPv4 allows */
+    put_be(ip + 20, src_port, 2);
+    put_be(ip + 22, dst_port, 2);
+    put_be(ip + 24, 8 + len, 2);
+    memcpy(ip + 28, data, len);
+
+    if (w->ng)
+    {
+        memset(ip + frame_len, 0, block_len - 4 - header_len - frame_len);
+        put_le(b + block_len - 4, block_len, 4);
+    }
+
+    if (fwrite(b, 1, block_len, w->f) != block_len)
+        return -1;
+
+    return 0;
+}
+
+int pcapwriter_close(pcapwriter_t *w)
+{
+    int err = 0;
+
+    if ((w->f != NULL) && (fclose(w->f) != 0))
+        err = errno;
+
+    free(w->buf);
+    memset(w, 0, sizeof(pcapwriter_t));
+
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "rtprofile.h"
+
+static const double lat_bucket_us[RT_LAT_BUCKETS] =
+{ 10, 50, 100, 500, 1000, 5000, 0 };
+
+void rtprofile_init(rtprofile_t *rt)
+{
+    int i;
+
+    memset(rt, 0, sizeof(rtprofile_t));
+
+    for (i = 0; i < RT_ROLES; i++)
+        rt->cpu[i] = -1;
+}
+
+int rtprofile_option(rtprofile_t *rt, const char *arg)
+{
+    char *end;
+
+    if (strcmp(arg, "--latency") == 0)
+    {
+        rt->report_latency = 1;
+        return 0;
+    }
+
+    if (strncmp(arg, "--realtime", 10) != 0)
+        return -1;
+
+    arg += 10;
+    rt->enabled = 1;
+
+    if (*arg == '\0')
+        return 0;
+
+    if (*arg++ != '=')
+        return -1;
+
+    rt->cpu[RT_AUDIO] = strtol(arg, &end, 10);
+    rt->cpu[RT_NET] = rt->cpu[RT_AUDIO];
+    if ((end == arg) || (rt->cpu[RT_AUDIO] < 0))
+        return -1;
+
+    if (*end == ',')
+    {
+        arg = end + 1;
+        rt->cpu[RT_NET] = strtol(arg, &end, 10);
+        if ((end == arg) || (rt->cpu[RT_NET] < 0))
+            return -1;
+    }
+
+    return (*end == '\0') ? 0 : -1;
+}
+
+/* Move the thread to SCHED_FIFO, settling for the highest priority the
+ * RLIMIT_RTPRIO limit allows when not privileged.  Returns the priority
+ * obtained, or 0 and sets errno. */
+static int set_priority(int prio)
+{
+    struct sched_param param;
+    struct rlimit limit;
+    int err;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = prio;
+    err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+    if ((err == EPERM) && (getrlimit(RLIMIT_RTPRIO, &limit) == 0)
+            && (limit.rlim_cur > 0) && (limit.rlim_cur < (rlim_t) prio))
+    {
+        param.sched_priority = limit.rlim_cur;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    }
+
+    if (err != 0)
+    {
+        errno = err;
+        return 0;
+    }
+
+    return param.sched_priority;
+}
+
+static int set_cpu(int cpu)
+{
+    cpu_set_t set;
+    int err;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    errno = err;
+
+    return err ? -1 : 0;
+}
+
+/* Touch the stack the thread will run in, so that it does not page fault
+ * later, and lock it.  Returns 0 if locked. */
+static int prefault_stack()
+{
+    volatile char stack[RT_STACK_PREFAULT];
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    for (i = 0; i < sizeof(stack); i += page)
+        stack[i] = 0;
+
+    return mlock((const void *) stack, sizeof(stack));
+}
+
+void rtprofile_thread(rtprofile_t *rt, int role, const char *name)
+{
+    int prio, pinned, locked;
+    int prio_errno, cpu_errno = 0;
+
+    if (!rt->enabled)
+        return;
+
+    prio = set_priority((role == RT_AUDIO) ? RT_PRIO_AUDIO : RT_PRIO_NET);
+    prio_errno = errno;
+
+    pinned = (rt->cpu[role] >= 0);
+    if (pinned && (set_cpu(rt->cpu[role]) < 0))
+    {
+        cpu_errno = errno;
+        pinned = 0;
+    }
+
+    locked = (prefault_stack() == 0);
+
+    printf("Realtime %s thread: ", name);
+    if (prio > 0)
+        printf("SCHED_FIFO %i", prio);
+    else
+        printf("normal priority (%s)", strerror(prio_errno));
+
+    if (pinned)
+        printf(", CPU %i", rt->cpu[role]);
+    else if (rt->cpu[role] >= 0)
+        printf(", any CPU (%s)", strerror(cpu_errno));
+    else
+        printf(", any CPU");
+
+    printf(", stack %i KB prefaulted%s\n", RT_STACK_PREFAULT / 1024,
+            locked ? " and locked" : "");
+}
+
+void rtprofile_locked(rtprofile_t *rt, size_t len, int err)
+{
+    if (err == 0)
+        rt->locked_bytes += len;
+    else
+    {
+        rt->unlocked_bytes += len;
+        rt->lock_errno = err;
+    }
+}
+
+void rtprofile_lock(rtprofile_t *rt, const void *addr, size_t len)
+{
+    if (!rt->enabled || (addr == NULL) || (len == 0))
+        return;
+
+    rtprofile_locked(rt, len, mlock(addr, len) ? errno : 0);
+}
+
+void rtprofile_lock_report(const rtprofile_t *rt)
+{
+    struct rlimit limit;
+
+    if (!rt->enabled)
+        return;
+
+    printf("Realtime memory: %lu KB locked", (rt->locked_bytes + 1023) / 1024);
+
+    if (rt->unlocked_bytes > 0)
+    {
+        printf(", %lu KB not locked (%s", (rt->unlocked_bytes + 1023) / 1024,
+                strerror(rt->lock_errno));
+        if ((getrlimit(RLIMIT_MEMLOCK, &limit) == 0)
+                && (limit.rlim_cur != RLIM_INFINITY))
+            printf(", RLIMIT_MEMLOCK = %lu KB",
+                    (unsigned long) limit.rlim_cur / 1024);
+        printf(")");
+    }
+
+    printf("\n");
+}
+
+void rtprofile_wakeup(rtprofile_t *rt, int role, clockid_t clock,
+        const struct timespec *due)
+{
+    rt_latency_t *lat = &rt->latency[role];
+    struct timespec now;
+    double us;
+    int i;
+
+    clock_gettime(clock, &now);
+    us = (now.tv_sec - due->tv_sec) * 1000000.0
+            + (now.tv_nsec - due->tv_nsec) / 1000.0;
+    if (us < 0)
+        us = 0;
+
+    for (i = 0; i < RT_LAT_BUCKETS - 1; i++)
+        if (us < lat_bucket_us[i])
+            break;
+
+    lat->hist[i]++;
+    lat->count++;
+    lat->sum_us += us;
+    if (us > lat->max_us)
+        lat->max_us = us;
+}
+
+void rtprofile_latency_report(const rtprofile_t *rt, int role,
+        const char *name)
+{
+    const rt_latency_t *lat = &rt->latency[role];
+    int i;
+
+    if (lat->count == 0)
+        return;
+
+    printf("%s wakeup latency: mean = %.0f us, max = %.0f us, n = %lu\n",
+            name, lat->sum_us / lat->count, lat->max_us, lat->count);
+
+    printf("  ");
+    for (i = 0; i < RT_LAT_BUCKETS - 1; i++)
+        printf("<%.0fus:%lu ", lat_bucket_us[i], lat->hist[i]);
+    printf(">=%.0fus:%lu\n", lat_bucket_us[RT_LAT_BUCKETS - 2],
+            lat->hist[RT_LAT_BUCKETS - 1]);
+}
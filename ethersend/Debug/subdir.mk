@@ -7,14 +7,26 @@ CPP_SRCS += \
 ../ethersend.cpp 
 
 C_SRCS += \
-../codec_g711.c 
+../codec_g711.c \
+../fanout.c \
+../mcast.c \
+../metrics.c \
+../transcode.c 
 
 OBJS += \
 ./codec_g711.o \
-./ethersend.o 
+./ethersend.o \
+./fanout.o \
+./mcast.o \
+./metrics.o \
+./transcode.o 
 
 C_DEPS += \
-./codec_g711.d 
+./codec_g711.d \
+./fanout.d \
+./mcast.d \
+./metrics.d \
+./transcode.d 
 
 CPP_DEPS += \
 ./ethersend.d 
@@ -0,0 +1,256 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Benchmark of sending a packet to many destinations, as ethersend and
+ * ethermic do for paging zones, with a sendto per destination against a
+ * single sendmmsg through fanout.c.
+ *
+ * For 1 to 1000 destinations, a -m 3 sized packet with its sequence
+ * header is sent to all of them, round after round.  Each round is timed
+ * by the CPU time of the sending thread, reported per destination, and by
+ * the wall time from the start of the round to its last datagram having
+ * been handed to the kernel, the wait of the last destination.  The
+ * destinations all point at one loopback socket, drained between rounds
+ * and not timed, so that the datagrams are really delivered, or at an
+ * address given, off the host.  On loopback the sending thread delivers
+ * each datagram as well, which can hide the system calls saved.
+ *
+ * Build from this directory with:
+ *
+ *    gcc -O2 -I.. -o fanoutbench fanoutbench.c ../fanout.c
+ *
+ * Usage: fanoutbench [datagrams per point] [packet bytes] [ip_addr:port]
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fanout.h"
+
+#define DEST_MAX   1000
+
+static const int dest_counts[] =
+{ 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+
+static long datagrams = 200000;
+static size_t packet_bytes = 1036;
+
+static int rx, tx;
+static struct sockaddr_in dests[DEST_MAX];
+static unsigned char *pkt;
+static unsigned char *drain_buf;
+
+typedef struct
+{
+  double cpu_ns;
+  double wall_ns;
+  unsigned long long syscalls;
+  unsigned long long sent;
+}
+result_t;
+
+static double now_ns(clockid_t clock)
+{
+    struct timespec t;
+
+    clock_gettime(clock, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void drain()
+{
+    if (rx < 0)
+        return;
+
+    while (recv(rx, drain_buf, 65536, MSG_DONTWAIT) > 0)
+        ;
+}
+
+/* A sendto per destination, as before */
+static void run_sendto(int n, long rounds, result_t *r)
+{
+    double cpu, wall;
+    long i;
+    int k;
+
+    memset(r, 0, sizeof(result_t));
+
+    for (i = 0; i < rounds; i++)
+    {
+        cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+        wall = now_ns(CLOCK_MONOTONIC);
+
+        for (k = 0; k < n; k++)
+        {
+            if (sendto(tx, pkt, packet_bytes, 0, (struct sockaddr *) &dests[k],
+                    sizeof(dests[k])) >= 0)
+                r->sent++;
+            r->syscalls++;
+        }
+
+        r->wall_ns += now_ns(CLOCK_MONOTONIC) - wall;
+        r->cpu_ns += now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+        drain();
+    }
+}
+
+/* All of them with one sendmmsg */
+static void run_fanout(int n, long rounds, result_t *r)
+{
+    fanout_t f;
+    double cpu, wall;
+    long i;
+
+    memset(r, 0, sizeof(result_t));
+
+    if (fanout_init(&f, tx, dests, sizeof(dests[0]), n, 1) < 0)
+    {
+        perror("fanout_init");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < rounds; i++)
+    {
+        cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+        wall = now_ns(CLOCK_MONOTONIC);
+
+        fanout_add(&f, pkt, 12, pkt + 12, packet_bytes - 12);
+        fanout_flush(&f);
+
+        r->wall_ns += now_ns(CLOCK_MONOTONIC) - wall;
+        r->cpu_ns += now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+        drain();
+    }
+
+    r->syscalls = f.syscalls;
+    r->sent = f.sent;
+    fanout_close(&f);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int size = 64 * 1024 * 1024;
+    result_t a, b;
+    char *port;
+    unsigned i;
+    long rounds;
+    int k, n;
+
+    if (argc > 1)
+        datagrams = atol(argv[1]);
+    if (argc > 2)
+        packet_bytes = atoi(argv[2]);
+    if (packet_bytes < 12)
+        packet_bytes = 12;
+
+    pkt = calloc(1, packet_bytes);
+    drain_buf = malloc(65536);
+
+    tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (setsockopt(tx, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(tx, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    if (argc > 3)
+    {
+        /* off the host, nothing to drain */
+        rx = -1;
+        port = strchr(argv[3], ':');
+        if (port != NULL)
+            *port++ = '\0';
+        addr.sin_port = htons((port != NULL) ? atoi(port) : 6502);
+        if (inet_pton(AF_INET, argv[3], &addr.sin_addr) != 1)
+        {
+            printf("Invalid address %s\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+    }
+    else
+        rx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    /* room for a round of 1000, past rmem_max when run as root */
+    if (rx >= 0)
+    {
+        if (setsockopt(rx, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size))
+                < 0)
+            setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(rx, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        {
+            perror("bind");
+            return EXIT_FAILURE;
+        }
+        getsockname(rx, (struct sockaddr *) &addr, &addr_len);
+    }
+
+    for (k = 0; k < DEST_MAX; k++)
+        dests[k] = addr;
+
+    printf("%zu byte packets, %ld datagrams per point\n\n", packet_bytes,
+            datagrams);
+    printf("                  sendto per destination       "
+            "      sendmmsg\n");
+    printf("dests  syscalls/pkt  ns/dest  last us    "
+            "syscalls/pkt  ns/dest  last us   CPU\n");
+
+    for (i = 0; i < sizeof(dest_counts) / sizeof(dest_counts[0]); i++)
+    {
+        n = dest_counts[i];
+        rounds = datagrams / n;
+        if (rounds < 20)
+            rounds = 20;
+
+        /* warm up, then the two in turn */
+        run_fanout(n, rounds / 10 + 1, &b);
+        run_sendto(n, rounds, &a);
+        run_fanout(n, rounds, &b);
+
+        printf("%5i  %12.2f  %7.0f  %7.1f    %12.2f  %7.0f  %7.1f  %+4.0f%%\n",
+                n, (double) a.syscalls / rounds, a.cpu_ns / (rounds * n),
+                a.wall_ns / rounds / 1000, (double) b.syscalls / rounds,
+                b.cpu_ns / (rounds * n), b.wall_ns / rounds / 1000,
+                (b.cpu_ns / a.cpu_ns - 1) * 100);
+
+        if ((a.sent != (unsigned long long) rounds * n)
+                || (b.sent != (unsigned long long) rounds * n))
+            printf("       %llu and %llu of %llu datagrams sent\n", a.sent,
+                    b.sent, (unsigned long long) rounds * n);
+    }
+
+    if (rx >= 0)
+        close(rx);
+    close(tx);
+    free(pkt);
+    free(drain_buf);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,248 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Benchmark of sending packets over loopback as ethersend and ethermic do
+ * with --gso=n, a sendmsg per datagram against n datagrams with one
+ * sendmmsg and against n datagrams as one message the kernel splits,
+ * UDP_SEGMENT, through fanout.c.
+ *
+ * A -m 3 sized packet with its sequence header is sent as fast as the
+ * socket takes it, to a receiver thread draining with recvmmsg, for each
+ * way and n of 8, 16, 32 and 64.  Reported are the datagrams received a
+ * second of the process' CPU time, sender and receiver together, the
+ * packets/s a core moves end to end, and the CPU time of the sending
+ * thread per datagram.  On loopback the sending thread also delivers
+ * each datagram, which is most of the cost offload leaves; through a NIC
+ * with checksum offload the saving on the sender is larger.
+ *
+ * Build from this directory with:
+ *
+ *    gcc -O2 -I.. -pthread -o gsobench gsobench.c ../fanout.c
+ *
+ * Usage: gsobench [datagrams per run] [packet bytes]
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fanout.h"
+
+#define RECV_BATCH  64
+
+static const int batch_sizes[] =
+{ 8, 16, 32, 64 };
+
+static long datagrams = 500000;
+static size_t packet_bytes = 1036;
+
+static int rx, tx;
+static struct sockaddr_in dest;
+static unsigned char *pkts;
+
+static volatile int stop_req;
+static volatile unsigned long long received;
+
+typedef struct
+{
+  double cpu_ns;
+  double send_cpu_ns;
+  unsigned long long sent;
+  unsigned long long received;
+  unsigned long long syscalls;
+  int gso;
+}
+result_t;
+
+static double now_ns(clockid_t clock)
+{
+    struct timespec t;
+
+    clock_gettime(clock, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Drain the receiving socket until told to stop */
+static void *receiver(void *arg)
+{
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    unsigned char *bufs = malloc(RECV_BATCH * 2048);
+    int i, n;
+
+    for (i = 0; i < RECV_BATCH; i++)
+    {
+        iov[i].iov_base = &bufs[i * 2048];
+        iov[i].iov_len = 2048;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (!stop_req)
+    {
+        n = recvmmsg(rx, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
+        if (n > 0)
+            received += n;
+    }
+
+    free(bufs);
+    return NULL;
+}
+
+/* Send datagrams in batches of n, way 0 a sendmsg each, 1 with sendmmsg
+ * and 2 with segmentation offload */
+static void run(int way, int n, result_t *r)
+{
+    unsigned long long start_received;
+    double cpu, send_cpu;
+    fanout_t f;
+    long i;
+    int k;
+
+    memset(r, 0, sizeof(result_t));
+
+    if (fanout_init(&f, tx, &dest, sizeof(dest), 1, n) < 0)
+    {
+        perror("fanout_init");
+        exit(EXIT_FAILURE);
+    }
+    if ((way == 2) && (fanout_gso(&f) < 0))
+    {
+        perror("fanout_gso");
+        exit(EXIT_FAILURE);
+    }
+    if (way == 0)
+        f.use_sendmmsg = 0;
+
+    start_received = received;
+    cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+    send_cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+
+    for (i = 0; i < datagrams; i += n)
+    {
+        for (k = 0; k < n; k++)
+            fanout_add(&f, NULL, 0, &pkts[k * packet_bytes], packet_bytes);
+        fanout_flush(&f);
+    }
+
+    r->send_cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID) - send_cpu;
+
+    /* the last of them still on their way to the receiver */
+    usleep(100000);
+
+    r->cpu_ns = now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    r->sent = f.sent;
+    r->received = received - start_received;
+    r->syscalls = f.syscalls;
+    r->gso = f.use_gso;
+
+    fanout_close(&f);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *ways[] =
+    { "sendmsg", "sendmmsg", "gso" };
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int size = 64 * 1024 * 1024;
+    pthread_t thread;
+    struct timeval tv;
+    result_t r, base;
+    unsigned i;
+    int way, n;
+
+    if (argc > 1)
+        datagrams = atol(argv[1]);
+    if (argc > 2)
+        packet_bytes = atoi(argv[2]);
+    if ((packet_bytes < 12) || (packet_bytes > 1472))
+        packet_bytes = 1036;
+
+    pkts = calloc(FANOUT_GSO_SEGMENTS, packet_bytes);
+
+    tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    rx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (setsockopt(tx, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(tx, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (setsockopt(rx, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    /* the receiver wakes up now and then to see if it is done */
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    setsockopt(rx, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(rx, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+    getsockname(rx, (struct sockaddr *) &addr, &addr_len);
+    dest = addr;
+
+    pthread_create(&thread, NULL, receiver, NULL);
+
+    printf("%zu byte packets over loopback, %ld datagrams per run\n\n",
+            packet_bytes, datagrams);
+    printf("    n  send       syscalls/pkt  kpkts/s/core  send ns/pkt"
+            "  lost    CPU\n");
+
+    for (i = 0; i < sizeof(batch_sizes) / sizeof(batch_sizes[0]); i++)
+    {
+        n = batch_sizes[i];
+
+        for (way = 0; way < 3; way++)
+        {
+            run(way, n, &r);
+            if (way == 0)
+                base = r;
+
+            printf("%5i  %-9s  %12.3f  %12.0f  %11.0f  %4llu  %+4.0f%%%s\n",
+                    n, ways[way], (double) r.syscalls / r.sent,
+                    r.received / (r.cpu_ns / 1e9) / 1000,
+                    r.send_cpu_ns / r.sent, r.sent - r.received,
+                    (r.send_cpu_ns / r.sent) / (base.send_cpu_ns / base.sent)
+                            * 100 - 100,
+                    ((way == 2) && !r.gso) ? "  (offload refused)" : "");
+        }
+    }
+
+    stop_req = 1;
+    pthread_join(thread, NULL);
+
+    close(rx);
+    close(tx);
+    free(pkts);
+
+    return EXIT_SUCCESS;
+}
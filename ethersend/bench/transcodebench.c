@@ -0,0 +1,246 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Benchmark of ethersend's on the fly conversion of WAV files, transcode.c,
+ * in the number of streams a core converts in real time.
+ *
+ * WAV files of common formats are made in memory, a tone on each channel,
+ * and read through the transcoder in packet sized blocks as ethersend
+ * does, for each -m mode.  The CPU time taken is reported per second of
+ * audio, and as the streams one core keeps up with.  The mu-law encoder is
+ * checked against linear2ulaw() for every 16 bit sample, and the two timed.
+ *
+ * Build from this directory with:
+ *
+ *    gcc -O2 -I.. -o transcodebench transcodebench.c ../transcode.c \
+ *       ../codec_g711.c -lm
+ *
+ * Usage: transcodebench [seconds of audio]
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "codec_g711.h"
+#include "transcode.h"
+
+typedef struct
+{
+  unsigned int rate;
+  unsigned int channels;
+  unsigned int bits;
+}
+file_format_t;
+
+typedef struct
+{
+  const char *name;
+  unsigned int rate;
+  unsigned int channels;
+  int ulaw;
+  size_t packet_bytes;
+}
+mode_t_;
+
+static const file_format_t files[] =
+{
+{ 44100, 2, 16 },
+{ 48000, 2, 24 },
+{ 22050, 2, 16 },
+{ 16000, 1, 16 },
+{ 11025, 1, 8 } };
+
+static const mode_t_ modes[] =
+{
+{ "-m 1", 8000, 1, 1, 256 },
+{ "-m 2", 16000, 1, 0, 1024 },
+{ "-m 3", 22050, 2, 0, 1024 } };
+
+static double seconds = 60;
+
+static double cpu_ns()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void put_le16(unsigned char *p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, unsigned long v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+/* A WAV file of tones, 1 kHz on the left and 3 kHz on the right */
+static unsigned char *make_wav(const file_format_t *f, size_t *size)
+{
+    size_t frames = f->rate * seconds;
+    size_t frame_bytes = f->channels * f->bits / 8;
+    size_t data = frames * frame_bytes;
+    unsigned char *w = malloc(44 + data);
+    unsigned char *p = w + 44;
+    size_t i;
+    unsigned c;
+    long v;
+
+    memcpy(w, "RIFF", 4);
+    put_le32(w + 4, 36 + data);
+    memcpy(w + 8, "WAVEfmt ", 8);
+    put_le32(w + 16, 16);
+    put_le16(w + 20, 1);
+    put_le16(w + 22, f->channels);
+    put_le32(w + 24, f->rate);
+    put_le32(w + 28, f->rate * frame_bytes);
+    put_le16(w + 32, frame_bytes);
+    put_le16(w + 34, f->bits);
+    memcpy(w + 36, "data", 4);
+    put_le32(w + 40, data);
+
+    for (i = 0; i < frames; i++)
+    {
+        for (c = 0; c < f->channels; c++)
+        {
+            v = lround(0.5 * sin(2 * M_PI * (1000 + 2000 * c) * i / f->rate)
+                    * ((1L << (f->bits - 1)) - 1));
+            if (f->bits == 8)
+                *p++ = v + 128;
+            else if (f->bits == 16)
+            {
+                put_le16(p, v);
+                p += 2;
+            }
+            else
+            {
+                put_le16(p, v);
+                p[2] = v >> 16;
+                p += 3;
+            }
+        }
+    }
+
+    *size = 44 + data;
+    return w;
+}
+
+static void bench_ulaw()
+{
+    static int16_t in[65536];
+    static unsigned char a[65536], b[65536];
+    double start, vec_ns = 0, ref_ns = 0;
+    int i, k, bad = 0;
+
+    for (i = 0; i < 65536; i++)
+        in[i] = i - 32768;
+
+    for (k = 0; k < 200; k++)
+    {
+        start = cpu_ns();
+        transcode_ulaw(a, in, 65536);
+        vec_ns += cpu_ns() - start;
+
+        start = cpu_ns();
+        for (i = 0; i < 65536; i++)
+            b[i] = linear2ulaw(in[i]);
+        ref_ns += cpu_ns() - start;
+    }
+
+    for (i = 0; i < 65536; i++)
+        bad += (a[i] != b[i]);
+
+    printf("mu-law encode: %.2f ns/sample, linear2ulaw %.2f ns/sample,"
+            " %i of 65536 differ\n\n", vec_ns / (200 * 65536.0),
+            ref_ns / (200 * 65536.0), bad);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char *wav, *buf;
+    size_t size, n, total;
+    transcode_t t;
+    double start, ns;
+    unsigned i, m;
+    FILE *file;
+
+    if (argc > 1)
+        seconds = atof(argv[1]);
+    if (seconds < 1)
+        seconds = 1;
+
+    bench_ulaw();
+
+    printf("%.0f s of audio per stream\n\n", seconds);
+    printf("file                 mode  work                ns/s audio"
+            "  streams/core\n");
+
+    buf = malloc(1024);
+
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        wav = make_wav(&files[i], &size);
+
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+        {
+            file = fmemopen(wav, size, "rb");
+            if (transcode_open(&t, file, "bench", modes[m].rate,
+                    modes[m].channels, modes[m].ulaw) < 0)
+                return EXIT_FAILURE;
+
+            total = 0;
+            start = cpu_ns();
+            while ((n = transcode_read(&t, buf, modes[m].packet_bytes)) > 0)
+                total += n;
+            ns = cpu_ns() - start;
+
+            printf("%5u Hz %u ch %2u bit  %s  %-18s %11.0f  %12.0f\n",
+                    files[i].rate, files[i].channels, files[i].bits,
+                    modes[m].name, t.passthrough ? "as is" :
+                            t.resample ? "resample" : "convert",
+                    ns / seconds, seconds * 1e9 / ns);
+
+            if (total != (size_t) (seconds * modes[m].rate) * modes[m].channels
+                    * (modes[m].ulaw ? 1 : 2))
+                printf("      %zu bytes out, not %zu\n", total,
+                        (size_t) (seconds * modes[m].rate) * modes[m].channels
+                                * (modes[m].ulaw ? 1 : 2));
+
+            transcode_close(&t);
+            fclose(file);
+        }
+
+        free(wav);
+    }
+
+    free(buf);
+
+    return EXIT_SUCCESS;
+}
@@ -22,11 +22,17 @@
  */
 
 #include <alsa/asoundlib.h>
+#include <algorithm>
 #include <netdb.h>
-#include <sys/time.h>
+#include <signal.h>
+#include <time.h>
 #include <vector>
 
-#include "codec_g711.h"
+#include "fanout.h"
+#include "mcast.h"
+#include "metrics.h"
+#include "pkthdr.h"
+#include "transcode.h"
 
 using namespace std;
 
@@ -35,6 +41,11 @@ struct UDP_Destination
     struct sockaddr_in dest_sock_addr;
     unsigned short dest_port;
     char *dest_addr;
+
+    /* metrics */
+    metric_t *packets;
+    metric_t *bytes;
+    metric_t *errors;
 };
 
 static struct
@@ -48,47 +59,228 @@ static struct
 /* socket configuration */
 static int socket_desc = 0;
 static vector<UDP_Destination> destination_points;
+static fanout_t fan;
 static unsigned long sample_buffer_size;
 static int packet_cnt = 0;
+static int departure_cnt = 0;
+
+/* packets sent together at each departure, as a single message to each
+ * destination point with UDP segmentation offload */
+static int gso_packets = 1;
+
+/* the most audio sent together, in us, the packets after the first leaving
+ * early by up to this, well within the jitter buffer of etherplay */
+#define GSO_BURST_MAX_US 100000
+
+/* optional sequence header */
+static int pkt_header = 0;
+static unsigned int format_id = 1;
 
 static int verbose_debug = 0;
 
-static double get_time()
+#define NSEC_PER_SEC     1000000000LL
+
+/* pacing, each packet due at the sample clock's time of its first sample,
+ * slept for until spin_ns before it and then spun for */
+static long long spin_ns = 0;
+static volatile sig_atomic_t shutdown_req = 0;
+
+/* a packet this late starts the sample clock over rather than sending
+ * the ones due since in a burst */
+#define RESYNC_NS        (250 * 1000000LL)
+
+/* departure errors, by the us up to ERROR_FINE_US and by the ms after */
+#define ERROR_FINE_US    10000
+#define ERROR_BUCKETS    (ERROR_FINE_US + 1000)
+#define LATE_NS          1000000LL
+
+static vector<unsigned long> error_hist(ERROR_BUCKETS);
+static long long error_sum_us = 0;
+static long long error_max_us = 0;
+static unsigned long late_cnt = 0;
+static unsigned long resync_cnt = 0;
+
+/* multicast destinations */
+static mcast_t mc;
+
+/* metrics */
+static metrics_t mx;
+static metric_t *schedule_error;
+
+/* distance from the due time in us */
+static const unsigned long long schedule_bounds[] =
+{ 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000 };
+
+static void signal_handler(int sig)
+{
+    shutdown_req = 1;
+}
+
+static void timespec_add_ns(struct timespec *t, long long ns)
+{
+    ns += t->tv_nsec;
+    t->tv_sec += ns / NSEC_PER_SEC;
+    t->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+static long long timespec_diff_ns(const struct timespec *a,
+        const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * NSEC_PER_SEC + (a->tv_nsec - b->tv_nsec);
+}
+
+/* Handle --spin=us, the time spun before each departure rather than slept */
+static int spin_option(const char *arg)
+{
+    char *end;
+
+    if (strncmp(arg, "--spin=", 7) != 0)
+        return -1;
+
+    spin_ns = strtol(arg + 7, &end, 10) * 1000;
+    if ((end == arg + 7) || (*end != '\0') || (spin_ns < 0)
+            || (spin_ns >= NSEC_PER_SEC))
+        return -1;
+
+    return 0;
+}
+
+/* Handle --gso=n, the packets sent together at each departure */
+static int gso_option(const char *arg)
+{
+    char *end;
+
+    if (strncmp(arg, "--gso=", 6) != 0)
+        return -1;
+
+    gso_packets = strtol(arg + 6, &end, 10);
+    if ((end == arg + 6) || (*end != '\0') || (gso_packets < 1)
+            || (gso_packets > FANOUT_GSO_SEGMENTS))
+        return -1;
+
+    return 0;
+}
+
+/* Wait for a departure time, sleeping to within spin_ns of it.  Returns
+ * the time it was left at, or -1 on shutdown. */
+static int wait_until(const struct timespec *deadline, struct timespec *now)
 {
-    struct timeval tv;
-    double time;
+    struct timespec wake = *deadline;
 
-    gettimeofday(&tv, NULL);
+    timespec_add_ns(&wake, -spin_ns);
+    if (wake.tv_nsec < 0)
+    {
+        wake.tv_sec--;
+        wake.tv_nsec += NSEC_PER_SEC;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)
+            == EINTR)
+    {
+        if (shutdown_req)
+            return -1;
+    }
 
-    time = tv.tv_sec + (tv.tv_usec / 1000000.0);
+    do
+        clock_gettime(CLOCK_MONOTONIC, now);
+    while ((spin_ns > 0) && (timespec_diff_ns(now, deadline) < 0));
 
-    return time;
+    return 0;
 }
 
-static void period_delay(double time_sec)
+static void record_error(long long error_ns)
 {
-    usleep(time_sec * 1000000);
+    long long error_us = max(error_ns, 0LL) / 1000;
+
+    if (error_ns > LATE_NS)
+        late_cnt++;
+
+    if (error_us < ERROR_FINE_US)
+        error_hist[error_us]++;
+    else
+        error_hist[min(ERROR_FINE_US + (error_us - ERROR_FINE_US) / 1000,
+                (long long) ERROR_BUCKETS - 1)]++;
+    error_sum_us += error_us;
+    error_max_us = max(error_max_us, error_us);
+
+    metric_observe(schedule_error, error_us);
+}
+
+/* The departure error below which a fraction of the packets left */
+static long long error_percentile(unsigned long count, double fraction)
+{
+    unsigned long seen = 0;
+    long long bucket;
+
+    for (bucket = 0; bucket < ERROR_BUCKETS; bucket++)
+    {
+        seen += error_hist[bucket];
+        if (seen >= count * fraction)
+            break;
+    }
+
+    if (bucket < ERROR_FINE_US)
+        return bucket;
+    return min(ERROR_FINE_US + (bucket - ERROR_FINE_US + 1) * 1000,
+            error_max_us);
+}
+
+static void print_pacing(double nominal, const struct timespec *first,
+        const struct timespec *last, int last_cnt)
+{
+    double elapsed = timespec_diff_ns(last, first) / 1e9;
+
+    printf("\nSent %i packets", packet_cnt);
+    if ((last_cnt > 0) && (elapsed > 0))
+    {
+        double achieved = last_cnt / elapsed;
+
+        printf(" in %.3f s, %.4f packets/s against %.4f nominal (%+.0f ppm)",
+                elapsed, achieved, nominal, (achieved / nominal - 1) * 1e6);
+    }
+    printf("\n");
+
+    if (departure_cnt == 0)
+        return;
+
+    printf("Departure error (us): mean %.1f, p50 %lli, p90 %lli, p99 %lli",
+            (double) error_sum_us / departure_cnt,
+            error_percentile(departure_cnt, 0.5),
+            error_percentile(departure_cnt, 0.9),
+            error_percentile(departure_cnt, 0.99));
+    printf(", p99.9 %lli, max %lli\n", error_percentile(departure_cnt, 0.999),
+            error_max_us);
+    printf("Late by more than %lli ms = %lu, sample clock restarted %lu"
+            " times\n", LATE_NS / 1000000, late_cnt, resync_cnt);
+    printf("%llu datagrams sent to %i destination(s) in %llu system calls,"
+            " %llu refused\n", fan.sent, fan.dest_count, fan.syscalls,
+            fan.failed);
+    if (fan.gso_sends > 0)
+        printf("%llu sends split into datagrams by the kernel, of up to %i"
+                " packets\n", fan.gso_sends, gso_packets);
 }
 
 static void play(char* file_name)
 {
-    double sample_time = 1.0 / rhwparams.rate;
-    double pkts_second = rhwparams.rate * rhwparams.bytes_sample
+    double pkts_second = (double) rhwparams.rate * rhwparams.bytes_sample
             * rhwparams.channels / sample_buffer_size;
-    double period_sleep = 1.0 / (pkts_second);
-    double period_adj_l = 0.25;
-    double period_adj_s = 0.01;
-    double pal_chk = period_adj_l * period_sleep;
+    unsigned long frame_bytes = rhwparams.bytes_sample * rhwparams.channels;
 
     FILE *file;
+    transcode_t tc;
     int bytes_sent;
-    unsigned long bytes_total;
-    double start_time, period_adj;
-    double elapsed, delta, prev_delta;
-
-    /* Buffer allocation is 2 x sample size for runtime mu-law conversion */
-    char buffer[sample_buffer_size * 2];
-    char *buf_ptr = &buffer[0];
+    pkthdr_t hdr;
+    size_t hdr_size = pkt_header ? PKTHDR_SIZE : 0;
+    unsigned long long frames_total, frames_start;
+    struct timespec start, deadline, now, first_sent;
+    long long error_ns;
+    int last_cnt = 0;
+
+    /* Buffer allocation is the sample size following room for the optional
+     * sequence header, for each of the packets sent together */
+    size_t slot_size = PKTHDR_SIZE + sample_buffer_size;
+    vector<char> buffer(slot_size * gso_packets);
+    vector<int> reads(gso_packets);
 
     /* Open file for binary read access */
     file = fopen(file_name, "rb");
@@ -98,99 +290,139 @@ static void play(char* file_name)
         return;
     }
 
-    start_time = get_time();
-    bytes_total = 0;
+    /* WAV files of other formats are converted to the mode's on the fly */
+    if (transcode_open(&tc, file, file_name, rhwparams.rate,
+            rhwparams.channels, rhwparams.format == SND_PCM_FORMAT_MU_LAW) < 0)
+    {
+        fclose(file);
+        return;
+    }
+
+    if (!tc.passthrough)
+    {
+        printf("Converting %u Hz, %u bit %s, %u channel(s) to %u Hz, %s,"
+                " %u channel(s)\n", tc.in_rate, tc.in_bits,
+                tc.in_ulaw ? "mu-law" : "PCM", tc.in_channels, tc.out_rate,
+                tc.out_ulaw ? "mu-law" : "16 bit PCM", tc.out_channels);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    first_sent = now = start;
+    frames_total = frames_start = 0;
 
-    period_adj = period_adj_s;
-    delta = 0.0;
-    prev_delta = 0.0;
+    pkthdr_init(&hdr, format_id);
 
     printf("Sending %s\n", file_name);
 
     /* Continue sending audio packets, until fread completes */
-    for (;;)
+    while (!shutdown_req)
     {
-        int read, i;
+        int read, j, count;
 
-        /* Runtime 16bit to 8bit mu-law conversion */
-        if (0)
+        for (count = 0; count < gso_packets; count++)
         {
-            read = fread(buf_ptr, 1, sample_buffer_size * 2, file);
+            char *buf_ptr = &buffer[count * slot_size + PKTHDR_SIZE];
+
+            read = transcode_read(&tc, buf_ptr, sample_buffer_size);
 
             if (read < 1)
                 break;
 
-            for (i = 0; i < read; i++)
-            {
-                short *pcm_val = (short *) &buf_ptr[i * 2];
-                buffer[i] = linear2ulaw(*pcm_val);
-            }
+            reads[count] = read;
+        }
+
+        if (count == 0)
+            break;
+
+        /* Due when its first sample is, by the sample clock from the start,
+         * so that neither sleep nor send times accumulate */
+        deadline = start;
+        timespec_add_ns(&deadline, (frames_total - frames_start) * NSEC_PER_SEC
+                / rhwparams.rate);
+
+        if (wait_until(&deadline, &now) < 0)
+            break;
 
-            read *= 0.5;
+        error_ns = timespec_diff_ns(&now, &deadline);
+        if (error_ns > RESYNC_NS)
+        {
+            /* Stopped or starved for long; resume the clock from now */
+            start = now;
+            frames_start = frames_total;
+            resync_cnt++;
         }
-        else
+
+        record_error(error_ns);
+        if (departure_cnt == 0)
+            first_sent = now;
+        last_cnt = packet_cnt;
+        departure_cnt++;
+
+        /* Send sample packets to each destination point, all with one
+         * system call */
+        for (j = 0; j < count; j++)
         {
-            read = fread(buf_ptr, 1, sample_buffer_size, file);
+            char *pkt_ptr = &buffer[j * slot_size + PKTHDR_SIZE] - hdr_size;
 
-            if (read < 1)
-                break;
-        }
+            if (pkt_header)
+                pkthdr_pack(&hdr, (unsigned char *) pkt_ptr);
+            pkthdr_next(&hdr, reads[j] / frame_bytes);
 
-        elapsed = bytes_total / (rhwparams.bytes_sample * rhwparams.channels)
-                * sample_time;
-        delta = (start_time + elapsed) - get_time();
+            fanout_add(&fan, NULL, 0, pkt_ptr, reads[j] + hdr_size);
+        }
+        fanout_flush(&fan);
 
-        /* Send sample packet to each destination point */
-        for (unsigned i = 0; i < destination_points.size(); i++)
+        for (int k = 0; k < fan.count; k++)
         {
-            bytes_sent = sendto(socket_desc, (const char *) buf_ptr, read, 0,
-                    (struct sockaddr *) &destination_points[i].dest_sock_addr,
-                    sizeof(destination_points[i].dest_sock_addr));
+            int dest;
+
+            bytes_sent = fanout_result(&fan, k, &dest);
 
             if (verbose_debug)
             {
                 printf("sent %i bytes to %s:%i\n", bytes_sent,
-                        destination_points[i].dest_addr,
-                        destination_points[i].dest_port);
+                        destination_points[dest].dest_addr,
+                        destination_points[dest].dest_port);
             }
 
-            if (bytes_sent == -1)
+            if (bytes_sent >= 0)
             {
-                printf("sendto() failed.  errno=%i\n", errno);
-                perror("sendto");
-                exit(EXIT_FAILURE);
+                metric_inc(destination_points[dest].packets);
+                metric_add(destination_points[dest].bytes, bytes_sent);
+                continue;
             }
-        }
-
-        bytes_total += bytes_sent;
-        packet_cnt++;
 
-        // Calculation of phase lock loop sleep period adjustments, so that
-        // packets are sent at the correct rate wrt the sample frequency.
-        // Large and then small adjustments are made to the sleep period,
-        // to reach the nominal sleep period as quickly as possible.
+            metric_inc(destination_points[dest].errors);
 
-        if (((delta > 0) && (delta > prev_delta))
-                || ((delta > 0) && (delta > pal_chk)))
-            period_sleep += period_sleep * period_adj;
+            /* A full queue or a destination not listening yet is no
+             * reason to stop the others */
+            if ((bytes_sent == -ENOBUFS) || (bytes_sent == -EAGAIN)
+                    || (bytes_sent == -ECONNREFUSED))
+                continue;
 
-        if (((delta < 0) && (delta < prev_delta))
-                || ((delta < 0) && (delta < -pal_chk)))
-            period_sleep -= period_sleep * period_adj;
+            printf("sendmmsg() failed.  errno=%i\n", -bytes_sent);
+            errno = -bytes_sent;
+            perror("sendmmsg");
+            exit(EXIT_FAILURE);
+        }
 
-        prev_delta = delta;
+        for (j = 0; j < count; j++)
+            frames_total += reads[j] / frame_bytes;
+        packet_cnt += count;
 
         if (verbose_debug)
         {
-            printf("\nelapsed = %f\n", elapsed);
-            printf("delta = %f\n", delta);
-            printf("period_sleep = %4.10f\n", period_sleep);
-            if (elapsed > 0)
-                printf("packets per second = %f\n", packet_cnt / elapsed);
+            printf("packet %i due at %.6f s, left %lli us late\n",
+                    last_cnt + 1,
+                    timespec_diff_ns(&deadline, &first_sent) / 1e9,
+                    error_ns / 1000);
         }
-
-        period_delay(period_sleep);
     }
+
+    transcode_close(&tc);
+    fclose(file);
+
+    print_pacing(pkts_second, &first_sent, &now, last_cnt);
 }
 
 static void create_socket()
@@ -211,6 +443,13 @@ static void create_socket()
         exit(EXIT_FAILURE);
     }
 
+    /* Multicast destinations, one packet for every receiver of a group */
+    if (mcast_sender(&mc, socket_desc) < 0)
+    {
+        perror("setsockopt (multicast)");
+        exit(EXIT_FAILURE);
+    }
+
     /* Set socket address attributes for destination points */
     for (unsigned i = 0; i < destination_points.size(); i++)
     {
@@ -229,6 +468,56 @@ static void create_socket()
                     destination_points[i].dest_port);
         }
     }
+
+    /* The packets of a departure, to every destination point */
+    if (fanout_init(&fan, socket_desc, &destination_points[0].dest_sock_addr,
+            sizeof(UDP_Destination), destination_points.size(), gso_packets)
+            < 0)
+    {
+        perror("fanout_init");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Without offload they still leave together, a datagram each */
+    if ((gso_packets > 1) && (fanout_gso(&fan) < 0))
+        printf("UDP segmentation offload unavailable (%s), sending a"
+                " datagram at a time\n", strerror(errno));
+}
+
+/* Label of a destination point's metrics */
+static const char *dest_labels(unsigned i)
+{
+    static char labels[METRIC_LABELS_MAX];
+
+    snprintf(labels, sizeof(labels), "dest=\"%s:%i\"",
+            destination_points[i].dest_addr, destination_points[i].dest_port);
+    return labels;
+}
+
+/* Series of the same name are registered together */
+static void register_metrics()
+{
+    unsigned i;
+
+    for (i = 0; i < destination_points.size(); i++)
+        destination_points[i].packets = metrics_counter(&mx,
+                "ethersend_packets_sent_total", "Packets sent",
+                dest_labels(i));
+
+    for (i = 0; i < destination_points.size(); i++)
+        destination_points[i].bytes = metrics_counter(&mx,
+                "ethersend_sent_bytes_total", "Bytes of packets sent",
+                dest_labels(i));
+
+    for (i = 0; i < destination_points.size(); i++)
+        destination_points[i].errors = metrics_counter(&mx,
+                "ethersend_send_errors_total", "Packets the socket refused",
+                dest_labels(i));
+
+    schedule_error = metrics_histogram(&mx, "ethersend_schedule_error_seconds",
+            "Distance of each packet from its due time", NULL,
+            schedule_bounds,
+            sizeof(schedule_bounds) / sizeof(schedule_bounds[0]), 1e6);
 }
 
 static void print_usage()
@@ -238,12 +527,27 @@ static void print_usage()
     printf("\n");
     printf("Stream audio packets across a LAN from an audio file");
     printf("\n");
-    printf("   -f, the audio filename\n");
-    printf("   -m n, audio file format\n");
+    printf("   -f, the audio filename, WAV files of 8, 16 or 24 bit PCM or\n");
+    printf("      mu-law at any rate, mono or stereo, converted to the mode\n");
+    printf("   -m n, audio format sent\n");
     printf("      1: mu-law au fmt  (8000 hz,  8 bit, 1 channel)\n");
     printf("      2: VOIP  wav fmt (16000 hz, 16 bit, 1 channel)\n");
     printf("      3: Music wav fmt (22050 hz, 16 bit, 2 channel)\n");
     printf("   -d ip_addr:port, destination ip address and port\n");
+    printf("   -s, prefix packets with a sequence header (etherplay -s)\n");
+    printf("   --spin=us, spin for the last us before each packet rather\n");
+    printf("      than sleep, for departures to the us (0 default)\n");
+    printf("   --gso=n, send n packets together, with UDP segmentation\n");
+    printf("      offload where the kernel has it, as a burst at the time of\n");
+    printf("      the first (1 default, 100 ms of packets most: 3 for -m 1\n");
+    printf("      and 2, 8 for -m 3)\n");
+    printf("   --metrics=unix:path|[host:]port, serve metrics in the Prometheus\n");
+    printf("      text format (loopback unless a host is given)\n");
+    printf("   --mcast-ttl=n, hops multicast packets go (1 default)\n");
+    printf("   --mcast-if=iface, interface name or address multicast packets\n");
+    printf("      are sent from (routed default)\n");
+    printf("   --mcast-loop=0|1, multicast packets also to this host\n");
+    printf("      (1 default)\n");
     printf("   -h, show this help message\n");
     printf("\n");
     printf("Example:\n");
@@ -255,6 +559,7 @@ static void print_usage()
 int main(int argc, char *argv[])
 {
     char *filename = 0;
+    double packet_us;
 
     /* Print usage if no options were given */
     if (argc < 2)
@@ -269,6 +574,9 @@ int main(int argc, char *argv[])
     rhwparams.bytes_sample = 1;
     sample_buffer_size = 256;
 
+    metrics_init(&mx);
+    mcast_init(&mc);
+
     /* Process command line options */
     while (argc > 1)
     {
@@ -289,6 +597,7 @@ int main(int argc, char *argv[])
                     rhwparams.rate = 8000;
                     rhwparams.bytes_sample = 1;
                     sample_buffer_size = 256;
+                    format_id = 1;
                 }
                 else if (strcasecmp(&argv[1][3], "2") == 0)
                 {
@@ -297,6 +606,7 @@ int main(int argc, char *argv[])
                     rhwparams.rate = 16000;
                     rhwparams.bytes_sample = 2;
                     sample_buffer_size = 1024;
+                    format_id = 2;
                 }
                 else if (strcasecmp(&argv[1][3], "3") == 0)
                 {
@@ -305,6 +615,7 @@ int main(int argc, char *argv[])
                     rhwparams.rate = 22050;
                     rhwparams.bytes_sample = 2;
                     sample_buffer_size = 1024;
+                    format_id = 3;
                 }
                 else
                 {
@@ -323,6 +634,22 @@ int main(int argc, char *argv[])
                 destination_points.push_back(udp_dest);
                 break;
 
+            case 's':
+                pkt_header = 1;
+                break;
+
+                /* --metrics, --spin, --gso and --mcast-* */
+            case '-':
+                if ((metrics_option(&mx, argv[1]) < 0)
+                        && (spin_option(argv[1]) < 0)
+                        && (gso_option(argv[1]) < 0)
+                        && (mcast_option(&mc, argv[1]) < 0))
+                {
+                    print_usage();
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+
             case 'h':
             default:
                 print_usage();
@@ -341,8 +668,25 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    packet_us = (double) sample_buffer_size * 1000000 / (rhwparams.rate
+            * rhwparams.bytes_sample * rhwparams.channels);
+    if (gso_packets * packet_us > GSO_BURST_MAX_US)
+    {
+        printf("--gso=%i sends %.0f ms at once, %i packets most for this"
+                " mode\n", gso_packets, gso_packets * packet_us / 1000,
+                (int) (GSO_BURST_MAX_US / packet_us));
+        exit(EXIT_FAILURE);
+    }
+
     create_socket();
 
+    register_metrics();
+    if (metrics_start(&mx) < 0)
+        exit(EXIT_FAILURE);
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
     if (filename != 0)
         play(filename);
     else
@@ -351,6 +695,9 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    metrics_close(&mx);
+    fanout_close(&fan);
+
     return 0;
 }
 
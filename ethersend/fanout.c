@@ -0,0 +1,386 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fanout.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT         103
+#endif
+
+/* the result of a message not sent yet */
+#define RESULT_PENDING      INT_MIN
+
+#define GSO_CMSG_SPACE      CMSG_SPACE(sizeof(uint16_t))
+
+int fanout_init(fanout_t *f, int sock, const struct sockaddr_in *dests,
+        size_t dest_size, int dest_count, int packets)
+{
+    memset(f, 0, sizeof(fanout_t));
+
+    if ((dest_count < 1) || (packets < 1))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    f->sock = sock;
+    f->dests = dests;
+    f->dest_size = dest_size;
+    f->dest_count = dest_count;
+    f->capacity = dest_count * packets;
+    f->use_sendmmsg = 1;
+
+    f->msgs = calloc(f->capacity, sizeof(struct mmsghdr));
+    f->iov = calloc(f->capacity * 2, sizeof(struct iovec));
+    f->result = calloc(f->capacity, sizeof(int));
+    if ((f->msgs == NULL) || (f->iov == NULL) || (f->result == NULL))
+    {
+        fanout_close(f);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+int fanout_gso(fanout_t *f)
+{
+    int value;
+    socklen_t len = sizeof(value);
+
+    /* Kernels before UDP_SEGMENT would send the whole message as one
+     * datagram, so it is asked for up front */
+    if (getsockopt(f->sock, SOL_UDP, UDP_SEGMENT, &value, &len) < 0)
+        return -1;
+
+    f->gso_msgs = calloc(f->capacity, sizeof(struct mmsghdr));
+    f->gso_iov = calloc(f->capacity * 2, sizeof(struct iovec));
+    f->gso_cmsg = calloc(f->capacity, GSO_CMSG_SPACE);
+    f->gso_first = calloc(f->capacity, sizeof(int));
+    f->gso_segs = calloc(f->capacity, sizeof(int));
+    if ((f->gso_msgs == NULL) || (f->gso_iov == NULL) || (f->gso_cmsg == NULL)
+            || (f->gso_first == NULL) || (f->gso_segs == NULL))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    f->use_gso = 1;
+    return 0;
+}
+
+int fanout_add(fanout_t *f, const void *hdr, size_t hdr_len, const void *data,
+        size_t len)
+{
+    struct msghdr *msg;
+    struct iovec *iov;
+    int i;
+
+    if (f->flushed)
+    {
+        f->count = 0;
+        f->flushed = 0;
+    }
+
+    if (f->count + f->dest_count > f->capacity)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    for (i = 0; i < f->dest_count; i++)
+    {
+        msg = &f->msgs[f->count].msg_hdr;
+        iov = &f->iov[f->count * 2];
+
+        iov[0].iov_base = (void *) hdr;
+        iov[0].iov_len = hdr_len;
+        iov[1].iov_base = (void *) data;
+        iov[1].iov_len = len;
+
+        memset(msg, 0, sizeof(struct msghdr));
+        msg->msg_name = (void *) ((const char *) f->dests + i * f->dest_size);
+        msg->msg_namelen = sizeof(struct sockaddr_in);
+        msg->msg_iov = (hdr != NULL) ? &iov[0] : &iov[1];
+        msg->msg_iovlen = (hdr != NULL) ? 2 : 1;
+
+        f->count++;
+    }
+
+    return 0;
+}
+
+static size_t msg_bytes(const struct msghdr *msg)
+{
+    size_t len = 0;
+    size_t i;
+
+    for (i = 0; i < msg->msg_iovlen; i++)
+        len += msg->msg_iov[i].iov_len;
+    return len;
+}
+
+/* Send messages one at a time.  Returns how many were sent before the
+ * first refused, or -1 if the first was refused. */
+static int send_each(fanout_t *f, struct mmsghdr *msgs, int n)
+{
+    int k, ret;
+
+    for (k = 0; k < n; k++)
+    {
+        f->syscalls++;
+        ret = sendmsg(f->sock, &msgs[k].msg_hdr, 0);
+        if (ret < 0)
+            return (k > 0) ? k : -1;
+        msgs[k].msg_len = ret;
+    }
+
+    return n;
+}
+
+/* Send messages in batches.  Returns how many were sent before the first
+ * refused, or -1 if the first was refused. */
+static int send_batch(fanout_t *f, struct mmsghdr *msgs, int n)
+{
+    int ret;
+
+    if (n > FANOUT_BATCH_MAX)
+        n = FANOUT_BATCH_MAX;
+
+    if (f->use_sendmmsg)
+    {
+        f->syscalls++;
+        ret = sendmmsg(f->sock, msgs, n, 0);
+        if ((ret >= 0) || (errno != ENOSYS))
+            return ret;
+        f->use_sendmmsg = 0;
+    }
+
+    return send_each(f, msgs, n);
+}
+
+/* Send the messages not sent yet, a datagram each */
+static int flush_each(fanout_t *f)
+{
+    int i = 0, j, n, ret, refused = 0;
+
+    while (i < f->count)
+    {
+        /* the next run of messages left to send */
+        if (f->result[i] != RESULT_PENDING)
+        {
+            i++;
+            continue;
+        }
+        for (j = i; (j < f->count) && (f->result[j] == RESULT_PENDING); j++)
+            ;
+
+        /* The messages before the first refused are sent, and the rest
+         * retried after it */
+        while (i < j)
+        {
+            ret = send_batch(f, &f->msgs[i], j - i);
+            if (ret > 0)
+            {
+                for (n = 0; n < ret; n++, i++)
+                    f->result[i] = f->msgs[i].msg_len;
+                f->sent += ret;
+            }
+            else
+            {
+                f->result[i++] = -errno;
+                f->failed++;
+                refused++;
+            }
+        }
+    }
+
+    return refused;
+}
+
+/* Gather the packets to each destination into messages of up to the most
+ * segments the kernel takes.  Returns the number of messages, or 0 if the
+ * packets are not of one size. */
+static int gather_gso(fanout_t *f)
+{
+    int packets = f->count / f->dest_count;
+    size_t seg = msg_bytes(&f->msgs[0].msg_hdr);
+    int seg_max, p, d, k, m = 0, iov = 0;
+    struct msghdr *msg, *pkt;
+    struct cmsghdr *cmsg;
+    uint16_t seg_size;
+
+    /* each datagram but the last of a message is of the segment size */
+    for (p = 1; p < packets - 1; p++)
+    {
+        if (msg_bytes(&f->msgs[p * f->dest_count].msg_hdr) != seg)
+            return 0;
+    }
+    if ((packets > 1)
+            && (msg_bytes(&f->msgs[(packets - 1) * f->dest_count].msg_hdr)
+                    > seg))
+        return 0;
+
+    if (seg == 0)
+        return 0;
+
+    seg_max = FANOUT_GSO_BYTES / seg;
+    if (seg_max > FANOUT_GSO_SEGMENTS)
+        seg_max = FANOUT_GSO_SEGMENTS;
+    if (seg_max < 2)
+        return 0;
+
+    for (d = 0; d < f->dest_count; d++)
+    {
+        for (p = 0; p < packets; p += seg_max)
+        {
+            msg = &f->gso_msgs[m].msg_hdr;
+            memset(msg, 0, sizeof(struct msghdr));
+            msg->msg_name = f->msgs[d].msg_hdr.msg_name;
+            msg->msg_namelen = f->msgs[d].msg_hdr.msg_namelen;
+            msg->msg_iov = &f->gso_iov[iov];
+
+            f->gso_first[m] = p * f->dest_count + d;
+            f->gso_segs[m] = (packets - p < seg_max) ? packets - p : seg_max;
+
+            for (k = 0; k < f->gso_segs[m]; k++)
+            {
+                pkt = &f->msgs[(p + k) * f->dest_count + d].msg_hdr;
+                memcpy(&f->gso_iov[iov], pkt->msg_iov,
+                        pkt->msg_iovlen * sizeof(struct iovec));
+                iov += pkt->msg_iovlen;
+                msg->msg_iovlen += pkt->msg_iovlen;
+            }
+
+            /* a single datagram needs no splitting */
+            if (f->gso_segs[m] > 1)
+            {
+                msg->msg_control = &f->gso_cmsg[m * GSO_CMSG_SPACE];
+                msg->msg_controllen = GSO_CMSG_SPACE;
+                cmsg = CMSG_FIRSTHDR(msg);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                seg_size = seg;
+                memcpy(CMSG_DATA(cmsg), &seg_size, sizeof(seg_size));
+            }
+
+            m++;
+        }
+    }
+
+    return m;
+}
+
+/* Send the packets to each destination as one message split by the
+ * kernel.  Returns the number of datagrams refused. */
+static int flush_gso(fanout_t *f, int messages)
+{
+    int i = 0, n, k, e, ret, err, refused = 0;
+
+    while (i < messages)
+    {
+        ret = send_batch(f, &f->gso_msgs[i], messages - i);
+        if (ret > 0)
+        {
+            for (n = 0; n < ret; n++, i++)
+            {
+                for (k = 0; k < f->gso_segs[i]; k++)
+                {
+                    e = f->gso_first[i] + k * f->dest_count;
+                    f->result[e] = msg_bytes(&f->msgs[e].msg_hdr);
+                }
+                f->sent += f->gso_segs[i];
+                f->gso_sends++;
+            }
+            continue;
+        }
+
+        /* Routes through devices without checksum offload, or kernels
+         * refusing the option, are sent to a datagram at a time from now
+         * on */
+        err = errno;
+        if ((err == EIO) || (err == EINVAL) || (err == ENOPROTOOPT)
+                || (err == EOPNOTSUPP))
+        {
+            f->use_gso = 0;
+            return refused + flush_each(f);
+        }
+
+        for (k = 0; k < f->gso_segs[i]; k++)
+        {
+            f->result[f->gso_first[i] + k * f->dest_count] = -err;
+            f->failed++;
+            refused++;
+        }
+        i++;
+    }
+
+    return refused;
+}
+
+int fanout_flush(fanout_t *f)
+{
+    int i, messages = 0, refused;
+
+    for (i = 0; i < f->count; i++)
+        f->result[i] = RESULT_PENDING;
+
+    if (f->use_gso && (f->count > f->dest_count))
+        messages = gather_gso(f);
+
+    if (messages > 0)
+        refused = flush_gso(f, messages);
+    else
+        refused = flush_each(f);
+
+    f->flushed = 1;
+    return refused;
+}
+
+void fanout_close(fanout_t *f)
+{
+    free(f->msgs);
+    free(f->iov);
+    free(f->result);
+    free(f->gso_msgs);
+    free(f->gso_iov);
+    free(f->gso_cmsg);
+    free(f->gso_first);
+    free(f->gso_segs);
+    f->msgs = NULL;
+    f->iov = NULL;
+    f->result = NULL;
+    f->gso_msgs = NULL;
+    f->gso_iov = NULL;
+    f->gso_cmsg = NULL;
+    f->gso_first = NULL;
+    f->gso_segs = NULL;
+    f->count = 0;
+}
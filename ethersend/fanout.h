@@ -0,0 +1,176 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _FANOUT_H
+#define _FANOUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/** @file fanout.h
+ *
+ * Sending each packet to every destination with as few system calls as
+ * there can be, for ethersend and ethermic.  Packets are queued to all of
+ * the destinations, as messages pointing at the caller's buffers, and sent
+ * together by sendmmsg, so that a packet to a hundred paging zones is one
+ * system call rather than a hundred and the last zone is not left waiting
+ * on the others' calls.  Kernels without sendmmsg are sent to a message at
+ * a time.
+ *
+ * With segmentation offload, the packets of a flush to one destination go
+ * as a single message the kernel splits into the datagrams, UDP_SEGMENT,
+ * so that the per datagram cost of the send path is paid once for them
+ * all.  Kernels and routes without it are sent a datagram per message.
+ */
+
+/* the most messages a single sendmmsg takes, UIO_MAXIOV */
+#define FANOUT_BATCH_MAX    1024
+
+/* the most datagrams, and bytes, the kernel splits a message into */
+#define FANOUT_GSO_SEGMENTS 64
+#define FANOUT_GSO_BYTES    65000
+
+typedef struct
+{
+  int sock;
+
+  /* destinations, each packet queued to all of them in order */
+  const struct sockaddr_in *dests;
+  size_t dest_size;
+  int dest_count;
+
+  /* the messages queued, two buffers each, and the result of each, the
+   * bytes sent or -errno */
+  struct mmsghdr *msgs;
+  struct iovec *iov;
+  int *result;
+  int count;
+  int capacity;
+  int flushed;
+
+  /* segmentation offload, the messages of a flush and the packets each
+   * carries */
+  int use_gso;
+  struct mmsghdr *gso_msgs;
+  struct iovec *gso_iov;
+  unsigned char *gso_cmsg;
+  int *gso_first;
+  int *gso_segs;
+
+  /* statistics */
+  unsigned long long syscalls;
+  unsigned long long sent;
+  unsigned long long failed;
+  unsigned long long gso_sends;
+  int use_sendmmsg;
+}
+fanout_t;
+
+/**
+ * Set up fan-out from a socket to destinations.
+ *
+ * @param f a pointer to the fan-out structure.
+ * @param sock the socket sent from.
+ * @param dests the first destination address, which must stay valid.
+ * @param dest_size the distance from one destination address to the next,
+ * for addresses held inside larger structures.
+ * @param dest_count the number of destinations.
+ * @param packets the most packets queued before a flush.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int fanout_init(fanout_t *f, int sock, const struct sockaddr_in *dests,
+        size_t dest_size, int dest_count, int packets);
+
+/**
+ * Send the packets of each flush to a destination as one message split by
+ * the kernel, when every packet but the last is of the same size.  Falls
+ * back to a datagram per message for good if a send is refused for want
+ * of offload.
+ *
+ * @param f a pointer to the fan-out structure.
+ *
+ * @return 0 on success, -1 with errno set if the kernel has no UDP
+ * segmentation offload, ENOPROTOOPT, or on error.
+ */
+int fanout_gso(fanout_t *f);
+
+/**
+ * Queue a packet to every destination.  The buffers must stay unchanged
+ * until the next flush.
+ *
+ * @param f a pointer to the fan-out structure.
+ * @param hdr a header sent in front of the data, or NULL.
+ * @param hdr_len the header size.
+ * @param data the packet data.
+ * @param len the data size.
+ *
+ * @return 0 on success, -1 with errno set to ENOSPC if the queue is full.
+ */
+int fanout_add(fanout_t *f, const void *hdr, size_t hdr_len, const void *data,
+        size_t len);
+
+/**
+ * Send the queued packets.  A message the socket refuses is recorded and
+ * the rest still sent.  The count messages of the flush stay readable with
+ * fanout_result until the next packet is queued.
+ *
+ * @param f a pointer to the fan-out structure.
+ *
+ * @return the number of messages refused.
+ */
+int fanout_flush(fanout_t *f);
+
+/**
+ * The result of a message of the last flush, in the order queued, packet
+ * by packet and within each destination by destination.
+ *
+ * @param f a pointer to the fan-out structure.
+ * @param i the message.
+ * @param dest set to the destination it was sent to.
+ *
+ * @return the bytes sent, or -errno.
+ */
+static inline int fanout_result(const fanout_t *f, int i, int *dest)
+{
+    *dest = i % f->dest_count;
+    return f->result[i];
+}
+
+/**
+ * Free the queue.  The socket is left open.
+ *
+ * @param f a pointer to the fan-out structure.
+ */
+void fanout_close(fanout_t *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
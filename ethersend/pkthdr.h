@@ -0,0 +1,162 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _PKTHDR_H
+#define _PKTHDR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/** @file pkthdr.h
+ *
+ * Optional header carried in front of the audio samples of each packet,
+ * enabled with -s on ethersend, ethermic, etherptt and etherplay.  The
+ * same file is shared by all of the tools.
+ *
+ * The header is 12 bytes in network byte order:
+ *
+ *    0      magic (0xA5)
+ *    1      version in the high nibble, format id (-m mode) in the low
+ *    2..3   stream id, chosen at random by the sender on startup
+ *    4..7   packet sequence number
+ *    8..11  timestamp of the first sample, in frames since stream start
+ *
+ * Sequence numbers and timestamps wrap, compare them with
+ * pkthdr_seq_diff().
+ */
+
+#define PKTHDR_SIZE        12
+#define PKTHDR_MAGIC       0xA5
+#define PKTHDR_VERSION     1
+
+typedef struct
+{
+  unsigned int format;
+  uint16_t stream;
+  uint32_t seq;
+  uint32_t timestamp;
+}
+pkthdr_t;
+
+/**
+ * Start a new stream, with a random stream id and sequence number zero.
+ *
+ * @param hdr a pointer to the header structure.
+ * @param format the format id, which is the -m audio configuration mode.
+ */
+static inline void pkthdr_init(pkthdr_t *hdr, unsigned int format)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    srand(now.tv_nsec ^ getpid());
+
+    hdr->format = format;
+    hdr->stream = rand() & 0xffff;
+    hdr->seq = 0;
+    hdr->timestamp = 0;
+}
+
+/**
+ * Serialize a header into the first PKTHDR_SIZE bytes of a packet.
+ *
+ * @param hdr a pointer to the header structure.
+ * @param buf the packet buffer.
+ */
+static inline void pkthdr_pack(const pkthdr_t *hdr, unsigned char *buf)
+{
+    uint16_t stream = htons(hdr->stream);
+    uint32_t seq = htonl(hdr->seq);
+    uint32_t timestamp = htonl(hdr->timestamp);
+
+    buf[0] = PKTHDR_MAGIC;
+    buf[1] = (PKTHDR_VERSION << 4) | (hdr->format & 0x0f);
+    memcpy(buf + 2, &stream, 2);
+    memcpy(buf + 4, &seq, 4);
+    memcpy(buf + 8, &timestamp, 4);
+}
+
+/**
+ * Parse the header at the start of a received packet.
+ *
+ * @param hdr a pointer to the header structure to fill in.
+ * @param buf the packet buffer.
+ * @param len the length of the packet.
+ *
+ * @return 0 on success, -1 if the packet does not carry a valid header.
+ */
+static inline int pkthdr_unpack(pkthdr_t *hdr, const unsigned char *buf,
+        size_t len)
+{
+    uint16_t stream;
+    uint32_t seq, timestamp;
+
+    if ((len < PKTHDR_SIZE) || (buf[0] != PKTHDR_MAGIC)
+            || ((buf[1] >> 4) != PKTHDR_VERSION))
+        return -1;
+
+    memcpy(&stream, buf + 2, 2);
+    memcpy(&seq, buf + 4, 4);
+    memcpy(&timestamp, buf + 8, 4);
+
+    hdr->format = buf[1] & 0x0f;
+    hdr->stream = ntohs(stream);
+    hdr->seq = ntohl(seq);
+    hdr->timestamp = ntohl(timestamp);
+
+    return 0;
+}
+
+/**
+ * Advance the header past one packet of the given number of frames.
+ *
+ * @param hdr a pointer to the header structure.
+ * @param frames the number of frames carried by the packet just sent.
+ */
+static inline void pkthdr_next(pkthdr_t *hdr, uint32_t frames)
+{
+    hdr->seq++;
+    hdr->timestamp += frames;
+}
+
+/**
+ * Return the signed distance from sequence number b to a, accounting for
+ * wrap around.
+ */
+static inline int32_t pkthdr_seq_diff(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,609 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "codec_g711.h"
+#include "transcode.h"
+
+#define WAV_FORMAT_PCM          1
+#define WAV_FORMAT_MULAW        7
+#define WAV_FORMAT_EXTENSIBLE   0xfffe
+
+/* Zero crossings of the filter either side of its centre, at the lower of
+ * the two rates, and its cutoff relative to that rate's Nyquist frequency */
+#define FILTER_ZEROS            12
+#define FILTER_CUTOFF           0.92
+
+typedef float v4f __attribute__ ((vector_size (16)));
+typedef int32_t v4i __attribute__ ((vector_size (16)));
+typedef int16_t v4s __attribute__ ((vector_size (8)));
+typedef uint8_t v4b __attribute__ ((vector_size (4)));
+
+/* the same, at any address */
+typedef float v4f_u __attribute__ ((vector_size (16), aligned (4), may_alias));
+typedef int16_t v4s_u __attribute__ ((vector_size (8), aligned (2),
+        may_alias));
+typedef uint8_t v4b_u __attribute__ ((vector_size (4), aligned (1),
+        may_alias));
+
+static unsigned int get_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long get_le32(const unsigned char *p)
+{
+    return get_le16(p) | ((unsigned long) get_le16(p + 2) << 16);
+}
+
+static unsigned long gcd(unsigned long a, unsigned long b)
+{
+    unsigned long r;
+
+    while (b != 0)
+    {
+        r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+static double sinc(double x)
+{
+    if (fabs(x) < 1e-9)
+        return 1.0;
+
+    return sin(M_PI * x) / (M_PI * x);
+}
+
+static double blackman(double x)
+{
+    if (fabs(x) >= 1.0)
+        return 0.0;
+
+    return 0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2 * M_PI * x);
+}
+
+/* Find the samples of a WAV file.  Returns 1 with the file at its first
+ * sample, 0 with the file at its start if it is not a WAV file, or -1. */
+static int wav_read_header(transcode_t *t, const char *name)
+{
+    unsigned char h[40];
+    unsigned long len, pad, got;
+    unsigned int format = 0, bits = 0;
+
+    if ((fread(h, 1, 12, t->file) != 12) || (memcmp(h, "RIFF", 4) != 0)
+            || (memcmp(h + 8, "WAVE", 4) != 0))
+    {
+        rewind(t->file);
+        return 0;
+    }
+
+    while (fread(h, 1, 8, t->file) == 8)
+    {
+        len = get_le32(h + 4);
+        pad = len & 1;
+
+        if (memcmp(h, "data", 4) == 0)
+        {
+            if (format == 0)
+                break;
+
+            /* streamed files leave the size at 0 or the most there is */
+            t->data_left = ((len == 0) || (len == 0xffffffffUL)) ?
+                    ULLONG_MAX : len;
+            return 1;
+        }
+
+        if ((memcmp(h, "fmt ", 4) == 0) && (len >= 16))
+        {
+            got = (len < sizeof(h)) ? len : sizeof(h);
+            if (fread(h, 1, got, t->file) != got)
+                break;
+            len -= got;
+
+            format = get_le16(h);
+            if ((format == WAV_FORMAT_EXTENSIBLE) && (got >= 26))
+                format = get_le16(h + 24);
+
+            t->in_channels = get_le16(h + 2);
+            t->in_rate = get_le32(h + 4);
+            bits = get_le16(h + 14);
+
+            if (!(((format == WAV_FORMAT_PCM)
+                    && ((bits == 8) || (bits == 16) || (bits == 24)))
+                    || ((format == WAV_FORMAT_MULAW) && (bits == 8)))
+                    || (t->in_channels < 1) || (t->in_channels > 2)
+                    || (t->in_rate < 1000) || (t->in_rate > 384000))
+            {
+                printf("%s: %u Hz, %u channels, format %u, %u bits, "
+                        "cannot be converted\n", name, t->in_rate,
+                        t->in_channels, format, bits);
+                return -1;
+            }
+
+            t->in_bits = bits;
+            t->in_ulaw = (format == WAV_FORMAT_MULAW);
+            t->in_frame_bytes = t->in_channels * bits / 8;
+        }
+
+        if (fseek(t->file, len + pad, SEEK_CUR) < 0)
+            break;
+    }
+
+    printf("%s: no audio data\n", name);
+    return -1;
+}
+
+/* Phase p holds the taps for an output frame p / phases of a frame past
+ * the input frame under tap taps / 2 - 1, with one extra phase for the
+ * nearest to round up to.  Every phase is normalized to unity gain. */
+static int make_filter(transcode_t *t)
+{
+    double cutoff = FILTER_CUTOFF;
+    double d, sum, *h;
+    int half, p, k;
+
+    if (t->out_rate < t->in_rate)
+        cutoff *= (double) t->out_rate / t->in_rate;
+
+    /* a multiple of 8 taps, for the filter kernel */
+    half = ((int) ceil(FILTER_ZEROS / cutoff) + 3) & ~3;
+    t->taps = 2 * half;
+    t->phases = (t->out_step <= TRANSCODE_PHASES_MAX) ?
+            t->out_step : TRANSCODE_PHASES_MAX;
+
+    t->filter = malloc((t->phases + 1) * t->taps * sizeof(float));
+    h = malloc(t->taps * sizeof(double));
+    if ((t->filter == NULL) || (h == NULL))
+    {
+        free(h);
+        return -1;
+    }
+
+    for (p = 0; p <= t->phases; p++)
+    {
+        sum = 0;
+        for (k = 0; k < t->taps; k++)
+        {
+            d = k - (half - 1) - (double) p / t->phases;
+            h[k] = sinc(cutoff * d) * blackman(d / half);
+            sum += h[k];
+        }
+
+        for (k = 0; k < t->taps; k++)
+            t->filter[p * t->taps + k] = h[k] / sum;
+    }
+
+    free(h);
+    return 0;
+}
+
+int transcode_open(transcode_t *t, FILE *file, const char *name,
+        unsigned int rate, unsigned int channels, int ulaw)
+{
+    unsigned long g;
+    size_t frames;
+    int i, wav;
+
+    memset(t, 0, sizeof(transcode_t));
+
+    t->file = file;
+    t->out_rate = rate;
+    t->out_channels = channels;
+    t->out_ulaw = ulaw;
+    t->out_frame_bytes = channels * (ulaw ? 1 : 2);
+
+    wav = wav_read_header(t, name);
+    if (wav < 0)
+        return -1;
+
+    t->wav = wav;
+    if (!wav)
+    {
+        t->passthrough = 1;
+        return 0;
+    }
+
+    /* Samples in the format sent go as they are */
+    if ((t->in_rate == rate) && (t->in_channels == channels)
+            && ((t->in_ulaw && ulaw) || (!t->in_ulaw && !ulaw
+                    && (t->in_bits == 16))))
+    {
+        t->passthrough = 1;
+        return 0;
+    }
+
+    if (t->in_rate != rate)
+    {
+        g = gcd(t->in_rate, rate);
+        t->resample = 1;
+        t->in_step = t->in_rate / g;
+        t->out_step = rate / g;
+        if (make_filter(t) < 0)
+            goto nomem;
+    }
+
+    /* the history left over from the last chunk, and the tail flushed
+     * at the end, both short of the filter length */
+    t->hist_cap = TRANSCODE_CHUNK + 2 * t->taps + 8;
+    frames = TRANSCODE_CHUNK + 4;
+
+    t->in_buf = malloc(TRANSCODE_CHUNK * t->in_frame_bytes);
+    t->mix_buf = malloc(TRANSCODE_CHUNK * t->in_channels * sizeof(float));
+    t->pcm_buf = malloc(frames * channels * sizeof(int16_t));
+    if ((t->in_buf == NULL) || (t->mix_buf == NULL) || (t->pcm_buf == NULL))
+        goto nomem;
+
+    for (i = 0; i < (int) channels; i++)
+    {
+        t->hist[i] = calloc(t->hist_cap, sizeof(float));
+        t->out_buf[i] = calloc(frames, sizeof(float));
+        if ((t->hist[i] == NULL) || (t->out_buf[i] == NULL))
+            goto nomem;
+    }
+
+    /* The first output frame is due at the first input frame, under the
+     * filter's centre */
+    if (t->resample)
+        t->hist_len = t->taps / 2 - 1;
+
+    if (t->in_ulaw)
+    {
+        for (i = 0; i < 256; i++)
+            t->ulaw_table[i] = ulaw2linear(i);
+    }
+
+    return 0;
+
+nomem:
+    printf("%s: out of memory\n", name);
+    transcode_close(t);
+    return -1;
+}
+
+/* Samples of the file to floats, in the range of 16 bit samples */
+static void decode(transcode_t *t, size_t frames)
+{
+    size_t i, n = frames * t->in_channels;
+    const unsigned char *in = t->in_buf;
+    float *out = t->mix_buf;
+
+    switch (t->in_bits)
+    {
+    case 8:
+        if (t->in_ulaw)
+        {
+            for (i = 0; i < n; i++)
+                out[i] = t->ulaw_table[in[i]];
+        }
+        else
+        {
+            for (i = 0; i < n; i++)
+                out[i] = (in[i] - 128) * 256.0f;
+        }
+        break;
+
+    case 16:
+        for (i = 0; i < n; i++)
+            out[i] = ((const int16_t *) in)[i];
+        break;
+
+    case 24:
+        for (i = 0; i < n; i++, in += 3)
+            out[i] = (int32_t) ((in[0] << 8) | (in[1] << 16)
+                    | ((uint32_t) in[2] << 24)) * (1.0f / 65536);
+        break;
+    }
+}
+
+/* Append decoded frames to the history of each output channel, mixed
+ * down or up */
+static void mix(transcode_t *t, size_t frames)
+{
+    const float *in = t->mix_buf;
+    float *l = t->hist[0] + t->hist_len;
+    float *r = (t->out_channels == 2) ? t->hist[1] + t->hist_len : NULL;
+    size_t i;
+
+    if (t->in_channels == t->out_channels)
+    {
+        if (t->out_channels == 1)
+            memcpy(l, in, frames * sizeof(float));
+        else
+        {
+            for (i = 0; i < frames; i++)
+            {
+                l[i] = in[2 * i];
+                r[i] = in[2 * i + 1];
+            }
+        }
+    }
+    else if (t->out_channels == 1)
+    {
+        for (i = 0; i < frames; i++)
+            l[i] = (in[2 * i] + in[2 * i + 1]) * 0.5f;
+    }
+    else
+    {
+        memcpy(l, in, frames * sizeof(float));
+        memcpy(r, in, frames * sizeof(float));
+    }
+
+    t->hist_len += frames;
+}
+
+/* Read the next chunk of the file into the history.  Returns 0 past the
+ * end of the file. */
+static int refill(transcode_t *t)
+{
+    unsigned long long frames;
+    unsigned int c;
+
+    if (t->eof)
+        return 0;
+
+    for (c = 0; c < t->out_channels; c++)
+        memmove(t->hist[c], t->hist[c] + t->pos,
+                (t->hist_len - t->pos) * sizeof(float));
+    t->hist_len -= t->pos;
+    t->pos = 0;
+
+    frames = t->data_left / t->in_frame_bytes;
+    if (frames > TRANSCODE_CHUNK)
+        frames = TRANSCODE_CHUNK;
+    frames = fread(t->in_buf, t->in_frame_bytes, frames, t->file);
+
+    if (frames == 0)
+    {
+        /* The frames due up to the end, their filter run out on silence */
+        t->eof = 1;
+        if (t->resample)
+        {
+            t->out_total = (t->in_frames * t->out_step + t->in_step - 1)
+                    / t->in_step;
+            for (c = 0; c < t->out_channels; c++)
+                memset(t->hist[c] + t->hist_len, 0, t->taps * sizeof(float));
+            t->hist_len += t->taps;
+        }
+        else
+            t->out_total = t->in_frames;
+        return 1;
+    }
+
+    decode(t, frames);
+    mix(t, frames);
+
+    t->in_frames += frames;
+    t->data_left -= frames * t->in_frame_bytes;
+    return 1;
+}
+
+static inline float dot(const float *x, const float *h, int n)
+{
+    v4f a = { 0 }, b = { 0 };
+    int k;
+
+    for (k = 0; k < n; k += 8)
+    {
+        a += *(const v4f_u *) (x + k) * *(const v4f_u *) (h + k);
+        b += *(const v4f_u *) (x + k + 4) * *(const v4f_u *) (h + k + 4);
+    }
+
+    a += b;
+    return a[0] + a[1] + a[2] + a[3];
+}
+
+/* Output frames from the history, up to max.  Returns how many. */
+static size_t produce(transcode_t *t, size_t max)
+{
+    const float *h;
+    size_t j = 0;
+    unsigned int c;
+    int p;
+
+    if (max > TRANSCODE_CHUNK)
+        max = TRANSCODE_CHUNK;
+    if (t->eof && (max > t->out_total - t->out_frames))
+        max = t->out_total - t->out_frames;
+
+    if (!t->resample)
+    {
+        j = t->hist_len - t->pos;
+        if (j > max)
+            j = max;
+
+        for (c = 0; c < t->out_channels; c++)
+            memcpy(t->out_buf[c], t->hist[c] + t->pos, j * sizeof(float));
+        t->pos += j;
+    }
+    else
+    {
+        for (; (j < max) && (t->pos + t->taps <= t->hist_len); j++)
+        {
+            /* the nearest phase, past TRANSCODE_PHASES_MAX */
+            p = ((unsigned long long) t->frac * t->phases + t->out_step / 2)
+                    / t->out_step;
+            h = t->filter + p * t->taps;
+
+            for (c = 0; c < t->out_channels; c++)
+                t->out_buf[c][j] = dot(t->hist[c] + t->pos, h, t->taps);
+
+            t->frac += t->in_step;
+            t->pos += t->frac / t->out_step;
+            t->frac %= t->out_step;
+        }
+    }
+
+    t->out_frames += j;
+    return j;
+}
+
+/* Round to the nearest 16 bit sample, clipped */
+static inline v4i to_int(v4f x)
+{
+    const v4f lo = { -32768, -32768, -32768, -32768 };
+    const v4f hi = { 32767, 32767, 32767, 32767 };
+    const v4i sign = { INT_MIN, INT_MIN, INT_MIN, INT_MIN };
+    const v4f half = { 0.5f, 0.5f, 0.5f, 0.5f };
+    v4i m;
+
+    m = x < lo;
+    x = (v4f) (((v4i) x & ~m) | ((v4i) lo & m));
+    m = x > hi;
+    x = (v4f) (((v4i) x & ~m) | ((v4i) hi & m));
+
+    return __builtin_convertvector(x + (v4f) (((v4i) x & sign) | (v4i) half),
+            v4i);
+}
+
+/* Output frames to interleaved 16 bit samples, 4 at a time into the room
+ * past them */
+static void to_s16(transcode_t *t, size_t frames)
+{
+    const v4i lo = { 0, 4, 1, 5 };
+    const v4i hi = { 2, 6, 3, 7 };
+    int16_t *out = t->pcm_buf;
+    v4i l, r;
+    size_t i;
+
+    if (t->out_channels == 1)
+    {
+        for (i = 0; i < frames; i += 4)
+            *(v4s_u *) (out + i) = __builtin_convertvector(
+                    to_int(*(const v4f_u *) (t->out_buf[0] + i)), v4s);
+    }
+    else
+    {
+        for (i = 0; i < frames; i += 4)
+        {
+            l = to_int(*(const v4f_u *) (t->out_buf[0] + i));
+            r = to_int(*(const v4f_u *) (t->out_buf[1] + i));
+            *(v4s_u *) (out + 2 * i) = __builtin_convertvector(
+                    __builtin_shuffle(l, r, lo), v4s);
+            *(v4s_u *) (out + 2 * i + 4) = __builtin_convertvector(
+                    __builtin_shuffle(l, r, hi), v4s);
+        }
+    }
+}
+
+void transcode_ulaw(unsigned char *out, const int16_t *in, size_t n)
+{
+    const v4i zero = { 0 };
+    v4i p, neg, seg, big, m, u;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        /* the magnitude, scaled, clipped and biased */
+        p = __builtin_convertvector(*(const v4s_u *) (in + i), v4i) >> 2;
+        neg = p < zero;
+        p = (p ^ neg) - neg;
+        m = p > 8159;
+        p = ((p & ~m) | (8159 & m)) + 33;
+
+        /* the segment, the number of segment ends below it */
+        seg = -((p > 0x3f) + (p > 0x7f) + (p > 0xff) + (p > 0x1ff)
+                + (p > 0x3ff) + (p > 0x7ff) + (p > 0xfff));
+        big = p > 0x1fff;
+
+        u = (seg << 4) | ((p >> (seg + 1)) & 0xf);
+        u = (u & ~big) | (0x7f & big);
+        u ^= 0x7f | (~neg & 0x80);
+
+        *(v4b_u *) (out + i) = __builtin_convertvector(u, v4b);
+    }
+
+    for (; i < n; i++)
+        out[i] = linear2ulaw(in[i]);
+}
+
+size_t transcode_read(transcode_t *t, void *buf, size_t bytes)
+{
+    unsigned char *out = buf;
+    size_t want, done = 0, n;
+
+    if (t->passthrough)
+    {
+        if (t->wav)
+        {
+            if (bytes > t->data_left)
+                bytes = t->data_left;
+            n = fread(out, t->out_frame_bytes, bytes / t->out_frame_bytes,
+                    t->file) * t->out_frame_bytes;
+            t->data_left -= n;
+            return n;
+        }
+        return fread(out, 1, bytes, t->file);
+    }
+
+    want = bytes / t->out_frame_bytes;
+
+    while (done < want)
+    {
+        n = produce(t, want - done);
+        if (n == 0)
+        {
+            if (!refill(t))
+                break;
+            continue;
+        }
+
+        to_s16(t, n);
+        if (t->out_ulaw)
+            transcode_ulaw(out + done * t->out_frame_bytes, t->pcm_buf,
+                    n * t->out_channels);
+        else
+            memcpy(out + done * t->out_frame_bytes, t->pcm_buf,
+                    n * t->out_frame_bytes);
+        done += n;
+    }
+
+    return done * t->out_frame_bytes;
+}
+
+void transcode_close(transcode_t *t)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        free(t->hist[i]);
+        free(t->out_buf[i]);
+        t->hist[i] = NULL;
+        t->out_buf[i] = NULL;
+    }
+
+    free(t->filter);
+    free(t->in_buf);
+    free(t->mix_buf);
+    free(t->pcm_buf);
+    t->filter = NULL;
+    t->in_buf = NULL;
+    t->mix_buf = NULL;
+    t->pcm_buf = NULL;
+}
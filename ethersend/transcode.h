@@ -0,0 +1,157 @@
+/*
+ *   MSX Ethernet Audio
+ *
+ *   Copyright (C) 2014 Harlan Murphy
+ *   Orbis Software - orbisoftware@gmail.com
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef _TRANSCODE_H
+#define _TRANSCODE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** @file transcode.h
+ *
+ * On the fly conversion of WAV files to the format of an ethersend -m
+ * mode, so that files need not be converted with sox beforehand.  8, 16
+ * and 24 bit PCM and mu-law files of any rate, mono or stereo, are
+ * downmixed or upmixed to the channels of the mode, resampled to its rate
+ * and encoded as 16 bit PCM or mu-law.
+ *
+ * Resampling is by a polyphase windowed sinc filter, with a phase for
+ * each output frame of a rational ratio up to TRANSCODE_PHASES_MAX phases,
+ * cut off below the lower of the two Nyquist frequencies.  The filter, the
+ * conversion to 16 bit and the mu-law encoder are written with the GCC
+ * vector extensions, SSE or NEON as the target has them, so that a core
+ * keeps up with many streams.
+ *
+ * Files already in the format of the mode have their samples read as they
+ * are, as are files which are not WAV files, such as .au and raw files.
+ */
+
+/* the frames read from the file at a time */
+#define TRANSCODE_CHUNK         1024
+
+/* the most filter phases, past which the nearest is taken */
+#define TRANSCODE_PHASES_MAX    512
+
+typedef struct
+{
+  FILE *file;
+
+  /* the file's samples, bits 8 for mu-law when ulaw is set */
+  unsigned int in_rate;
+  unsigned int in_channels;
+  unsigned int in_bits;
+  int in_ulaw;
+  unsigned int in_frame_bytes;
+
+  /* the format sent */
+  unsigned int out_rate;
+  unsigned int out_channels;
+  int out_ulaw;
+  unsigned int out_frame_bytes;
+
+  /* the samples are read as they are; wav is unset for other files */
+  int wav;
+  int passthrough;
+  unsigned long long data_left;
+
+  /* resampling by in_step / out_step input frames per output frame */
+  int resample;
+  unsigned long in_step;
+  unsigned long out_step;
+  unsigned long frac;
+  int taps;
+  int phases;
+  float *filter;
+
+  /* the input of each output channel, from pos */
+  float *hist[2];
+  size_t hist_len;
+  size_t hist_cap;
+  size_t pos;
+  int eof;
+  unsigned long long in_frames;
+  unsigned long long out_frames;
+  unsigned long long out_total;
+
+  /* blocks on their way through */
+  unsigned char *in_buf;
+  float *mix_buf;
+  float *out_buf[2];
+  int16_t *pcm_buf;
+  float ulaw_table[256];
+}
+transcode_t;
+
+/**
+ * Read the header of a file and set up its conversion.  A WAV file is
+ * left at its first sample, any other file at its start.
+ *
+ * @param t a pointer to the transcoder structure.
+ * @param file the file, open for reading, which must stay open.
+ * @param name the file name, for messages.
+ * @param rate the rate sent.
+ * @param channels the channels sent, 1 or 2.
+ * @param ulaw nonzero to send mu-law, zero for 16 bit PCM.
+ *
+ * @return 0 on success, -1 if the file cannot be converted, with the
+ * reason printed.
+ */
+int transcode_open(transcode_t *t, FILE *file, const char *name,
+        unsigned int rate, unsigned int channels, int ulaw);
+
+/**
+ * Read samples in the format sent.
+ *
+ * @param t a pointer to the transcoder structure.
+ * @param buf the buffer for the samples.
+ * @param bytes its size, a whole number of frames.
+ *
+ * @return the bytes read, a whole number of frames but for files which are
+ * not WAV files, fewer than asked only at the end of the file, 0 past it.
+ */
+size_t transcode_read(transcode_t *t, void *buf, size_t bytes);
+
+/**
+ * Free the buffers.  The file is left open.
+ *
+ * @param t a pointer to the transcoder structure.
+ */
+void transcode_close(transcode_t *t);
+
+/**
+ * Convert 16 bit samples to mu-law, as linear2ulaw() does.
+ *
+ * @param out the mu-law samples.
+ * @param in the 16 bit samples.
+ * @param n the number of samples.
+ */
+void transcode_ulaw(unsigned char *out, const int16_t *in, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif